@@ -0,0 +1,265 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "app_match.h"
+#include "hashmap_str.h"
+
+#define APP_CACHE_SIZE		64
+#define SEGMENT_MAX		256 /* longest component a wildcard is tried against */
+
+typedef struct match_node {
+	char* segment; /* one path component, possibly with wildcards */
+	int is_glob;
+	void* profile; /* for paths ending at this node */
+	struct match_node* children;
+	struct match_node* next;
+} match_node_t;
+
+struct app_matcher {
+	match_node_t root;
+};
+
+typedef struct app_cache_entry {
+	char* path;
+	uint32_t hash;
+	size_t len;
+	unsigned long generation;
+	unsigned long used; /* tick of the last hit, smallest is evicted */
+	void* profile;
+} app_cache_entry_t;
+
+static __thread app_cache_entry_t app_cache[APP_CACHE_SIZE];
+static __thread unsigned long app_cache_tick;
+static unsigned long app_cache_hits;
+static unsigned long app_cache_misses;
+
+static void free_node(match_node_t* node);
+static match_node_t* child_for(match_node_t* parent, const char* segment, size_t len);
+static void* find_from(match_node_t* node, const char* path);
+
+app_matcher_t* app_matcher_create(void) {
+	return (app_matcher_t*)calloc(1, sizeof(app_matcher_t));
+}
+
+void app_matcher_free(app_matcher_t* matcher) {
+	match_node_t* cur;
+	match_node_t* next;
+
+	if (matcher == NULL) {
+		return;
+	}
+	cur = matcher->root.children;
+	while (cur != NULL) {
+		next = cur->next;
+		free_node(cur);
+		cur = next;
+	}
+	free(matcher);
+	return;
+}
+
+void free_node(match_node_t* node) {
+	match_node_t* cur;
+	match_node_t* next;
+
+	cur = node->children;
+	while (cur != NULL) {
+		next = cur->next;
+		free_node(cur);
+		cur = next;
+	}
+	free(node->segment);
+	free(node);
+	return;
+}
+
+int app_matcher_is_pattern(const char* name) {
+	return name != NULL && strpbrk(name, "*?[") != NULL;
+}
+
+/* Returns 1 if pattern was already present; the first profile keeps it */
+int app_matcher_add(app_matcher_t* matcher, const char* pattern, void* profile) {
+	match_node_t* node = &matcher->root;
+	const char* start = pattern;
+	const char* end;
+
+	for (;;) {
+		end = strchr(start, '/');
+		if (end == NULL) {
+			end = start + strlen(start);
+		}
+		node = child_for(node, start, end - start);
+		if (node == NULL) {
+			return 1;
+		}
+		if (*end == '\0') {
+			break;
+		}
+		start = end + 1;
+	}
+	if (node->profile != NULL) {
+		return 1;
+	}
+	node->profile = profile;
+	return 0;
+}
+
+/* Finds or appends the child for one component, keeping file order */
+match_node_t* child_for(match_node_t* parent, const char* segment, size_t len) {
+	match_node_t** link;
+	match_node_t* node;
+
+	for (link = &parent->children; *link != NULL; link = &(*link)->next) {
+		if (strncmp((*link)->segment, segment, len) == 0 && (*link)->segment[len] == '\0') {
+			return *link;
+		}
+	}
+	node = (match_node_t*)calloc(1, sizeof(match_node_t));
+	if (node == NULL) {
+		return NULL;
+	}
+	node->segment = strndup(segment, len);
+	if (node->segment == NULL) {
+		free(node);
+		return NULL;
+	}
+	node->is_glob = app_matcher_is_pattern(node->segment);
+	*link = node;
+	return node;
+}
+
+void* app_matcher_find(app_matcher_t* matcher, const char* path) {
+	if (matcher == NULL || path == NULL) {
+		return NULL;
+	}
+	return find_from(&matcher->root, path);
+}
+
+/* Matches the component at the start of path against node's children,
+ * literals first, then descends. Backtracks when a branch dead ends */
+void* find_from(match_node_t* node, const char* path) {
+	char segment[SEGMENT_MAX];
+	const char* end;
+	const char* rest;
+	match_node_t* child;
+	void* profile;
+	size_t len;
+	int pass;
+
+	end = strchr(path, '/');
+	if (end == NULL) {
+		end = path + strlen(path);
+	}
+	len = end - path;
+	rest = *end == '\0' ? NULL : end + 1;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (child = node->children; child != NULL; child = child->next) {
+			if (child->is_glob != pass) {
+				continue;
+			}
+			if (pass == 0) {
+				if (strncmp(child->segment, path, len) != 0 || child->segment[len] != '\0') {
+					continue;
+				}
+			}
+			else {
+				if (len >= SEGMENT_MAX) {
+					continue;
+				}
+				memcpy(segment, path, len);
+				segment[len] = '\0';
+				if (fnmatch(child->segment, segment, FNM_PATHNAME) != 0) {
+					continue;
+				}
+			}
+			if (rest == NULL) {
+				if (child->profile != NULL) {
+					return child->profile;
+				}
+				continue;
+			}
+			profile = find_from(child, rest);
+			if (profile != NULL) {
+				return profile;
+			}
+		}
+	}
+	return NULL;
+}
+
+void* app_cache_get(const char* path, unsigned long generation) {
+	app_cache_entry_t* entry;
+	uint32_t hash;
+	size_t len;
+	int i;
+
+	hash = str_hashmap_hash(path, &len);
+	for (i = 0; i < APP_CACHE_SIZE; i++) {
+		entry = &app_cache[i];
+		if (entry->hash == hash && entry->len == len && entry->generation == generation &&
+				entry->path != NULL && memcmp(entry->path, path, len) == 0) {
+			entry->used = ++app_cache_tick;
+			__atomic_add_fetch(&app_cache_hits, 1, __ATOMIC_RELAXED);
+			return entry->profile;
+		}
+	}
+	__atomic_add_fetch(&app_cache_misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void app_cache_put(const char* path, unsigned long generation, void* profile) {
+	app_cache_entry_t* victim = &app_cache[0];
+	char* copy;
+	int i;
+
+	for (i = 1; i < APP_CACHE_SIZE && victim->used != 0; i++) {
+		if (app_cache[i].used < victim->used) {
+			victim = &app_cache[i];
+		}
+	}
+	copy = strdup(path);
+	if (copy == NULL) {
+		return;
+	}
+	free(victim->path);
+	victim->path = copy;
+	victim->hash = str_hashmap_hash(path, &victim->len);
+	victim->generation = generation;
+	victim->profile = profile;
+	victim->used = ++app_cache_tick;
+	return;
+}
+
+void app_cache_stats(unsigned long* hits, unsigned long* misses) {
+	*hits = __atomic_load_n(&app_cache_hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&app_cache_misses, __ATOMIC_RELAXED);
+	return;
+}
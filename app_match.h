@@ -0,0 +1,52 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef APP_MATCH_H
+#define APP_MATCH_H
+
+typedef struct app_matcher app_matcher_t;
+
+/* Profiles whose Application holds fnmatch wildcards (* ? [...]) are
+ * compiled into a trie of path components when the config is loaded.
+ * A wildcard never matches across a '/', so "/usr/lib/jvm/java-*-openjdk/bin/java"
+ * covers every installed JDK but nothing below bin. At each
+ * component literal children are tried before wildcards, and wildcards
+ * in the order they appear in the file. The matcher does not own the
+ * profiles it points to */
+app_matcher_t* app_matcher_create(void);
+void app_matcher_free(app_matcher_t* matcher);
+int app_matcher_add(app_matcher_t* matcher, const char* pattern, void* profile);
+void* app_matcher_find(app_matcher_t* matcher, const char* path);
+int app_matcher_is_pattern(const char* name);
+
+/* Every thread remembers the profile its most recent application paths
+ * resolved to. Entries are tagged with the config generation, so they
+ * stop matching as soon as a reload installs new profiles */
+void* app_cache_get(const char* path, unsigned long generation);
+void app_cache_put(const char* path, unsigned long generation, void* profile);
+void app_cache_stats(unsigned long* hits, unsigned long* misses);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#include "client_sessions.h"
+#include "hashmap_str.h"
+#include "trust_store.h"
+#include "config.h"
+#include "log.h"
+
+#define CLIENT_SESSION_TICKETS	4 /* TLS 1.3 tickets kept per destination */
+#define CLIENT_SESSION_KEY_LEN	512
+#define CLIENT_SESSION_BUCKETS	64
+
+typedef struct destination {
+	char* key;
+	SSL_SESSION* sessions[CLIENT_SESSION_TICKETS]; /* oldest first */
+	int count;
+	struct destination* prev; /* most recently used toward head */
+	struct destination* next;
+} destination_t;
+
+static hsmap_t* destinations;
+static destination_t* head;
+static destination_t* tail;
+static int max_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int key_index = -1;
+
+static int new_session_cb(SSL* tls, SSL_SESSION* session);
+static void free_key(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+static int make_key(SSL* tls, const char* profile, struct sockaddr* addr, char* key, size_t len);
+static SSL_SESSION* take_session(destination_t* dest);
+static int session_usable(SSL_SESSION* session, time_t now);
+static void lru_unlink(destination_t* dest);
+static void lru_push(destination_t* dest);
+static void free_destination(destination_t* dest);
+
+int client_sessions_init(int max_destinations) {
+	if (max_destinations <= 0) {
+		return 0;
+	}
+	destinations = str_hashmap_create(CLIENT_SESSION_BUCKETS);
+	if (destinations == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate client session cache\n");
+		return 1;
+	}
+	max_count = max_destinations;
+	if (key_index == -1) {
+		key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_key);
+	}
+	return 0;
+}
+
+void client_sessions_free(void) {
+	destination_t* dest;
+
+	if (destinations == NULL) {
+		return;
+	}
+	while (head != NULL) {
+		dest = head;
+		lru_unlink(dest);
+		free_destination(dest);
+	}
+	str_hashmap_free(destinations);
+	destinations = NULL;
+	return;
+}
+
+/* OpenSSL's own client cache only holds sessions handed back with
+ * SSL_get1_session, so everything goes through the callback */
+void client_sessions_attach(SSL_CTX* tls_ctx) {
+	/* a role-neutral context may carry the server cache callbacks */
+	SSL_CTX_sess_set_get_cb(tls_ctx, NULL);
+	SSL_CTX_sess_set_remove_cb(tls_ctx, NULL);
+	if (destinations == NULL) {
+		SSL_CTX_sess_set_new_cb(tls_ctx, NULL);
+		SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+		return;
+	}
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(tls_ctx, new_session_cb);
+	return;
+}
+
+/* Called before the handshake starts, once SNI is set. Remembers the
+ * destination for sessions the server sends later */
+void client_sessions_resume(SSL* tls, const char* profile, struct sockaddr* addr, int addrlen) {
+	char key[CLIENT_SESSION_KEY_LEN];
+	destination_t* dest;
+	SSL_SESSION* session = NULL;
+	char* saved;
+
+	if (destinations == NULL || tls == NULL) {
+		return;
+	}
+	if (make_key(tls, profile, addr, key, sizeof(key)) != 0) {
+		return;
+	}
+	saved = strdup(key);
+	if (saved == NULL || SSL_set_ex_data(tls, key_index, saved) != 1) {
+		free(saved);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	dest = str_hashmap_get(destinations, key);
+	if (dest != NULL) {
+		session = take_session(dest);
+		lru_unlink(dest);
+		lru_push(dest);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (session != NULL) {
+		SSL_set_session(tls, session);
+		SSL_SESSION_free(session);
+	}
+	return;
+}
+
+/* Takes the reference when it returns 1 */
+int new_session_cb(SSL* tls, SSL_SESSION* session) {
+	destination_t* dest;
+	char* key;
+
+	key = SSL_get_ex_data(tls, key_index);
+	if (key == NULL || destinations == NULL || !SSL_SESSION_is_resumable(session)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	dest = str_hashmap_get(destinations, key);
+	if (dest == NULL) {
+		if (destinations->item_count >= max_count) {
+			dest = tail;
+			lru_unlink(dest);
+			str_hashmap_del(destinations, dest->key);
+			free_destination(dest);
+		}
+		dest = calloc(1, sizeof(destination_t));
+		if (dest != NULL) {
+			dest->key = strdup(key);
+		}
+		if (dest == NULL || dest->key == NULL ||
+				str_hashmap_add(destinations, dest->key, dest) != 0) {
+			pthread_mutex_unlock(&lock);
+			log_printf(LOG_ERROR, "Failed to cache client session\n");
+			if (dest != NULL) {
+				free(dest->key);
+				free(dest);
+			}
+			return 0;
+		}
+	}
+	else {
+		lru_unlink(dest);
+	}
+	lru_push(dest);
+
+	/* a TLS 1.2 session replaces the last one, TLS 1.3 tickets queue up */
+	if (SSL_SESSION_get_protocol_version(session) != TLS1_3_VERSION) {
+		while (dest->count > 0) {
+			SSL_SESSION_free(dest->sessions[--dest->count]);
+		}
+	}
+	if (dest->count == CLIENT_SESSION_TICKETS) {
+		SSL_SESSION_free(dest->sessions[0]);
+		memmove(&dest->sessions[0], &dest->sessions[1],
+			sizeof(SSL_SESSION*) * (CLIENT_SESSION_TICKETS - 1));
+		dest->count--;
+	}
+	dest->sessions[dest->count++] = session;
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+void free_key(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+	free(ptr);
+	return;
+}
+
+int make_key(SSL* tls, const char* profile, struct sockaddr* addr, char* key, size_t len) {
+	char address[INET6_ADDRSTRLEN];
+	char identity[EVP_MAX_MD_SIZE * 2 + 1] = "-";
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	const char* hostname;
+	X509* cert;
+	unsigned long store_serial = 0;
+	int verify_mode;
+	int port;
+	unsigned int i;
+	int ret;
+
+	if (addr->sa_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr, address, sizeof(address));
+		port = ntohs(((struct sockaddr_in*)addr)->sin_port);
+	}
+	else if (addr->sa_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)addr)->sin6_addr, address, sizeof(address));
+		port = ntohs(((struct sockaddr_in6*)addr)->sin6_port);
+	}
+	else {
+		return 1;
+	}
+	/* A resumed session skips certificate checks, so it must have been
+	 * checked the same way. Stores a socket pins itself have no serial
+	 * and are never shared */
+	verify_mode = SSL_get_verify_mode(tls);
+	if (verify_mode != SSL_VERIFY_NONE) {
+		store_serial = trust_store_serial(SSL_CTX_get_cert_store(SSL_get_SSL_CTX(tls)));
+		if (store_serial == 0) {
+			return 1;
+		}
+	}
+	hostname = SSL_get_servername(tls, TLSEXT_NAMETYPE_host_name);
+	cert = SSL_get_certificate(tls);
+	if (cert != NULL && X509_digest(cert, EVP_sha256(), digest, &digest_len) == 1) {
+		for (i = 0; i < digest_len; i++) {
+			sprintf(&identity[i * 2], "%02x", digest[i]);
+		}
+	}
+	ret = snprintf(key, len, "%s\n%s\n[%s]:%d\n%s\n%d:%lu", profile != NULL ? profile : DEFAULT_CONF,
+		hostname != NULL ? hostname : "", address, port, identity, verify_mode, store_serial);
+	if (ret < 0 || (size_t)ret >= len) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns a reference for the caller, dropping whatever has expired */
+SSL_SESSION* take_session(destination_t* dest) {
+	SSL_SESSION* session;
+	time_t now = time(NULL);
+
+	while (dest->count > 0) {
+		session = dest->sessions[dest->count - 1];
+		if (!session_usable(session, now)) {
+			SSL_SESSION_free(session);
+			dest->count--;
+			continue;
+		}
+		if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION) {
+			dest->count--;
+		}
+		else {
+			SSL_SESSION_up_ref(session);
+		}
+		return session;
+	}
+	return NULL;
+}
+
+int session_usable(SSL_SESSION* session, time_t now) {
+	return SSL_SESSION_is_resumable(session) &&
+		SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) > now;
+}
+
+void lru_unlink(destination_t* dest) {
+	if (dest->prev != NULL) dest->prev->next = dest->next;
+	else head = dest->next;
+	if (dest->next != NULL) dest->next->prev = dest->prev;
+	else tail = dest->prev;
+	dest->prev = NULL;
+	dest->next = NULL;
+	return;
+}
+
+void lru_push(destination_t* dest) {
+	dest->next = head;
+	if (head != NULL) head->prev = dest;
+	head = dest;
+	if (tail == NULL) tail = dest;
+	return;
+}
+
+void free_destination(destination_t* dest) {
+	while (dest->count > 0) {
+		SSL_SESSION_free(dest->sessions[--dest->count]);
+	}
+	free(dest->key);
+	free(dest);
+	return;
+}
@@ -0,0 +1,46 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CLIENT_SESSIONS_H
+#define CLIENT_SESSIONS_H
+
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+/* Sessions from servers we connect to, kept per worker so an app that
+ * reconnects to the same backend resumes. A destination is the profile,
+ * the hostname sent in SNI, the remote address and port, the client
+ * certificate and how the server's certificate was checked: the verify
+ * mode and the shared trust store. Sockets that trust certificates of
+ * their own neither resume nor save sessions. Up to max_destinations
+ * are kept, least recently used first out. TLS 1.3 tickets are handed
+ * out once each, TLS 1.2 sessions until they expire or are replaced */
+int client_sessions_init(int max_destinations);
+void client_sessions_free(void);
+void client_sessions_attach(SSL_CTX* tls_ctx);
+void client_sessions_resume(SSL* tls, const char* profile, struct sockaddr* addr, int addrlen);
+
+#endif
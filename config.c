@@ -9,6 +9,23 @@
 char DEFAULT_CONF[] = "default";
 hsmap_t* global_config = NULL;
 size_t global_config_size = 0;
+static char* config_path = NULL;
+static unsigned long config_generation;
+static unsigned long installed_generation; /* of the profiles in global_config */
+
+static hsmap_t* load_profiles(config_t* cfg);
+static int parse_log_level(const char* value, log_level_t* level);
+daemon_config_t daemon_config = {
+	.workers = 0,
+	.pin_workers = 1,
+	.threads = 0,
+	.slow_callback_ms = 100,
+	.session_cache_size = 4096,
+	.ticket_key_rotation = 3600,
+	.client_session_cache_size = 1024,
+	.verify_cache_size = 1024,
+	.verify_cache_timeout = 300,
+};
 
 
 void add_setting(ssa_config_t* config, config_setting_t* cur_setting) {
@@ -102,12 +119,195 @@ void add_setting(ssa_config_t* config, config_setting_t* cur_setting) {
 		}
 
 	}
+	else if (STR_MATCH(name, "RandomReseedInterval")) {
+		config->reseed_interval = config_setting_get_int(cur_setting);
+		if (config->reseed_interval < 0) {
+			log_printf(LOG_ERROR, "Invalid RandomReseedInterval: %d\n", config->reseed_interval);
+			config->reseed_interval = 0;
+		}
+	}
+	else if (STR_MATCH(name, "RelayBufferMin")) {
+		config->relay_buffer_min = config_setting_get_int(cur_setting);
+		if (config->relay_buffer_min < 0) {
+			log_printf(LOG_ERROR, "Invalid RelayBufferMin: %ld\n", config->relay_buffer_min);
+			config->relay_buffer_min = 0;
+		}
+	}
+	else if (STR_MATCH(name, "RelayBufferMax")) {
+		config->relay_buffer_max = config_setting_get_int(cur_setting);
+		if (config->relay_buffer_max < 0) {
+			log_printf(LOG_ERROR, "Invalid RelayBufferMax: %ld\n", config->relay_buffer_max);
+			config->relay_buffer_max = 0;
+		}
+	}
+	else if (STR_MATCH(name, "KernelTLS")) {
+		value = config_setting_get_string(cur_setting);
+		config->ktls = 0;
+		if (STR_MATCH(value, "On")) {
+			config->ktls = 1;
+		}
+	}
 	else {
 		log_printf(LOG_ERROR, "Unsupported configline: %s\n", name);
 	}
 }
 
+void add_daemon_setting(daemon_config_t* config, config_setting_t* cur_setting) {
+	const char* value;
+	const char* name = config_setting_name(cur_setting);
+
+	if (STR_MATCH(name, "Workers")) {
+		config->workers = config_setting_get_int(cur_setting);
+		if (config->workers < 0) {
+			log_printf(LOG_ERROR, "Invalid Workers: %d\n", config->workers);
+			config->workers = 0;
+		}
+	}
+	else if (STR_MATCH(name, "PinWorkers")) {
+		value = config_setting_get_string(cur_setting);
+		config->pin_workers = 0;
+		if (STR_MATCH(value, "On")) {
+			config->pin_workers = 1;
+		}
+	}
+	else if (STR_MATCH(name, "Threads")) {
+		config->threads = config_setting_get_int(cur_setting);
+		if (config->threads < 0) {
+			log_printf(LOG_ERROR, "Invalid Threads: %d\n", config->threads);
+			config->threads = 0;
+		}
+	}
+	else if (STR_MATCH(name, "LogLevel")) {
+		value = config_setting_get_string(cur_setting);
+		if (parse_log_level(value, &config->log_level) != 0) {
+			log_printf(LOG_ERROR, "Unsupported LogLevel: %s\n", value);
+		}
+	}
+	else if (STR_MATCH(name, "WatchConfig")) {
+		value = config_setting_get_string(cur_setting);
+		config->watch_config = 0;
+		if (STR_MATCH(value, "On")) {
+			config->watch_config = 1;
+		}
+	}
+	else if (STR_MATCH(name, "PoolHugePages")) {
+		value = config_setting_get_string(cur_setting);
+		config->pool_hugepages = 0;
+		if (STR_MATCH(value, "On")) {
+			config->pool_hugepages = 1;
+		}
+	}
+	else if (STR_MATCH(name, "RelayEngine")) {
+		value = config_setting_get_string(cur_setting);
+		if (STR_MATCH(value, "bufferevent")) {
+			config->relay_engine = RELAY_ENGINE_BUFFEREVENT;
+		}
+		else if (STR_MATCH(value, "ring")) {
+			config->relay_engine = RELAY_ENGINE_RING;
+		}
+		else {
+			log_printf(LOG_ERROR, "Unsupported RelayEngine: %s\n", value);
+		}
+	}
+	else if (STR_MATCH(name, "SlowCallbackMs")) {
+		config->slow_callback_ms = config_setting_get_int(cur_setting);
+		if (config->slow_callback_ms < 0) {
+			log_printf(LOG_ERROR, "Invalid SlowCallbackMs: %d\n", config->slow_callback_ms);
+			config->slow_callback_ms = 0;
+		}
+	}
+	else if (STR_MATCH(name, "SessionCacheSize")) {
+		config->session_cache_size = config_setting_get_int(cur_setting);
+		if (config->session_cache_size < 0) {
+			log_printf(LOG_ERROR, "Invalid SessionCacheSize: %d\n", config->session_cache_size);
+			config->session_cache_size = 0;
+		}
+	}
+	else if (STR_MATCH(name, "SessionCacheKeyFile")) {
+		free(config->session_key_file);
+		config->session_key_file = strdup(config_setting_get_string(cur_setting));
+	}
+	else if (STR_MATCH(name, "TicketKeyRotation")) {
+		config->ticket_key_rotation = config_setting_get_int(cur_setting);
+		if (config->ticket_key_rotation < 0) {
+			log_printf(LOG_ERROR, "Invalid TicketKeyRotation: %d\n", config->ticket_key_rotation);
+			config->ticket_key_rotation = 0;
+		}
+	}
+	else if (STR_MATCH(name, "ClientSessionCacheSize")) {
+		config->client_session_cache_size = config_setting_get_int(cur_setting);
+		if (config->client_session_cache_size < 0) {
+			log_printf(LOG_ERROR, "Invalid ClientSessionCacheSize: %d\n", config->client_session_cache_size);
+			config->client_session_cache_size = 0;
+		}
+	}
+	else if (STR_MATCH(name, "VerifyCacheSize")) {
+		config->verify_cache_size = config_setting_get_int(cur_setting);
+		if (config->verify_cache_size < 0) {
+			log_printf(LOG_ERROR, "Invalid VerifyCacheSize: %d\n", config->verify_cache_size);
+			config->verify_cache_size = 0;
+		}
+	}
+	else if (STR_MATCH(name, "VerifyCacheTimeout")) {
+		config->verify_cache_timeout = config_setting_get_int(cur_setting);
+		if (config->verify_cache_timeout < 0) {
+			log_printf(LOG_ERROR, "Invalid VerifyCacheTimeout: %d\n", config->verify_cache_timeout);
+			config->verify_cache_timeout = 0;
+		}
+	}
+	else if (STR_MATCH(name, "TraceSample")) {
+		config->trace_sample = config_setting_get_int(cur_setting);
+		if (config->trace_sample < 0) {
+			log_printf(LOG_ERROR, "Invalid TraceSample: %d\n", config->trace_sample);
+			config->trace_sample = 0;
+		}
+	}
+	else if (STR_MATCH(name, "TraceFile")) {
+		free(config->trace_file);
+		config->trace_file = strdup(config_setting_get_string(cur_setting));
+	}
+	else if (STR_MATCH(name, "MetricsSocket")) {
+		free(config->metrics_socket);
+		config->metrics_socket = strdup(config_setting_get_string(cur_setting));
+	}
+	else if (STR_MATCH(name, "RelayMemoryBudget")) {
+		config->relay_memory_budget = config_setting_get_int64(cur_setting);
+		if (config->relay_memory_budget < 0) {
+			log_printf(LOG_ERROR, "Invalid RelayMemoryBudget: %lld\n", config->relay_memory_budget);
+			config->relay_memory_budget = 0;
+		}
+	}
+	else {
+		log_printf(LOG_ERROR, "Unsupported daemon configline: %s\n", name);
+	}
+}
+
+int parse_log_level(const char* value, log_level_t* level) {
+	if (value == NULL) {
+		return 1;
+	}
+	if (STR_MATCH(value, "debug")) {
+		*level = LOG_DEBUG;
+	}
+	else if (STR_MATCH(value, "info")) {
+		*level = LOG_INFO;
+	}
+	else if (STR_MATCH(value, "warning")) {
+		*level = LOG_WARNING;
+	}
+	else if (STR_MATCH(value, "error")) {
+		*level = LOG_ERROR;
+	}
+	else {
+		return 1;
+	}
+	return 0;
+}
+
 void init_ssa_config(ssa_config_t* def, ssa_config_t* cur) {
+	cur->profile           = NULL;
+	cur->generation        = def->generation;
+	cur->matcher           = NULL;
 	cur->options           = def->options;
 	cur->cipher_list       = strdup(def->cipher_list);
 	cur->validate          = def->validate;
@@ -120,6 +320,10 @@ void init_ssa_config(ssa_config_t* def, ssa_config_t* cur) {
 	cur->max_version       = def->max_version;
 	cur->randseed_path     = strdup(def->randseed_path);
 	cur->randseed_size     = def->randseed_size;
+	cur->reseed_interval   = def->reseed_interval;
+	cur->ktls              = def->ktls;
+	cur->relay_buffer_min  = def->relay_buffer_min;
+	cur->relay_buffer_max  = def->relay_buffer_max;
 
 }
 
@@ -138,29 +342,39 @@ void free_config_entry(void* config) {
 		free(conf->cache_path);
 	if (conf->randseed_path != NULL)
 		free(conf->randseed_path);
+	app_matcher_free(conf->matcher);
 	free(conf);
 }
 
 void free_config()
 {
+	unsigned long hits;
+	unsigned long misses;
+
+	app_cache_stats(&hits, &misses);
+	if (hits + misses > 0) {
+		log_printf(LOG_INFO, "Profile lookups: %lu cached, %lu resolved\n", hits, misses);
+	}
+	__atomic_store_n(&installed_generation, 0, __ATOMIC_RELEASE);
 	str_hashmap_deep_free(global_config,free_config_entry);
 	global_config = NULL;
 	global_config_size = 0;
+	free(config_path);
+	config_path = NULL;
+	free(daemon_config.metrics_socket);
+	daemon_config.metrics_socket = NULL;
+	free(daemon_config.session_key_file);
+	daemon_config.session_key_file = NULL;
+	free(daemon_config.trace_file);
+	daemon_config.trace_file = NULL;
 }
 
 size_t parse_config(char* filename) {
 	int i;
-	int j;
 	free_config(); // Just incase you call parse_config multiple times
 	config_t cfg;
-	config_setting_t *default_profile;
-	config_setting_t *cur_profile;
-	config_setting_t *cur_setting;
-	config_setting_t *profiles;
-	ssa_config_t* default_config;
-	ssa_config_t* cur_config;
-
-	int num_profiles;
+	config_setting_t *daemon_settings;
+	hsmap_t* profiles;
 
 	config_init(&cfg);
 
@@ -169,52 +383,116 @@ size_t parse_config(char* filename) {
 		return -1;
 	}
 
-	profiles = config_lookup(&cfg, "Profiles");
-	num_profiles = config_setting_length(profiles);
-	
-	// global_config = calloc(num_profiles + 1, sizeof(ssa_config_t));
-	global_config = str_hashmap_create(HASHMAP_SIZE);
-	default_config = calloc(1,sizeof(ssa_config_t));
-	global_config_size = num_profiles + 1;
-	
-	// Parse default
-	default_profile = config_lookup(&cfg, "Default");
-	int default_i = config_setting_length(default_profile);
-	for (i = 0; i < default_i; i++) {
-		add_setting(default_config, config_setting_get_elem(default_profile, i));
+	// Daemon-wide settings are optional
+	daemon_settings = config_lookup(&cfg, "Daemon");
+	if (daemon_settings != NULL) {
+		for (i = 0; i < config_setting_length(daemon_settings); i++) {
+			add_daemon_setting(&daemon_config, config_setting_get_elem(daemon_settings, i));
+		}
 	}
-	//Default profile does not need a name
-	default_config->profile = NULL;
-	str_hashmap_add(global_config,DEFAULT_CONF,default_config);
 
+	profiles = load_profiles(&cfg);
+	config_destroy(&cfg);
+	if (profiles == NULL) {
+		exit(-1);
+	}
+	config_path = strdup(filename);
+	config_install(profiles);
+	return global_config_size;
+}
 
+/* Parses filename into a new set of profiles without touching the ones
+ * in use. Daemon settings other than LogLevel are only read at startup.
+ * Returns NULL if the file can't be used, leaving the caller's
+ * configuration as it was */
+hsmap_t* config_load_profiles(char* filename) {
+	config_t cfg;
+	hsmap_t* profiles;
+	const char* value;
+	log_level_t level;
 
-	//TODO failout if a default is not set 
-	if (config_lookup(&cfg, "Default.MinProtocol") == NULL) {
+	config_init(&cfg);
+	if (!config_read_file(&cfg, filename)) {
+		log_printf(LOG_ERROR, "Error loading config file %s: %s %d\n", filename, config_error_text(&cfg), config_error_line(&cfg));
+		config_destroy(&cfg);
+		return NULL;
+	}
+	profiles = load_profiles(&cfg);
+	/* The one Daemon setting that can change while running */
+	if (profiles != NULL && config_lookup_string(&cfg, "Daemon.LogLevel", &value) &&
+	    parse_log_level(value, &level) == 0) {
+		daemon_config.log_level = level;
+		log_set_level(level);
+	}
+	config_destroy(&cfg);
+	return profiles;
+}
+
+hsmap_t* load_profiles(config_t* cfg) {
+	int i;
+	int j;
+	config_setting_t *default_profile;
+	config_setting_t *cur_profile;
+	config_setting_t *cur_setting;
+	config_setting_t *profiles;
+	ssa_config_t* default_config;
+	ssa_config_t* cur_config;
+	hsmap_t* map;
+	unsigned long generation;
+
+	int num_profiles;
+
+	//Every setting that has no built in value must come from Default
+	if (config_lookup(cfg, "Default.MinProtocol") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for MinProtocol not set.\n");
-		exit(-1);
+		return NULL;
 	}
-	if (config_lookup(&cfg, "Default.CipherSuite") == NULL) {
+	if (config_lookup(cfg, "Default.CipherSuite") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for CipherSuite not set.\n");
-		exit(-1);
+		return NULL;
 	}
-	if (config_lookup(&cfg, "Default.SessionCacheTimeout") == NULL) {
+	if (config_lookup(cfg, "Default.SessionCacheTimeout") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for SessionCacheTimeout not set.\n");
-		exit(-1);
+		return NULL;
 	}
-	if (config_lookup(&cfg, "Default.Validation") == NULL) {
+	if (config_lookup(cfg, "Default.Validation") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for Validation not set.\n");
-		exit(-1);
+		return NULL;
 	}
-	if (config_lookup(&cfg, "Default.TrustStoreLocation") == NULL) {
+	if (config_lookup(cfg, "Default.TrustStoreLocation") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for TrustStoreLocation not set.\n");
-		exit(-1);
+		return NULL;
 	}   
-	if (config_lookup(&cfg, "Default.AppCustomValidation") == NULL) {
+	if (config_lookup(cfg, "Default.AppCustomValidation") == NULL) {
 		log_printf(LOG_ERROR, "Default configuration for AppCustomValidation not set.\n");
-		exit(-1);
+		return NULL;
+	}
+
+	profiles = config_lookup(cfg, "Profiles");
+	num_profiles = profiles != NULL ? config_setting_length(profiles) : 0;
+	generation = __atomic_add_fetch(&config_generation, 1, __ATOMIC_RELAXED);
+
+	map = str_hashmap_create(HASHMAP_SIZE);
+	if (map == NULL) {
+		return NULL;
+	}
+	default_config = calloc(1,sizeof(ssa_config_t));
+	if (default_config == NULL) {
+		str_hashmap_free(map);
+		return NULL;
+	}
+
+	// Parse default
+	default_profile = config_lookup(cfg, "Default");
+	int default_i = config_setting_length(default_profile);
+	for (i = 0; i < default_i; i++) {
+		add_setting(default_config, config_setting_get_elem(default_profile, i));
 	}
-	
+	//Default profile does not need a name
+	default_config->profile = NULL;
+	default_config->generation = generation;
+	str_hashmap_add(map,DEFAULT_CONF,default_config);
+
 	// Parse all the profiles
 
 	for(i = 0; i < num_profiles; i++) {
@@ -226,30 +504,86 @@ size_t parse_config(char* filename) {
 			cur_setting = config_setting_get_elem(cur_profile, j);
 			add_setting(cur_config, cur_setting);
 		}
-		str_hashmap_add(global_config,cur_config->profile,cur_config);
+		if (cur_config->profile == NULL ||
+		    str_hashmap_add(map,cur_config->profile,cur_config) != 0) {
+			log_printf(LOG_ERROR, "Profile %d has no or a duplicate Application\n", i);
+			free_config_entry(cur_config);
+			continue;
+		}
+		if (app_matcher_is_pattern(cur_config->profile)) {
+			if (default_config->matcher == NULL) {
+				default_config->matcher = app_matcher_create();
+			}
+			if (default_config->matcher == NULL ||
+			    app_matcher_add(default_config->matcher, cur_config->profile, cur_config) != 0) {
+				log_printf(LOG_ERROR, "Unable to add Application pattern %s\n", cur_config->profile);
+			}
+		}
 	}
+	return map;
+}
 
-	config_destroy(&cfg);
-	return global_config_size;
+/* Makes profiles the configuration every later lookup sees. Returns the
+ * previous profiles, which lookups already under way may still be
+ * reading; release them with config_free_profiles once they are done */
+hsmap_t* config_install(hsmap_t* profiles) {
+	ssa_config_t* default_config;
+	hsmap_t* old;
+
+	__atomic_store_n(&global_config_size, (size_t)profiles->item_count, __ATOMIC_RELAXED);
+	old = __atomic_exchange_n(&global_config, profiles, __ATOMIC_ACQ_REL);
+	/* Published after the profiles, so a reader that sees the new
+	 * generation also sees the profiles it belongs to */
+	default_config = str_hashmap_get(profiles, DEFAULT_CONF);
+	__atomic_store_n(&installed_generation, default_config->generation, __ATOMIC_RELEASE);
+	return old;
+}
+
+void config_free_profiles(hsmap_t* profiles) {
+	str_hashmap_deep_free(profiles, free_config_entry);
+	return;
+}
+
+char* config_get_path(void) {
+	return config_path;
 }
 
 /* return NULL if the config has not been parsed 
- * If it has, get the requested application
+ * If it has, get the requested application, trying an exact
+ * Application first and then the wildcard ones
  * If the requested application does not exist return
  * the defualt configuration
+ * Answers are cached per thread until the next reload
 */
 ssa_config_t* get_app_config(char* app_path)
 {
 	ssa_config_t* config;
+	ssa_config_t* default_config;
+	unsigned long generation;
+	hsmap_t* profiles;
 
-	if (global_config == NULL)
+	if (app_path != NULL) {
+		generation = __atomic_load_n(&installed_generation, __ATOMIC_ACQUIRE);
+		config = app_cache_get(app_path, generation);
+		if (config != NULL)
+			return config;
+	}
+
+	profiles = __atomic_load_n(&global_config, __ATOMIC_ACQUIRE);
+	if (profiles == NULL)
 		return NULL;
 
-	config = str_hashmap_get(global_config,app_path);
+	default_config = str_hashmap_get(profiles,DEFAULT_CONF);
+	if (app_path == NULL)
+		return default_config;
 
+	config = str_hashmap_get(profiles,app_path);
+	if (config == NULL)
+		config = app_matcher_find(default_config->matcher, app_path);
 	if (config == NULL) 
-		return str_hashmap_get(global_config,DEFAULT_CONF);
-	
+		config = default_config;
+
+	app_cache_put(app_path, config->generation, config);
 	return config;
 }
 
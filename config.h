@@ -4,11 +4,15 @@
 #include <stdlib.h>
 #include <openssl/ssl.h>
 #include "hashmap_str.h"
+#include "app_match.h"
+#include "log.h"
 enum validation { Normal, TrustBase };
 #define SSA_EXT_SNI    0x0001
 #define SSA_EXT_ALPN   0x0002
 #define SSA_EXT_TICKET 0x0004
 
+enum relay_engine { RELAY_ENGINE_BUFFEREVENT, RELAY_ENGINE_RING };
+
 typedef struct {
     char* profile;
     int min_version;
@@ -23,15 +27,53 @@ typedef struct {
     long extensions; //bitmask
     char* randseed_path;
     int randseed_size;
+    int reseed_interval; //seconds, 0 disables
+    int ktls; //hand record crypto to the kernel after the handshake
+    long relay_buffer_min; //bytes, 0 uses the built in default
+    long relay_buffer_max;
+    unsigned long generation; //bumped each time the file is loaded
+    app_matcher_t* matcher; //wildcard Applications, default profile only
 
 } ssa_config_t;
 
+/* Settings for the daemon as a whole, from the optional Daemon group */
+typedef struct {
+    int workers; //0 starts one worker per online CPU
+    int pin_workers;
+    int threads; //data plane threads per worker, 0 or 1 keeps one event loop
+    long long relay_memory_budget; //bytes across all workers, 0 is unlimited
+    enum relay_engine relay_engine;
+    int pool_hugepages;
+    int watch_config; //reload when the file changes, not only on SIGHUP
+    log_level_t log_level; //least severe level written, applied on reload too
+    char* metrics_socket; //Unix socket for scrapes, @ for abstract, NULL disables
+    int trace_sample; //trace one in this many sockets, 0 disables
+    int slow_callback_ms; //log callbacks and loop stalls longer than this, 0 disables
+    char* trace_file; //prefix of each worker's trace file, NULL uses ssa-trace
+    int session_cache_size; //server sessions shared by all workers, 0 keeps them per context
+    char* session_key_file; //seals sessions stored under SessionCacheLocation, NULL keeps them in memory
+    int ticket_key_rotation; //seconds between session ticket key rotations, 0 never rotates
+    int client_session_cache_size; //destinations each worker keeps sessions for, 0 disables
+    int verify_cache_size; //peer chains each worker remembers verifying, 0 disables
+    int verify_cache_timeout; //seconds a verification result is reused, 0 disables
+} daemon_config_t;
+
 extern char DEFAULT_CONF[];
 extern hsmap_t* global_config;
 extern size_t global_config_size;
+extern daemon_config_t daemon_config;
 
 size_t parse_config(char* filename);
 void free_config();
 ssa_config_t* get_app_config(char* app_path);
 
+/* Reloading builds a complete new set of profiles and swaps it in with
+ * a single pointer exchange, so get_app_config sees either the old
+ * profiles or the new ones. Pointers it returned earlier stay valid
+ * until the replaced profiles are passed to config_free_profiles */
+hsmap_t* config_load_profiles(char* filename);
+hsmap_t* config_install(hsmap_t* profiles);
+void config_free_profiles(hsmap_t* profiles);
+char* config_get_path(void);
+
 #endif
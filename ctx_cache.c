@@ -0,0 +1,240 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+
+#include "ctx_cache.h"
+#include "config.h"
+#include "hashmap_str.h"
+#include "openssl_compat.h"
+#include "tls_wrapper.h"
+#include "log.h"
+
+#define CTX_CACHE_BUCKETS	20
+
+typedef struct ctx_entry {
+	char* key;
+	SSL_CTX* tls_ctx;
+} ctx_entry_t;
+
+static hsmap_t* ctx_map = NULL;
+static pthread_mutex_t ctx_map_lock = PTHREAD_MUTEX_INITIALIZER; /* data plane threads share the cache */
+static unsigned long ctx_cache_hits;
+static unsigned long ctx_cache_misses;
+
+static char* ctx_cache_key(ssa_config_t* ssa_config, ctx_role_t role);
+static void build_entry(char* name, void* config, void* arg);
+static void free_ctx_entry(void* entry);
+
+typedef struct ctx_build {
+	hsmap_t* map;
+	int failed;
+} ctx_build_t;
+
+int ctx_cache_init(void) {
+	if (ctx_map != NULL) {
+		return 0;
+	}
+	ctx_map = str_hashmap_create(CTX_CACHE_BUCKETS);
+	if (ctx_map == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate SSL_CTX cache\n");
+		return 1;
+	}
+	return 0;
+}
+
+void ctx_cache_free(void) {
+	log_printf(LOG_INFO, "SSL_CTX cache: %lu hits, %lu misses\n",
+			ctx_cache_hits, ctx_cache_misses);
+	str_hashmap_deep_free(ctx_map, free_ctx_entry);
+	ctx_map = NULL;
+	return;
+}
+
+SSL_CTX* ctx_cache_get(char* app_path, ctx_role_t role) {
+	ssa_config_t* ssa_config;
+	ctx_entry_t* entry;
+	char* key;
+
+	if (ctx_map == NULL && ctx_cache_init() != 0) {
+		return NULL;
+	}
+
+	ssa_config = get_app_config(app_path);
+	if (ssa_config == NULL) {
+		log_printf(LOG_ERROR, "Unable to find ssa configuration\n");
+		return NULL;
+	}
+
+	key = ctx_cache_key(ssa_config, role);
+	if (key == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx_map_lock);
+	entry = (ctx_entry_t*)str_hashmap_get(ctx_map, key);
+	if (entry != NULL) {
+		free(key);
+		ctx_cache_hits++;
+		#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		SSL_CTX_up_ref(entry->tls_ctx);
+		#else
+		compat_SSL_CTX_up_ref(entry->tls_ctx);
+		#endif
+		pthread_mutex_unlock(&ctx_map_lock);
+		return entry->tls_ctx;
+	}
+
+	ctx_cache_misses++;
+	entry = (ctx_entry_t*)calloc(1, sizeof(ctx_entry_t));
+	if (entry == NULL) {
+		free(key);
+		pthread_mutex_unlock(&ctx_map_lock);
+		return NULL;
+	}
+	entry->key = key;
+	entry->tls_ctx = tls_ctx_create(ssa_config, role);
+	if (entry->tls_ctx == NULL) {
+		free_ctx_entry(entry);
+		pthread_mutex_unlock(&ctx_map_lock);
+		return NULL;
+	}
+	str_hashmap_add(ctx_map, entry->key, entry);
+	log_printf(LOG_INFO, "Created shared SSL_CTX for %s\n", key);
+
+	/* One reference for the cache, one for the caller */
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_up_ref(entry->tls_ctx);
+	#else
+	compat_SSL_CTX_up_ref(entry->tls_ctx);
+	#endif
+	pthread_mutex_unlock(&ctx_map_lock);
+	return entry->tls_ctx;
+}
+
+/* Creates the context every profile in profiles hands to new sockets,
+ * without touching the cache in use. Returns NULL if any profile can't
+ * produce one, so a broken configuration is rejected before it is seen */
+hsmap_t* ctx_cache_build(hsmap_t* profiles) {
+	ctx_build_t build = { 0 };
+
+	build.map = str_hashmap_create(CTX_CACHE_BUCKETS);
+	if (build.map == NULL) {
+		return NULL;
+	}
+	str_hashmap_foreach(profiles, build_entry, &build);
+	if (build.failed) {
+		ctx_cache_discard(build.map);
+		return NULL;
+	}
+	return build.map;
+}
+
+/* Swaps in a map from ctx_cache_build. Sockets keep their references to
+ * the contexts being dropped, so those live until the last one closes */
+void ctx_cache_install(hsmap_t* map) {
+	hsmap_t* old_map;
+
+	pthread_mutex_lock(&ctx_map_lock);
+	old_map = ctx_map;
+	ctx_map = map;
+	pthread_mutex_unlock(&ctx_map_lock);
+	ctx_cache_discard(old_map);
+	return;
+}
+
+void ctx_cache_discard(hsmap_t* map) {
+	str_hashmap_deep_free(map, free_ctx_entry);
+	return;
+}
+
+void build_entry(char* name, void* config, void* arg) {
+	ssa_config_t* ssa_config = (ssa_config_t*)config;
+	ctx_build_t* build = (ctx_build_t*)arg;
+	ctx_entry_t* entry;
+
+	if (build->failed) {
+		return;
+	}
+	entry = (ctx_entry_t*)calloc(1, sizeof(ctx_entry_t));
+	if (entry == NULL) {
+		build->failed = 1;
+		return;
+	}
+	entry->key = ctx_cache_key(ssa_config, CTX_ROLE_UNSPEC);
+	if (entry->key != NULL) {
+		entry->tls_ctx = tls_ctx_create(ssa_config, CTX_ROLE_UNSPEC);
+	}
+	if (entry->tls_ctx == NULL) {
+		log_printf(LOG_ERROR, "Unable to create SSL_CTX for profile %s\n", name);
+		free_ctx_entry(entry);
+		build->failed = 1;
+		return;
+	}
+	str_hashmap_add(build->map, entry->key, entry);
+	return;
+}
+
+/* Contexts are interchangeable if they come from the same profile and
+ * load of the config file, play the same role and were loaded with the
+ * same trust store and credentials */
+char* ctx_cache_key(ssa_config_t* ssa_config, ctx_role_t role) {
+	char* key;
+	int length;
+	const char* profile = ssa_config->profile ? ssa_config->profile : DEFAULT_CONF;
+	const char* trust_store = ssa_config->trust_store ? ssa_config->trust_store : "";
+	const char* cert = role == CTX_ROLE_SERVER ? SERVER_DEFAULT_CERT : "";
+	const char* pkey = role == CTX_ROLE_SERVER ? SERVER_DEFAULT_KEY : "";
+
+	length = snprintf(NULL, 0, "%s|%lu|%d|%s|%s|%s", profile, ssa_config->generation,
+			role, trust_store, cert, pkey);
+	if (length < 0) {
+		return NULL;
+	}
+	key = (char*)malloc(length + 1);
+	if (key == NULL) {
+		log_printf(LOG_ERROR, "Unable to allocate SSL_CTX cache key\n");
+		return NULL;
+	}
+	snprintf(key, length + 1, "%s|%lu|%d|%s|%s|%s", profile, ssa_config->generation,
+			role, trust_store, cert, pkey);
+	return key;
+}
+
+void free_ctx_entry(void* arg) {
+	ctx_entry_t* entry = (ctx_entry_t*)arg;
+	if (entry->tls_ctx != NULL) {
+		SSL_CTX_free(entry->tls_ctx);
+	}
+	free(entry->key);
+	free(entry);
+	return;
+}
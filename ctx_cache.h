@@ -0,0 +1,51 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CTX_CACHE_H
+#define CTX_CACHE_H
+
+#include <openssl/ssl.h>
+#include "hashmap_str.h"
+
+typedef enum ctx_role {
+	CTX_ROLE_UNSPEC, /* socket created, role not yet known */
+	CTX_ROLE_CLIENT,
+	CTX_ROLE_SERVER,
+} ctx_role_t;
+
+/* The context cache hands out SSL_CTX objects shared between all sockets
+ * of the same application profile and role. Every context returned by
+ * ctx_cache_get carries a reference owned by the caller, which must be
+ * released with SSL_CTX_free. Shared contexts must never be modified;
+ * callers needing per-socket settings create a private context instead */
+int ctx_cache_init(void);
+void ctx_cache_free(void);
+SSL_CTX* ctx_cache_get(char* app_path, ctx_role_t role);
+hsmap_t* ctx_cache_build(hsmap_t* profiles);
+void ctx_cache_install(hsmap_t* map);
+void ctx_cache_discard(hsmap_t* map);
+
+#endif
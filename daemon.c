@@ -55,25 +55,45 @@
 #include "daemon.h"
 #include "hashmap.h"
 #include "tls_wrapper.h"
+#include "ctx_cache.h"
+#include "trust_store.h"
+#include "client_sessions.h"
+#include "verify_cache.h"
+#include "entropy.h"
+#include "reload.h"
+#include "metrics.h"
+#include "trace.h"
+#include "loop_monitor.h"
+#include "relay_budget.h"
+#include "pool.h"
+#include "dataplane.h"
+#include "port_owner.h"
+#include "openssl_compat.h"
+#include "config.h"
 #include "netlink.h"
 #include "log.h"
 
 #define MAX_UPGRADE_SOCKET  18
 #define HASHMAP_NUM_BUCKETS	100
+#define PORT_KEY_UNIX		0x100000
 
 #ifdef CLIENT_AUTH
 int auth_info_index;
 #endif
+int tls_opts_index;
+
+/* sock_ctx_t is allocated per socket, freed in close_cb and free_sock_ctx */
+static pool_t* sock_ctx_pool;
 
 typedef struct sock_ctx {
 	unsigned long id;
 	evutil_socket_t fd;
 	int has_bound; /* Nonzero if we've called bind locally */
-	struct sockaddr int_addr;
+	struct sockaddr_storage int_addr; /* AF_UNIX names don't fit a sockaddr */
 	int int_addrlen;
 	union {
-		struct sockaddr ext_addr;
-		struct sockaddr rem_addr;
+		struct sockaddr_storage ext_addr;
+		struct sockaddr_storage rem_addr;
 	};
 	union {
 		int ext_addrlen;
@@ -86,10 +106,28 @@ typedef struct sock_ctx {
 	char rem_hostname[MAX_HOSTNAME];
 	tls_conn_ctx_t* tls_conn;
 	tls_daemon_ctx_t* daemon;
+	int owner; /* data plane thread serving this socket */
+	int port_key; /* entry in sock_map_port, 0 if none */
+	conn_trace_t* trace; /* NULL unless this socket was sampled */
 } sock_ctx_t;
 
+typedef struct plain_accept {
+	evutil_socket_t fd;
+	int port;
+} plain_accept_t;
+
+typedef struct upgrade_req {
+	evutil_socket_t fd;
+	evutil_socket_t new_fd;
+	unsigned long id;
+	int is_accepting;
+	struct sockaddr_un addr;
+	int addr_len;
+} upgrade_req_t;
+
 
 void free_sock_ctx(sock_ctx_t* sock_ctx);
+static void end_trace(sock_ctx_t* sock_ctx);
 
 /* SSA direct functions */
 static void accept_error_cb(struct evconnlistener *listener, void *ctx);
@@ -100,24 +138,44 @@ static evutil_socket_t create_server_socket(ev_uint16_t port, int family, int pr
 
 /* SSA listener functions */
 static void listener_accept_error_cb(struct evconnlistener *listener, void *ctx);
+static evutil_socket_t create_plain_unix_leg(int* port);
+static evutil_socket_t create_plain_tcp_leg(int* port);
 static void listener_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
 	struct sockaddr *address, int socklen, void *arg);
 
+static void plain_accept(tls_daemon_ctx_t* ctx, evutil_socket_t fd, int port);
+static void plain_accept_task(tls_daemon_ctx_t* ctx, void* arg);
+
 /* special */
 static evutil_socket_t create_upgrade_socket(int port);
 static void upgrade_recv(evutil_socket_t fd, short events, void *arg);
+static void upgrade_sock(tls_daemon_ctx_t* ctx, void* arg);
+
+/* sock_map and sock_map_port, locked when data plane threads share them */
+static void* sock_map_get(tls_daemon_ctx_t* ctx, unsigned long id);
+static void sock_map_add(tls_daemon_ctx_t* ctx, unsigned long id, sock_ctx_t* sock_ctx);
+static void sock_map_del(tls_daemon_ctx_t* ctx, unsigned long id);
+static void* port_map_get(tls_daemon_ctx_t* ctx, int port);
+static void port_map_add(tls_daemon_ctx_t* ctx, int port, sock_ctx_t* sock_ctx);
+static void port_map_del(tls_daemon_ctx_t* ctx, int port, sock_ctx_t* sock_ctx);
 ssize_t recv_fd_from(int fd, void *ptr, size_t nbytes, int *recvfd, struct sockaddr_un* addr, int addr_len);
 
-int server_create(int port) {
+int server_create(int port, int worker_id, int worker_count) {
 	int ret;
 	evutil_socket_t server_sock;
+	evutil_socket_t unix_server_sock;
 	evutil_socket_t upgrade_sock;
 	struct evconnlistener* listener;
+	struct evconnlistener* unix_listener;
 	struct event* sev_pipe;
 	struct event* sev_int;
 	struct event* nl_ev;
 	struct event* upgrade_ev;
 	struct nl_sock* netlink_sock;
+	dataplane_t* dataplane = NULL;
+	loop_monitor_t* monitor;
+	pthread_rwlock_t map_lock;
+	pthread_mutex_t netlink_lock;
 	struct event_base* ev_base = event_base_new();
 
 #ifndef NO_LOG
@@ -137,6 +195,40 @@ int server_create(int port) {
 	#ifdef CLIENT_AUTH
 	auth_info_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 	#endif
+	tls_opts_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (ctx_cache_init() != 0) {
+		return 1;
+	}
+	if (trust_store_init() != 0) {
+		return 1;
+	}
+	if (client_sessions_init(daemon_config.client_session_cache_size) != 0) {
+		log_printf(LOG_WARNING, "Continuing without client session resumption\n");
+	}
+	if (verify_cache_init(daemon_config.verify_cache_size, daemon_config.verify_cache_timeout) != 0) {
+		log_printf(LOG_WARNING, "Continuing without the verification cache\n");
+	}
+	relay_budget_init(daemon_config.relay_memory_budget / worker_count);
+	pool_set_default_flags(daemon_config.pool_hugepages ? POOL_HUGEPAGES : 0);
+	sock_ctx_pool = pool_create("sock_ctx", sizeof(sock_ctx_t));
+	if (sock_ctx_pool == NULL) {
+		return 1;
+	}
+
+	if (entropy_init(ev_base) != 0) {
+		return 1;
+	}
+	if (reload_init(ev_base) != 0) {
+		return 1;
+	}
+	if (metrics_attach(ev_base, worker_id) != 0) {
+		return 1;
+	}
+	loop_monitor_init(daemon_config.slow_callback_ms);
+	monitor = loop_monitor_attach(ev_base);
+	if (trace_init(daemon_config.trace_file, daemon_config.trace_sample, worker_id) != 0) {
+		log_printf(LOG_WARNING, "Continuing without connection traces\n");
+	}
 
 	/* Signal handler registration */
 	sev_pipe = evsignal_new(ev_base, SIGPIPE, signal_cb, NULL);
@@ -158,8 +250,15 @@ int server_create(int port) {
 		.ev_base = ev_base,
 		.netlink_sock = NULL,
 		.port = port,
+		.worker_id = worker_id,
+		.worker_count = worker_count,
+		.accepted = hashmap_create(HASHMAP_NUM_BUCKETS),
 		.sock_map = hashmap_create(HASHMAP_NUM_BUCKETS),
-		.sock_map_port = hashmap_create(HASHMAP_NUM_BUCKETS),
+		.sock_map_port = port_table_create(),
+		.dataplane = NULL,
+		.thread_id = DP_CONTROL_THREAD,
+		.map_lock = NULL,
+		.netlink_lock = NULL,
 	};
 
 	/* Set up server socket with event base */
@@ -172,6 +271,17 @@ int server_create(int port) {
 	}
 	evconnlistener_set_error_cb(listener, accept_error_cb);
 
+	/* Apps may also reach us over AF_UNIX at "\0<port>", which skips
+	 * the TCP stack and uses no ephemeral ports */
+	unix_server_sock = create_server_socket(port, PF_UNIX, SOCK_STREAM);
+	unix_listener = evconnlistener_new(ev_base, accept_cb, &daemon_ctx, 
+		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_THREADSAFE, SOMAXCONN, unix_server_sock);
+	if (unix_listener == NULL) {
+		log_printf(LOG_ERROR, "Couldn't create AF_UNIX evconnlistener\n");
+		return 1;
+	}
+	evconnlistener_set_error_cb(unix_listener, accept_error_cb);
+
 	/* Set up netlink socket with event base */
 	netlink_sock = netlink_connect(&daemon_ctx);
 	if (netlink_sock == NULL) {
@@ -189,6 +299,26 @@ int server_create(int port) {
 		return 1;
 	}
 
+	/* With data plane threads this event base becomes the control thread */
+	if (daemon_config.threads > 1) {
+		if (compat_thread_setup() == 0) {
+			log_printf(LOG_ERROR, "Couldn't set up OpenSSL for threads\n");
+			return 1;
+		}
+		pthread_rwlock_init(&map_lock, NULL);
+		pthread_mutex_init(&netlink_lock, NULL);
+		daemon_ctx.map_lock = &map_lock;
+		daemon_ctx.netlink_lock = &netlink_lock;
+		dataplane = dataplane_create(&daemon_ctx, daemon_config.threads);
+		if (dataplane == NULL) {
+			return 1;
+		}
+		daemon_ctx.dataplane = dataplane;
+		if (dataplane_start(dataplane) != 0) {
+			return 1;
+		}
+	}
+
 	/* Set up upgrade notification socket with event base */
 	upgrade_sock = create_upgrade_socket(port);
 	upgrade_ev = event_new(ev_base, upgrade_sock, EV_READ | EV_PERSIST, upgrade_recv, &daemon_ctx);
@@ -201,12 +331,44 @@ int server_create(int port) {
 	event_base_dispatch(ev_base);
 
 	log_printf(LOG_INFO, "Main event loop terminated\n");
+	if (daemon_ctx.misrouted > 0) {
+		log_printf(LOG_INFO, "Worker %d passed %lu messages on to the workers owning their sockets\n",
+				worker_id, daemon_ctx.misrouted);
+	}
 	netlink_disconnect(netlink_sock);
 
 	/* Cleanup */
 	evconnlistener_free(listener); /* This also closes the socket due to our listener creation flags */
-	hashmap_free(daemon_ctx.sock_map_port);
+	evconnlistener_free(unix_listener);
+	if (dataplane != NULL) {
+		/* Sockets are freed once their threads have stopped but
+		 * before the event bases their events belong to */
+		dataplane_stop(dataplane);
+	}
+	if (port_table_stale_count(daemon_ctx.sock_map_port) > 0) {
+		log_printf(LOG_WARNING, "Worker %d saw %lu stale port entries\n",
+				worker_id, port_table_stale_count(daemon_ctx.sock_map_port));
+	}
+	port_table_free(daemon_ctx.sock_map_port);
+	hashmap_free(daemon_ctx.accepted);
 	hashmap_deep_free(daemon_ctx.sock_map, (void (*)(void*))free_sock_ctx);
+	trace_free();
+	pool_log_stats();
+	pool_destroy(sock_ctx_pool);
+	if (dataplane != NULL) {
+		dataplane_free(dataplane);
+		pthread_rwlock_destroy(&map_lock);
+		pthread_mutex_destroy(&netlink_lock);
+		compat_thread_cleanup();
+	}
+	loop_monitor_detach(monitor);
+	metrics_detach();
+	reload_free();
+	ctx_cache_free();
+	trust_store_free();
+	client_sessions_free();
+	verify_cache_free();
+	entropy_free();
 	event_free(nl_ev);
 
 	event_free(upgrade_ev);
@@ -394,23 +556,59 @@ void accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
 	log_printf(LOG_INFO, "Received connection!\n");
 
 	int port;
-	sock_ctx_t* sock_ctx;
+	int thread_id;
+	plain_accept_t* task;
 	tls_daemon_ctx_t* ctx = arg;
+	uint64_t started;
 
-	if (address->sa_family == AF_UNIX) {
-		port = strtol(((struct sockaddr_un*)address)->sun_path+1, NULL, 16);
-		log_printf(LOG_INFO, "unix port is %05x", port);
+	port = sockaddr_port_key(address);
+	if (ctx->dataplane == NULL) {
+		started = loop_monitor_begin();
+		plain_accept(ctx, fd, port);
+		loop_monitor_end(LOOP_CB_ACCEPT, 0, started);
+		return;
 	}
-	else {
-		port = (int)ntohs(((struct sockaddr_in*)address)->sin_port);
+
+	/* The connection's bufferevents live on its owner's thread */
+	thread_id = sock_owner_port(ctx, port);
+	if (thread_id < 0) {
+		log_printf(LOG_ERROR, "Got an unauthorized connection on port %d\n", port);
+		EVUTIL_CLOSESOCKET(fd);
+		return;
 	}
-	sock_ctx = hashmap_get(ctx->sock_map_port, port);
+	task = (plain_accept_t*)malloc(sizeof(plain_accept_t));
+	if (task == NULL) {
+		EVUTIL_CLOSESOCKET(fd);
+		return;
+	}
+	task->fd = fd;
+	task->port = port;
+	if (dataplane_dispatch(ctx->dataplane, thread_id, plain_accept_task, task) != 0) {
+		EVUTIL_CLOSESOCKET(fd);
+		free(task);
+	}
+	return;
+}
+
+void plain_accept_task(tls_daemon_ctx_t* ctx, void* arg) {
+	plain_accept_t* task = (plain_accept_t*)arg;
+	plain_accept(ctx, task->fd, task->port);
+	free(task);
+	return;
+}
+
+/* Pairs the app's plaintext connection with the TLS connection waiting
+ * for it on port */
+void plain_accept(tls_daemon_ctx_t* ctx, evutil_socket_t fd, int port) {
+	sock_ctx_t* sock_ctx;
+
+	sock_ctx = port_map_get(ctx, port);
 	if (sock_ctx == NULL) {
 		log_printf(LOG_ERROR, "Got an unauthorized connection on port %d\n", port);
 		EVUTIL_CLOSESOCKET(fd);
 		return;
 	}
-	log_printf_addr(&sock_ctx->rem_addr);
+	log_printf_addr((struct sockaddr*)&sock_ctx->rem_addr);
 
 	if (evutil_make_socket_nonblocking(fd) == -1) {
 		log_printf(LOG_ERROR, "Failed in evutil_make_socket_nonblocking: %s\n",
@@ -418,10 +616,11 @@ void accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
 		EVUTIL_CLOSESOCKET(fd);
 		return;
 	}
-	hashmap_del(ctx->sock_map_port, port);
+	port_map_del(ctx, port, sock_ctx);
 	//sock_ctx->tls_conn = tls_client_wrapper_setup(sock_ctx->fd, ctx, 
 	//			sock_ctx->rem_hostname, sock_ctx->is_accepting, sock_ctx->tls_opts);
 
+	trace_mark(sock_ctx->trace, TRACE_ASSOCIATE);
 	associate_fd(sock_ctx->tls_conn, fd);
 	return;
 }
@@ -439,16 +638,11 @@ void accept_error_cb(struct evconnlistener *listener, void *ctx) {
 
 void listener_accept_cb(struct evconnlistener *listener, evutil_socket_t efd,
 	struct sockaddr *address, int socklen, void *arg) {
-	struct sockaddr_in int_addr = {
-		.sin_family = AF_INET,
-		.sin_port = 0,
-		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
-	};
-	socklen_t intaddr_len = sizeof(int_addr);
 	sock_ctx_t* sock_ctx = (sock_ctx_t*)arg;
 	evutil_socket_t ifd;
 	int port;
 	sock_ctx_t* new_sock_ctx;
+	uint64_t started = loop_monitor_begin();
         //struct event_base *base = evconnlistener_get_base(listener);
 
 	//log_printf(LOG_DEBUG, "Got a connection on a vicarious listener\n");
@@ -460,46 +654,121 @@ void listener_accept_cb(struct evconnlistener *listener, evutil_socket_t efd,
 		return;
 	}
 
-	new_sock_ctx = (sock_ctx_t*)calloc(1, sizeof(sock_ctx_t));
+	new_sock_ctx = (sock_ctx_t*)pool_alloc(sock_ctx_pool);
 	if (new_sock_ctx == NULL) {
 		return;
 	}
 	new_sock_ctx->fd = efd;
+	new_sock_ctx->owner = sock_ctx->daemon->thread_id;
+	/* The TCP connection is already up, its ID comes with ACCEPT_NOTIFY */
+	new_sock_ctx->trace = trace_begin(0, sock_ctx->tls_opts->app_path);
+	trace_mark(new_sock_ctx->trace, TRACE_ESTABLISHED);
 	//new_sock_ctx->daemon = sock_ctx->daemon;
 	//new_sock_ctx->tls_opts = sock_ctx->tls_opts;
 	//new_sock_ctx->int_addr = sock_ctx->int_addr;
 	//new_sock_ctx->int_addrlen = sock_ctx->int_addrlen;
 
-	ifd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	/* The app's internal listener decides the plaintext transport */
+	if (sock_ctx->int_addr.ss_family == AF_UNIX) {
+		ifd = create_plain_unix_leg(&port);
+	}
+	else {
+		ifd = create_plain_tcp_leg(&port);
+	}
 	if (ifd == -1) {
 		return;
 	}
 
-	if (bind(ifd, (struct sockaddr*)&int_addr, sizeof(int_addr)) == -1) {
-		perror("bind");
+	if (evutil_make_socket_nonblocking(ifd) == -1) {
+		log_printf(LOG_ERROR, "Failed in ifd evutil_make_socket_nonblocking: %s\n",
+			 evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
 		EVUTIL_CLOSESOCKET(ifd);
 		return;
 	}
 
+	port_map_add(sock_ctx->daemon, port, new_sock_ctx);
+	
+	new_sock_ctx->tls_conn = tls_server_wrapper_setup(efd, ifd, sock_ctx->daemon,
+			sock_ctx->tls_opts, (struct sockaddr*)&sock_ctx->int_addr, sock_ctx->int_addrlen);
+	if (new_sock_ctx->tls_conn != NULL) {
+		tls_conn_set_trace(new_sock_ctx->tls_conn, new_sock_ctx->trace);
+	}
+	loop_monitor_end(LOOP_CB_ACCEPT, 0, started);
+	return;
+}
+
+/* An AF_UNIX leg autobinds to a five hex digit abstract name, which
+ * the kernel reports back to us in ACCEPT_NOTIFY */
+evutil_socket_t create_plain_unix_leg(int* port) {
+	struct sockaddr_un int_addr = {
+		.sun_family = AF_UNIX,
+	};
+	socklen_t intaddr_len = sizeof(int_addr);
+	evutil_socket_t ifd;
+
+	ifd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (ifd == -1) {
+		log_printf(LOG_ERROR, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Binding just the family asks for an autobind */
+	if (bind(ifd, (struct sockaddr*)&int_addr, sizeof(sa_family_t)) == -1) {
+		perror("bind");
+		EVUTIL_CLOSESOCKET(ifd);
+		return -1;
+	}
+
 	if (getsockname(ifd, (struct sockaddr*)&int_addr, &intaddr_len) == -1) {
 		perror("getsockname");
 		EVUTIL_CLOSESOCKET(ifd);
-		return;
+		return -1;
 	}
+	*port = sockaddr_port_key((struct sockaddr*)&int_addr);
+	return ifd;
+}
 
-	if (evutil_make_socket_nonblocking(ifd) == -1) {
-		log_printf(LOG_ERROR, "Failed in ifd evutil_make_socket_nonblocking: %s\n",
-			 evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+/* Fallback for apps whose internal listener is on loopback TCP */
+evutil_socket_t create_plain_tcp_leg(int* port) {
+	struct sockaddr_in int_addr = {
+		.sin_family = AF_INET,
+		.sin_port = 0,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	socklen_t intaddr_len = sizeof(int_addr);
+	evutil_socket_t ifd;
+
+	ifd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (ifd == -1) {
+		return -1;
+	}
+
+	if (bind(ifd, (struct sockaddr*)&int_addr, sizeof(int_addr)) == -1) {
+		perror("bind");
 		EVUTIL_CLOSESOCKET(ifd);
-		return;
+		return -1;
 	}
 
-	port = (int)ntohs((&int_addr)->sin_port);
-	hashmap_add(sock_ctx->daemon->sock_map_port, port, (void*)new_sock_ctx);
-	
-	new_sock_ctx->tls_conn = tls_server_wrapper_setup(efd, ifd, sock_ctx->daemon,
-			sock_ctx->tls_opts, &sock_ctx->int_addr, sock_ctx->int_addrlen);
-	return;
+	if (getsockname(ifd, (struct sockaddr*)&int_addr, &intaddr_len) == -1) {
+		perror("getsockname");
+		EVUTIL_CLOSESOCKET(ifd);
+		return -1;
+	}
+	*port = (int)ntohs(int_addr.sin_port);
+	return ifd;
+}
+
+/* Keys plaintext legs in sock_map_port. AF_UNIX autobind names are
+ * twenty bit hex numbers, so they are kept apart from TCP ports by
+ * setting bit twenty */
+int sockaddr_port_key(struct sockaddr* addr) {
+	if (addr->sa_family == AF_UNIX) {
+		return PORT_KEY_UNIX | (int)strtol(((struct sockaddr_un*)addr)->sun_path+1, NULL, 16);
+	}
+	if (addr->sa_family == AF_INET6) {
+		return (int)ntohs(((struct sockaddr_in6*)addr)->sin6_port);
+	}
+	return (int)ntohs(((struct sockaddr_in*)addr)->sin_port);
 }
 
 void listener_accept_error_cb(struct evconnlistener *listener, void *ctx) {
@@ -535,7 +804,7 @@ void socket_cb(tls_daemon_ctx_t* ctx, unsigned long id, char* comm) {
 	int ret;
 	int response = 0;
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx != NULL) {
 		log_printf(LOG_ERROR, "We have created a socket with this ID already: %lu\n", id);
 		netlink_notify_kernel(ctx, id, response);
@@ -547,21 +816,31 @@ void socket_cb(tls_daemon_ctx_t* ctx, unsigned long id, char* comm) {
 		response = -errno;
 	}
 	else {
-		sock_ctx = (sock_ctx_t*)calloc(1, sizeof(sock_ctx_t));
+		sock_ctx = (sock_ctx_t*)pool_alloc(sock_ctx_pool);
 		if (sock_ctx == NULL) {
 			response = -ENOMEM;
 		}
 		else {
 			sock_ctx->id = id;
 			sock_ctx->fd = fd;
+			sock_ctx->owner = ctx->thread_id;
 			sock_ctx->tls_opts = tls_opts_create(comm);
-			hashmap_add(ctx->sock_map, id, (void*)sock_ctx);
+			if (sock_ctx->tls_opts == NULL) {
+				EVUTIL_CLOSESOCKET(fd);
+				pool_free(sock_ctx_pool, sock_ctx);
+				netlink_notify_kernel(ctx, id, -ENOMEM);
+				return;
+			}
+			sock_ctx->trace = trace_begin(id, comm);
+			sock_map_add(ctx, id, sock_ctx);
 		}
 	}
-	ret = evutil_make_socket_nonblocking(sock_ctx->fd);
-	if (ret == -1) {
-		log_printf(LOG_ERROR, "Failed in evutil_make_socket_nonblocking: %s\n",
-			 evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+	if (response == 0) {
+		ret = evutil_make_socket_nonblocking(sock_ctx->fd);
+		if (ret == -1) {
+			log_printf(LOG_ERROR, "Failed in evutil_make_socket_nonblocking: %s\n",
+				 evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		}
 	}
 
 	log_printf(LOG_INFO, "Socket created on behalf of application %s\n", comm);
@@ -574,12 +853,13 @@ void setsockopt_cb(tls_daemon_ctx_t* ctx, unsigned long id, int level,
 	sock_ctx_t* sock_ctx;
 	int response = 0; /* Default is success */
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		response = -EBADF;
 		netlink_notify_kernel(ctx, id, response);
 		return;
 	}
+	trace_option(sock_ctx->trace, TRACE_SETSOCKOPT, option);
 
 	switch (option) {
 	case TLS_REMOTE_HOSTNAME:
@@ -658,11 +938,12 @@ void getsockopt_cb(tls_daemon_ctx_t* ctx, unsigned long id, int level, int optio
 	unsigned int len = 0;
 	int need_free = 0;
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		netlink_notify_kernel(ctx, id, -EBADF);
 		return;
 	}
+	trace_option(sock_ctx->trace, TRACE_GETSOCKOPT, option);
 	switch (option) {
 	case TLS_REMOTE_HOSTNAME:
 		if (sock_ctx->rem_hostname != NULL) {
@@ -751,7 +1032,7 @@ void bind_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
 	sock_ctx_t* sock_ctx;
 	int response = 0;
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		response = -EBADF;
 	}
@@ -771,9 +1052,10 @@ void bind_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
 		}
 		else {
 			sock_ctx->has_bound = 1;
-			sock_ctx->int_addr = *int_addr;
+			trace_mark(sock_ctx->trace, TRACE_BIND);
+			memcpy(&sock_ctx->int_addr, int_addr, int_addrlen);
 			sock_ctx->int_addrlen = int_addrlen;
-			sock_ctx->ext_addr = *ext_addr;
+			memcpy(&sock_ctx->ext_addr, ext_addr, ext_addrlen);
 			sock_ctx->ext_addrlen = ext_addrlen;
 		}
 	}
@@ -788,30 +1070,27 @@ void connect_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_ad
 	sock_ctx_t* sock_ctx;
 	int port;
 
-	if (int_addr->sa_family == AF_UNIX) {
-		port = strtol(((struct sockaddr_un*)int_addr)->sun_path+1, NULL, 16);
-		log_printf(LOG_INFO, "unix port is %05x", port);
-	}
-	else {
-		port = (int)ntohs(((struct sockaddr_in*)int_addr)->sin_port);
-	}
+	port = sockaddr_port_key(int_addr);
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		netlink_notify_kernel(ctx, id, -EBADF);
 		return;
 	}
 
+	trace_mark(sock_ctx->trace, TRACE_CONNECT);
 	tls_opts_client_setup(sock_ctx->tls_opts);
 	sock_ctx->tls_conn = tls_client_wrapper_setup(sock_ctx->fd, ctx, 
 				sock_ctx->rem_hostname, sock_ctx->is_accepting, sock_ctx->tls_opts);
 	set_netlink_cb_params(sock_ctx->tls_conn, ctx, sock_ctx->id);
+	tls_conn_set_trace(sock_ctx->tls_conn, sock_ctx->trace);
+	tls_conn_resume(sock_ctx->tls_conn, sock_ctx->tls_opts, rem_addr, rem_addrlen);
 	/* only connect if we're not already.
 	 * we might already be connected due to a
 	 * socket upgrade */
 	if (sock_ctx->is_connected == 0) {
 		//ret = connect(sock_ctx->fd, rem_addr, rem_addrlen);
-		ret = bufferevent_socket_connect(sock_ctx->tls_conn->secure.bev, rem_addr, rem_addrlen);
+		ret = tls_conn_connect(sock_ctx->tls_conn, rem_addr, rem_addrlen);
 	}
 	else {
 		ret = 0;
@@ -823,12 +1102,12 @@ void connect_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_ad
 	}
 
 	if (sock_ctx->has_bound == 0) {
-		sock_ctx->int_addr = *int_addr;
+		memcpy(&sock_ctx->int_addr, int_addr, int_addrlen);
 		sock_ctx->int_addrlen = int_addrlen;
 	}
 	log_printf(LOG_INFO, "Placing sock_ctx for port %d\n", port);
-	hashmap_add(ctx->sock_map_port, port, sock_ctx);
-	sock_ctx->rem_addr = *rem_addr;
+	port_map_add(ctx, port, sock_ctx);
+	memcpy(&sock_ctx->rem_addr, rem_addr, rem_addrlen);
 	sock_ctx->rem_addrlen = rem_addrlen;
 	sock_ctx->is_connected = 1; /* is this a lie? */
 
@@ -846,7 +1125,7 @@ void listen_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_add
 	sock_ctx_t* sock_ctx;
 	int response = 0;
 	
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		response = -EBADF;
 	}
@@ -855,6 +1134,7 @@ void listen_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_add
 		if (ret == -1) {
 			response = -errno;
 		}
+		trace_mark(sock_ctx->trace, TRACE_LISTEN);
 	}
 	netlink_notify_kernel(ctx, id, response);
 	if (response != 0) {
@@ -884,15 +1164,9 @@ void associate_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_
 	int response = 0;
 	int port;
 
-	if (int_addr->sa_family == AF_UNIX) {
-		port = strtol(((struct sockaddr_un*)int_addr)->sun_path+1, NULL, 16);
-		log_printf(LOG_INFO, "unix port is %05x", port);
-	}
-	else {
-		port = (int)ntohs(((struct sockaddr_in*)int_addr)->sin_port);
-	}
-	sock_ctx = hashmap_get(ctx->sock_map_port, port);
-	hashmap_del(ctx->sock_map_port, port);
+	port = sockaddr_port_key(int_addr);
+	sock_ctx = port_map_get(ctx, port);
+	port_map_del(ctx, port, sock_ctx);
 	if (sock_ctx == NULL) {
 		log_printf(LOG_ERROR, "port provided in associate_cb not found");
 		response = -EBADF;
@@ -902,7 +1176,9 @@ void associate_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_
 
 	sock_ctx->id = id;
 	sock_ctx->is_connected = 1;
-	hashmap_add(ctx->sock_map, id, (void*)sock_ctx);
+	sock_map_add(ctx, id, sock_ctx);
+	trace_set_id(sock_ctx->trace, id);
+	trace_mark(sock_ctx->trace, TRACE_ASSOCIATE);
 	
 	set_netlink_cb_params(sock_ctx->tls_conn, ctx, id);
 	//log_printf(LOG_INFO, "Socket %lu accepted\n", id);
@@ -913,20 +1189,25 @@ void associate_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_
 void close_cb(tls_daemon_ctx_t* ctx, unsigned long id) {
 	sock_ctx_t* sock_ctx;
 
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	sock_ctx = sock_map_get(ctx, id);
 	if (sock_ctx == NULL) {
 		return;
 	}
+	/* A plaintext leg that never arrived must not leave its port behind */
+	if (sock_ctx->port_key != 0) {
+		port_map_del(ctx, sock_ctx->port_key, sock_ctx);
+	}
+	end_trace(sock_ctx);
 	/* close things here */
 	if (sock_ctx->is_accepting == 1) {
 		/* This is an ophan server connection.
 		 * We don't host its corresponding listen socket
 		 * But we were given control of the remote peer
 		 * connection */
-		hashmap_del(ctx->sock_map, id);
+		sock_map_del(ctx, id);
 		tls_opts_free(sock_ctx->tls_opts);
 		free_tls_conn_ctx(sock_ctx->tls_conn);
-		free(sock_ctx);
+		pool_free(sock_ctx_pool, sock_ctx);
 		return;
 	}
 	if (sock_ctx->is_connected == 1) {
@@ -935,23 +1216,23 @@ void close_cb(tls_daemon_ctx_t* ctx, unsigned long id) {
 		 * received from one of the endpoints. In this case we
 		 * only need to clean up the sock_ctx */
 		//netlink_notify_kernel(ctx, id, 0);
-		hashmap_del(ctx->sock_map, id);
+		sock_map_del(ctx, id);
 		tls_opts_free(sock_ctx->tls_opts);
 		free_tls_conn_ctx(sock_ctx->tls_conn);
-		free(sock_ctx);
+		pool_free(sock_ctx_pool, sock_ctx);
 		return;
 	}
 	if (sock_ctx->listener != NULL) {
-		hashmap_del(ctx->sock_map, id);
+		sock_map_del(ctx, id);
 		evconnlistener_free(sock_ctx->listener);
 		tls_opts_free(sock_ctx->tls_opts);
-		free(sock_ctx);
+		pool_free(sock_ctx_pool, sock_ctx);
 		//netlink_notify_kernel(ctx, id, 0);
 		return;
 	}
-	hashmap_del(ctx->sock_map, id);
+	sock_map_del(ctx, id);
 	EVUTIL_CLOSESOCKET(sock_ctx->fd);
-	free(sock_ctx);
+	pool_free(sock_ctx_pool, sock_ctx);
 	//netlink_notify_kernel(ctx, id, 0);
 	return;
 }
@@ -965,6 +1246,7 @@ void upgrade_cb(tls_daemon_ctx_t* ctx, unsigned long id,
 /* This function is provided to the hashmap implementation
  * so that it can correctly free all held data */
 void free_sock_ctx(sock_ctx_t* sock_ctx) {
+	end_trace(sock_ctx);
 	if (sock_ctx->listener != NULL) {
 		evconnlistener_free(sock_ctx->listener);
 	}
@@ -981,12 +1263,26 @@ void free_sock_ctx(sock_ctx_t* sock_ctx) {
 	if (sock_ctx->tls_conn != NULL) {
 		free_tls_conn_ctx(sock_ctx->tls_conn);
 	}
-	free(sock_ctx);
+	pool_free(sock_ctx_pool, sock_ctx);
+	return;
+}
+
+/* Writes out a sampled socket's trace before its connection goes away */
+void end_trace(sock_ctx_t* sock_ctx) {
+	if (sock_ctx->trace == NULL) {
+		return;
+	}
+	if (sock_ctx->tls_conn != NULL) {
+		tls_conn_set_trace(sock_ctx->tls_conn, NULL);
+	}
+	trace_end(sock_ctx->trace);
+	sock_ctx->trace = NULL;
 	return;
 }
 
 void upgrade_recv(evutil_socket_t fd, short events, void *arg) {
-	sock_ctx_t* sock_ctx;
+	upgrade_req_t* req;
+	int thread_id;
 	tls_daemon_ctx_t* ctx = (tls_daemon_ctx_t*)arg;
 	char msg_buffer[256];
 	int new_fd;
@@ -1008,16 +1304,44 @@ void upgrade_recv(evutil_socket_t fd, short events, void *arg) {
 	sscanf(msg_buffer, "%d:%lu", &is_accepting, &id);
 	log_printf(LOG_INFO, "Got a new %s descriptor %d, to be associated with %lu from addr %s\n",
 		       	is_accepting == 1 ? "accepting" : "connecting", new_fd, id, addr.sun_path+1, addr_len);
-	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+
+	req = (upgrade_req_t*)malloc(sizeof(upgrade_req_t));
+	if (req == NULL) {
+		return;
+	}
+	req->fd = fd;
+	req->new_fd = new_fd;
+	req->id = id;
+	req->is_accepting = is_accepting;
+	req->addr = addr;
+	req->addr_len = addr_len;
+	if (ctx->dataplane == NULL) {
+		upgrade_sock(ctx, req);
+		return;
+	}
+	thread_id = sock_owner(ctx, id);
+	if (thread_id < 0 || dataplane_dispatch(ctx->dataplane, thread_id, upgrade_sock, req) != 0) {
+		free(req);
+	}
+	return;
+}
+
+void upgrade_sock(tls_daemon_ctx_t* ctx, void* arg) {
+	upgrade_req_t* req = (upgrade_req_t*)arg;
+	sock_ctx_t* sock_ctx;
+
+	sock_ctx = sock_map_get(ctx, req->id);
 	if (sock_ctx == NULL) {
+		free(req);
 		return;
 	}
 	EVUTIL_CLOSESOCKET(sock_ctx->fd);
-	sock_ctx->fd = new_fd;
+	sock_ctx->fd = req->new_fd;
 	sock_ctx->is_connected = 1;
+	tls_opts_free(sock_ctx->tls_opts);
 	sock_ctx->tls_opts = tls_opts_create(NULL); 
 
-	if (is_accepting == 1) {
+	if (req->is_accepting == 1) {
 		tls_opts_server_setup(sock_ctx->tls_opts);
 		sock_ctx->is_accepting = 1;
 	}
@@ -1030,9 +1354,124 @@ void upgrade_recv(evutil_socket_t fd, short events, void *arg) {
 	//			sock_ctx->rem_hostname, sock_ctx->is_accepting, sock_ctx->tls_opts);
 	//set_netlink_cb_params(sock_ctx->tls_conn, ctx, sock_ctx->id);
 
-	if (sendto(fd, "GOT IT", sizeof("GOT IT"), 0, (struct sockaddr*)&addr, addr_len) == -1) {
+	if (sendto(req->fd, "GOT IT", sizeof("GOT IT"), 0, (struct sockaddr*)&req->addr, req->addr_len) == -1) {
 		perror("sendto");
 	}
+	free(req);
+	return;
+}
+
+int sock_owner(tls_daemon_ctx_t* ctx, unsigned long id) {
+	sock_ctx_t* sock_ctx;
+	int owner = -1;
+
+	if (ctx->map_lock != NULL) {
+		pthread_rwlock_rdlock(ctx->map_lock);
+	}
+	/* Read under the lock so the owner can't free it meanwhile */
+	sock_ctx = (sock_ctx_t*)hashmap_get(ctx->sock_map, id);
+	if (sock_ctx != NULL) {
+		owner = sock_ctx->owner;
+	}
+	if (ctx->map_lock != NULL) {
+		pthread_rwlock_unlock(ctx->map_lock);
+	}
+	return owner;
+}
+
+int sock_owner_port(tls_daemon_ctx_t* ctx, int port) {
+	sock_ctx_t* sock_ctx;
+	int owner = -1;
+
+	if (ctx->map_lock != NULL) {
+		pthread_rwlock_rdlock(ctx->map_lock);
+	}
+	sock_ctx = (sock_ctx_t*)port_table_get(ctx->sock_map_port, port);
+	if (sock_ctx != NULL) {
+		owner = sock_ctx->owner;
+	}
+	if (ctx->map_lock != NULL) {
+		pthread_rwlock_unlock(ctx->map_lock);
+	}
+	return owner;
+}
+
+void* sock_map_get(tls_daemon_ctx_t* ctx, unsigned long id) {
+	void* value;
+	if (ctx->map_lock == NULL) {
+		return hashmap_get(ctx->sock_map, id);
+	}
+	pthread_rwlock_rdlock(ctx->map_lock);
+	value = hashmap_get(ctx->sock_map, id);
+	pthread_rwlock_unlock(ctx->map_lock);
+	return value;
+}
+
+void sock_map_add(tls_daemon_ctx_t* ctx, unsigned long id, sock_ctx_t* sock_ctx) {
+	if (ctx->map_lock == NULL) {
+		hashmap_add(ctx->sock_map, id, (void*)sock_ctx);
+		return;
+	}
+	pthread_rwlock_wrlock(ctx->map_lock);
+	hashmap_add(ctx->sock_map, id, (void*)sock_ctx);
+	pthread_rwlock_unlock(ctx->map_lock);
+	return;
+}
+
+void sock_map_del(tls_daemon_ctx_t* ctx, unsigned long id) {
+	if (ctx->map_lock == NULL) {
+		hashmap_del(ctx->sock_map, id);
+		return;
+	}
+	pthread_rwlock_wrlock(ctx->map_lock);
+	hashmap_del(ctx->sock_map, id);
+	pthread_rwlock_unlock(ctx->map_lock);
+	return;
+}
+
+void* port_map_get(tls_daemon_ctx_t* ctx, int port) {
+	void* value;
+	if (ctx->map_lock == NULL) {
+		return port_table_get(ctx->sock_map_port, port);
+	}
+	pthread_rwlock_rdlock(ctx->map_lock);
+	value = port_table_get(ctx->sock_map_port, port);
+	pthread_rwlock_unlock(ctx->map_lock);
+	return value;
+}
+
+/* Other workers find the leg through port_owner, see check_shard */
+void port_map_add(tls_daemon_ctx_t* ctx, int port, sock_ctx_t* sock_ctx) {
+	sock_ctx->port_key = port;
+	port_owner_set(port, ctx->worker_id);
+	if (ctx->map_lock == NULL) {
+		port_table_add(ctx->sock_map_port, port, (void*)sock_ctx, sock_ctx->id);
+		return;
+	}
+	pthread_rwlock_wrlock(ctx->map_lock);
+	port_table_add(ctx->sock_map_port, port, (void*)sock_ctx, sock_ctx->id);
+	pthread_rwlock_unlock(ctx->map_lock);
+	return;
+}
+
+/* With a sock_ctx, the entry is only removed if it still points there */
+void port_map_del(tls_daemon_ctx_t* ctx, int port, sock_ctx_t* sock_ctx) {
+	int ret;
+
+	if (sock_ctx != NULL) {
+		sock_ctx->port_key = 0;
+	}
+	if (ctx->map_lock == NULL) {
+		ret = port_table_del(ctx->sock_map_port, port, (void*)sock_ctx);
+	}
+	else {
+		pthread_rwlock_wrlock(ctx->map_lock);
+		ret = port_table_del(ctx->sock_map_port, port, (void*)sock_ctx);
+		pthread_rwlock_unlock(ctx->map_lock);
+	}
+	if (ret == 0) {
+		port_owner_clear(port, ctx->worker_id);
+	}
 	return;
 }
 
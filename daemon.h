@@ -28,6 +28,7 @@
 #define DAEMON_H
 
 #include <netinet/in.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 #include <event2/util.h>
@@ -37,21 +38,33 @@
 #include <openssl/evp.h>
 
 #include "hashmap.h"
+#include "port_table.h"
 #include "queue.h"
 
 
 #define MAX_HOSTNAME		255
 
+typedef struct dataplane dataplane_t;
+
 typedef struct tls_daemon_ctx {
 	struct event_base* ev_base;
 	struct nl_sock* netlink_sock;
 	int netlink_family;
 	int port; /* Port to use for both listening and netlink */
+	int worker_id;
+	int worker_count;
+	unsigned long misrouted; /* messages passed on to the worker their socket shards to */
+	hmap_t* accepted; /* worker_id + 1 of those holding sockets that shard here */
 	hmap_t* sock_map;
-	hmap_t* sock_map_port;
+	port_table_t* sock_map_port;
+	/* Set only when data plane threads share this worker, see dataplane.h */
+	dataplane_t* dataplane;
+	int thread_id;
+	pthread_rwlock_t* map_lock; /* guards sock_map and sock_map_port */
+	pthread_mutex_t* netlink_lock; /* serializes sends on netlink_sock */
 } tls_daemon_ctx_t;
 
-int server_create(int port);
+int server_create(int port, int worker_id, int worker_count);
 void socket_cb(tls_daemon_ctx_t* ctx, unsigned long id, char* comm);
 void setsockopt_cb(tls_daemon_ctx_t* ctx, unsigned long id, int level, 
 		int option, void* value, socklen_t len);
@@ -65,6 +78,9 @@ void listen_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_add
 void associate_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
 	       	int int_addrlen);
 void close_cb(tls_daemon_ctx_t* ctx, unsigned long id);
+int sockaddr_port_key(struct sockaddr* addr);
+int sock_owner(tls_daemon_ctx_t* ctx, unsigned long id);
+int sock_owner_port(tls_daemon_ctx_t* ctx, int port);
 void upgrade_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr, 
 	int int_addrlen);
 
@@ -0,0 +1,270 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+
+#include "dataplane.h"
+#include "shard.h"
+#include "loop_monitor.h"
+#include "reload.h"
+#include "log.h"
+
+#define DP_RING_SIZE	4096 /* must be a power of two */
+#define DP_CACHE_LINE	64
+
+typedef struct dp_task {
+	dp_func_t func;
+	void* arg;
+} dp_task_t;
+
+/* Only the control thread produces and only the owning data plane thread
+ * consumes, so head and tail each have a single writer */
+typedef struct dp_ring {
+	unsigned long head;
+	char pad_head[DP_CACHE_LINE - sizeof(unsigned long)];
+	unsigned long tail;
+	char pad_tail[DP_CACHE_LINE - sizeof(unsigned long)];
+	dp_task_t slots[DP_RING_SIZE];
+} dp_ring_t;
+
+typedef struct dp_thread {
+	dp_ring_t ring;
+	int wake_pending;
+	int wake_fd;
+	struct event* wake_ev;
+	pthread_t thread;
+	int started;
+	loop_monitor_t* monitor;
+	reload_reader_t* reader;
+	tls_daemon_ctx_t ctx; /* this thread's view of the worker */
+} dp_thread_t;
+
+struct dataplane {
+	int thread_count;
+	int worker_count;
+	dp_thread_t* threads;
+};
+
+static void* dp_thread_main(void* arg);
+static void dp_wake_cb(evutil_socket_t fd, short events, void* arg);
+static void dp_stop_cb(tls_daemon_ctx_t* ctx, void* arg);
+
+dataplane_t* dataplane_create(tls_daemon_ctx_t* control_ctx, int thread_count) {
+	dataplane_t* dp;
+	dp_thread_t* thread;
+	int i;
+
+	dp = (dataplane_t*)calloc(1, sizeof(dataplane_t));
+	if (dp == NULL) {
+		return NULL;
+	}
+	dp->threads = (dp_thread_t*)calloc(thread_count, sizeof(dp_thread_t));
+	if (dp->threads == NULL) {
+		free(dp);
+		return NULL;
+	}
+	dp->thread_count = thread_count;
+	dp->worker_count = control_ctx->worker_count;
+
+	for (i = 0; i < thread_count; i++) {
+		thread = &dp->threads[i];
+		thread->wake_fd = -1;
+		thread->ctx = *control_ctx;
+		thread->ctx.thread_id = i;
+		thread->ctx.dataplane = dp;
+		thread->ctx.ev_base = event_base_new();
+		if (thread->ctx.ev_base == NULL) {
+			log_printf(LOG_ERROR, "Couldn't create event base for data plane thread %d\n", i);
+			dataplane_free(dp);
+			return NULL;
+		}
+		thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (thread->wake_fd == -1) {
+			log_printf(LOG_ERROR, "eventfd: %s\n", strerror(errno));
+			dataplane_free(dp);
+			return NULL;
+		}
+		thread->wake_ev = event_new(thread->ctx.ev_base, thread->wake_fd,
+				EV_READ | EV_PERSIST, dp_wake_cb, thread);
+		if (thread->wake_ev == NULL || event_add(thread->wake_ev, NULL) == -1) {
+			log_printf(LOG_ERROR, "Couldn't add wakeup event for data plane thread %d\n", i);
+			dataplane_free(dp);
+			return NULL;
+		}
+		thread->monitor = loop_monitor_attach(thread->ctx.ev_base);
+		thread->reader = reload_reader_attach(thread->ctx.ev_base);
+		if (thread->reader == NULL) {
+			dataplane_free(dp);
+			return NULL;
+		}
+	}
+	return dp;
+}
+
+int dataplane_start(dataplane_t* dp) {
+	int i;
+	int ret;
+
+	for (i = 0; i < dp->thread_count; i++) {
+		ret = pthread_create(&dp->threads[i].thread, NULL, dp_thread_main, &dp->threads[i]);
+		if (ret != 0) {
+			log_printf(LOG_ERROR, "Couldn't start data plane thread %d: %s\n", i, strerror(ret));
+			return 1;
+		}
+		dp->threads[i].started = 1;
+	}
+	log_printf(LOG_INFO, "Started %d data plane threads\n", dp->thread_count);
+	return 0;
+}
+
+/* Queued behind any work already handed to the threads */
+void dataplane_stop(dataplane_t* dp) {
+	int i;
+
+	for (i = 0; i < dp->thread_count; i++) {
+		if (dp->threads[i].started == 0) {
+			continue;
+		}
+		dataplane_dispatch(dp, i, dp_stop_cb, NULL);
+	}
+	for (i = 0; i < dp->thread_count; i++) {
+		if (dp->threads[i].started == 0) {
+			continue;
+		}
+		pthread_join(dp->threads[i].thread, NULL);
+		dp->threads[i].started = 0;
+	}
+	return;
+}
+
+void dataplane_free(dataplane_t* dp) {
+	dp_thread_t* thread;
+	int i;
+
+	if (dp == NULL) {
+		return;
+	}
+	for (i = 0; i < dp->thread_count; i++) {
+		thread = &dp->threads[i];
+		loop_monitor_detach(thread->monitor);
+		reload_reader_detach(thread->reader);
+		if (thread->wake_ev != NULL) {
+			event_free(thread->wake_ev);
+		}
+		if (thread->wake_fd != -1) {
+			close(thread->wake_fd);
+		}
+		if (thread->ctx.ev_base != NULL) {
+			event_base_free(thread->ctx.ev_base);
+		}
+	}
+	free(dp->threads);
+	free(dp);
+	return;
+}
+
+int dataplane_thread_for_id(dataplane_t* dp, unsigned long id) {
+	return shard_for_thread(id, dp->worker_count, dp->thread_count);
+}
+
+/* Called from the control thread only */
+int dataplane_dispatch(dataplane_t* dp, int thread_id, dp_func_t func, void* arg) {
+	dp_thread_t* thread;
+	dp_ring_t* ring;
+	unsigned long tail;
+	uint64_t wake = 1;
+
+	if (thread_id < 0 || thread_id >= dp->thread_count) {
+		return 1;
+	}
+	thread = &dp->threads[thread_id];
+	ring = &thread->ring;
+
+	tail = ring->tail;
+	while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= DP_RING_SIZE) {
+		/* The thread is DP_RING_SIZE tasks behind, let it catch up */
+		sched_yield();
+	}
+	ring->slots[tail & (DP_RING_SIZE - 1)].func = func;
+	ring->slots[tail & (DP_RING_SIZE - 1)].arg = arg;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* Skip the syscall if a wakeup is already on its way */
+	if (__atomic_exchange_n(&thread->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (write(thread->wake_fd, &wake, sizeof(wake)) == -1 && errno != EAGAIN) {
+			log_printf(LOG_ERROR, "Failed to wake data plane thread %d: %s\n",
+					thread_id, strerror(errno));
+		}
+	}
+	return 0;
+}
+
+void* dp_thread_main(void* arg) {
+	dp_thread_t* thread = (dp_thread_t*)arg;
+	event_base_dispatch(thread->ctx.ev_base);
+	log_printf(LOG_INFO, "Data plane thread %d terminated\n", thread->ctx.thread_id);
+	return NULL;
+}
+
+void dp_wake_cb(evutil_socket_t fd, short events, void* arg) {
+	dp_thread_t* thread = (dp_thread_t*)arg;
+	dp_ring_t* ring = &thread->ring;
+	dp_task_t task;
+	unsigned long head;
+	uint64_t count;
+	uint64_t started;
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		log_printf(LOG_ERROR, "Failed to read data plane wakeup: %s\n", strerror(errno));
+	}
+	/* Cleared before draining so a task queued from here on wakes us again */
+	__atomic_store_n(&thread->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+	head = ring->head;
+	while (head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+		task = ring->slots[head & (DP_RING_SIZE - 1)];
+		head++;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		started = loop_monitor_begin();
+		task.func(&thread->ctx, task.arg);
+		loop_monitor_end(LOOP_CB_TASK, 0, started);
+	}
+	return;
+}
+
+void dp_stop_cb(tls_daemon_ctx_t* ctx, void* arg) {
+	event_base_loopbreak(ctx->ev_base);
+	return;
+}
@@ -0,0 +1,50 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef DATAPLANE_H
+#define DATAPLANE_H
+
+#include "daemon.h"
+
+/* thread_id of the control thread that owns the netlink socket */
+#define DP_CONTROL_THREAD	-1
+
+typedef void (*dp_func_t)(tls_daemon_ctx_t* ctx, void* arg);
+
+/* In threaded mode the control thread parses netlink messages and hands
+ * each one to the data plane thread that owns the socket. Every thread
+ * runs its own event_base, and a socket's bufferevents and listener
+ * belong to the thread that created them, so per-socket state is only
+ * touched by that thread. Handoff is through a single-producer ring per
+ * thread, with an eventfd to wake the consumer */
+dataplane_t* dataplane_create(tls_daemon_ctx_t* control_ctx, int thread_count);
+int dataplane_start(dataplane_t* dp);
+void dataplane_stop(dataplane_t* dp);
+void dataplane_free(dataplane_t* dp);
+int dataplane_thread_for_id(dataplane_t* dp, unsigned long id);
+int dataplane_dispatch(dataplane_t* dp, int thread_id, dp_func_t func, void* arg);
+
+#endif
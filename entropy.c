@@ -0,0 +1,239 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#include "entropy.h"
+#include "config.h"
+#include "hashmap_str.h"
+#include "loop_monitor.h"
+#include "log.h"
+
+typedef struct seed_source {
+	char* path;
+	int size;
+	int interval; /* seconds between reseeds, 0 to seed only at startup */
+	int fd; /* held open while a reseed is being gathered */
+	unsigned char* buf;
+	int filled;
+	struct event* timer;
+	struct seed_source* next;
+} seed_source_t;
+
+static seed_source_t* sources = NULL;
+static unsigned long reseed_count; /* read by the metrics sampler */
+
+static void add_source(char* name, void* config, void* arg);
+static int read_seed(seed_source_t* source);
+static void reseed_cb(evutil_socket_t fd, short events, void* arg);
+static void free_source(seed_source_t* source);
+
+int entropy_init(struct event_base* ev_base) {
+	seed_source_t* source;
+	struct timeval tv;
+
+	str_hashmap_foreach(global_config, add_source, NULL);
+
+	for (source = sources; source != NULL; source = source->next) {
+		if (read_seed(source) == 1) {
+			RAND_seed(source->buf, source->size);
+		}
+		else {
+			log_printf(LOG_ERROR, "Unable to read set random seed from %s\n", source->path);
+		}
+		source->filled = 0;
+
+		if (source->interval <= 0) {
+			continue;
+		}
+		if (source->buf == NULL) {
+			/* reseed_cb reads into buf, which read_seed failed to allocate */
+			log_printf(LOG_ERROR, "Not reseeding from %s, out of memory\n", source->path);
+			continue;
+		}
+		source->timer = event_new(ev_base, -1, EV_PERSIST, reseed_cb, source);
+		if (source->timer == NULL) {
+			log_printf(LOG_ERROR, "Couldn't create reseed timer for %s\n", source->path);
+			return 1;
+		}
+		tv.tv_sec = source->interval;
+		tv.tv_usec = 0;
+		if (event_add(source->timer, &tv) == -1) {
+			log_printf(LOG_ERROR, "Couldn't add reseed timer for %s\n", source->path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void entropy_free(void) {
+	seed_source_t* source;
+	seed_source_t* next;
+
+	log_printf(LOG_INFO, "Entropy: %lu reseeds\n", entropy_reseed_count());
+	source = sources;
+	while (source != NULL) {
+		next = source->next;
+		free_source(source);
+		source = next;
+	}
+	sources = NULL;
+	return;
+}
+
+unsigned long entropy_reseed_count(void) {
+	return __atomic_load_n(&reseed_count, __ATOMIC_RELAXED);
+}
+
+/* Profiles sharing a seed path share a source, reading the largest
+ * size and reseeding at the shortest interval asked for */
+void add_source(char* name, void* config, void* arg) {
+	ssa_config_t* ssa_config = (ssa_config_t*)config;
+	seed_source_t* source;
+
+	if (ssa_config->randseed_path == NULL || ssa_config->randseed_size <= 0) {
+		return;
+	}
+	for (source = sources; source != NULL; source = source->next) {
+		if (strcmp(source->path, ssa_config->randseed_path) == 0) {
+			break;
+		}
+	}
+	if (source == NULL) {
+		source = (seed_source_t*)calloc(1, sizeof(seed_source_t));
+		if (source == NULL) {
+			return;
+		}
+		source->path = strdup(ssa_config->randseed_path);
+		if (source->path == NULL) {
+			free(source);
+			return;
+		}
+		source->fd = -1;
+		source->next = sources;
+		sources = source;
+	}
+	if (ssa_config->randseed_size > source->size) {
+		source->size = ssa_config->randseed_size;
+	}
+	if (ssa_config->reseed_interval > 0 && (source->interval == 0 ||
+			ssa_config->reseed_interval < source->interval)) {
+		source->interval = ssa_config->reseed_interval;
+	}
+	return;
+}
+
+/* Blocking read used once at startup, before any sockets exist */
+int read_seed(seed_source_t* source) {
+	int fd;
+	int ret;
+
+	source->buf = realloc(source->buf, source->size);
+	if (source->buf == NULL) {
+		return 0;
+	}
+	fd = open(source->path, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	source->filled = 0;
+	while (source->filled < source->size) {
+		ret = read(fd, source->buf + source->filled, source->size - source->filled);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			return 0;
+		}
+		source->filled += ret;
+	}
+	close(fd);
+	return 1;
+}
+
+void reseed_cb(evutil_socket_t fd, short events, void* arg) {
+	seed_source_t* source = (seed_source_t*)arg;
+	uint64_t started = loop_monitor_begin();
+	int ret;
+
+	if (source->fd == -1) {
+		source->fd = open(source->path, O_RDONLY | O_NONBLOCK);
+		if (source->fd == -1) {
+			log_printf(LOG_ERROR, "Unable to open random seed %s\n", source->path);
+			goto out;
+		}
+	}
+	while (source->filled < source->size) {
+		ret = read(source->fd, source->buf + source->filled, source->size - source->filled);
+		if (ret > 0) {
+			source->filled += ret;
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			/* Keep what we have and try again next interval */
+			goto out;
+		}
+		log_printf(LOG_ERROR, "Unable to read random seed %s\n", source->path);
+		close(source->fd);
+		source->fd = -1;
+		source->filled = 0;
+		goto out;
+	}
+	RAND_seed(source->buf, source->size);
+	__atomic_add_fetch(&reseed_count, 1, __ATOMIC_RELAXED);
+	close(source->fd);
+	source->fd = -1;
+	source->filled = 0;
+	log_printf(LOG_DEBUG, "Reseeded RNG from %s\n", source->path);
+out:
+	loop_monitor_end(LOOP_CB_ENTROPY, 0, started);
+	return;
+}
+
+void free_source(seed_source_t* source) {
+	if (source->timer != NULL) {
+		event_free(source->timer);
+	}
+	if (source->fd != -1) {
+		close(source->fd);
+	}
+	if (source->buf != NULL) {
+		OPENSSL_cleanse(source->buf, source->size);
+		free(source->buf);
+	}
+	free(source->path);
+	free(source);
+	return;
+}
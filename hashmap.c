@@ -26,55 +26,232 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "hashmap.h"
 
-typedef struct hnode {
-	struct hnode* next;
+#define HSLOT_EMPTY	0
+#define HSLOT_MOVED	0x80000000 /* left behind in the old table */
+#define MIGRATE_STEP	32 /* old slots moved per add or del */
+#define RELEASE_STEP	(256*1024) /* bytes of a drained table unmapped per add or del */
+
+typedef struct hslot {
 	unsigned long key;
 	void* value;
-} hnode_t;
+	uint32_t dist; /* probe distance + 1, 0 when empty */
+} hslot_t;
+
+static size_t hash(unsigned long key);
+static size_t table_bytes(size_t capacity);
+static int table_init(htable_t* table, size_t capacity);
+static hslot_t* table_find(htable_t* table, unsigned long key);
+static void table_insert(htable_t* table, unsigned long key, void* value);
+static void table_remove(htable_t* table, hslot_t* slot);
+static void migrate(hmap_t* map, size_t steps);
+static void grow(hmap_t* map);
+static void release_retired(hmap_t* map);
 
+/* fmix64 from MurmurHash3, socket IDs are kernel pointers whose low
+ * bits barely change */
+size_t hash(unsigned long key) {
+	uint64_t h = key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+size_t table_bytes(size_t capacity) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (capacity * sizeof(hslot_t) + page - 1) & ~(page - 1);
+}
 
-static int hash(hmap_t* map, unsigned long key);
+/* Tables are mapped directly so a drained one can be returned to the
+ * kernel piece by piece, unmapping a large table at once stalls */
+int table_init(htable_t* table, size_t capacity) {
+	void* slots;
 
-int hash(hmap_t* map, unsigned long key) {
-	return key % map->num_buckets;
+	slots = mmap(NULL, table_bytes(capacity), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) {
+		return 1;
+	}
+	table->slots = (hslot_t*)slots;
+	table->mask = capacity - 1;
+	table->count = 0;
+	return 0;
+}
+
+/* A probe can stop as soon as it passes an entry closer to its home
+ * than the key would be, robin hood keeps those in order. Moved slots
+ * keep their distance so they still hold the order in the old table */
+hslot_t* table_find(htable_t* table, unsigned long key) {
+	size_t pos;
+	uint32_t dist;
+	hslot_t* slot;
+
+	if (table->slots == NULL) {
+		return NULL;
+	}
+	pos = hash(key) & table->mask;
+	for (dist = 1; ; dist++) {
+		slot = &table->slots[pos];
+		if (slot->dist == HSLOT_EMPTY || (slot->dist & ~HSLOT_MOVED) < dist) {
+			return NULL;
+		}
+		if (slot->key == key && !(slot->dist & HSLOT_MOVED)) {
+			return slot;
+		}
+		pos = (pos + 1) & table->mask;
+	}
+}
+
+/* Only used on the current table, which never holds moved slots */
+void table_insert(htable_t* table, unsigned long key, void* value) {
+	hslot_t entry = { key, value, 1 };
+	hslot_t tmp;
+	size_t pos;
+
+	pos = hash(key) & table->mask;
+	for (;;) {
+		hslot_t* slot = &table->slots[pos];
+		if (slot->dist == HSLOT_EMPTY) {
+			*slot = entry;
+			table->count++;
+			return;
+		}
+		if (slot->dist < entry.dist) {
+			tmp = *slot;
+			*slot = entry;
+			entry = tmp;
+		}
+		entry.dist++;
+		pos = (pos + 1) & table->mask;
+	}
+}
+
+/* Backward shift deletion, no tombstones in the current table */
+void table_remove(htable_t* table, hslot_t* slot) {
+	size_t pos = slot - table->slots;
+	size_t next;
+
+	for (;;) {
+		next = (pos + 1) & table->mask;
+		if (table->slots[next].dist <= 1) {
+			break;
+		}
+		table->slots[pos] = table->slots[next];
+		table->slots[pos].dist--;
+		pos = next;
+	}
+	table->slots[pos].dist = HSLOT_EMPTY;
+	table->count--;
+	return;
+}
+
+void migrate(hmap_t* map, size_t steps) {
+	hslot_t* slot;
+
+	release_retired(map);
+	while (map->old.slots != NULL && steps-- > 0) {
+		slot = &map->old.slots[map->migrate_pos];
+		if (slot->dist != HSLOT_EMPTY && !(slot->dist & HSLOT_MOVED)) {
+			table_insert(&map->cur, slot->key, slot->value);
+			slot->dist |= HSLOT_MOVED;
+			map->old.count--;
+		}
+		if (++map->migrate_pos > map->old.mask) {
+			if (map->retired != NULL) {
+				munmap(map->retired, map->retired_size);
+			}
+			map->retired = map->old.slots;
+			map->retired_size = table_bytes(map->old.mask + 1);
+			map->old.slots = NULL;
+		}
+	}
+	return;
+}
+
+void release_retired(hmap_t* map) {
+	size_t chunk;
+
+	if (map->retired == NULL) {
+		return;
+	}
+	chunk = map->retired_size < RELEASE_STEP ? map->retired_size : RELEASE_STEP;
+	map->retired_size -= chunk;
+	munmap((char*)map->retired + map->retired_size, chunk);
+	if (map->retired_size == 0) {
+		map->retired = NULL;
+	}
+	return;
+}
+
+/* Starts moving into a table twice the size. The old table holds at
+ * most 7/8 of its capacity and empties by MIGRATE_STEP slots per
+ * change, so the new one cannot fill up before the move completes */
+void grow(hmap_t* map) {
+	htable_t bigger;
+
+	if (map->old.slots != NULL) {
+		migrate(map, map->old.mask + 1);
+	}
+	if (table_init(&bigger, (map->cur.mask + 1) * 2) != 0) {
+		return;
+	}
+	map->old = map->cur;
+	map->cur = bigger;
+	map->migrate_pos = 0;
+	return;
 }
 
 hmap_t* hashmap_create(int num_buckets) {
-	hmap_t* map = (hmap_t*)malloc(sizeof(hmap_t));
+	hmap_t* map;
+	size_t capacity = 16;
+
+	map = (hmap_t*)calloc(1, sizeof(hmap_t));
 	if (map == NULL) {
 		return NULL;
 	}
-	map->buckets = (hnode_t**)calloc(num_buckets, sizeof(hnode_t*));
-	if (map->buckets == NULL) {
+	while (capacity < (size_t)num_buckets) {
+		capacity *= 2;
+	}
+	if (table_init(&map->cur, capacity) != 0) {
 		free(map);
 		return NULL;
 	}
-	map->num_buckets = num_buckets;
 	return map;
 }
 
 void hashmap_deep_free(hmap_t* map, void (*free_func)(void*)) {
-	hnode_t* cur = NULL;
-	hnode_t* tmp = NULL;
-	int i;
+	htable_t* tables[2];
+	size_t i;
+	int t;
+
 	if (map == NULL) {
 		return;
 	}
-	for (i = 0; i < map->num_buckets; i++) {
-		cur = map->buckets[i];
-		while (cur != NULL) {
-			tmp = cur->next;
-			if (free_func != NULL) {
-				free_func(cur->value);
+	tables[0] = &map->cur;
+	tables[1] = &map->old;
+	for (t = 0; t < 2; t++) {
+		if (tables[t]->slots == NULL) {
+			continue;
+		}
+		for (i = 0; free_func != NULL && i <= tables[t]->mask; i++) {
+			hslot_t* slot = &tables[t]->slots[i];
+			if (slot->dist != HSLOT_EMPTY && !(slot->dist & HSLOT_MOVED)) {
+				free_func(slot->value);
 			}
-			free(cur);
-			cur = tmp;
 		}
+		munmap(tables[t]->slots, table_bytes(tables[t]->mask + 1));
+	}
+	if (map->retired != NULL) {
+		munmap(map->retired, map->retired_size);
 	}
-	free(map->buckets);
 	free(map);
 	return;
 }
@@ -85,100 +262,72 @@ void hashmap_free(hmap_t* map) {
 }
 
 int hashmap_add(hmap_t* map, unsigned long key, void* value) {
-	int index;
-	hnode_t* cur;
-	hnode_t* next;
-	hnode_t* new_node = (hnode_t*)malloc(sizeof(hnode_t));
-	new_node->key = key;
-	new_node->value = value;
-	new_node->next = NULL;
-	
-	index = hash(map, key);
-	cur = map->buckets[index];
-	next = cur;
-	if (cur == NULL) {
-		map->buckets[index] = new_node;
-		map->item_count++;
-		return 0;
+	migrate(map, MIGRATE_STEP);
+	if (table_find(&map->cur, key) != NULL || table_find(&map->old, key) != NULL) {
+		/* Duplicate entry */
+		return 1;
 	}
-
-	do {
-		cur = next;
-		if (cur->key == key) {
-			/* Duplicate entry */
+	if ((map->cur.count + map->old.count + 1) * 8 > (map->cur.mask + 1) * 7) {
+		grow(map);
+		if (map->cur.count == map->cur.mask) {
+			/* Could not grow and only one slot is left */
 			return 1;
 		}
-		next = cur->next;
-	} while (next != NULL);
-
-	cur->next = new_node;
+	}
+	table_insert(&map->cur, key, value);
 	map->item_count++;
 	return 0;
 }
 
 int hashmap_del(hmap_t* map, unsigned long key) {
-	int index;
-	hnode_t* cur;
-	hnode_t* tmp;
-	index = hash(map, key);
-	cur = map->buckets[index];
-	if (cur == NULL) {
-		/* Not found */
-		return 1;
-	}
-	if (cur->key == key) {
-		map->buckets[index] = cur->next;
-		free(cur);
+	hslot_t* slot;
+
+	migrate(map, MIGRATE_STEP);
+	slot = table_find(&map->cur, key);
+	if (slot != NULL) {
+		table_remove(&map->cur, slot);
 		map->item_count--;
 		return 0;
 	}
-	while (cur->next != NULL) {
-		if (cur->next->key == key) {
-			tmp = cur->next;
-			cur->next = cur->next->next;
-			free(tmp);
-			map->item_count--;
-			return 0;
-		}
-		cur = cur->next;
+	slot = table_find(&map->old, key);
+	if (slot != NULL) {
+		slot->dist |= HSLOT_MOVED;
+		map->old.count--;
+		map->item_count--;
+		return 0;
 	}
 	/* Not found */
 	return 1;
 }
 
 void* hashmap_get(hmap_t* map, unsigned long key) {
-	int index;
-	hnode_t* cur;
-	index = hash(map, key);
-	cur = map->buckets[index];
-	if (cur == NULL) {
-		/* Not found */
-		return NULL;
-	}
-	if (cur->key == key) {
-		return cur->value;
-	}
-	while (cur->next != NULL) {
-		if (cur->next->key == key) {
-			return cur->next->value;
-		}
-		cur = cur->next;
+	hslot_t* slot;
+
+	slot = table_find(&map->cur, key);
+	if (slot == NULL) {
+		slot = table_find(&map->old, key);
 	}
-	return NULL;
+	return slot == NULL ? NULL : slot->value;
 }
 
 void hashmap_print(hmap_t* map) {
-	int i;
-	hnode_t* cur;
+	size_t i;
+	hslot_t* slot;
 	printf("Hash map contents:\n");
-	for (i = 0; i < map->num_buckets; i++) {
-		printf("\tBucket %d:\n", i);
-		cur = map->buckets[i];
-		while (cur) {
-			printf("\t\tNode [key = %lu, value=%p]\n",
-				cur->key, cur->value);
-			cur = cur->next;
+	for (i = 0; i <= map->cur.mask; i++) {
+		slot = &map->cur.slots[i];
+		if (slot->dist == HSLOT_EMPTY) {
+			continue;
+		}
+		printf("\tSlot %zu (distance %u): [key = %lu, value=%p]\n",
+			i, slot->dist - 1, slot->key, slot->value);
+	}
+	for (i = 0; map->old.slots != NULL && i <= map->old.mask; i++) {
+		slot = &map->old.slots[i];
+		if (slot->dist == HSLOT_EMPTY || (slot->dist & HSLOT_MOVED)) {
+			continue;
 		}
+		printf("\tOld slot %zu: [key = %lu, value=%p]\n", i, slot->key, slot->value);
 	}
 	return;
 }
@@ -27,9 +27,24 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
 
+#include <stddef.h>
+
+/* Open addressing with robin hood probing. The table doubles once it is
+ * 7/8 full, and the move to the new table happens a few slots at a time
+ * on each add and del, so no single call pays for the whole rehash.
+ * Lookups never modify the table */
+typedef struct htable {
+	struct hslot* slots;
+	size_t mask; /* capacity - 1, capacity is a power of two */
+	size_t count; /* live entries */
+} htable_t;
+
 typedef struct hmap {
-	struct hnode** buckets;
-	int num_buckets;
+	htable_t cur;
+	htable_t old; /* being drained into cur, slots is NULL otherwise */
+	size_t migrate_pos; /* next slot of old to move */
+	void* retired; /* drained table still being unmapped */
+	size_t retired_size;
 	int item_count;
 } hmap_t;
 
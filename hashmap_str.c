@@ -26,41 +26,103 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include "hashmap_str.h"
-#define STR_MATCH(s, n) strcmp(s, n) == 0
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+#define MIN_BUCKETS	8
+#define MAX_LOAD	1 /* items per bucket before the table doubles */
 
 typedef struct hsnode {
 	struct hsnode* next;
 	char* key;
 	void* value;
+	uint32_t hash; /* cached so lookups and resizes skip most strcmps */
+	size_t len;
 } hsnode_t;
 
-static int hash(hsmap_t* map, char* key);
+static hsnode_t* find_node(hsmap_t* map, char* key, hsnode_t*** link);
+static void grow(hsmap_t* map);
 
-int hash(hsmap_t* map, char* key) {
-	int i;
-	int hash_val = 0;
-	
-	for (i = 0; i < strlen(key); ++i) {
-		hash_val += key[i];
+/* 64-bit FNV-1a folded to 32 bits. Measures the key in the same pass */
+uint32_t str_hashmap_hash(const char* key, size_t* len) {
+	const unsigned char* p = (const unsigned char*)key;
+	uint64_t hash_val = FNV_OFFSET;
+
+	while (*p != '\0') {
+		hash_val ^= *p++;
+		hash_val *= FNV_PRIME;
 	}
+	*len = p - (const unsigned char*)key;
+	return (uint32_t)(hash_val ^ (hash_val >> 32));
+}
 
-	return hash_val % map->num_buckets;
+/* Returns the node for key, and the pointer that links to it if link is set */
+hsnode_t* find_node(hsmap_t* map, char* key, hsnode_t*** link) {
+	uint32_t hash_val;
+	size_t len;
+	hsnode_t** cur;
+
+	hash_val = str_hashmap_hash(key, &len);
+	cur = &map->buckets[hash_val & (map->num_buckets - 1)];
+	while (*cur != NULL) {
+		if ((*cur)->hash == hash_val && (*cur)->len == len &&
+				memcmp((*cur)->key, key, len) == 0) {
+			break;
+		}
+		cur = &(*cur)->next;
+	}
+	if (link != NULL) {
+		*link = cur;
+	}
+	return *cur;
 }
 
+/* Doubles the bucket array, relinking nodes by their cached hash. On
+ * allocation failure the map keeps working at its current size */
+void grow(hsmap_t* map) {
+	hsnode_t** buckets;
+	hsnode_t* cur;
+	hsnode_t* next;
+	int num_buckets = map->num_buckets * 2;
+	int i;
+
+	buckets = (hsnode_t**)calloc(num_buckets, sizeof(hsnode_t*));
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i < map->num_buckets; i++) {
+		cur = map->buckets[i];
+		while (cur != NULL) {
+			next = cur->next;
+			cur->next = buckets[cur->hash & (num_buckets - 1)];
+			buckets[cur->hash & (num_buckets - 1)] = cur;
+			cur = next;
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->num_buckets = num_buckets;
+	return;
+}
 
 hsmap_t* str_hashmap_create(int num_buckets) {
-	hsmap_t* map = (hsmap_t*)malloc(sizeof(hsmap_t));
+	hsmap_t* map = (hsmap_t*)calloc(1, sizeof(hsmap_t));
+	int size = MIN_BUCKETS;
 	if (map == NULL) {
 		return NULL;
 	}
-	map->buckets = (hsnode_t**)calloc(num_buckets, sizeof(hsnode_t*));
+	while (size < num_buckets) {
+		size *= 2;
+	}
+	map->buckets = (hsnode_t**)calloc(size, sizeof(hsnode_t*));
 	if (map->buckets == NULL) {
 		free(map);
 		return NULL;
 	}
-	map->num_buckets = num_buckets;
+	map->num_buckets = size;
 	return map;
 }
 
@@ -93,96 +155,83 @@ void str_hashmap_free(hsmap_t* map) {
 }
 
 int str_hashmap_add(hsmap_t* map, char* key, void* value) {
-	int index;
-	hsnode_t* cur;
-	hsnode_t* next;
-	hsnode_t* new_node = (hsnode_t*)malloc(sizeof(hsnode_t));
-	new_node->key = key;
-	new_node->value = value;
-	new_node->next = NULL;
+	hsnode_t** link;
+	hsnode_t* new_node;
 
 	if (key == NULL) {
 		return 1;
 	}
-	
-	index = hash(map, key);
-	cur = map->buckets[index];
-	next = cur;
-	if (cur == NULL) {
-		map->buckets[index] = new_node;
-		map->item_count++;
-		return 0;
+	if (find_node(map, key, &link) != NULL) {
+		/* Duplicate entry */
+		return 1;
 	}
 
-	do {
-		cur = next;
-		if(STR_MATCH(cur->key,key)) {
-			/* Duplicate entry */
-
-			return 1;
-		}
-		next = cur->next;
-	} while (next != NULL);
-
-	cur->next = new_node;
+	new_node = (hsnode_t*)malloc(sizeof(hsnode_t));
+	if (new_node == NULL) {
+		return 1;
+	}
+	new_node->key = key;
+	new_node->value = value;
+	new_node->hash = str_hashmap_hash(key, &new_node->len);
+	new_node->next = NULL;
+	*link = new_node;
 	map->item_count++;
+
+	if (map->item_count > map->num_buckets * MAX_LOAD) {
+		grow(map);
+	}
 	return 0;
 }
 
 int str_hashmap_del(hsmap_t* map, char* key) {
-	int index;
+	hsnode_t** link;
 	hsnode_t* cur;
-	hsnode_t* tmp;
-	index = hash(map, key);
-	cur = map->buckets[index];
+
+	if (key == NULL) {
+		return 1;
+	}
+	cur = find_node(map, key, &link);
 	if (cur == NULL) {
 		/* Not found */
 		return 1;
 	}
-	if (STR_MATCH(cur->key,key)) {
-		map->buckets[index] = cur->next;
-		free(cur);
-		map->item_count--;
-		return 0;
-	}
-	while (cur->next != NULL) {
-		if (STR_MATCH(cur->key,key)) {
-			tmp = cur->next;
-			cur->next = cur->next->next;
-			free(tmp);
-			map->item_count--;
-			return 0;
-		}
-		cur = cur->next;
-	}
-	/* Not found */
-	return 1;
+	*link = cur->next;
+	free(cur);
+	map->item_count--;
+	return 0;
 }
 
 void* str_hashmap_get(hsmap_t* map, char* key) {
-	int index;
 	hsnode_t* cur;
 
 	if (key == NULL) {
 		return NULL;
 	}
-
-	index = hash(map, key);
-	cur = map->buckets[index];
+	cur = find_node(map, key, NULL);
 	if (cur == NULL) {
 		/* Not found */
 		return NULL;
 	}
-	if (STR_MATCH(cur->key,key)) {
-		return cur->value;
+	return cur->value;
+}
+
+void str_hashmap_foreach(hsmap_t* map, void (*func)(char*, void*, void*), void* arg) {
+	int i;
+	hsnode_t* cur;
+	hsnode_t* next;
+	if (map == NULL) {
+		return;
 	}
-	while (cur->next != NULL) {
-		if (STR_MATCH(cur->next->key,key)) {
-			return cur->next->value;
+	for (i = 0; i < map->num_buckets; i++) {
+		cur = map->buckets[i];
+		while (cur != NULL) {
+			/* func may remove cur from the map */
+			next = cur->next;
+			func(cur->key, cur->value, arg);
+			cur = next;
 		}
-		cur = cur->next;
 	}
-	return NULL;
+	return;
 }
 
 
@@ -194,8 +243,8 @@ void str_hashmap_print(hsmap_t* map) {
 		printf("\tBucket %d:\n", i);
 		cur = map->buckets[i];
 		while (cur) {
-			printf("\t\tNode [key = \"%s\", value=%p]\n",
-				cur->key, cur->value);
+			printf("\t\tNode [key = \"%s\", value=%p, hash=%08x]\n",
+				cur->key, cur->value, cur->hash);
 			cur = cur->next;
 		}
 	}
@@ -27,9 +27,12 @@
 #ifndef HASHMAP_STR_H
 #define HASHMAP_STR_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 typedef struct hsmap {
 	struct hsnode** buckets;
-	int num_buckets;
+	int num_buckets; /* always a power of two */
 	int item_count;
 } hsmap_t;
 
@@ -39,6 +42,8 @@ void str_hashmap_deep_free(hsmap_t* map, void (*free_func)(void*));
 int str_hashmap_add(hsmap_t* map, char* key, void* value);
 int str_hashmap_del(hsmap_t* map, char* key);
 void* str_hashmap_get(hsmap_t* map, char* key);
+void str_hashmap_foreach(hsmap_t* map, void (*func)(char*, void*, void*), void* arg);
 void str_hashmap_print(hsmap_t* map);
+uint32_t str_hashmap_hash(const char* key, size_t* len);
 
 #endif
@@ -25,21 +25,83 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <netinet/in.h>
 #include <stdarg.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "log.h"
 
 #ifndef NO_LOG
+#define LOG_RING_SIZE	256 /* records per thread, must be a power of two */
+#define LOG_RECORD_MAX	512 /* longer messages are cut short */
+#define LOG_BATCH_MAX	65536 /* bytes written per call */
+#define LOG_IDLE_MS	10 /* writer sleep when no ring is filling up */
+
+typedef struct log_record {
+	struct timespec ts;
+	log_level_t level;
+	int len;
+	char msg[LOG_RECORD_MAX];
+} log_record_t;
+
+/* Written by one thread, drained by the writer. head and tail each
+ * have a single writer, as in dataplane.c */
+typedef struct log_ring {
+	unsigned long head;
+	unsigned long tail;
+	int closed; /* owning thread exited, free once drained */
+	struct log_ring* next;
+	log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
 FILE* g_log_file = NULL;
 log_level_t g_log_level = LOG_DEBUG;
 
-void level_printf(log_level_t level);
+static log_ring_t* rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread log_ring_t* my_ring;
+static pthread_t writer;
+static int writer_state; /* 0 stopped, 1 running, 2 stopping, 3 failed to start */
+static int wake_fd = -1; /* producers past half a ring wake the writer early */
+static unsigned long dropped;
+static unsigned long dropped_reported;
+static time_t dropped_reported_at; /* drops are summarized at most once a second */
+
+static const char* level_str(log_level_t level);
+static log_ring_t* get_ring(void);
+static void ring_exit(void* arg);
+static void start_writer(void);
+static void* writer_main(void* arg);
+static int drain(char* batch, int final);
+static size_t format_prefix(char* buf, size_t size, struct timespec* ts, log_level_t level);
+static void atfork_prepare(void);
+static void atfork_parent(void);
+static void atfork_child(void);
 
 int log_init(const char* log_filename, log_level_t level) {
 	FILE* new_log_file;
+	static int initialized = 0;
+
 	g_log_level = level;
+	if (initialized == 0) {
+		if (pthread_key_create(&ring_key, ring_exit) != 0) {
+			return -1;
+		}
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		/* Workers are forked after logging starts and need their own writer */
+		pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+		/* Startup failures log an error and exit, write it out first */
+		atexit(log_close);
+		initialized = 1;
+	}
 	if (log_filename == NULL) {
 		g_log_file = stdout;
 		return 0;
@@ -53,19 +115,66 @@ int log_init(const char* log_filename, log_level_t level) {
 	return 0;
 }
 
+void log_set_level(log_level_t level) {
+	__atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+	return;
+}
+
+unsigned long log_dropped(void) {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/* The message is formatted here, since the arguments may not outlive the
+ * call, and queued for the writer thread. Nothing on this path blocks,
+ * and the only system call is a wakeup once per half ring during a
+ * burst; a full ring drops the record and counts it */
 void log_printf(log_level_t level, const char* format, ...) {
 	va_list args;
-	if (level < g_log_level) {
+	log_ring_t* ring;
+	log_record_t* record;
+	unsigned long head;
+	unsigned long queued;
+	uint64_t one = 1;
+
+	if (level < __atomic_load_n(&g_log_level, __ATOMIC_RELAXED)) {
 		return;
 	}
 	if (g_log_file == NULL) {
 		return;
 	}
-	level_printf(level);
+	ring = get_ring();
+	if (ring == NULL) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	head = ring->head;
+	queued = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (queued == LOG_RING_SIZE) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	record = &ring->records[head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &record->ts);
+	record->level = level;
 	va_start(args, format);
-	vfprintf(g_log_file, format, args);
-	fflush(g_log_file);
+	record->len = vsnprintf(record->msg, LOG_RECORD_MAX, format, args);
 	va_end(args);
+	if (record->len < 0) {
+		record->len = 0;
+	}
+	if (record->len >= LOG_RECORD_MAX) {
+		record->len = LOG_RECORD_MAX - 1;
+		record->msg[LOG_RECORD_MAX - 2] = '\n';
+	}
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&writer_state, __ATOMIC_ACQUIRE) == 0) {
+		start_writer();
+	}
+	if (queued == LOG_RING_SIZE / 2 && wake_fd != -1) {
+		if (write(wake_fd, &one, sizeof(one)) == -1) {
+			/* Already signalled, the writer is on its way */
+		}
+	}
 	return;
 }
 
@@ -75,6 +184,11 @@ void log_printf_addr(struct sockaddr *addr) {
 	unsigned long ip_addr;
 	struct in6_addr ip6_addr;
 	int port;
+	if (addr->sa_family == AF_UNIX) {
+		/* Abstract names start with a null byte */
+		log_printf(LOG_INFO, "Address: unix:@%s\n", ((struct sockaddr_un*)addr)->sun_path+1);
+		return;
+	}
 	if (addr->sa_family == AF_INET) {
 		ip_addr = ((struct sockaddr_in*)addr)->sin_addr.s_addr;
 		inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
@@ -90,34 +204,235 @@ void log_printf_addr(struct sockaddr *addr) {
 }
 
 void log_close(void) {
-	if (g_log_file != stdout) {
+	int running = 1;
+	char* batch;
+
+	if (__atomic_compare_exchange_n(&writer_state, &running, 2, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_join(writer, NULL);
+	}
+	else if (g_log_file != NULL) {
+		/* Never started, or failed to: write what is queued ourselves */
+		batch = malloc(LOG_BATCH_MAX);
+		if (batch != NULL) {
+			while (drain(batch, 1) > 0);
+			free(batch);
+		}
+	}
+	__atomic_store_n(&writer_state, 0, __ATOMIC_RELEASE);
+	if (g_log_file != stdout && g_log_file != NULL) {
 		fclose(g_log_file);
 	}
 	g_log_file = NULL;
 	return;
 }
 
-void level_printf(log_level_t level) {
-	char level_str[32];
+log_ring_t* get_ring(void) {
+	log_ring_t* ring;
+
+	if (my_ring != NULL) {
+		return my_ring;
+	}
+	ring = (log_ring_t*)calloc(1, sizeof(log_ring_t));
+	if (ring == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+	return ring;
+}
+
+void ring_exit(void* arg) {
+	log_ring_t* ring = (log_ring_t*)arg;
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+	return;
+}
+
+void start_writer(void) {
+	int stopped = 0;
+	int ret;
+
+	if (!__atomic_compare_exchange_n(&writer_state, &stopped, 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	ret = pthread_create(&writer, NULL, writer_main, NULL);
+	if (ret != 0) {
+		/* Records stay queued until log_close writes them */
+		fprintf(stderr, "Unable to start log writer: %s\n", strerror(ret));
+		__atomic_store_n(&writer_state, 3, __ATOMIC_RELEASE);
+	}
+	return;
+}
+
+void* writer_main(void* arg) {
+	struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+	uint64_t count;
+	char* batch;
+	int written;
+	int stopping;
+
+	batch = malloc(LOG_BATCH_MAX);
+	if (batch == NULL) {
+		return NULL;
+	}
+	for (;;) {
+		stopping = __atomic_load_n(&writer_state, __ATOMIC_ACQUIRE) == 2;
+		written = drain(batch, stopping);
+		if (written > 0) {
+			continue;
+		}
+		if (stopping) {
+			break;
+		}
+		if (poll(&pfd, wake_fd != -1 ? 1 : 0, LOG_IDLE_MS) > 0) {
+			if (read(wake_fd, &count, sizeof(count)) == -1) {
+				continue;
+			}
+		}
+	}
+	free(batch);
+	return NULL;
+}
+
+/* Writes out everything queued when it starts, oldest record first
+ * across all threads. Returns the number of records written */
+int drain(char* batch, int final) {
+	log_ring_t* ring;
+	log_ring_t* oldest;
+	log_ring_t** link;
+	log_record_t* record;
+	log_record_t* best;
+	struct timespec now;
+	unsigned long lost;
+	size_t used = 0;
+	int count = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (;;) {
+		oldest = NULL;
+		for (ring = rings; ring != NULL; ring = ring->next) {
+			if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			record = &ring->records[ring->tail & (LOG_RING_SIZE - 1)];
+			if (oldest == NULL) {
+				oldest = ring;
+				continue;
+			}
+			best = &oldest->records[oldest->tail & (LOG_RING_SIZE - 1)];
+			if (record->ts.tv_sec < best->ts.tv_sec || (record->ts.tv_sec == best->ts.tv_sec &&
+					record->ts.tv_nsec < best->ts.tv_nsec)) {
+				oldest = ring;
+			}
+		}
+		if (oldest == NULL) {
+			break;
+		}
+		record = &oldest->records[oldest->tail & (LOG_RING_SIZE - 1)];
+		if (used + record->len + 32 > LOG_BATCH_MAX) {
+			fwrite(batch, 1, used, g_log_file);
+			used = 0;
+		}
+		used += format_prefix(batch + used, LOG_BATCH_MAX - used, &record->ts, record->level);
+		memcpy(batch + used, record->msg, record->len);
+		used += record->len;
+		__atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	/* Rings of exited threads go once they are empty */
+	link = &rings;
+	while (*link != NULL) {
+		ring = *link;
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+				ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			*link = ring->next;
+			free(ring);
+			continue;
+		}
+		link = &ring->next;
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	lost = log_dropped();
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (lost != dropped_reported && used + 96 < LOG_BATCH_MAX &&
+			(now.tv_sec != dropped_reported_at || final)) {
+		dropped_reported_at = now.tv_sec;
+		used += format_prefix(batch + used, LOG_BATCH_MAX - used, &now, LOG_WARNING);
+		used += snprintf(batch + used, LOG_BATCH_MAX - used, "%lu log records dropped\n",
+				lost - dropped_reported);
+		dropped_reported = lost;
+	}
+	if (used > 0) {
+		fwrite(batch, 1, used, g_log_file);
+		fflush(g_log_file);
+	}
+	return count;
+}
+
+/* Only the forking thread exists in the child. Records already queued
+ * belong to the parent, which writes them */
+void atfork_prepare(void) {
+	pthread_mutex_lock(&rings_lock);
+	return;
+}
+
+void atfork_parent(void) {
+	pthread_mutex_unlock(&rings_lock);
+	return;
+}
+
+void atfork_child(void) {
+	log_ring_t* ring;
+	log_ring_t* next;
+
+	pthread_mutex_init(&rings_lock, NULL);
+	ring = rings;
+	while (ring != NULL) {
+		next = ring->next;
+		if (ring != my_ring) {
+			free(ring);
+		}
+		ring = next;
+	}
+	rings = my_ring;
+	if (my_ring != NULL) {
+		my_ring->tail = my_ring->head;
+		my_ring->next = NULL;
+	}
+	writer_state = 0;
+	dropped = 0;
+	dropped_reported = 0;
+	return;
+}
+
+size_t format_prefix(char* buf, size_t size, struct timespec* ts, log_level_t level) {
+	struct tm tm;
+	localtime_r(&ts->tv_sec, &tm);
+	return snprintf(buf, size, "%02d:%02d:%02d.%03ld %s", tm.tm_hour, tm.tm_min,
+			tm.tm_sec, ts->tv_nsec / 1000000, level_str(level));
+}
+
+const char* level_str(log_level_t level) {
 	switch(level) {
 		case LOG_DEBUG:
-			strcpy(level_str, "DEBUG:   ");
-			break;
+			return "DEBUG:   ";
 		case LOG_INFO:
-			strcpy(level_str, "INFO:    ");
-			break;
+			return "INFO:    ";
 		case LOG_WARNING:
-			strcpy(level_str, "WARNING: ");
-			break;
+			return "WARNING: ";
 		case LOG_ERROR:
-			strcpy(level_str, "ERROR:   ");
-			break;
+			return "ERROR:   ";
 	}
-	fprintf(g_log_file, "%s", level_str);
-	return;
+	return "";
 }
 
-
 int timeval_subtract(struct timeval* result, struct timeval* x, struct timeval* y) {
 	struct timeval y_cpy = *y;
 	/* Perform the carry for the later subtraction by updating y_cpy. */
@@ -37,16 +37,25 @@ typedef enum log_level {
 	LOG_ERROR,
 } log_level_t;
 
+/* log_printf queues each line on a ring owned by the calling thread and
+ * a writer thread started on first use writes them out in batches. When
+ * a ring is full the line is dropped and counted instead of waiting.
+ * Whatever is still queued is written out by log_close, which also runs
+ * at exit */
 #ifndef NO_LOG
 int log_init(const char* log_filename, log_level_t level);
 void log_printf(log_level_t level, const char* format, ...);
 void log_printf_addr(struct sockaddr *addr);
+void log_set_level(log_level_t level);
+unsigned long log_dropped(void);
 void log_close(void);
 #else
 #define noop
 #define log_init(X, Y)	((int)0)
 #define log_printf(...) noop
 #define log_printf_addr(...) noop
+#define log_set_level(X) noop
+#define log_dropped() ((unsigned long)0)
 #define log_close() noop
 #endif
 
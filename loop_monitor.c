@@ -0,0 +1,159 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include <event2/event.h>
+
+#include "loop_monitor.h"
+#include "metrics.h"
+#include "log.h"
+
+#define LOOP_LAG_INTERVAL_MS	100
+
+struct loop_monitor {
+	struct event* lag_ev;
+	uint64_t expected; /* when lag_ev should fire */
+};
+
+static const char* cb_names[LOOP_CB_TYPES] = {
+	"netlink", "accept", "relay", "verify", "client_auth", "entropy", "reload", "task"
+};
+
+/* Shared by the control and data plane threads of a worker */
+static uint64_t slow_us;
+static time_t last_report;
+static unsigned long suppressed;
+
+static void lag_cb(evutil_socket_t fd, short events, void* arg);
+static void lag_schedule(loop_monitor_t* monitor);
+static int report_allowed(void);
+
+void loop_monitor_init(unsigned long slow_ms) {
+	slow_us = (uint64_t)slow_ms * 1000;
+	return;
+}
+
+loop_monitor_t* loop_monitor_attach(struct event_base* ev_base) {
+	loop_monitor_t* monitor;
+
+	if (slow_us == 0) {
+		return NULL;
+	}
+	monitor = (loop_monitor_t*)calloc(1, sizeof(loop_monitor_t));
+	if (monitor == NULL) {
+		return NULL;
+	}
+	monitor->lag_ev = evtimer_new(ev_base, lag_cb, monitor);
+	if (monitor->lag_ev == NULL) {
+		log_printf(LOG_ERROR, "Failed to create loop lag timer\n");
+		free(monitor);
+		return NULL;
+	}
+	lag_schedule(monitor);
+	return monitor;
+}
+
+void loop_monitor_detach(loop_monitor_t* monitor) {
+	if (monitor == NULL) {
+		return;
+	}
+	event_free(monitor->lag_ev);
+	free(monitor);
+	if (__atomic_load_n(&suppressed, __ATOMIC_RELAXED) > 0) {
+		log_printf(LOG_WARNING, "%lu slow callbacks were not logged\n",
+			__atomic_exchange_n(&suppressed, 0, __ATOMIC_RELAXED));
+	}
+	return;
+}
+
+uint64_t loop_monitor_begin(void) {
+	if (slow_us == 0) {
+		return 0;
+	}
+	return metrics_now();
+}
+
+void loop_monitor_end(enum loop_cb type, unsigned long id, uint64_t started) {
+	uint64_t elapsed;
+
+	if (started == 0 || slow_us == 0) {
+		return;
+	}
+	elapsed = metrics_now() - started;
+	metrics_callback(type, elapsed);
+	if (elapsed >= slow_us && report_allowed()) {
+		log_printf(LOG_WARNING, "Slow %s callback on socket %lu took %lu ms (%lu more not logged)\n",
+			cb_names[type], id, (unsigned long)(elapsed / 1000),
+			__atomic_exchange_n(&suppressed, 0, __ATOMIC_RELAXED));
+	}
+	return;
+}
+
+const char* loop_monitor_cb_name(int type) {
+	if (type < 0 || type >= LOOP_CB_TYPES) {
+		return "unknown";
+	}
+	return cb_names[type];
+}
+
+/* Re-armed by hand rather than EV_PERSIST so each firing is measured
+ * against the time it was asked for */
+void lag_cb(evutil_socket_t fd, short events, void* arg) {
+	loop_monitor_t* monitor = (loop_monitor_t*)arg;
+	uint64_t now = metrics_now();
+	uint64_t lag = now > monitor->expected ? now - monitor->expected : 0;
+
+	metrics_loop_lag(lag);
+	if (lag >= slow_us && report_allowed()) {
+		log_printf(LOG_WARNING, "Event loop ran %lu ms late (%lu more not logged)\n",
+			(unsigned long)(lag / 1000), __atomic_exchange_n(&suppressed, 0, __ATOMIC_RELAXED));
+	}
+	lag_schedule(monitor);
+	return;
+}
+
+void lag_schedule(loop_monitor_t* monitor) {
+	struct timeval interval = { 0, LOOP_LAG_INTERVAL_MS * 1000 };
+
+	monitor->expected = metrics_now() + LOOP_LAG_INTERVAL_MS * 1000;
+	evtimer_add(monitor->lag_ev, &interval);
+	return;
+}
+
+/* One line a second at most, a stall tends to hold up many callbacks */
+int report_allowed(void) {
+	time_t now = time(NULL);
+	time_t last = __atomic_load_n(&last_report, __ATOMIC_RELAXED);
+
+	if (now == last || !__atomic_compare_exchange_n(&last_report, &last, now,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
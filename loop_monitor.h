@@ -0,0 +1,60 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LOOP_MONITOR_H
+#define LOOP_MONITOR_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+enum loop_cb {
+	LOOP_CB_NETLINK, /* one kernel notification */
+	LOOP_CB_ACCEPT, /* plaintext legs and listener connections */
+	LOOP_CB_RELAY, /* bufferevent and ring relay callbacks */
+	LOOP_CB_VERIFY, /* certificate verification, TrustBase included */
+	LOOP_CB_CLIENT_AUTH, /* round trips to the auth daemon */
+	LOOP_CB_ENTROPY,
+	LOOP_CB_RELOAD,
+	LOOP_CB_TASK, /* work handed to a data plane thread */
+	LOOP_CB_TYPES
+};
+
+typedef struct loop_monitor loop_monitor_t;
+
+/* Times callbacks on the event loops and a timer that should fire every
+ * LOOP_LAG_INTERVAL_MS, which shows how late the loop runs. Both go to
+ * histograms in the metrics. Anything taking longer than slow_ms is
+ * logged, at most once a second, with the socket it was working on.
+ * A threshold of 0 turns the monitor off and loop_monitor_begin()
+ * returns 0, which loop_monitor_end() ignores */
+void loop_monitor_init(unsigned long slow_ms);
+loop_monitor_t* loop_monitor_attach(struct event_base* ev_base);
+void loop_monitor_detach(loop_monitor_t* monitor);
+uint64_t loop_monitor_begin(void);
+void loop_monitor_end(enum loop_cb type, unsigned long id, uint64_t started);
+const char* loop_monitor_cb_name(int type);
+
+#endif
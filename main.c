@@ -24,8 +24,10 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,10 +40,15 @@
 #include "csr_daemon.h"
 #include "daemon.h"
 #include "log.h"
+#include "metrics.h"
 #include "nsd.h"
+#include "port_owner.h"
 #include "self_sign.h"
+#include "session_cache.h"
+#include "ticket_keys.h"
 
 void sig_handler(int signum);
+static void pin_worker(int worker_id);
 void* create_csr_daemon(void* arg);
 
 #ifdef CLIENT_AUTH
@@ -65,6 +72,7 @@ int main(int argc, char* argv[]) {
 	int status;
 	int ret;
 	int starting_port = 8443;
+	ssa_config_t* default_config;
 #ifdef CLIENT_AUTH
 	pthread_t csr_daemon;
 	daemon_param_t csr_params = {
@@ -75,9 +83,9 @@ int main(int argc, char* argv[]) {
 	};
 	pthread_t auth_daemon;
 #endif
+	long cpus_on;
 #ifndef NO_LOG
 	long cpus_conf;
-	long cpus_on;
 #endif
 
 	/* Init logger */
@@ -91,8 +99,8 @@ int main(int argc, char* argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-#ifndef NO_LOG
 	cpus_on = sysconf(_SC_NPROCESSORS_ONLN);
+#ifndef NO_LOG
 	cpus_conf = sysconf(_SC_NPROCESSORS_CONF);
 	log_printf(LOG_INFO, "Detected %ld/%ld active CPUs\n", cpus_on, cpus_conf);
 #endif
@@ -101,10 +109,38 @@ int main(int argc, char* argv[]) {
 	memset(&sigact, 0, sizeof(sigact));
 	sigact.sa_handler = sig_handler;
 	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGHUP, &sigact, NULL);
 
 	parse_config("ssa.cfg");
+	log_set_level(daemon_config.log_level);
 	
-	worker_count = 1;
+	worker_count = daemon_config.workers;
+	if (worker_count == 0) {
+		worker_count = cpus_on > 0 ? (int)cpus_on : 1;
+	}
+	log_printf(LOG_INFO, "Starting %d workers on ports %d-%d\n", worker_count,
+			starting_port, starting_port + worker_count - 1);
+
+	if (daemon_config.metrics_socket != NULL && metrics_init(worker_count) != 0) {
+		log_printf(LOG_ERROR, "Continuing without metrics\n");
+	}
+	/* Before the fork, like the metrics region */
+	if (worker_count > 1 && port_owner_init(worker_count) != 0) {
+		log_printf(LOG_ERROR, "Continuing with accepted sockets served where they are announced\n");
+	}
+	/* Sessions left by the last run are loaded here, once, rather than
+	 * by each worker in server_create */
+	default_config = get_app_config(DEFAULT_CONF);
+	if (session_cache_init(daemon_config.session_cache_size,
+			default_config != NULL ? default_config->cache_path : NULL,
+			daemon_config.session_key_file) != 0) {
+		log_printf(LOG_ERROR, "Continuing with a session cache per worker\n");
+	}
+	if (ticket_keys_init(daemon_config.ticket_key_rotation,
+			default_config != NULL ? default_config->cache_path : NULL,
+			daemon_config.session_key_file) != 0) {
+		log_printf(LOG_ERROR, "Continuing with ticket keys per worker\n");
+	}
 
 	workers = malloc(sizeof(pid_t) * worker_count);
 	if (workers == NULL) {
@@ -118,8 +154,14 @@ int main(int argc, char* argv[]) {
 			exit(EXIT_FAILURE);
 		}
 		if (pid == 0) {
-			server_create(starting_port + i);
+			is_parent = 0;
+			if (daemon_config.pin_workers == 1) {
+				pin_worker(i);
+			}
+			server_create(starting_port + i, i, worker_count);
 			free(workers);
+			free_config();
+			log_close();
 			return 0;
 		}
 		else {
@@ -128,6 +170,8 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	metrics_serve(daemon_config.metrics_socket);
+
 	#ifdef CLIENT_AUTH
 	pthread_create(&csr_daemon, NULL, create_csr_daemon, (void*)&csr_params);
 	pthread_create(&auth_daemon, NULL, create_auth_daemon, (void*)&auth_params);
@@ -155,6 +199,9 @@ int main(int argc, char* argv[]) {
 	/*pthread_join(csr_daemon, NULL);
 	pthread_join(auth_daemon, NULL);*/
 
+	metrics_free();
+	session_cache_free();
+	ticket_keys_free();
 	log_close();
 	free_config();
 	free(workers);
@@ -174,6 +221,46 @@ void sig_handler(int signum) {
 			_exit(0);
 		}
 	}
+	/* Each worker reloads its own copy of the configuration */
+	if (signum == SIGHUP && is_parent == 1) {
+		for (i = 0; i < worker_count; i++) {
+			kill(workers[i], SIGHUP);
+		}
+	}
+	return;
+}
+
+/* Pins worker_id to the worker_id'th CPU this process may run on,
+ * wrapping around when there are more workers than CPUs */
+void pin_worker(int worker_id) {
+	cpu_set_t allowed;
+	cpu_set_t target;
+	int cpu_count;
+	int cpu;
+	int n;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		log_printf(LOG_ERROR, "Failed in sched_getaffinity: %s\n", strerror(errno));
+		return;
+	}
+	cpu_count = CPU_COUNT(&allowed);
+	if (cpu_count == 0) {
+		return;
+	}
+	n = worker_id % cpu_count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+			break;
+		}
+	}
+	CPU_ZERO(&target);
+	CPU_SET(cpu, &target);
+	if (sched_setaffinity(0, sizeof(target), &target) == -1) {
+		log_printf(LOG_ERROR, "Failed to pin worker %d to CPU %d: %s\n",
+				worker_id, cpu, strerror(errno));
+		return;
+	}
+	log_printf(LOG_INFO, "Worker %d pinned to CPU %d\n", worker_id, cpu);
 	return;
 }
 
@@ -0,0 +1,765 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+#include <openssl/ssl.h>
+
+#include "metrics.h"
+#include "netlink.h"
+#include "loop_monitor.h"
+#include "relay_budget.h"
+#include "entropy.h"
+#include "reload.h"
+#include "session_cache.h"
+#include "verify_cache.h"
+#include "pool.h"
+#include "log.h"
+
+#define METRICS_VERSIONS	5 /* TLS 1.0 to 1.3, then anything else */
+#define METRICS_CIPHERS		32 /* the last one counts every cipher past the rest */
+#define METRICS_CIPHER_LEN	48
+#define METRICS_NL_CMDS		16
+#define METRICS_POOLS		8
+#define METRICS_BUCKETS		14
+#define METRICS_SAMPLE_SECS	1
+#define METRICS_BACKLOG		8
+#define METRICS_READ_MS		100 /* wait for an HTTP request line before answering raw */
+
+typedef struct histogram {
+	uint64_t buckets[METRICS_BUCKETS]; /* not cumulative, the last is +Inf */
+	uint64_t count;
+	uint64_t sum_us;
+} histogram_t;
+
+typedef struct pool_gauge {
+	char name[32];
+	uint64_t in_use;
+} pool_gauge_t;
+
+typedef struct worker_metrics {
+	int attached;
+	uint64_t hs_started[METRICS_ROLES];
+	uint64_t hs_completed[METRICS_VERSIONS][METRICS_CIPHERS];
+	uint64_t hs_failed[METRICS_VERSIONS][METRICS_CIPHERS];
+	uint64_t hs_resumed[METRICS_ROLES];
+	histogram_t hs_duration;
+	uint64_t relay_bytes[METRICS_DIRS];
+	histogram_t nl_service[METRICS_NL_CMDS];
+	histogram_t loop_lag;
+	histogram_t callbacks[LOOP_CB_TYPES];
+	/* sampled by the worker's event loop */
+	uint64_t relay_buffered;
+	uint64_t relay_peak;
+	uint64_t log_dropped;
+	uint64_t entropy_reseeds;
+	uint64_t reloads;
+	uint64_t reload_failures;
+	uint64_t verify_hits;
+	uint64_t verify_misses;
+	uint64_t verify_entries;
+	int pool_count;
+	pool_gauge_t pools[METRICS_POOLS];
+} __attribute__((aligned(64))) worker_metrics_t;
+
+typedef struct cipher_slot {
+	int state; /* 0 free, 1 being named, 2 named */
+	char name[METRICS_CIPHER_LEN];
+} cipher_slot_t;
+
+typedef struct metrics_region {
+	int worker_count;
+	cipher_slot_t ciphers[METRICS_CIPHERS];
+	worker_metrics_t workers[];
+} metrics_region_t;
+
+typedef struct out_buf {
+	char* data;
+	size_t len;
+	size_t size;
+} out_buf_t;
+
+static const char* version_names[METRICS_VERSIONS] = {
+	"TLSv1", "TLSv1.1", "TLSv1.2", "TLSv1.3", "other"
+};
+static const char* role_names[METRICS_ROLES] = { "client", "server" };
+static const char* dir_names[METRICS_DIRS] = { "outbound", "inbound" };
+/* bucket upper bounds in microseconds */
+static const uint64_t hs_bounds[METRICS_BUCKETS - 1] = {
+	1000, 2000, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000
+};
+static const uint64_t nl_bounds[METRICS_BUCKETS - 1] = {
+	5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000
+};
+static const uint64_t loop_bounds[METRICS_BUCKETS - 1] = {
+	10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000
+};
+
+static metrics_region_t* region;
+static size_t region_size;
+static worker_metrics_t* self;
+static struct event* sample_ev;
+static int listen_fd = -1;
+static char* socket_path; /* unlinked at exit, NULL when abstract */
+static pthread_t server_thread;
+
+static int version_index(int version);
+static int cipher_index(const char* cipher);
+static const char* cipher_label(int index);
+static void histogram_add(histogram_t* hist, const uint64_t* bounds, uint64_t value);
+static void sample_cb(evutil_socket_t fd, short events, void* arg);
+static void sample_pool(pool_stats_t* stats, void* arg);
+static void* server_loop(void* arg);
+static void serve_client(int fd);
+static int render(out_buf_t* out);
+static void render_histogram(out_buf_t* out, const char* name, const char* labels,
+	const uint64_t* bounds, histogram_t* hist);
+static void sum_histogram(histogram_t* total, histogram_t* hist);
+static int out_printf(out_buf_t* out, const char* fmt, ...);
+static uint64_t load(uint64_t* counter);
+
+/* Called by the parent before it forks, so every worker and the
+ * parent see the same pages */
+int metrics_init(int worker_count) {
+	region_size = sizeof(metrics_region_t) + sizeof(worker_metrics_t) * worker_count;
+	region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		log_printf(LOG_ERROR, "Failed to map metrics: %s\n", strerror(errno));
+		region = NULL;
+		return 1;
+	}
+	region->worker_count = worker_count;
+	return 0;
+}
+
+int metrics_attach(struct event_base* ev_base, int worker_id) {
+	struct timeval interval = { METRICS_SAMPLE_SECS, 0 };
+
+	if (region == NULL || worker_id >= region->worker_count) {
+		return 0;
+	}
+	self = &region->workers[worker_id];
+	memset(self, 0, sizeof(worker_metrics_t));
+	sample_ev = event_new(ev_base, -1, EV_PERSIST, sample_cb, NULL);
+	if (sample_ev == NULL) {
+		log_printf(LOG_ERROR, "Failed to create metrics sampler event\n");
+		return 1;
+	}
+	event_add(sample_ev, &interval);
+	__atomic_store_n(&self->attached, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Counters stay behind for the parent to report, gauges drop out */
+void metrics_detach(void) {
+	if (self == NULL) {
+		return;
+	}
+	__atomic_store_n(&self->attached, 0, __ATOMIC_RELEASE);
+	if (sample_ev != NULL) {
+		event_free(sample_ev);
+		sample_ev = NULL;
+	}
+	self = NULL;
+	return;
+}
+
+/* Starts the thread answering scrapes. A name starting with @ is in
+ * the abstract namespace, anything else a path in the filesystem */
+int metrics_serve(const char* socket_name) {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	size_t name_len;
+
+	if (region == NULL || socket_name == NULL) {
+		return 0;
+	}
+	name_len = strlen(socket_name);
+	if (name_len == 0 || name_len >= sizeof(addr.sun_path)) {
+		log_printf(LOG_ERROR, "Invalid MetricsSocket: %s\n", socket_name);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, socket_name, name_len);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + name_len;
+	if (socket_name[0] == '@') {
+		addr.sun_path[0] = '\0';
+	}
+	else {
+		unlink(socket_name);
+		addrlen++;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1) {
+		log_printf(LOG_ERROR, "Failed to create metrics socket: %s\n", strerror(errno));
+		return 1;
+	}
+	if (bind(listen_fd, (struct sockaddr*)&addr, addrlen) == -1 ||
+			listen(listen_fd, METRICS_BACKLOG) == -1) {
+		log_printf(LOG_ERROR, "Failed to listen on %s: %s\n", socket_name, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return 1;
+	}
+	if (socket_name[0] != '@') {
+		socket_path = strdup(socket_name);
+	}
+	if (pthread_create(&server_thread, NULL, server_loop, NULL) != 0) {
+		log_printf(LOG_ERROR, "Failed to start metrics thread\n");
+		close(listen_fd);
+		listen_fd = -1;
+		return 1;
+	}
+	log_printf(LOG_INFO, "Serving metrics on %s\n", socket_name);
+	return 0;
+}
+
+void metrics_free(void) {
+	if (listen_fd != -1) {
+		/* wakes the thread out of accept */
+		shutdown(listen_fd, SHUT_RDWR);
+		pthread_join(server_thread, NULL);
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (socket_path != NULL) {
+		unlink(socket_path);
+		free(socket_path);
+		socket_path = NULL;
+	}
+	if (region != NULL) {
+		munmap(region, region_size);
+		region = NULL;
+	}
+	return;
+}
+
+uint64_t metrics_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metrics_handshake_started(enum metrics_role role) {
+	if (self == NULL) return;
+	__atomic_add_fetch(&self->hs_started[role], 1, __ATOMIC_RELAXED);
+	return;
+}
+
+void metrics_handshake_completed(int version, const char* cipher, uint64_t started) {
+	if (self == NULL) return;
+	__atomic_add_fetch(&self->hs_completed[version_index(version)][cipher_index(cipher)],
+		1, __ATOMIC_RELAXED);
+	histogram_add(&self->hs_duration, hs_bounds, metrics_now() - started);
+	return;
+}
+
+void metrics_handshake_resumed(enum metrics_role role) {
+	if (self == NULL) return;
+	__atomic_add_fetch(&self->hs_resumed[role], 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/* A NULL cipher is a handshake that failed before one was chosen */
+void metrics_handshake_failed(int version, const char* cipher) {
+	if (self == NULL) return;
+	__atomic_add_fetch(&self->hs_failed[version_index(version)][cipher_index(cipher != NULL ? cipher : "none")],
+		1, __ATOMIC_RELAXED);
+	return;
+}
+
+void metrics_relay_bytes(enum metrics_dir dir, size_t bytes) {
+	if (self == NULL) return;
+	__atomic_add_fetch(&self->relay_bytes[dir], bytes, __ATOMIC_RELAXED);
+	return;
+}
+
+void metrics_netlink(int cmd, uint64_t started) {
+	if (self == NULL || cmd < 0 || cmd >= METRICS_NL_CMDS) return;
+	histogram_add(&self->nl_service[cmd], nl_bounds, metrics_now() - started);
+	return;
+}
+
+void metrics_loop_lag(uint64_t lag) {
+	if (self == NULL) return;
+	histogram_add(&self->loop_lag, loop_bounds, lag);
+	return;
+}
+
+void metrics_callback(int type, uint64_t elapsed) {
+	if (self == NULL || type < 0 || type >= LOOP_CB_TYPES) return;
+	histogram_add(&self->callbacks[type], loop_bounds, elapsed);
+	return;
+}
+
+int version_index(int version) {
+	if (version >= TLS1_VERSION && version <= TLS1_3_VERSION) {
+		return version - TLS1_VERSION;
+	}
+	return METRICS_VERSIONS - 1;
+}
+
+/* Cipher names share one table across workers so the parent can label
+ * the counters. Slots are claimed in the order ciphers are first seen */
+int cipher_index(const char* cipher) {
+	cipher_slot_t* slot;
+	int expected;
+	int state;
+	int i;
+
+	if (cipher == NULL) {
+		return METRICS_CIPHERS - 1;
+	}
+	for (i = 0; i < METRICS_CIPHERS - 1; i++) {
+		slot = &region->ciphers[i];
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == 0) {
+			expected = 0;
+			if (__atomic_compare_exchange_n(&slot->state, &expected, 1,
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				strncpy(slot->name, cipher, METRICS_CIPHER_LEN - 1);
+				__atomic_store_n(&slot->state, 2, __ATOMIC_RELEASE);
+				return i;
+			}
+			state = expected;
+		}
+		/* another thread or worker is naming it, only a few stores */
+		while (state == 1) {
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		}
+		if (strncmp(slot->name, cipher, METRICS_CIPHER_LEN - 1) == 0) {
+			return i;
+		}
+	}
+	return METRICS_CIPHERS - 1;
+}
+
+const char* cipher_label(int index) {
+	if (index < METRICS_CIPHERS - 1 &&
+			__atomic_load_n(&region->ciphers[index].state, __ATOMIC_ACQUIRE) == 2) {
+		return region->ciphers[index].name;
+	}
+	return "other";
+}
+
+void histogram_add(histogram_t* hist, const uint64_t* bounds, uint64_t value) {
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		if (value <= bounds[i]) break;
+	}
+	__atomic_add_fetch(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum_us, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/* Gauges owned by other modules are copied in once a second */
+void sample_cb(evutil_socket_t fd, short events, void* arg) {
+	reload_stats_t reload;
+	verify_cache_stats_t verify;
+
+	if (self == NULL) return;
+	reload_get_stats(&reload);
+	verify_cache_get_stats(&verify);
+	__atomic_store_n(&self->relay_buffered, relay_budget_current(), __ATOMIC_RELAXED);
+	__atomic_store_n(&self->relay_peak, relay_budget_peak(), __ATOMIC_RELAXED);
+	__atomic_store_n(&self->log_dropped, log_dropped(), __ATOMIC_RELAXED);
+	__atomic_store_n(&self->entropy_reseeds, entropy_reseed_count(), __ATOMIC_RELAXED);
+	__atomic_store_n(&self->reloads, reload.reloads, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->reload_failures, reload.failures, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->verify_hits, verify.hits, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->verify_misses, verify.misses, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->verify_entries, verify.entries, __ATOMIC_RELAXED);
+	pool_foreach(sample_pool, NULL);
+	return;
+}
+
+void sample_pool(pool_stats_t* stats, void* arg) {
+	int i;
+	int count = __atomic_load_n(&self->pool_count, __ATOMIC_RELAXED);
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(self->pools[i].name, stats->name) == 0) {
+			__atomic_store_n(&self->pools[i].in_use, stats->in_use, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	if (count == METRICS_POOLS) {
+		return;
+	}
+	strncpy(self->pools[count].name, stats->name, sizeof(self->pools[count].name) - 1);
+	__atomic_store_n(&self->pools[count].in_use, stats->in_use, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->pool_count, count + 1, __ATOMIC_RELEASE);
+	return;
+}
+
+void* server_loop(void* arg) {
+	int fd;
+
+	while (1) {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		serve_client(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Prometheus scrapes over HTTP, so a request line gets a minimal
+ * HTTP/1.0 response. Clients that send nothing get the bare text */
+void serve_client(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	out_buf_t out = { 0 };
+	char request[512];
+	char header[128];
+	ssize_t n = 0;
+	size_t sent;
+	int header_len = 0;
+
+	if (poll(&pfd, 1, METRICS_READ_MS) == 1) {
+		n = recv(fd, request, sizeof(request), 0);
+	}
+	if (render(&out) != 0) {
+		free(out.data);
+		return;
+	}
+	if (n >= 3 && memcmp(request, "GET", 3) == 0) {
+		header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", out.len);
+		if (send(fd, header, header_len, MSG_NOSIGNAL) != header_len) {
+			free(out.data);
+			return;
+		}
+	}
+	sent = 0;
+	while (sent < out.len) {
+		n = send(fd, out.data + sent, out.len - sent, MSG_NOSIGNAL);
+		if (n <= 0) break;
+		sent += n;
+	}
+	free(out.data);
+	return;
+}
+
+int render(out_buf_t* out) {
+	worker_metrics_t* worker;
+	histogram_t duration = { { 0 } };
+	histogram_t netlink[METRICS_NL_CMDS] = { { { 0 } } };
+	histogram_t loop_lag = { { 0 } };
+	histogram_t callbacks[LOOP_CB_TYPES] = { { { 0 } } };
+	uint64_t started[METRICS_ROLES] = { 0 };
+	uint64_t completed[METRICS_VERSIONS][METRICS_CIPHERS] = { { 0 } };
+	uint64_t failed[METRICS_VERSIONS][METRICS_CIPHERS] = { { 0 } };
+	uint64_t resumed[METRICS_ROLES] = { 0 };
+	session_cache_stats_t sessions;
+	uint64_t bytes[METRICS_DIRS] = { 0 };
+	uint64_t buffered = 0;
+	uint64_t peak = 0;
+	uint64_t dropped = 0;
+	uint64_t reseeds = 0;
+	uint64_t reloads = 0;
+	uint64_t reload_failures = 0;
+	uint64_t verify_hits = 0;
+	uint64_t verify_misses = 0;
+	uint64_t verify_entries = 0;
+	pool_gauge_t pools[METRICS_POOLS];
+	int pool_count = 0;
+	int attached = 0;
+	char labels[128];
+	int count;
+	int i;
+	int j;
+	int k;
+
+	memset(pools, 0, sizeof(pools));
+	for (i = 0; i < region->worker_count; i++) {
+		worker = &region->workers[i];
+		for (j = 0; j < METRICS_ROLES; j++) {
+			started[j] += load(&worker->hs_started[j]);
+			resumed[j] += load(&worker->hs_resumed[j]);
+		}
+		for (j = 0; j < METRICS_VERSIONS; j++) {
+			for (k = 0; k < METRICS_CIPHERS; k++) {
+				completed[j][k] += load(&worker->hs_completed[j][k]);
+				failed[j][k] += load(&worker->hs_failed[j][k]);
+			}
+		}
+		for (j = 0; j < METRICS_DIRS; j++) {
+			bytes[j] += load(&worker->relay_bytes[j]);
+		}
+		sum_histogram(&duration, &worker->hs_duration);
+		for (j = 0; j < METRICS_NL_CMDS; j++) {
+			sum_histogram(&netlink[j], &worker->nl_service[j]);
+		}
+		sum_histogram(&loop_lag, &worker->loop_lag);
+		for (j = 0; j < LOOP_CB_TYPES; j++) {
+			sum_histogram(&callbacks[j], &worker->callbacks[j]);
+		}
+		dropped += load(&worker->log_dropped);
+		reseeds += load(&worker->entropy_reseeds);
+		reloads += load(&worker->reloads);
+		reload_failures += load(&worker->reload_failures);
+		verify_hits += load(&worker->verify_hits);
+		verify_misses += load(&worker->verify_misses);
+		if (__atomic_load_n(&worker->attached, __ATOMIC_ACQUIRE) == 0) {
+			continue;
+		}
+		attached++;
+		buffered += load(&worker->relay_buffered);
+		if (load(&worker->relay_peak) > peak) {
+			peak = load(&worker->relay_peak);
+		}
+		verify_entries += load(&worker->verify_entries);
+		count = __atomic_load_n(&worker->pool_count, __ATOMIC_ACQUIRE);
+		for (j = 0; j < count; j++) {
+			for (k = 0; k < pool_count; k++) {
+				if (strcmp(pools[k].name, worker->pools[j].name) == 0) break;
+			}
+			if (k == pool_count) {
+				if (pool_count == METRICS_POOLS) continue;
+				memcpy(pools[k].name, worker->pools[j].name, sizeof(pools[k].name));
+				pool_count++;
+			}
+			pools[k].in_use += load(&worker->pools[j].in_use);
+		}
+	}
+
+	out_printf(out, "# HELP ssa_workers Worker processes currently running.\n"
+		"# TYPE ssa_workers gauge\nssa_workers %d\n", attached);
+
+	out_printf(out, "# HELP ssa_handshakes_started_total TLS handshakes begun, by our role.\n"
+		"# TYPE ssa_handshakes_started_total counter\n");
+	for (i = 0; i < METRICS_ROLES; i++) {
+		out_printf(out, "ssa_handshakes_started_total{role=\"%s\"} %lu\n",
+			role_names[i], started[i]);
+	}
+	out_printf(out, "# HELP ssa_handshakes_completed_total TLS handshakes finished, by version and cipher.\n"
+		"# TYPE ssa_handshakes_completed_total counter\n");
+	for (i = 0; i < METRICS_VERSIONS; i++) {
+		for (j = 0; j < METRICS_CIPHERS; j++) {
+			if (completed[i][j] == 0) continue;
+			out_printf(out, "ssa_handshakes_completed_total{version=\"%s\",cipher=\"%s\"} %lu\n",
+				version_names[i], cipher_label(j), completed[i][j]);
+		}
+	}
+	out_printf(out, "# HELP ssa_handshakes_failed_total TLS handshakes abandoned, by the version offered or negotiated and the cipher chosen, none if it failed first.\n"
+		"# TYPE ssa_handshakes_failed_total counter\n");
+	for (i = 0; i < METRICS_VERSIONS; i++) {
+		for (j = 0; j < METRICS_CIPHERS; j++) {
+			if (failed[i][j] == 0) continue;
+			out_printf(out, "ssa_handshakes_failed_total{version=\"%s\",cipher=\"%s\"} %lu\n",
+				version_names[i], cipher_label(j), failed[i][j]);
+		}
+	}
+	out_printf(out, "# HELP ssa_handshakes_resumed_total Finished handshakes that resumed a session, by our role.\n"
+		"# TYPE ssa_handshakes_resumed_total counter\n");
+	for (i = 0; i < METRICS_ROLES; i++) {
+		out_printf(out, "ssa_handshakes_resumed_total{role=\"%s\"} %lu\n",
+			role_names[i], resumed[i]);
+	}
+	out_printf(out, "# HELP ssa_handshake_duration_seconds Time from socket setup to a finished handshake.\n"
+		"# TYPE ssa_handshake_duration_seconds histogram\n");
+	render_histogram(out, "ssa_handshake_duration_seconds", "", hs_bounds, &duration);
+
+	out_printf(out, "# HELP ssa_relay_bytes_total Plaintext bytes relayed, outbound is from the application.\n"
+		"# TYPE ssa_relay_bytes_total counter\n");
+	for (i = 0; i < METRICS_DIRS; i++) {
+		out_printf(out, "ssa_relay_bytes_total{direction=\"%s\"} %lu\n", dir_names[i], bytes[i]);
+	}
+	out_printf(out, "# HELP ssa_relay_buffered_bytes Bytes held in relay buffers.\n"
+		"# TYPE ssa_relay_buffered_bytes gauge\nssa_relay_buffered_bytes %lu\n", buffered);
+	out_printf(out, "# HELP ssa_relay_buffered_bytes_peak Most bytes a running worker has held in relay buffers at once.\n"
+		"# TYPE ssa_relay_buffered_bytes_peak gauge\nssa_relay_buffered_bytes_peak %lu\n", peak);
+
+	out_printf(out, "# HELP ssa_pool_objects_in_use Pooled objects allocated, sock_ctx is the number of live sockets.\n"
+		"# TYPE ssa_pool_objects_in_use gauge\n");
+	for (i = 0; i < pool_count; i++) {
+		out_printf(out, "ssa_pool_objects_in_use{pool=\"%s\"} %lu\n", pools[i].name, pools[i].in_use);
+	}
+
+	if (session_cache_get_stats(&sessions)) {
+		out_printf(out, "# HELP ssa_session_cache_lookups_total Resumption attempts looked up in the shared session cache.\n"
+			"# TYPE ssa_session_cache_lookups_total counter\nssa_session_cache_lookups_total %lu\n",
+			sessions.lookups);
+		out_printf(out, "# HELP ssa_session_cache_hits_total Lookups that found a live session.\n"
+			"# TYPE ssa_session_cache_hits_total counter\nssa_session_cache_hits_total %lu\n",
+			sessions.hits);
+		out_printf(out, "# HELP ssa_session_cache_hit_ratio Hits over lookups since the daemon started.\n"
+			"# TYPE ssa_session_cache_hit_ratio gauge\nssa_session_cache_hit_ratio %.4f\n",
+			sessions.lookups != 0 ? (double)sessions.hits / sessions.lookups : 0.0);
+		out_printf(out, "# HELP ssa_session_cache_stores_total Sessions written to the shared session cache.\n"
+			"# TYPE ssa_session_cache_stores_total counter\nssa_session_cache_stores_total %lu\n",
+			sessions.stores);
+		out_printf(out, "# HELP ssa_session_cache_evictions_total Live sessions replaced to make room.\n"
+			"# TYPE ssa_session_cache_evictions_total counter\nssa_session_cache_evictions_total %lu\n",
+			sessions.evictions);
+		out_printf(out, "# HELP ssa_session_cache_oversized_total Sessions too large to share.\n"
+			"# TYPE ssa_session_cache_oversized_total counter\nssa_session_cache_oversized_total %lu\n",
+			sessions.oversized);
+		out_printf(out, "# HELP ssa_session_cache_entries Sessions held in the shared session cache.\n"
+			"# TYPE ssa_session_cache_entries gauge\nssa_session_cache_entries %zu\n",
+			sessions.entries);
+	}
+
+	out_printf(out, "# HELP ssa_verify_cache_hits_total Peer chains accepted from the verification cache.\n"
+		"# TYPE ssa_verify_cache_hits_total counter\nssa_verify_cache_hits_total %lu\n", verify_hits);
+	out_printf(out, "# HELP ssa_verify_cache_misses_total Cacheable peer chains verified in full.\n"
+		"# TYPE ssa_verify_cache_misses_total counter\nssa_verify_cache_misses_total %lu\n", verify_misses);
+	out_printf(out, "# HELP ssa_verify_cache_entries Verification results held by running workers.\n"
+		"# TYPE ssa_verify_cache_entries gauge\nssa_verify_cache_entries %lu\n", verify_entries);
+
+	out_printf(out, "# HELP ssa_netlink_service_seconds Time spent handling each netlink command.\n"
+		"# TYPE ssa_netlink_service_seconds histogram\n");
+	for (i = 0; i < METRICS_NL_CMDS; i++) {
+		if (netlink[i].count == 0) continue;
+		snprintf(labels, sizeof(labels), "command=\"%s\"", netlink_cmd_name(i));
+		render_histogram(out, "ssa_netlink_service_seconds", labels, nl_bounds, &netlink[i]);
+	}
+
+	out_printf(out, "# HELP ssa_event_loop_lag_seconds How late a timer due every 100 ms fired.\n"
+		"# TYPE ssa_event_loop_lag_seconds histogram\n");
+	render_histogram(out, "ssa_event_loop_lag_seconds", "", loop_bounds, &loop_lag);
+	out_printf(out, "# HELP ssa_callback_seconds Wall time spent in event loop callbacks, by kind.\n"
+		"# TYPE ssa_callback_seconds histogram\n");
+	for (i = 0; i < LOOP_CB_TYPES; i++) {
+		if (callbacks[i].count == 0) continue;
+		snprintf(labels, sizeof(labels), "type=\"%s\"", loop_monitor_cb_name(i));
+		render_histogram(out, "ssa_callback_seconds", labels, loop_bounds, &callbacks[i]);
+	}
+
+	out_printf(out, "# HELP ssa_config_reloads_total Configurations swapped in.\n"
+		"# TYPE ssa_config_reloads_total counter\nssa_config_reloads_total %lu\n", reloads);
+	out_printf(out, "# HELP ssa_config_reload_failures_total Configuration files rejected.\n"
+		"# TYPE ssa_config_reload_failures_total counter\nssa_config_reload_failures_total %lu\n",
+		reload_failures);
+	out_printf(out, "# HELP ssa_log_dropped_total Log records lost to full queues.\n"
+		"# TYPE ssa_log_dropped_total counter\nssa_log_dropped_total %lu\n", dropped);
+	out_printf(out, "# HELP ssa_entropy_reseeds_total Times a RandomSeed was read back into the RNG after startup.\n"
+		"# TYPE ssa_entropy_reseeds_total counter\nssa_entropy_reseeds_total %lu\n", reseeds);
+
+	return out->data == NULL;
+}
+
+/* Buckets are read one at a time, so a scrape racing an update can be
+ * off by an observation. The count comes from the buckets to keep the
+ * histogram consistent with itself */
+void render_histogram(out_buf_t* out, const char* name, const char* labels,
+		const uint64_t* bounds, histogram_t* hist) {
+	const char* sep = labels[0] != '\0' ? "," : "";
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		total += hist->buckets[i];
+		if (i < METRICS_BUCKETS - 1) {
+			out_printf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep,
+				bounds[i] / 1e6, total);
+		}
+		else {
+			out_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, total);
+		}
+	}
+	if (labels[0] != '\0') {
+		out_printf(out, "%s_sum{%s} %g\n%s_count{%s} %lu\n", name, labels,
+			hist->sum_us / 1e6, name, labels, total);
+	}
+	else {
+		out_printf(out, "%s_sum %g\n%s_count %lu\n", name, hist->sum_us / 1e6, name, total);
+	}
+	return;
+}
+
+void sum_histogram(histogram_t* total, histogram_t* hist) {
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		total->buckets[i] += load(&hist->buckets[i]);
+	}
+	total->sum_us += load(&hist->sum_us);
+	total->count += load(&hist->count);
+	return;
+}
+
+int out_printf(out_buf_t* out, const char* fmt, ...) {
+	va_list args;
+	char* data;
+	size_t size;
+	int len;
+
+	if (out->size == 0 && out->data == NULL) {
+		out->size = 4096;
+		out->data = malloc(out->size);
+		if (out->data == NULL) return 1;
+	}
+	if (out->data == NULL) return 1;
+	while (1) {
+		va_start(args, fmt);
+		len = vsnprintf(out->data + out->len, out->size - out->len, fmt, args);
+		va_end(args);
+		if (len < 0) return 1;
+		if (out->len + len < out->size) break;
+		size = out->size * 2;
+		while (size <= out->len + len) size *= 2;
+		data = realloc(out->data, size);
+		if (data == NULL) {
+			free(out->data);
+			out->data = NULL;
+			return 1;
+		}
+		out->data = data;
+		out->size = size;
+	}
+	out->len += len;
+	return 0;
+}
+
+uint64_t load(uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
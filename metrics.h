@@ -0,0 +1,57 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <event2/event.h>
+
+enum metrics_role { METRICS_CLIENT, METRICS_SERVER, METRICS_ROLES };
+enum metrics_dir { METRICS_OUTBOUND, METRICS_INBOUND, METRICS_DIRS }; /* app to peer, peer to app */
+
+/* Counters live in one shared mapping made by the parent before it forks,
+ * with a cache line aligned block per worker. Threads of a worker update
+ * its block with relaxed atomics, and the parent adds the blocks up when
+ * it answers a scrape in Prometheus text format on MetricsSocket */
+int metrics_init(int worker_count);
+int metrics_attach(struct event_base* ev_base, int worker_id);
+void metrics_detach(void);
+int metrics_serve(const char* socket_name);
+void metrics_free(void);
+
+uint64_t metrics_now(void);
+void metrics_handshake_started(enum metrics_role role);
+void metrics_handshake_completed(int version, const char* cipher, uint64_t started);
+void metrics_handshake_resumed(enum metrics_role role);
+void metrics_handshake_failed(int version, const char* cipher);
+void metrics_relay_bytes(enum metrics_dir dir, size_t bytes);
+void metrics_netlink(int cmd, uint64_t started);
+void metrics_loop_lag(uint64_t lag);
+void metrics_callback(int type, uint64_t elapsed);
+
+#endif
@@ -25,12 +25,21 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
 #include <event2/util.h>
 
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include "netlink.h"
 #include "daemon.h"
+#include "shard.h"
+#include "dataplane.h"
+#include "port_owner.h"
+#include "metrics.h"
+#include "loop_monitor.h"
 #include "log.h"
 
 
@@ -92,6 +101,14 @@ static struct nla_policy ssa_nl_policy[SSA_NL_A_MAX + 1] = {
 };
 
 int handle_netlink_msg(struct nl_msg* msg, void* arg);
+static int route_netlink_msg(tls_daemon_ctx_t* ctx, struct nl_msg* msg);
+static void run_netlink_msg(tls_daemon_ctx_t* ctx, void* arg);
+static int check_shard(tls_daemon_ctx_t* ctx, struct nl_msg* msg, int cmd, unsigned long id,
+		struct nlattr** attrs);
+static int find_owner(tls_daemon_ctx_t* ctx, struct nl_msg* msg, int cmd, unsigned long id,
+		struct nlattr** attrs);
+static int send_netlink_msg(tls_daemon_ctx_t* ctx, struct nl_msg* msg);
+static int nla_get_sockaddr(struct nlattr* attr, struct sockaddr_storage* addr);
 
 struct nl_sock* netlink_connect(tls_daemon_ctx_t* ctx) {
 	int group;
@@ -122,7 +139,9 @@ struct nl_sock* netlink_connect(tls_daemon_ctx_t* ctx) {
 		return NULL;
 	}
 
-	if (nl_socket_add_membership(netlink_sock, group) < 0) {
+	/* A multicast reaches every member, so only worker 0 takes them and
+	 * passes each on to the worker the socket shards to */
+	if (ctx->worker_id == 0 && nl_socket_add_membership(netlink_sock, group) < 0) {
 		log_printf(LOG_ERROR, "Failed to add membership to group\n");
 		return NULL;
 	}
@@ -148,9 +167,9 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 	int addr_internal_len;
 	int addr_external_len;
 	int addr_remote_len;
-	struct sockaddr_in addr_internal;
-	struct sockaddr_in addr_external;
-	struct sockaddr_in addr_remote;
+	struct sockaddr_storage addr_internal;
+	struct sockaddr_storage addr_external;
+	struct sockaddr_storage addr_remote;
 
 	int level;
 	int blocking;
@@ -158,11 +177,22 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 	char* optval;
 	int commlen;
 	socklen_t optlen;
+	uint64_t started;
+
+	if (ctx->dataplane != NULL && ctx->thread_id == DP_CONTROL_THREAD) {
+		return route_netlink_msg(ctx, msg);
+	}
+	started = metrics_now();
+	id = 0;
 
         // Get Message
         nlh = nlmsg_hdr(msg);
         gnlh = (struct genlmsghdr*)nlmsg_data(nlh);
         genlmsg_parse(nlh, 0, attrs, SSA_NL_A_MAX, ssa_nl_policy);
+	if (ctx->dataplane == NULL && attrs[SSA_NL_A_ID] != NULL &&
+			check_shard(ctx, msg, gnlh->cmd, nla_get_u64(attrs[SSA_NL_A_ID]), attrs) != 0) {
+		return 0;
+	}
         switch (gnlh->cmd) {
 		case SSA_NL_C_SOCKET_NOTIFY:
 			id = nla_get_u64(attrs[SSA_NL_A_ID]);
@@ -195,10 +225,8 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 			break;
 		case SSA_NL_C_BIND_NOTIFY:
 			id = nla_get_u64(attrs[SSA_NL_A_ID]);
-			addr_internal_len = nla_len(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_external_len = nla_len(attrs[SSA_NL_A_SOCKADDR_EXTERNAL]);
-			addr_internal = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_external = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_EXTERNAL]);
+			addr_internal_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
+			addr_external_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_EXTERNAL], &addr_external);
 			log_printf(LOG_INFO, "Received bind notification for socket ID %lu\n", id);
 			//log_printf_addr((struct sockaddr*)&addr_internal);
 			//log_printf_addr((struct sockaddr*)&addr_external);
@@ -207,10 +235,8 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 			break;
 		case SSA_NL_C_CONNECT_NOTIFY:
 			id = nla_get_u64(attrs[SSA_NL_A_ID]);
-			addr_internal_len = nla_len(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_remote_len = nla_len(attrs[SSA_NL_A_SOCKADDR_REMOTE]);
-			addr_internal = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_remote = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_REMOTE]);
+			addr_internal_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
+			addr_remote_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_REMOTE], &addr_remote);
 			blocking = nla_get_u32(attrs[SSA_NL_A_BLOCKING]);
 			log_printf(LOG_INFO, "Received connect notification for socket ID %lu\n", id);
 			//log_printf_addr((struct sockaddr*)&addr_internal);
@@ -220,10 +246,8 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 			break;
 		case SSA_NL_C_LISTEN_NOTIFY:
 			id = nla_get_u64(attrs[SSA_NL_A_ID]);
-			addr_internal_len = nla_len(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_external_len = nla_len(attrs[SSA_NL_A_SOCKADDR_EXTERNAL]);
-			addr_internal = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_external = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_EXTERNAL]);
+			addr_internal_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
+			addr_external_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_EXTERNAL], &addr_external);
 			log_printf(LOG_INFO, "Received listen notification for socket ID %lu\n", id);
 			//log_printf_addr((struct sockaddr*)&addr_internal);
 			//log_printf_addr((struct sockaddr*)&addr_external);
@@ -232,8 +256,7 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 			break;
 		case SSA_NL_C_ACCEPT_NOTIFY:
 			id = nla_get_u64(attrs[SSA_NL_A_ID]);
-			addr_internal_len = nla_len(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
-			addr_internal = *(struct sockaddr_in*)nla_data(attrs[SSA_NL_A_SOCKADDR_INTERNAL]);
+			addr_internal_len = nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
 			log_printf(LOG_INFO, "Received accept notification for socket ID %lu\n", id);
 			associate_cb(ctx, id, (struct sockaddr*)&addr_internal, addr_internal_len);
 			break;
@@ -246,9 +269,190 @@ int handle_netlink_msg(struct nl_msg* msg, void* arg) {
 			log_printf(LOG_ERROR, "unrecognized command\n");
 			break;
 	}
+	metrics_netlink(gnlh->cmd, started);
+	loop_monitor_end(LOOP_CB_NETLINK, id, started);
+	return 0;
+}
+
+const char* netlink_cmd_name(int cmd) {
+	switch (cmd) {
+		case SSA_NL_C_SOCKET_NOTIFY: return "socket";
+		case SSA_NL_C_SETSOCKOPT_NOTIFY: return "setsockopt";
+		case SSA_NL_C_GETSOCKOPT_NOTIFY: return "getsockopt";
+		case SSA_NL_C_BIND_NOTIFY: return "bind";
+		case SSA_NL_C_CONNECT_NOTIFY: return "connect";
+		case SSA_NL_C_LISTEN_NOTIFY: return "listen";
+		case SSA_NL_C_ACCEPT_NOTIFY: return "accept";
+		case SSA_NL_C_CLOSE_NOTIFY: return "close";
+		default: return "unknown";
+	}
+}
+
+/* Runs on the control thread. Messages go to the thread that owns the
+ * socket, or for a new socket to the thread its ID shards to. Messages
+ * about unknown sockets go there too, to be answered with an error */
+int route_netlink_msg(tls_daemon_ctx_t* ctx, struct nl_msg* msg) {
+	struct nlmsghdr* nlh;
+	struct genlmsghdr* gnlh;
+	struct nlattr* attrs[SSA_NL_A_MAX + 1];
+	struct sockaddr_storage addr_internal;
+	unsigned long id;
+	int thread_id;
+	int port;
+
+	nlh = nlmsg_hdr(msg);
+	gnlh = (struct genlmsghdr*)nlmsg_data(nlh);
+	genlmsg_parse(nlh, 0, attrs, SSA_NL_A_MAX, ssa_nl_policy);
+	if (attrs[SSA_NL_A_ID] == NULL) {
+		log_printf(LOG_ERROR, "unrecognized command\n");
+		return 0;
+	}
+	id = nla_get_u64(attrs[SSA_NL_A_ID]);
+	if (check_shard(ctx, msg, gnlh->cmd, id, attrs) != 0) {
+		return 0;
+	}
+
+	switch (gnlh->cmd) {
+		case SSA_NL_C_SOCKET_NOTIFY:
+			thread_id = dataplane_thread_for_id(ctx->dataplane, id);
+			break;
+		case SSA_NL_C_ACCEPT_NOTIFY:
+			/* The accepted connection is still only known by the
+			 * port of its plaintext leg */
+			nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
+			port = sockaddr_port_key((struct sockaddr*)&addr_internal);
+			thread_id = sock_owner_port(ctx, port);
+			break;
+		default:
+			thread_id = sock_owner(ctx, id);
+			break;
+	}
+	if (thread_id < 0) {
+		thread_id = dataplane_thread_for_id(ctx->dataplane, id);
+	}
+
+	nlmsg_get(msg);
+	if (dataplane_dispatch(ctx->dataplane, thread_id, run_netlink_msg, msg) != 0) {
+		nlmsg_free(msg);
+	}
 	return 0;
 }
 
+void run_netlink_msg(tls_daemon_ctx_t* ctx, void* arg) {
+	struct nl_msg* msg = (struct nl_msg*)arg;
+	handle_netlink_msg(msg, ctx);
+	nlmsg_free(msg);
+	return;
+}
+
+/* Messages about a socket whose ID shards to another worker are passed
+ * on to that worker's netlink port, so each socket's state lives in one
+ * place whichever worker the kernel sent to. The one exception is an
+ * accepted socket, which stays with the worker holding its listener's
+ * plaintext leg. The worker its ID shards to remembers which that is
+ * and passes its messages on again. Returns 1 when msg was passed on or
+ * refused and must not be handled here */
+int check_shard(tls_daemon_ctx_t* ctx, struct nl_msg* msg, int cmd, unsigned long id,
+		struct nlattr** attrs) {
+	struct sockaddr_nl owner_addr;
+	int owner;
+
+	owner = find_owner(ctx, msg, cmd, id, attrs);
+	if (owner == ctx->worker_id) {
+		return 0;
+	}
+	if (owner == shard_for_id(id, ctx->worker_count)) {
+		ctx->misrouted++;
+	}
+	memset(&owner_addr, 0, sizeof(owner_addr));
+	owner_addr.nl_family = AF_NETLINK;
+	owner_addr.nl_pid = ctx->port - ctx->worker_id + owner;
+	nlmsg_set_dst(msg, &owner_addr);
+	/* Tells the receiver which worker passed it on */
+	nlmsg_hdr(msg)->nlmsg_pid = ctx->port;
+	if (send_netlink_msg(ctx, msg) < 0) {
+		log_printf(LOG_ERROR, "Unable to pass socket ID %lu on to worker %d\n", id, owner);
+		netlink_notify_kernel(ctx, id, -EHOSTUNREACH);
+		return 1;
+	}
+	log_printf(LOG_DEBUG, "Passed socket ID %lu on to worker %d\n", id, owner);
+	return 1;
+}
+
+/* Picks the worker that serves msg, updating ctx->accepted on the way */
+int find_owner(tls_daemon_ctx_t* ctx, struct nl_msg* msg, int cmd, unsigned long id,
+		struct nlattr** attrs) {
+	struct sockaddr_storage addr_internal;
+	int shard;
+	int owner;
+	int port;
+
+	shard = shard_for_id(id, ctx->worker_count);
+	if (shard != ctx->worker_id) {
+		/* The worker the socket shards to already chose this one */
+		if (nlmsg_hdr(msg)->nlmsg_pid == (uint32_t)(ctx->port - ctx->worker_id + shard)) {
+			return ctx->worker_id;
+		}
+		return shard;
+	}
+	owner = (int)(long)hashmap_get(ctx->accepted, id) - 1;
+	switch (cmd) {
+		case SSA_NL_C_SOCKET_NOTIFY:
+			/* The kernel reuses IDs once a socket is closed */
+			if (owner >= 0) {
+				hashmap_del(ctx->accepted, id);
+			}
+			return shard;
+		case SSA_NL_C_ACCEPT_NOTIFY:
+			if (owner >= 0) {
+				hashmap_del(ctx->accepted, id);
+			}
+			if (attrs[SSA_NL_A_SOCKADDR_INTERNAL] == NULL) {
+				return shard;
+			}
+			nla_get_sockaddr(attrs[SSA_NL_A_SOCKADDR_INTERNAL], &addr_internal);
+			port = sockaddr_port_key((struct sockaddr*)&addr_internal);
+			owner = port_owner_get(port);
+			if (owner < 0 || owner == shard) {
+				return shard;
+			}
+			hashmap_add(ctx->accepted, id, (void*)(long)(owner + 1));
+			return owner;
+		case SSA_NL_C_CLOSE_NOTIFY:
+			if (owner >= 0) {
+				hashmap_del(ctx->accepted, id);
+			}
+			break;
+		default:
+			break;
+	}
+	return owner >= 0 ? owner : shard;
+}
+
+/* Addresses may be AF_INET, AF_INET6 or AF_UNIX, so copy no more than
+ * the kernel sent and no more than fits */
+int nla_get_sockaddr(struct nlattr* attr, struct sockaddr_storage* addr) {
+	int len = nla_len(attr);
+	if (len > (int)sizeof(struct sockaddr_storage)) {
+		len = sizeof(struct sockaddr_storage);
+	}
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	memcpy(addr, nla_data(attr), len);
+	return len;
+}
+
+int send_netlink_msg(tls_daemon_ctx_t* ctx, struct nl_msg* msg) {
+	int ret;
+
+	if (ctx->netlink_lock == NULL) {
+		return nl_send_auto(ctx->netlink_sock, msg);
+	}
+	pthread_mutex_lock(ctx->netlink_lock);
+	ret = nl_send_auto(ctx->netlink_sock, msg);
+	pthread_mutex_unlock(ctx->netlink_lock);
+	return ret;
+}
+
 int netlink_disconnect(struct nl_sock* sock) {
         nl_socket_free(sock);
         return 0;
@@ -280,7 +484,7 @@ void netlink_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, int response
 		log_printf(LOG_ERROR, "Failed to insert response in netlink msg\n");
 		return;
 	}
-	ret = nl_send_auto(ctx->netlink_sock, msg);
+	ret = send_netlink_msg(ctx, msg);
 	if (ret < 0) {
 		log_printf(LOG_ERROR, "Failed to send netlink msg\n");
 		return;
@@ -316,7 +520,7 @@ void netlink_send_and_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, cha
 		log_printf(LOG_ERROR, "Failed to insert data response in netlink msg\n");
 		return;
 	}
-	ret = nl_send_auto(ctx->netlink_sock, msg);
+	ret = send_netlink_msg(ctx, msg);
 	if (ret < 0) {
 		log_printf(LOG_ERROR, "Failed to send netlink msg\n");
 		return;
@@ -352,7 +556,7 @@ void netlink_handshake_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, in
 		log_printf(LOG_ERROR, "Failed to insert response in netlink msg\n");
 		return;
 	}
-	ret = nl_send_auto(ctx->netlink_sock, msg);
+	ret = send_netlink_msg(ctx, msg);
 	if (ret < 0) {
 		log_printf(LOG_ERROR, "Failed to send netlink msg\n");
 		return;
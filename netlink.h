@@ -40,5 +40,6 @@ void netlink_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, int response
 void netlink_send_and_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, char* data, unsigned int len);
 void netlink_handshake_notify_kernel(tls_daemon_ctx_t* ctx, unsigned long id, int response); 
 struct nl_sock* netlink_connect(tls_daemon_ctx_t* ctx);
+const char* netlink_cmd_name(int cmd);
 
 #endif
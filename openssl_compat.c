@@ -89,6 +89,7 @@
 #include <openssl/x509v3.h>
 #include <openssl/ssl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "openssl_compat.h"
 
@@ -501,3 +502,77 @@ static int use_certificate_chain_file(SSL_CTX *ctx, SSL *ssl, const char *file)
 int compat_SSL_use_certificate_chain_file(SSL *ssl, const char *file) {
 	return use_certificate_chain_file(NULL, ssl, file);
 }
+
+int compat_SSL_CTX_up_ref(SSL_CTX *ctx) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+	return 1;
+#else
+	return SSL_CTX_up_ref(ctx);
+#endif
+}
+
+int compat_X509_STORE_up_ref(X509_STORE *store) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+	return 1;
+#else
+	return X509_STORE_up_ref(store);
+#endif
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t* compat_locks = NULL;
+
+static void compat_locking_cb(int mode, int n, const char *file, int line) {
+	if (mode & CRYPTO_LOCK) {
+		pthread_mutex_lock(&compat_locks[n]);
+	}
+	else {
+		pthread_mutex_unlock(&compat_locks[n]);
+	}
+}
+
+static unsigned long compat_thread_id_cb(void) {
+	return (unsigned long)pthread_self();
+}
+#endif
+
+/* OpenSSL before 1.1.0 needs locking callbacks before it is used from
+ * more than one thread. Later versions lock internally */
+int compat_thread_setup(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int i;
+
+	if (compat_locks != NULL) {
+		return 1;
+	}
+	compat_locks = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+	if (compat_locks == NULL) {
+		return 0;
+	}
+	for (i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_init(&compat_locks[i], NULL);
+	}
+	CRYPTO_set_id_callback(compat_thread_id_cb);
+	CRYPTO_set_locking_callback(compat_locking_cb);
+#endif
+	return 1;
+}
+
+void compat_thread_cleanup(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int i;
+
+	if (compat_locks == NULL) {
+		return;
+	}
+	CRYPTO_set_id_callback(NULL);
+	CRYPTO_set_locking_callback(NULL);
+	for (i = 0; i < CRYPTO_num_locks(); i++) {
+		pthread_mutex_destroy(&compat_locks[i]);
+	}
+	OPENSSL_free(compat_locks);
+	compat_locks = NULL;
+#endif
+}
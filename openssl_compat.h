@@ -61,3 +61,7 @@ typedef enum {
 */
 HostnameValidationResult validate_hostname(const char *hostname, const X509 *server_cert);
 int compat_SSL_use_certificate_chain_file(SSL *ssl, const char *file);
+int compat_SSL_CTX_up_ref(SSL_CTX *ctx);
+int compat_X509_STORE_up_ref(X509_STORE *store);
+int compat_thread_setup(void);
+void compat_thread_cleanup(void);
@@ -0,0 +1,238 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "log.h"
+
+#define POOL_SLAB_SIZE		(64*1024)
+#define POOL_HUGE_SLAB_SIZE	(2*1024*1024)
+
+typedef struct pool_slab {
+	struct pool_slab* next;
+	size_t size;
+} pool_slab_t;
+
+typedef struct pool_obj {
+	struct pool_obj* next;
+} pool_obj_t;
+
+struct pool {
+	const char* name;
+	size_t obj_size;
+	int flags;
+	pthread_mutex_t lock;
+	pool_obj_t* free_list;
+	pool_slab_t* slabs;
+	size_t slab_count;
+	size_t free_count;
+	size_t in_use;
+	size_t peak;
+	int hugepages;
+	struct pool* next; /* in the registry */
+};
+
+static int default_flags;
+static pool_t* pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_grow(pool_t* pool);
+static void log_stats(pool_stats_t* stats, void* arg);
+
+void pool_set_default_flags(int flags) {
+	default_flags = flags;
+	return;
+}
+
+pool_t* pool_create(const char* name, size_t obj_size) {
+	pool_t* pool;
+
+	pool = (pool_t*)calloc(1, sizeof(pool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+	/* Room for the free list link and natural alignment */
+	if (obj_size < sizeof(pool_obj_t)) {
+		obj_size = sizeof(pool_obj_t);
+	}
+	pool->obj_size = (obj_size + 15) & ~(size_t)15;
+	pool->name = name;
+	pool->flags = default_flags;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	pool->next = pools;
+	pools = pool;
+	pthread_mutex_unlock(&pools_lock);
+	return pool;
+}
+
+/* Maps one more slab and threads its objects onto the free list.
+ * Called with the pool locked */
+int pool_grow(pool_t* pool) {
+	pool_slab_t* slab = MAP_FAILED;
+	size_t size = POOL_SLAB_SIZE;
+	size_t offset;
+	char* base;
+
+	if (pool->flags & POOL_HUGEPAGES) {
+		size = POOL_HUGE_SLAB_SIZE;
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab != MAP_FAILED) {
+			pool->hugepages = 1;
+		}
+	}
+	if (slab == MAP_FAILED) {
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			log_printf(LOG_ERROR, "Unable to grow %s pool: %s\n", pool->name, strerror(errno));
+			return 1;
+		}
+#ifdef MADV_HUGEPAGE
+		/* Let transparent huge pages back it when reserved ones are absent */
+		if (pool->flags & POOL_HUGEPAGES) {
+			madvise(slab, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	slab->size = size;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+
+	base = (char*)slab;
+	offset = (sizeof(pool_slab_t) + 15) & ~(size_t)15;
+	for (; offset + pool->obj_size <= size; offset += pool->obj_size) {
+		pool_obj_t* obj = (pool_obj_t*)(base + offset);
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+		pool->free_count++;
+	}
+	return 0;
+}
+
+/* Returns a zeroed object, like calloc */
+void* pool_alloc(pool_t* pool) {
+	pool_obj_t* obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_list == NULL && pool_grow(pool) != 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->free_count--;
+	pool->in_use++;
+	if (pool->in_use > pool->peak) {
+		pool->peak = pool->in_use;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	memset(obj, 0, pool->obj_size);
+	return obj;
+}
+
+void pool_free(pool_t* pool, void* ptr) {
+	pool_obj_t* obj = ptr;
+
+	if (obj == NULL) return;
+	pthread_mutex_lock(&pool->lock);
+	obj->next = pool->free_list;
+	pool->free_list = obj;
+	pool->free_count++;
+	pool->in_use--;
+	pthread_mutex_unlock(&pool->lock);
+	return;
+}
+
+void pool_destroy(pool_t* pool) {
+	pool_slab_t* slab;
+	pool_slab_t* next;
+	pool_t** cur;
+
+	if (pool == NULL) return;
+	pthread_mutex_lock(&pools_lock);
+	for (cur = &pools; *cur != NULL; cur = &(*cur)->next) {
+		if (*cur == pool) {
+			*cur = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	for (slab = pool->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		munmap(slab, slab->size);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return;
+}
+
+void pool_get_stats(pool_t* pool, pool_stats_t* stats) {
+	pthread_mutex_lock(&pool->lock);
+	stats->name = pool->name;
+	stats->obj_size = pool->obj_size;
+	stats->in_use = pool->in_use;
+	stats->peak = pool->peak;
+	stats->free = pool->free_count;
+	stats->slabs = pool->slab_count;
+	stats->hugepages = pool->hugepages;
+	pthread_mutex_unlock(&pool->lock);
+	return;
+}
+
+void pool_foreach(void (*func)(pool_stats_t* stats, void* arg), void* arg) {
+	pool_stats_t stats;
+	pool_t* pool;
+
+	pthread_mutex_lock(&pools_lock);
+	for (pool = pools; pool != NULL; pool = pool->next) {
+		pool_get_stats(pool, &stats);
+		func(&stats, arg);
+	}
+	pthread_mutex_unlock(&pools_lock);
+	return;
+}
+
+void log_stats(pool_stats_t* stats, void* arg) {
+	log_printf(LOG_INFO, "Pool %s: %zu in use, %zu peak, %zu free in %zu %sslabs\n",
+		stats->name, stats->in_use, stats->peak, stats->free, stats->slabs,
+		stats->hugepages ? "huge " : "");
+	return;
+}
+
+void pool_log_stats(void) {
+	pool_foreach(log_stats, NULL);
+	return;
+}
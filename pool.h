@@ -0,0 +1,61 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_HUGEPAGES	0x01 /* back slabs with huge pages when the system has them */
+
+typedef struct pool pool_t;
+
+typedef struct pool_stats {
+	const char* name;
+	size_t obj_size;
+	size_t in_use;
+	size_t peak;
+	size_t free;
+	size_t slabs;
+	int hugepages; /* slabs were mapped with MAP_HUGETLB */
+} pool_stats_t;
+
+/* Fixed size object pools for the per-socket structures. Objects come
+ * from slabs mapped a few at a time and go back on a free list, so heavy
+ * connection churn reuses the same memory instead of going through
+ * malloc. Slabs are only unmapped by pool_destroy. Pools are shared by
+ * the data plane threads of a worker and guard their free list with a
+ * mutex held for a few instructions */
+void pool_set_default_flags(int flags);
+pool_t* pool_create(const char* name, size_t obj_size);
+void* pool_alloc(pool_t* pool);
+void pool_free(pool_t* pool, void* obj);
+void pool_destroy(pool_t* pool);
+void pool_get_stats(pool_t* pool, pool_stats_t* stats);
+void pool_foreach(void (*func)(pool_stats_t* stats, void* arg), void* arg);
+void pool_log_stats(void);
+
+#endif
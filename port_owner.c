@@ -0,0 +1,80 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "port_owner.h"
+#include "port_table.h"
+#include "log.h"
+
+#define PORT_OWNER_KEYS		(1 << PORT_TABLE_BITS)
+#define PORT_OWNER_MAX_WORKERS	255 /* entries hold worker_id + 1 */
+
+/* Pages are only touched for the port ranges in use */
+static unsigned char* owners;
+
+int port_owner_init(int worker_count) {
+	if (worker_count > PORT_OWNER_MAX_WORKERS) {
+		log_printf(LOG_ERROR, "Port owners only track %d workers\n", PORT_OWNER_MAX_WORKERS);
+		return 1;
+	}
+	owners = mmap(NULL, PORT_OWNER_KEYS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (owners == MAP_FAILED) {
+		log_printf(LOG_ERROR, "Failed to map port owners: %s\n", strerror(errno));
+		owners = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+void port_owner_set(int key, int worker_id) {
+	if (owners == NULL || key < 0 || key >= PORT_OWNER_KEYS) {
+		return;
+	}
+	__atomic_store_n(&owners[key], (unsigned char)(worker_id + 1), __ATOMIC_RELEASE);
+	return;
+}
+
+/* Leaves the entry alone if another worker has since taken the key */
+void port_owner_clear(int key, int worker_id) {
+	unsigned char expected = (unsigned char)(worker_id + 1);
+
+	if (owners == NULL || key < 0 || key >= PORT_OWNER_KEYS) {
+		return;
+	}
+	__atomic_compare_exchange_n(&owners[key], &expected, 0,
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	return;
+}
+
+int port_owner_get(int key) {
+	if (owners == NULL || key < 0 || key >= PORT_OWNER_KEYS) {
+		return -1;
+	}
+	return (int)__atomic_load_n(&owners[key], __ATOMIC_ACQUIRE) - 1;
+}
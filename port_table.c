@@ -0,0 +1,157 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "port_table.h"
+#include "log.h"
+
+#define LEAF_SIZE	(1 << PORT_TABLE_LEAF_BITS)
+#define LEAF_COUNT	(1 << (PORT_TABLE_BITS - PORT_TABLE_LEAF_BITS))
+
+typedef struct port_entry {
+	void* value;
+	unsigned long id; /* socket that placed the entry */
+	time_t added;
+} port_entry_t;
+
+struct port_table {
+	port_entry_t* leaves[LEAF_COUNT];
+	unsigned long stale; /* entries overwritten or held past the TTL */
+};
+
+static time_t now(void);
+static port_entry_t* find_entry(port_table_t* table, int key);
+
+time_t now(void) {
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec;
+}
+
+port_entry_t* find_entry(port_table_t* table, int key) {
+	port_entry_t* leaf;
+
+	if (key < 0 || key >= (1 << PORT_TABLE_BITS)) {
+		return NULL;
+	}
+	leaf = table->leaves[key >> PORT_TABLE_LEAF_BITS];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return &leaf[key & (LEAF_SIZE - 1)];
+}
+
+port_table_t* port_table_create(void) {
+	return (port_table_t*)calloc(1, sizeof(port_table_t));
+}
+
+void port_table_free(port_table_t* table) {
+	int i;
+
+	if (table == NULL) return;
+	for (i = 0; i < LEAF_COUNT; i++) {
+		free(table->leaves[i]);
+	}
+	free(table);
+	return;
+}
+
+/* Returns 1 if an older entry had to be replaced, which means a socket
+ * on this port never collected its plaintext leg */
+int port_table_add(port_table_t* table, int key, void* value, unsigned long id) {
+	port_entry_t** leaf;
+	port_entry_t* entry;
+	int replaced = 0;
+
+	if (key < 0 || key >= (1 << PORT_TABLE_BITS)) {
+		log_printf(LOG_ERROR, "Port key %d out of range\n", key);
+		return 1;
+	}
+	leaf = &table->leaves[key >> PORT_TABLE_LEAF_BITS];
+	if (*leaf == NULL) {
+		*leaf = (port_entry_t*)calloc(LEAF_SIZE, sizeof(port_entry_t));
+		if (*leaf == NULL) {
+			return 1;
+		}
+	}
+	entry = &(*leaf)[key & (LEAF_SIZE - 1)];
+	if (entry->value != NULL) {
+		log_printf(LOG_WARNING, "Port %d still held by socket %lu for %lds, giving it to %lu\n",
+			key, entry->id, (long)(now() - entry->added), id);
+		table->stale++;
+		replaced = 1;
+	}
+	entry->value = value;
+	entry->id = id;
+	entry->added = now();
+	return replaced;
+}
+
+/* An old entry is still returned. Its connect or handshake may just be
+ * slow, and a socket that really went away has its entry cleared by
+ * close or replaced by add */
+void* port_table_get(port_table_t* table, int key) {
+	port_entry_t* entry;
+
+	entry = find_entry(table, key);
+	if (entry == NULL || entry->value == NULL) {
+		return NULL;
+	}
+	if (now() - entry->added > PORT_ENTRY_TTL) {
+		log_printf(LOG_WARNING, "Port %d entry from socket %lu is %lds old\n",
+			key, entry->id, (long)(now() - entry->added));
+	}
+	return entry->value;
+}
+
+/* Clears the entry for key. With a value, only if the entry still holds
+ * it, so a closing socket cannot remove its successor's entry */
+int port_table_del(port_table_t* table, int key, void* value) {
+	port_entry_t* entry;
+
+	entry = find_entry(table, key);
+	if (entry == NULL || entry->value == NULL) {
+		return 1;
+	}
+	if (value != NULL && entry->value != value) {
+		return 1;
+	}
+	if (now() - entry->added > PORT_ENTRY_TTL) {
+		table->stale++;
+	}
+	entry->value = NULL;
+	return 0;
+}
+
+unsigned long port_table_stale_count(port_table_t* table) {
+	return table->stale;
+}
@@ -0,0 +1,53 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PORT_TABLE_H
+#define PORT_TABLE_H
+
+/* Keys are TCP ports or AF_UNIX autobind names with bit twenty set,
+ * see sockaddr_port_key() */
+#define PORT_TABLE_BITS		21
+#define PORT_TABLE_LEAF_BITS	10
+#define PORT_ENTRY_TTL		60 /* seconds before a waiting entry is reported */
+
+typedef struct port_table port_table_t;
+
+/* Direct-indexed map from port key to the sock_ctx waiting for its
+ * plaintext leg. A two level table: the second level is allocated in
+ * blocks of 1024 keys the first time one of them is used, so there is
+ * no allocation per entry. Each entry remembers the socket ID that
+ * placed it and when, so an entry that outlived PORT_ENTRY_TTL or is
+ * overwritten by a new connection on the same port is reported. Age
+ * alone never hides an entry, a connect can retry for minutes. get
+ * never modifies the table */
+port_table_t* port_table_create(void);
+void port_table_free(port_table_t* table);
+int port_table_add(port_table_t* table, int key, void* value, unsigned long id);
+void* port_table_get(port_table_t* table, int key);
+int port_table_del(port_table_t* table, int key, void* value);
+unsigned long port_table_stale_count(port_table_t* table);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "relay_budget.h"
+
+/* Shared by the data plane threads of a worker */
+static size_t budget;
+static size_t current;
+static size_t peak;
+
+void relay_budget_init(size_t bytes) {
+	budget = bytes;
+	__atomic_store_n(&current, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&peak, 0, __ATOMIC_RELAXED);
+	return;
+}
+
+void relay_budget_account(long delta) {
+	size_t now;
+	size_t old_peak;
+
+	if (delta == 0) return;
+	now = __atomic_add_fetch(&current, (size_t)delta, __ATOMIC_RELAXED);
+	if (delta < 0) return;
+	old_peak = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+	while (now > old_peak && !__atomic_compare_exchange_n(&peak, &old_peak, now,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* old_peak was reloaded, try again */
+	}
+	return;
+}
+
+size_t relay_budget_limit(size_t limit, size_t floor) {
+	size_t used;
+	size_t scaled;
+
+	if (budget == 0) {
+		return limit;
+	}
+	used = __atomic_load_n(&current, __ATOMIC_RELAXED);
+	if (used <= budget / 2) {
+		return limit;
+	}
+	if (used >= budget) {
+		return floor < limit ? floor : limit;
+	}
+	/* Linear from the full limit at half the budget to the floor at all of it */
+	scaled = (size_t)((double)limit * (budget - used) / (budget - budget / 2));
+	if (scaled < floor) {
+		scaled = floor < limit ? floor : limit;
+	}
+	return scaled;
+}
+
+size_t relay_budget_current(void) {
+	return __atomic_load_n(&current, __ATOMIC_RELAXED);
+}
+
+size_t relay_budget_peak(void) {
+	return __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
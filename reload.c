@@ -0,0 +1,492 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <libgen.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include <event2/event.h>
+
+#include "reload.h"
+#include "config.h"
+#include "ctx_cache.h"
+#include "trust_store.h"
+#include "verify_cache.h"
+#include "loop_monitor.h"
+#include "log.h"
+
+#define RELOAD_DEBOUNCE_MS	200 /* editors write a file in several steps */
+#define RELOAD_GRACE_SECS	10 /* least time replaced profiles stay readable */
+#define RELOAD_TICK_MS		1000 /* how often readers report, and retirement rechecks */
+
+typedef struct retired {
+	hsmap_t* profiles;
+	unsigned long epoch; /* readers past this no longer hold the profiles */
+	int waited; /* reported as held up by a reader */
+	struct event* timer;
+	struct retired* next;
+} retired_t;
+
+struct reload_reader {
+	unsigned long seen; /* last epoch this reader's event loop was idle in */
+	struct event* tick;
+	struct reload_reader* next;
+};
+
+typedef struct reload_state {
+	struct event_base* ev_base;
+	struct event* hup_ev;
+	struct event* watch_ev;
+	struct event* debounce_ev;
+	struct event* done_ev;
+	int watch_fd;
+	int done_fd;
+	char* watch_name; /* file name inside the watched directory */
+	pthread_t thread;
+	int running;
+	int pending; /* asked again while the thread was busy */
+	/* written by the thread before it signals done_fd */
+	hsmap_t* new_profiles;
+	hsmap_t* new_stores; /* NULL keeps the running trust stores */
+	hsmap_t* new_contexts;
+	unsigned long elapsed_ms;
+	retired_t* retired;
+	reload_reader_t* readers;
+	unsigned long epoch; /* bumped each time profiles are retired */
+	reload_stats_t stats;
+} reload_state_t;
+
+static reload_state_t state = {
+	.watch_fd = -1,
+	.done_fd = -1,
+};
+
+static void reload_start(void);
+static void* reload_thread(void* arg);
+static void hup_cb(evutil_socket_t fd, short events, void* arg);
+static void watch_cb(evutil_socket_t fd, short events, void* arg);
+static void debounce_cb(evutil_socket_t fd, short events, void* arg);
+static void done_cb(evutil_socket_t fd, short events, void* arg);
+static void retire_profiles(hsmap_t* profiles);
+static void retire_cb(evutil_socket_t fd, short events, void* arg);
+static int readers_past(unsigned long epoch);
+static void tick_cb(evutil_socket_t fd, short events, void* arg);
+static int watch_config(char* path);
+static unsigned long now_ms(void);
+
+int reload_init(struct event_base* ev_base) {
+	state.ev_base = ev_base;
+
+	state.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (state.done_fd == -1) {
+		log_printf(LOG_ERROR, "eventfd: %s\n", strerror(errno));
+		return 1;
+	}
+	state.done_ev = event_new(ev_base, state.done_fd, EV_READ | EV_PERSIST, done_cb, NULL);
+	state.hup_ev = evsignal_new(ev_base, SIGHUP, hup_cb, NULL);
+	state.debounce_ev = evtimer_new(ev_base, debounce_cb, NULL);
+	if (state.done_ev == NULL || state.hup_ev == NULL || state.debounce_ev == NULL) {
+		log_printf(LOG_ERROR, "Couldn't create config reload events\n");
+		return 1;
+	}
+	if (event_add(state.done_ev, NULL) == -1 || evsignal_add(state.hup_ev, NULL) == -1) {
+		log_printf(LOG_ERROR, "Couldn't add config reload events\n");
+		return 1;
+	}
+
+	/* A missing watch only costs automatic reloads, SIGHUP still works */
+	if (daemon_config.watch_config && config_get_path() != NULL) {
+		if (watch_config(config_get_path()) != 0) {
+			log_printf(LOG_ERROR, "Not watching %s for changes\n", config_get_path());
+		}
+	}
+	return 0;
+}
+
+void reload_free(void) {
+	retired_t* cur;
+	retired_t* next;
+
+	if (state.running) {
+		pthread_join(state.thread, NULL);
+		state.running = 0;
+		if (state.new_profiles != NULL) {
+			config_free_profiles(state.new_profiles);
+			ctx_cache_discard(state.new_contexts);
+			trust_store_discard(state.new_stores);
+		}
+	}
+	log_printf(LOG_INFO, "Config reloads: %lu applied, %lu failed\n",
+			state.stats.reloads, state.stats.failures);
+
+	/* The event loop has stopped, nothing can still be reading these */
+	cur = state.retired;
+	while (cur != NULL) {
+		next = cur->next;
+		config_free_profiles(cur->profiles);
+		event_free(cur->timer);
+		free(cur);
+		cur = next;
+	}
+	state.retired = NULL;
+
+	if (state.watch_ev != NULL) event_free(state.watch_ev);
+	if (state.debounce_ev != NULL) event_free(state.debounce_ev);
+	if (state.hup_ev != NULL) event_free(state.hup_ev);
+	if (state.done_ev != NULL) event_free(state.done_ev);
+	if (state.watch_fd != -1) close(state.watch_fd);
+	if (state.done_fd != -1) close(state.done_fd);
+	free(state.watch_name);
+	memset(&state, 0, sizeof(state));
+	state.watch_fd = -1;
+	state.done_fd = -1;
+	return;
+}
+
+/* Called from the control thread for each data plane event loop, before
+ * the loop runs. The tick is a callback like any other, so the loop has
+ * finished whatever it was doing before the epoch it copies was set */
+reload_reader_t* reload_reader_attach(struct event_base* ev_base) {
+	reload_reader_t* reader;
+	struct timeval tv = { .tv_sec = RELOAD_TICK_MS / 1000,
+		.tv_usec = (RELOAD_TICK_MS % 1000) * 1000 };
+
+	reader = (reload_reader_t*)calloc(1, sizeof(reload_reader_t));
+	if (reader == NULL) {
+		return NULL;
+	}
+	reader->seen = state.epoch;
+	reader->tick = event_new(ev_base, -1, EV_PERSIST, tick_cb, reader);
+	if (reader->tick == NULL || event_add(reader->tick, &tv) == -1) {
+		log_printf(LOG_ERROR, "Couldn't add config reader tick\n");
+		if (reader->tick != NULL) event_free(reader->tick);
+		free(reader);
+		return NULL;
+	}
+	reader->next = state.readers;
+	state.readers = reader;
+	return reader;
+}
+
+/* Called from the control thread once the reader's loop has stopped */
+void reload_reader_detach(reload_reader_t* reader) {
+	reload_reader_t** cur;
+
+	if (reader == NULL) {
+		return;
+	}
+	for (cur = &state.readers; *cur != NULL; cur = &(*cur)->next) {
+		if (*cur == reader) {
+			*cur = reader->next;
+			break;
+		}
+	}
+	event_free(reader->tick);
+	free(reader);
+	return;
+}
+
+void reload_get_stats(reload_stats_t* stats) {
+	*stats = state.stats;
+	return;
+}
+
+void reload_start(void) {
+	int ret;
+
+	if (config_get_path() == NULL) {
+		return;
+	}
+	if (state.running) {
+		state.pending = 1;
+		return;
+	}
+	state.new_profiles = NULL;
+	state.new_stores = NULL;
+	state.new_contexts = NULL;
+	ret = pthread_create(&state.thread, NULL, reload_thread, config_get_path());
+	if (ret != 0) {
+		log_printf(LOG_ERROR, "Couldn't start config reload: %s\n", strerror(ret));
+		state.stats.failures++;
+		return;
+	}
+	state.running = 1;
+	return;
+}
+
+/* Everything slow happens here: parsing, reading trust stores and
+ * building contexts. Nothing the event loop uses is modified, the
+ * results are installed together by done_cb */
+void* reload_thread(void* arg) {
+	char* path = (char*)arg;
+	unsigned long start = now_ms();
+	uint64_t one = 1;
+	hsmap_t* profiles;
+	hsmap_t* stores = NULL;
+	hsmap_t* contexts = NULL;
+
+	profiles = config_load_profiles(path);
+	if (profiles != NULL) {
+		stores = trust_store_load(profiles);
+		if (stores == NULL) {
+			log_printf(LOG_ERROR, "Unable to reload trust stores, keeping the old ones\n");
+		}
+		trust_store_stage(stores);
+		contexts = ctx_cache_build(profiles);
+		trust_store_stage(NULL);
+		if (contexts == NULL) {
+			config_free_profiles(profiles);
+			trust_store_discard(stores);
+			profiles = NULL;
+			stores = NULL;
+		}
+	}
+	state.new_profiles = profiles;
+	state.new_stores = stores;
+	state.new_contexts = contexts;
+	state.elapsed_ms = now_ms() - start;
+	if (write(state.done_fd, &one, sizeof(one)) != sizeof(one)) {
+		log_printf(LOG_ERROR, "Couldn't signal reload completion: %s\n", strerror(errno));
+	}
+	return NULL;
+}
+
+void done_cb(evutil_socket_t fd, short events, void* arg) {
+	uint64_t count;
+	hsmap_t* old_profiles;
+	uint64_t started;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count) || state.running == 0) {
+		return;
+	}
+	started = loop_monitor_begin();
+	pthread_join(state.thread, NULL);
+	state.running = 0;
+	state.stats.last_ms = state.elapsed_ms;
+
+	if (state.new_profiles == NULL) {
+		state.stats.failures++;
+		log_printf(LOG_ERROR, "Rejected %s after %lu ms, keeping the running configuration\n",
+				config_get_path(), state.elapsed_ms);
+	}
+	else {
+		/* Profiles first, so a socket that misses the new contexts
+		 * builds one from the new profile rather than the old */
+		old_profiles = config_install(state.new_profiles);
+		if (state.new_stores != NULL) {
+			trust_store_install(state.new_stores);
+		}
+		ctx_cache_install(state.new_contexts);
+		/* Verdicts were reached under the old trust stores and settings */
+		verify_cache_flush();
+		retire_profiles(old_profiles);
+		state.stats.reloads++;
+		log_printf(LOG_INFO, "Reloaded %s in %lu ms, %lu profiles\n",
+				config_get_path(), state.elapsed_ms, (unsigned long)global_config_size);
+	}
+	state.new_profiles = NULL;
+	state.new_stores = NULL;
+	state.new_contexts = NULL;
+
+	if (state.pending) {
+		state.pending = 0;
+		reload_start();
+	}
+	loop_monitor_end(LOOP_CB_RELOAD, 0, started);
+	return;
+}
+
+/* get_app_config callers only hold on to a profile for the duration of
+ * one callback. The control loop is between callbacks whenever
+ * retire_cb runs, and each data plane loop once its reader has ticked
+ * in a later epoch. A loop stuck in a callback, waiting on TrustBase or
+ * the auth daemon, holds the profiles back for as long as it takes */
+void retire_profiles(hsmap_t* profiles) {
+	retired_t* node;
+	struct timeval tv = { .tv_sec = RELOAD_GRACE_SECS, .tv_usec = 0 };
+
+	if (profiles == NULL) {
+		return;
+	}
+	node = (retired_t*)calloc(1, sizeof(retired_t));
+	if (node == NULL) {
+		/* Leaking is safer than freeing under a reader */
+		log_printf(LOG_ERROR, "Unable to track replaced config, leaking it\n");
+		return;
+	}
+	node->profiles = profiles;
+	/* After config_install, so any callback that starts once a reader
+	 * has seen this epoch can only find the new profiles */
+	node->epoch = __atomic_add_fetch(&state.epoch, 1, __ATOMIC_RELEASE);
+	node->timer = evtimer_new(state.ev_base, retire_cb, node);
+	if (node->timer == NULL || evtimer_add(node->timer, &tv) == -1) {
+		log_printf(LOG_ERROR, "Unable to schedule freeing replaced config, leaking it\n");
+		if (node->timer != NULL) event_free(node->timer);
+		free(node);
+		return;
+	}
+	node->next = state.retired;
+	state.retired = node;
+	return;
+}
+
+void retire_cb(evutil_socket_t fd, short events, void* arg) {
+	retired_t* node = (retired_t*)arg;
+	retired_t** cur;
+	struct timeval tv = { .tv_sec = RELOAD_TICK_MS / 1000,
+		.tv_usec = (RELOAD_TICK_MS % 1000) * 1000 };
+
+	if (!readers_past(node->epoch)) {
+		if (!node->waited) {
+			log_printf(LOG_WARNING, "Replaced config still in use by a data plane thread, "
+					"keeping it until the thread moves on\n");
+			node->waited = 1;
+		}
+		evtimer_add(node->timer, &tv);
+		return;
+	}
+	for (cur = &state.retired; *cur != NULL; cur = &(*cur)->next) {
+		if (*cur == node) {
+			*cur = node->next;
+			break;
+		}
+	}
+	config_free_profiles(node->profiles);
+	event_free(node->timer);
+	free(node);
+	return;
+}
+
+int readers_past(unsigned long epoch) {
+	reload_reader_t* reader;
+
+	for (reader = state.readers; reader != NULL; reader = reader->next) {
+		if ((long)(__atomic_load_n(&reader->seen, __ATOMIC_ACQUIRE) - epoch) < 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void tick_cb(evutil_socket_t fd, short events, void* arg) {
+	reload_reader_t* reader = (reload_reader_t*)arg;
+
+	__atomic_store_n(&reader->seen, __atomic_load_n(&state.epoch, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+	return;
+}
+
+void hup_cb(evutil_socket_t fd, short events, void* arg) {
+	log_printf(LOG_INFO, "SIGHUP received, reloading %s\n", config_get_path());
+	reload_start();
+	return;
+}
+
+/* Editors usually write a new file and rename it over the old one, which
+ * would drop a watch on the file itself, so the directory is watched */
+int watch_config(char* path) {
+	char* dir_copy;
+	char* name_copy;
+	int wd;
+
+	dir_copy = strdup(path);
+	name_copy = strdup(path);
+	if (dir_copy == NULL || name_copy == NULL) {
+		free(dir_copy);
+		free(name_copy);
+		return 1;
+	}
+	state.watch_name = strdup(basename(name_copy));
+	free(name_copy);
+	if (state.watch_name == NULL) {
+		free(dir_copy);
+		return 1;
+	}
+
+	state.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (state.watch_fd == -1) {
+		log_printf(LOG_ERROR, "inotify_init1: %s\n", strerror(errno));
+		free(dir_copy);
+		return 1;
+	}
+	wd = inotify_add_watch(state.watch_fd, dirname(dir_copy),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (wd == -1) {
+		log_printf(LOG_ERROR, "inotify_add_watch: %s\n", strerror(errno));
+		free(dir_copy);
+		return 1;
+	}
+	free(dir_copy);
+
+	state.watch_ev = event_new(state.ev_base, state.watch_fd, EV_READ | EV_PERSIST, watch_cb, NULL);
+	if (state.watch_ev == NULL || event_add(state.watch_ev, NULL) == -1) {
+		return 1;
+	}
+	log_printf(LOG_INFO, "Watching %s for changes\n", path);
+	return 0;
+}
+
+void watch_cb(evutil_socket_t fd, short events, void* arg) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event* event;
+	struct timeval tv = { .tv_sec = 0, .tv_usec = RELOAD_DEBOUNCE_MS * 1000 };
+	ssize_t len;
+	char* ptr;
+	int matched = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event*)ptr;
+			if (event->len > 0 && strcmp(event->name, state.watch_name) == 0) {
+				matched = 1;
+			}
+		}
+	}
+	if (matched) {
+		evtimer_add(state.debounce_ev, &tv);
+	}
+	return;
+}
+
+void debounce_cb(evutil_socket_t fd, short events, void* arg) {
+	log_printf(LOG_INFO, "%s changed, reloading\n", config_get_path());
+	reload_start();
+	return;
+}
+
+unsigned long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
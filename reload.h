@@ -0,0 +1,53 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <event2/event.h>
+
+typedef struct reload_stats {
+	unsigned long reloads; /* configurations swapped in */
+	unsigned long failures; /* files rejected, old configuration kept */
+	unsigned long last_ms; /* time spent parsing and building the last one */
+} reload_stats_t;
+
+/* SIGHUP, and with WatchConfig any write to the config file, makes the
+ * worker reload it. The file is parsed and the shared SSL_CTX of every
+ * profile built on a separate thread; the event loop only swaps the
+ * results in. Sockets opened before keep the contexts they were given */
+int reload_init(struct event_base* ev_base);
+void reload_free(void);
+void reload_get_stats(reload_stats_t* stats);
+
+/* Event loops other than the one given to reload_init that read
+ * profiles attach a reader. Replaced profiles are freed once each
+ * reader's loop has come back between callbacks */
+typedef struct reload_reader reload_reader_t;
+reload_reader_t* reload_reader_attach(struct event_base* ev_base);
+void reload_reader_detach(reload_reader_t* reader);
+
+#endif
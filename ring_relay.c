@@ -0,0 +1,729 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+
+#include "ring_relay.h"
+#include "metrics.h"
+#include "loop_monitor.h"
+#include "log.h"
+
+#define RING_MASK	(RING_RELAY_SIZE - 1)
+
+/* head and tail run freely, only their difference and masked
+ * positions matter */
+typedef struct ring {
+	char* buf;
+	size_t head; /* next byte to consume */
+	size_t tail; /* next byte to fill */
+} ring_t;
+
+typedef enum relay_state {
+	RELAY_HANDSHAKE,
+	RELAY_OPEN,
+	RELAY_DONE,
+} relay_state_t;
+
+struct ring_relay {
+	SSL* tls;
+	relay_state_t state;
+	char* mem; /* backing store for all four rings */
+	ring_t net_in; /* records read from the secure socket, drained by SSL */
+	ring_t net_out; /* records from SSL waiting for the secure socket */
+	ring_t app_in; /* plaintext read from the app, drained by SSL_write */
+	ring_t app_out; /* plaintext from SSL_read waiting for the app */
+	evutil_socket_t secure_fd;
+	evutil_socket_t plain_fd;
+	int secure_connected;
+	int plain_connected;
+	int net_eof; /* the secure socket hit EOF */
+	int secure_eof; /* no more plaintext will come from SSL */
+	int plain_eof;
+	int secure_shut; /* close_notify queued */
+	int secure_closed; /* SHUT_WR sent on the secure socket */
+	int plain_closed;
+	int data_seen; /* 1 once plaintext moved, 2 once reported */
+	struct event_base* ev_base;
+	struct event* secure_read_ev;
+	struct event* secure_write_ev;
+	struct event* plain_read_ev;
+	struct event* plain_write_ev;
+	ring_relay_cb_t cb;
+	void* arg;
+	unsigned long id; /* reported to the loop monitor */
+};
+
+static size_t ring_used(ring_t* ring);
+static size_t ring_space(ring_t* ring);
+static int ring_data_iov(ring_t* ring, struct iovec* iov);
+static int ring_space_iov(ring_t* ring, struct iovec* iov);
+static size_t ring_copy_out(ring_t* ring, char* out, size_t len);
+static size_t ring_copy_in(ring_t* ring, const char* in, size_t len);
+
+static void set_event(struct event* ev, int wanted);
+static void relay_update(ring_relay_t* relay);
+static void relay_run(ring_relay_t* relay);
+static int relay_pump(ring_relay_t* relay);
+static int relay_flush(evutil_socket_t fd, ring_t* ring, int* progress);
+static int relay_fill(evutil_socket_t fd, ring_t* ring, int* eof);
+static int socket_error(evutil_socket_t fd);
+static void relay_finish(ring_relay_t* relay, int error);
+static void secure_read_cb(evutil_socket_t fd, short events, void* arg);
+static void secure_write_cb(evutil_socket_t fd, short events, void* arg);
+static void plain_read_cb(evutil_socket_t fd, short events, void* arg);
+static void plain_write_cb(evutil_socket_t fd, short events, void* arg);
+static void secure_read(evutil_socket_t fd, void* arg);
+static void secure_write(evutil_socket_t fd, void* arg);
+static void plain_read(evutil_socket_t fd, void* arg);
+static void plain_write(evutil_socket_t fd, void* arg);
+static int plain_events_new(ring_relay_t* relay);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static BIO_METHOD* ring_bio_method;
+static pthread_once_t ring_bio_once = PTHREAD_ONCE_INIT;
+
+static void ring_bio_method_init(void);
+static int ring_bio_create(BIO* bio);
+static int ring_bio_destroy(BIO* bio);
+static int ring_bio_read(BIO* bio, char* out, int len);
+static int ring_bio_write(BIO* bio, const char* in, int len);
+static long ring_bio_ctrl(BIO* bio, int cmd, long num, void* ptr);
+#endif
+
+ring_relay_t* ring_relay_new(struct event_base* ev_base, SSL* tls, evutil_socket_t secure_fd,
+	evutil_socket_t plain_fd, int is_accepting, ring_relay_cb_t cb, void* arg) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ring_relay_t* relay;
+	BIO* bio;
+
+	pthread_once(&ring_bio_once, ring_bio_method_init);
+	if (ring_bio_method == NULL) {
+		return NULL;
+	}
+
+	relay = (ring_relay_t*)calloc(1, sizeof(ring_relay_t));
+	if (relay == NULL) {
+		return NULL;
+	}
+	relay->mem = (char*)malloc(4 * RING_RELAY_SIZE);
+	if (relay->mem == NULL) {
+		free(relay);
+		return NULL;
+	}
+	relay->net_in.buf = relay->mem;
+	relay->net_out.buf = relay->mem + RING_RELAY_SIZE;
+	relay->app_in.buf = relay->mem + 2 * RING_RELAY_SIZE;
+	relay->app_out.buf = relay->mem + 3 * RING_RELAY_SIZE;
+	relay->ev_base = ev_base;
+	relay->secure_fd = secure_fd;
+	relay->plain_fd = plain_fd;
+	relay->cb = cb;
+	relay->arg = arg;
+
+	relay->secure_read_ev = event_new(ev_base, secure_fd, EV_READ | EV_PERSIST, secure_read_cb, relay);
+	relay->secure_write_ev = event_new(ev_base, secure_fd, EV_WRITE | EV_PERSIST, secure_write_cb, relay);
+	bio = BIO_new(ring_bio_method);
+	if (relay->secure_read_ev == NULL || relay->secure_write_ev == NULL || bio == NULL ||
+		(plain_fd != -1 && plain_events_new(relay) != 0)) {
+		if (bio != NULL) {
+			BIO_free(bio);
+		}
+		/* The caller still owns the SSL and sockets */
+		relay->secure_fd = -1;
+		relay->plain_fd = -1;
+		ring_relay_free(relay);
+		return NULL;
+	}
+	BIO_set_data(bio, relay);
+	BIO_set_init(bio, 1);
+	SSL_set_bio(tls, bio, bio);
+	/* SSL_write retries may see more of the ring than the first attempt */
+	SSL_set_mode(tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if (is_accepting == 1) {
+		SSL_set_accept_state(tls);
+	}
+	else {
+		SSL_set_connect_state(tls);
+	}
+	relay->tls = tls;
+	relay->state = RELAY_HANDSHAKE;
+	relay_update(relay);
+	return relay;
+#else
+	log_printf(LOG_ERROR, "The ring relay engine needs OpenSSL 1.1.0 or later\n");
+	return NULL;
+#endif
+}
+
+int ring_relay_connect(ring_relay_t* relay, struct sockaddr* addr, int addrlen) {
+	if (connect(relay->secure_fd, addr, addrlen) == -1 && errno != EINPROGRESS) {
+		log_printf(LOG_ERROR, "connect: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int ring_relay_connect_plain(ring_relay_t* relay, struct sockaddr* addr, int addrlen) {
+	if (connect(relay->plain_fd, addr, addrlen) == -1 && errno != EINPROGRESS) {
+		relay_finish(relay, errno);
+		return -1;
+	}
+	/* Writable means connected, see plain_write_cb */
+	set_event(relay->plain_write_ev, 1);
+	return 0;
+}
+
+int ring_relay_set_plain(ring_relay_t* relay, evutil_socket_t plain_fd) {
+	relay->plain_fd = plain_fd;
+	if (plain_events_new(relay) != 0) {
+		return -1;
+	}
+	relay->plain_connected = 1;
+	relay_update(relay);
+	return 0;
+}
+
+evutil_socket_t ring_relay_plain_fd(ring_relay_t* relay) {
+	return relay->plain_fd;
+}
+
+void ring_relay_set_id(ring_relay_t* relay, unsigned long id) {
+	relay->id = id;
+	return;
+}
+
+void ring_relay_free(ring_relay_t* relay) {
+	if (relay == NULL) return;
+	if (relay->secure_read_ev != NULL) event_free(relay->secure_read_ev);
+	if (relay->secure_write_ev != NULL) event_free(relay->secure_write_ev);
+	if (relay->plain_read_ev != NULL) event_free(relay->plain_read_ev);
+	if (relay->plain_write_ev != NULL) event_free(relay->plain_write_ev);
+	if (relay->tls != NULL) {
+		SSL_free(relay->tls);
+	}
+	if (relay->secure_fd != -1) {
+		EVUTIL_CLOSESOCKET(relay->secure_fd);
+	}
+	if (relay->plain_fd != -1) {
+		EVUTIL_CLOSESOCKET(relay->plain_fd);
+	}
+	free(relay->mem);
+	free(relay);
+	return;
+}
+
+int plain_events_new(ring_relay_t* relay) {
+	relay->plain_read_ev = event_new(relay->ev_base, relay->plain_fd, EV_READ | EV_PERSIST,
+		plain_read_cb, relay);
+	relay->plain_write_ev = event_new(relay->ev_base, relay->plain_fd, EV_WRITE | EV_PERSIST,
+		plain_write_cb, relay);
+	if (relay->plain_read_ev == NULL || relay->plain_write_ev == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+size_t ring_used(ring_t* ring) {
+	return ring->tail - ring->head;
+}
+
+size_t ring_space(ring_t* ring) {
+	return RING_RELAY_SIZE - ring_used(ring);
+}
+
+/* Fills iov with the one or two stretches holding data */
+int ring_data_iov(ring_t* ring, struct iovec* iov) {
+	size_t used = ring_used(ring);
+	size_t start = ring->head & RING_MASK;
+	size_t first = RING_RELAY_SIZE - start;
+
+	iov[0].iov_base = ring->buf + start;
+	if (used <= first) {
+		iov[0].iov_len = used;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = ring->buf;
+	iov[1].iov_len = used - first;
+	return 2;
+}
+
+/* Fills iov with the one or two free stretches */
+int ring_space_iov(ring_t* ring, struct iovec* iov) {
+	size_t space = ring_space(ring);
+	size_t start = ring->tail & RING_MASK;
+	size_t first = RING_RELAY_SIZE - start;
+
+	iov[0].iov_base = ring->buf + start;
+	if (space <= first) {
+		iov[0].iov_len = space;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = ring->buf;
+	iov[1].iov_len = space - first;
+	return 2;
+}
+
+size_t ring_copy_out(ring_t* ring, char* out, size_t len) {
+	struct iovec iov[2];
+	size_t copied = 0;
+	int count;
+	int i;
+
+	count = ring_data_iov(ring, iov);
+	for (i = 0; i < count && copied < len; i++) {
+		size_t n = iov[i].iov_len < len - copied ? iov[i].iov_len : len - copied;
+		memcpy(out + copied, iov[i].iov_base, n);
+		copied += n;
+	}
+	ring->head += copied;
+	return copied;
+}
+
+size_t ring_copy_in(ring_t* ring, const char* in, size_t len) {
+	struct iovec iov[2];
+	size_t copied = 0;
+	int count;
+	int i;
+
+	count = ring_space_iov(ring, iov);
+	for (i = 0; i < count && copied < len; i++) {
+		size_t n = iov[i].iov_len < len - copied ? iov[i].iov_len : len - copied;
+		memcpy(iov[i].iov_base, in + copied, n);
+		copied += n;
+	}
+	ring->tail += copied;
+	return copied;
+}
+
+void set_event(struct event* ev, int wanted) {
+	int pending;
+
+	if (ev == NULL) return;
+	pending = event_pending(ev, EV_READ | EV_WRITE, NULL);
+	if (wanted && !pending) {
+		event_add(ev, NULL);
+	}
+	else if (!wanted && pending) {
+		event_del(ev);
+	}
+	return;
+}
+
+/* Arms exactly the events that can make progress. A full ring stops
+ * reading on the socket that feeds it, which is the backpressure */
+void relay_update(ring_relay_t* relay) {
+	int open = (relay->state == RELAY_OPEN);
+
+	if (relay->state == RELAY_DONE) {
+		return;
+	}
+	set_event(relay->secure_read_ev, relay->secure_connected && !relay->net_eof &&
+		ring_space(&relay->net_in) > 0);
+	set_event(relay->secure_write_ev, !relay->secure_connected ||
+		(ring_used(&relay->net_out) > 0 && !relay->secure_closed));
+	if (relay->plain_fd == -1) {
+		return;
+	}
+	set_event(relay->plain_read_ev, open && relay->plain_connected && !relay->plain_eof &&
+		ring_space(&relay->app_in) > 0);
+	if (relay->plain_connected) {
+		set_event(relay->plain_write_ev, ring_used(&relay->app_out) > 0 && !relay->plain_closed);
+	}
+	return;
+}
+
+/* Moves data through SSL and out to both sockets until nothing changes,
+ * then rearms events. Reports the handshake and the end of the relay */
+void relay_run(ring_relay_t* relay) {
+	int handshaking = (relay->state == RELAY_HANDSHAKE);
+	int error;
+
+	error = relay_pump(relay);
+	if (error != 0) {
+		relay_finish(relay, error);
+		return;
+	}
+	if (relay->secure_closed && relay->plain_closed) {
+		relay_finish(relay, 0);
+		return;
+	}
+	relay_update(relay);
+	if (handshaking && relay->state == RELAY_OPEN) {
+		relay->cb(relay->arg, RING_RELAY_CONNECTED, 0);
+	}
+	if (relay->data_seen == 1) {
+		relay->data_seen = 2;
+		relay->cb(relay->arg, RING_RELAY_DATA, 0);
+	}
+	return;
+}
+
+int relay_pump(ring_relay_t* relay) {
+	struct iovec iov[2];
+	int progress;
+	int ret;
+	int ssl_err;
+	int error;
+
+	do {
+		progress = 0;
+		if (relay->state == RELAY_HANDSHAKE) {
+			ret = SSL_do_handshake(relay->tls);
+			if (ret == 1) {
+				relay->state = RELAY_OPEN;
+				progress = 1;
+			}
+			else {
+				ssl_err = SSL_get_error(relay->tls, ret);
+				if (ssl_err != SSL_ERROR_WANT_READ && ssl_err != SSL_ERROR_WANT_WRITE) {
+					log_printf(LOG_ERROR, "Handshake failed: %s\n",
+						ERR_reason_error_string(ERR_get_error()));
+					return ECONNABORTED;
+				}
+			}
+		}
+
+		if (relay->state == RELAY_OPEN) {
+			/* Secure side to app */
+			while (!relay->secure_eof && ring_space(&relay->app_out) > 0) {
+				ring_space_iov(&relay->app_out, iov);
+				ret = SSL_read(relay->tls, iov[0].iov_base, iov[0].iov_len);
+				if (ret > 0) {
+					relay->app_out.tail += ret;
+					metrics_relay_bytes(METRICS_INBOUND, ret);
+					relay->data_seen |= 1;
+					progress = 1;
+					continue;
+				}
+				ssl_err = SSL_get_error(relay->tls, ret);
+				if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
+					break;
+				}
+				/* A missing close_notify is tolerated, as with
+				 * bufferevent_openssl_set_allow_dirty_shutdown */
+				if (ssl_err == SSL_ERROR_ZERO_RETURN || relay->net_eof) {
+					relay->secure_eof = 1;
+					progress = 1;
+					break;
+				}
+				return EPROTO;
+			}
+
+			/* App to secure side, records collect in net_out */
+			while (!relay->secure_shut && ring_used(&relay->app_in) > 0) {
+				ring_data_iov(&relay->app_in, iov);
+				ret = SSL_write(relay->tls, iov[0].iov_base, iov[0].iov_len);
+				if (ret > 0) {
+					relay->app_in.head += ret;
+					metrics_relay_bytes(METRICS_OUTBOUND, ret);
+					relay->data_seen |= 1;
+					progress = 1;
+					continue;
+				}
+				ssl_err = SSL_get_error(relay->tls, ret);
+				if (ssl_err == SSL_ERROR_WANT_WRITE || ssl_err == SSL_ERROR_WANT_READ) {
+					break;
+				}
+				return EPROTO;
+			}
+
+			if (relay->plain_eof && !relay->secure_shut && ring_used(&relay->app_in) == 0) {
+				SSL_shutdown(relay->tls);
+				relay->secure_shut = 1;
+				progress = 1;
+			}
+		}
+
+		if (relay->secure_connected && !relay->secure_closed) {
+			error = relay_flush(relay->secure_fd, &relay->net_out, &progress);
+			if (error != 0) {
+				return error;
+			}
+			if (relay->secure_shut && ring_used(&relay->net_out) == 0) {
+				shutdown(relay->secure_fd, SHUT_WR);
+				relay->secure_closed = 1;
+			}
+		}
+		if (relay->plain_connected && !relay->plain_closed) {
+			error = relay_flush(relay->plain_fd, &relay->app_out, &progress);
+			if (error != 0) {
+				return error;
+			}
+			if (relay->secure_eof && ring_used(&relay->app_out) == 0) {
+				shutdown(relay->plain_fd, SHUT_WR);
+				relay->plain_closed = 1;
+			}
+		}
+	} while (progress);
+	return 0;
+}
+
+/* Writes as much of the ring as the socket takes in one writev */
+int relay_flush(evutil_socket_t fd, ring_t* ring, int* progress) {
+	struct iovec iov[2];
+	ssize_t n;
+	int count;
+
+	if (ring_used(ring) == 0) {
+		return 0;
+	}
+	count = ring_data_iov(ring, iov);
+	n = writev(fd, iov, count);
+	if (n > 0) {
+		ring->head += n;
+		*progress = 1;
+		return 0;
+	}
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return 0;
+	}
+	return n == -1 ? errno : EPIPE;
+}
+
+/* Reads as much as the ring holds in one readv */
+int relay_fill(evutil_socket_t fd, ring_t* ring, int* eof) {
+	struct iovec iov[2];
+	ssize_t n;
+	int count;
+
+	if (ring_space(ring) == 0) {
+		return 0;
+	}
+	count = ring_space_iov(ring, iov);
+	n = readv(fd, iov, count);
+	if (n > 0) {
+		ring->tail += n;
+		return 0;
+	}
+	if (n == 0) {
+		*eof = 1;
+		return 0;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return 0;
+	}
+	return errno;
+}
+
+int socket_error(evutil_socket_t fd) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+		return errno;
+	}
+	return error;
+}
+
+void relay_finish(ring_relay_t* relay, int error) {
+	if (relay->state == RELAY_DONE) return;
+	relay->state = RELAY_DONE;
+	set_event(relay->secure_read_ev, 0);
+	set_event(relay->secure_write_ev, 0);
+	set_event(relay->plain_read_ev, 0);
+	set_event(relay->plain_write_ev, 0);
+	relay->cb(relay->arg, RING_RELAY_CLOSED, error);
+	return;
+}
+
+/* The socket callbacks are timed for the loop monitor. The id is read
+ * first, relay_finish may free the relay */
+void secure_read_cb(evutil_socket_t fd, short events, void* arg) {
+	unsigned long id = ((ring_relay_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	secure_read(fd, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void secure_write_cb(evutil_socket_t fd, short events, void* arg) {
+	unsigned long id = ((ring_relay_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	secure_write(fd, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void plain_read_cb(evutil_socket_t fd, short events, void* arg) {
+	unsigned long id = ((ring_relay_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	plain_read(fd, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void plain_write_cb(evutil_socket_t fd, short events, void* arg) {
+	unsigned long id = ((ring_relay_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	plain_write(fd, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void secure_read(evutil_socket_t fd, void* arg) {
+	ring_relay_t* relay = arg;
+	int error;
+
+	error = relay_fill(fd, &relay->net_in, &relay->net_eof);
+	if (error != 0) {
+		relay_finish(relay, error);
+		return;
+	}
+	relay_run(relay);
+	return;
+}
+
+void secure_write(evutil_socket_t fd, void* arg) {
+	ring_relay_t* relay = arg;
+	int error;
+
+	if (!relay->secure_connected) {
+		error = socket_error(fd);
+		if (error != 0) {
+			relay_finish(relay, error);
+			return;
+		}
+		relay->secure_connected = 1;
+	}
+	relay_run(relay);
+	return;
+}
+
+void plain_read(evutil_socket_t fd, void* arg) {
+	ring_relay_t* relay = arg;
+	int error;
+
+	error = relay_fill(fd, &relay->app_in, &relay->plain_eof);
+	if (error != 0) {
+		relay_finish(relay, error);
+		return;
+	}
+	relay_run(relay);
+	return;
+}
+
+void plain_write(evutil_socket_t fd, void* arg) {
+	ring_relay_t* relay = arg;
+	int error;
+
+	if (!relay->plain_connected) {
+		error = socket_error(fd);
+		if (error != 0) {
+			relay_finish(relay, error);
+			return;
+		}
+		relay->plain_connected = 1;
+	}
+	relay_run(relay);
+	return;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+void ring_bio_method_init(void) {
+	ring_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "ring relay");
+	if (ring_bio_method == NULL) {
+		return;
+	}
+	BIO_meth_set_create(ring_bio_method, ring_bio_create);
+	BIO_meth_set_destroy(ring_bio_method, ring_bio_destroy);
+	BIO_meth_set_read(ring_bio_method, ring_bio_read);
+	BIO_meth_set_write(ring_bio_method, ring_bio_write);
+	BIO_meth_set_ctrl(ring_bio_method, ring_bio_ctrl);
+	return;
+}
+
+int ring_bio_create(BIO* bio) {
+	BIO_set_shutdown(bio, 0);
+	return 1;
+}
+
+int ring_bio_destroy(BIO* bio) {
+	/* The rings belong to the relay */
+	BIO_set_data(bio, NULL);
+	return 1;
+}
+
+int ring_bio_read(BIO* bio, char* out, int len) {
+	ring_relay_t* relay = BIO_get_data(bio);
+
+	BIO_clear_retry_flags(bio);
+	if (len <= 0) {
+		return 0;
+	}
+	if (ring_used(&relay->net_in) == 0) {
+		if (relay->net_eof) {
+			return 0;
+		}
+		BIO_set_retry_read(bio);
+		return -1;
+	}
+	return ring_copy_out(&relay->net_in, out, len);
+}
+
+int ring_bio_write(BIO* bio, const char* in, int len) {
+	ring_relay_t* relay = BIO_get_data(bio);
+
+	BIO_clear_retry_flags(bio);
+	if (len <= 0) {
+		return 0;
+	}
+	if (ring_space(&relay->net_out) == 0) {
+		BIO_set_retry_write(bio);
+		return -1;
+	}
+	return ring_copy_in(&relay->net_out, in, len);
+}
+
+long ring_bio_ctrl(BIO* bio, int cmd, long num, void* ptr) {
+	ring_relay_t* relay = BIO_get_data(bio);
+
+	switch (cmd) {
+	case BIO_CTRL_FLUSH:
+		return 1;
+	case BIO_CTRL_PENDING:
+		return ring_used(&relay->net_in);
+	case BIO_CTRL_WPENDING:
+		return ring_used(&relay->net_out);
+	case BIO_CTRL_EOF:
+		return relay->net_eof && ring_used(&relay->net_in) == 0;
+	default:
+		return 0;
+	}
+}
+#endif
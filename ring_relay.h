@@ -0,0 +1,59 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RING_RELAY_H
+#define RING_RELAY_H
+
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <openssl/ssl.h>
+
+#define RING_RELAY_SIZE		(64*1024) /* bytes per ring, a power of two */
+
+#define RING_RELAY_CONNECTED	1 /* handshake finished */
+#define RING_RELAY_CLOSED	2 /* both directions done or failed, error is an errno */
+#define RING_RELAY_DATA		3 /* first plaintext moved either way, sent once */
+
+typedef struct ring_relay ring_relay_t;
+typedef void (*ring_relay_cb_t)(void* arg, int event, int error);
+
+/* An alternative to the bufferevent pair of a tls_conn_ctx_t. OpenSSL
+ * reads and writes through a BIO over fixed rings allocated with the
+ * connection. The sockets are filled from and flushed to those rings
+ * with readv() and writev(), so several records go out in one call.
+ * The relay owns the SSL and both sockets once created. The handshake
+ * begins when the secure socket first reports writable, so a connect
+ * issued right after creation is waited for */
+ring_relay_t* ring_relay_new(struct event_base* ev_base, SSL* tls, evutil_socket_t secure_fd,
+	evutil_socket_t plain_fd, int is_accepting, ring_relay_cb_t cb, void* arg);
+int ring_relay_connect(ring_relay_t* relay, struct sockaddr* addr, int addrlen);
+int ring_relay_connect_plain(ring_relay_t* relay, struct sockaddr* addr, int addrlen);
+int ring_relay_set_plain(ring_relay_t* relay, evutil_socket_t plain_fd);
+evutil_socket_t ring_relay_plain_fd(ring_relay_t* relay);
+void ring_relay_set_id(ring_relay_t* relay, unsigned long id); /* for the loop monitor */
+void ring_relay_free(ring_relay_t* relay);
+
+#endif
@@ -0,0 +1,635 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "session_cache.h"
+#include "log.h"
+
+#define SESSION_CACHE_WAYS	8
+#define SESSION_CACHE_STRIPES	64
+#define SESSION_CACHE_DER_MAX	2048 /* sessions holding a long client chain stay local */
+#define SESSION_STORE_MAGIC	"SSASESS"
+#define SESSION_STORE_VERSION	1
+#define SESSION_STORE_FILE	"sessions"
+#define SESSION_NONCE_LEN	12
+#define SESSION_TAG_LEN		16
+
+typedef struct session_entry {
+	uint64_t hash; /* 0 when the entry is free */
+	uint64_t last_used; /* stripe clock when last stored or found */
+	int64_t expires; /* wall clock, so it holds across restarts */
+	uint32_t ns;
+	uint16_t der_len;
+	uint8_t id_len;
+	uint8_t single_use; /* TLS 1.3, taken out by the lookup that finds it */
+	uint8_t id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t nonce[SESSION_NONCE_LEN]; /* unused unless stored in a file */
+	uint8_t tag[SESSION_TAG_LEN];
+} session_entry_t;
+
+typedef struct stripe {
+	pthread_mutex_t lock;
+	uint64_t clock;
+} __attribute__((aligned(64))) stripe_t;
+
+/* Also the layout of the file under SessionCacheLocation, so the
+ * fields that describe it come first and keep their sizes */
+typedef struct session_region {
+	char magic[8];
+	uint32_t version;
+	uint32_t ways;
+	uint32_t der_max;
+	uint32_t entry_size;
+	uint64_t sets;
+	unsigned char key_id[32]; /* digest of the key the entries were sealed with */
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t stores;
+	uint64_t evictions;
+	uint64_t oversized;
+	stripe_t stripes[SESSION_CACHE_STRIPES];
+	session_entry_t entries[]; /* sets * SESSION_CACHE_WAYS, then as many DER slots */
+} session_region_t;
+
+static session_region_t* region;
+static size_t region_size;
+static unsigned char* der_slots;
+static int ns_index = -1;
+static int sealed; /* entries are encrypted, the region is backed by a file */
+static unsigned char store_key[SESSION_KEY_LEN];
+
+static int new_session_cb(SSL* tls, SSL_SESSION* session);
+static SSL_SESSION* get_session_cb(SSL* tls, const unsigned char* id, int id_len, int* copy);
+static void remove_session_cb(SSL_CTX* tls_ctx, SSL_SESSION* session);
+static uint64_t session_hash(uint32_t ns, const unsigned char* id, unsigned int id_len);
+static uint32_t ctx_namespace(SSL_CTX* tls_ctx);
+static session_entry_t* set_lock(uint64_t hash, stripe_t** stripe);
+static session_entry_t* set_find(session_entry_t* set, uint64_t hash, uint32_t ns,
+	const unsigned char* id, unsigned int id_len);
+static unsigned char* entry_der(session_entry_t* entry);
+static session_region_t* map_file(const char* location, size_t sets);
+static int seal_der(session_entry_t* meta, const unsigned char* der, unsigned char* out);
+static int open_der(session_entry_t* meta, const unsigned char* in, unsigned char* out);
+static size_t sweep(void);
+
+/* Called by the parent before it forks. Entries are rounded up to
+ * whole sets. With a location and a key file the cache lives in a file
+ * there, so sessions outlast restarts. Entries are sealed with the key
+ * and written in place as they change, and the kernel writes the
+ * pages back on its own. Anything expired or torn is dropped here,
+ * before the workers start on it */
+int session_cache_init(size_t entries, const char* location, const char* key_file) {
+	pthread_mutexattr_t attr;
+	size_t sets;
+#ifndef NO_LOG
+	size_t loaded;
+#endif
+	int i;
+
+	sets = (entries + SESSION_CACHE_WAYS - 1) / SESSION_CACHE_WAYS;
+	if (sets == 0) {
+		return 0;
+	}
+	region_size = sizeof(session_region_t) + sets * SESSION_CACHE_WAYS *
+		(sizeof(session_entry_t) + SESSION_CACHE_DER_MAX);
+	if (location != NULL && key_file != NULL) {
+		if (session_cache_load_key(key_file, store_key) == 0) {
+			region = map_file(location, sets);
+		}
+		if (region == NULL) {
+			log_printf(LOG_ERROR, "Keeping sessions in memory only\n");
+			OPENSSL_cleanse(store_key, sizeof(store_key));
+		}
+	}
+	if (region == NULL) {
+		region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			log_printf(LOG_ERROR, "Failed to map session cache: %s\n", strerror(errno));
+			region = NULL;
+			return 1;
+		}
+		region->sets = sets;
+	}
+	else {
+		sealed = 1;
+	}
+	der_slots = (unsigned char*)&region->entries[sets * SESSION_CACHE_WAYS];
+
+	/* robust, so a worker dying with a lock held can't wedge the rest.
+	 * Locks left in the file by an earlier run mean nothing now */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (i = 0; i < SESSION_CACHE_STRIPES; i++) {
+		pthread_mutex_init(&region->stripes[i].lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+	region->lookups = 0;
+	region->hits = 0;
+	region->stores = 0;
+	region->evictions = 0;
+	region->oversized = 0;
+
+	ns_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (sealed) {
+#ifndef NO_LOG
+		loaded = sweep();
+		log_printf(LOG_INFO, "Loaded %zu server sessions from %s\n", loaded, location);
+#else
+		sweep();
+#endif
+	}
+	log_printf(LOG_INFO, "Sharing up to %zu server sessions between workers\n",
+		sets * SESSION_CACHE_WAYS);
+	return 0;
+}
+
+/* Points a context at the shared cache. Contexts of one profile and
+ * location find each other's sessions, the session ID context keeps
+ * verified and unverified sessions apart as before */
+void session_cache_attach(SSL_CTX* tls_ctx, ssa_config_t* ssa_config) {
+	const char* profile;
+	uint32_t ns = 2166136261u;
+	const char* c;
+
+	if (region == NULL || ns_index == -1) {
+		return;
+	}
+	profile = ssa_config->profile != NULL ? ssa_config->profile : DEFAULT_CONF;
+	for (c = profile; *c != '\0'; c++) {
+		ns = (ns ^ (unsigned char)*c) * 16777619u;
+	}
+	ns = (ns ^ '\n') * 16777619u;
+	for (c = ssa_config->cache_path; c != NULL && *c != '\0'; c++) {
+		ns = (ns ^ (unsigned char)*c) * 16777619u;
+	}
+	SSL_CTX_set_ex_data(tls_ctx, ns_index, (void*)(uintptr_t)(ns | 1));
+	SSL_CTX_sess_set_new_cb(tls_ctx, new_session_cb);
+	SSL_CTX_sess_set_get_cb(tls_ctx, get_session_cb);
+	SSL_CTX_sess_set_remove_cb(tls_ctx, remove_session_cb);
+	return;
+}
+
+/* Extra session cache mode bits for server contexts. Nothing is kept
+ * in the context itself once the shared cache is up, so every lookup
+ * sees what the other workers stored */
+long session_cache_mode(void) {
+	if (region == NULL) {
+		return 0;
+	}
+	return SSL_SESS_CACHE_NO_INTERNAL;
+}
+
+int session_cache_get_stats(session_cache_stats_t* stats) {
+	size_t i;
+
+	if (region == NULL) {
+		return 0;
+	}
+	stats->lookups = __atomic_load_n(&region->lookups, __ATOMIC_RELAXED);
+	stats->hits = __atomic_load_n(&region->hits, __ATOMIC_RELAXED);
+	stats->stores = __atomic_load_n(&region->stores, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&region->evictions, __ATOMIC_RELAXED);
+	stats->oversized = __atomic_load_n(&region->oversized, __ATOMIC_RELAXED);
+	/* unlocked, a rough count is enough for a gauge */
+	stats->entries = 0;
+	for (i = 0; i < region->sets * SESSION_CACHE_WAYS; i++) {
+		if (__atomic_load_n(&region->entries[i].hash, __ATOMIC_RELAXED) != 0) {
+			stats->entries++;
+		}
+	}
+	return 1;
+}
+
+/* The parent goes last, so it pushes the file out before exiting */
+void session_cache_free(void) {
+	if (region == NULL) {
+		return;
+	}
+	if (sealed) {
+		msync(region, region_size, MS_SYNC);
+	}
+	munmap(region, region_size);
+	region = NULL;
+	der_slots = NULL;
+	sealed = 0;
+	OPENSSL_cleanse(store_key, sizeof(store_key));
+	return;
+}
+
+int new_session_cb(SSL* tls, SSL_SESSION* session) {
+	unsigned char der[SESSION_CACHE_DER_MAX];
+	unsigned char* p;
+	const unsigned char* id;
+	unsigned int id_len;
+	session_entry_t meta;
+	session_entry_t* set;
+	session_entry_t* entry;
+	stripe_t* stripe;
+	uint64_t hash;
+	uint32_t ns;
+	int der_len;
+	int i;
+
+	ns = ctx_namespace(SSL_get_SSL_CTX(tls));
+	id = SSL_SESSION_get_id(session, &id_len);
+	if (ns == 0 || id_len == 0) {
+		return 0;
+	}
+	der_len = i2d_SSL_SESSION(session, NULL);
+	if (der_len <= 0 || der_len > SESSION_CACHE_DER_MAX) {
+		__atomic_add_fetch(&region->oversized, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	p = der;
+	i2d_SSL_SESSION(session, &p);
+	hash = session_hash(ns, id, id_len);
+
+	/* sealed before taking the lock, then copied in whole */
+	memset(&meta, 0, sizeof(meta));
+	meta.ns = ns;
+	meta.id_len = id_len;
+	memcpy(meta.id, id, id_len);
+	meta.expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+	meta.der_len = der_len;
+	meta.single_use = SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION;
+	if (sealed && seal_der(&meta, der, der) != 0) {
+		OPENSSL_cleanse(der, der_len);
+		return 0;
+	}
+
+	set = set_lock(hash, &stripe);
+	entry = set_find(set, hash, ns, id, id_len);
+	if (entry == NULL) {
+		/* a free or expired entry, else the least recently used */
+		entry = &set[0];
+		for (i = 0; i < SESSION_CACHE_WAYS; i++) {
+			if (set[i].hash == 0 || set[i].expires <= time(NULL)) {
+				entry = &set[i];
+				break;
+			}
+			if (set[i].last_used < entry->last_used) {
+				entry = &set[i];
+			}
+		}
+		if (i == SESSION_CACHE_WAYS) {
+			__atomic_add_fetch(&region->evictions, 1, __ATOMIC_RELAXED);
+		}
+	}
+	/* free while it changes, so a write cut short is never taken for a session */
+	__atomic_store_n(&entry->hash, 0, __ATOMIC_RELEASE);
+	meta.last_used = ++stripe->clock;
+	memcpy(entry, &meta, sizeof(meta));
+	memcpy(entry_der(entry), der, der_len);
+	__atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stripe->lock);
+
+	OPENSSL_cleanse(der, der_len);
+	__atomic_add_fetch(&region->stores, 1, __ATOMIC_RELAXED);
+	return 0; /* we keep a copy, not the reference */
+}
+
+SSL_SESSION* get_session_cb(SSL* tls, const unsigned char* id, int id_len, int* copy) {
+	unsigned char der[SESSION_CACHE_DER_MAX];
+	const unsigned char* p;
+	session_entry_t meta;
+	session_entry_t* set;
+	session_entry_t* entry;
+	SSL_SESSION* session;
+	stripe_t* stripe;
+	uint64_t hash;
+	uint32_t ns;
+	int der_len = 0;
+
+	*copy = 0;
+	ns = ctx_namespace(SSL_get_SSL_CTX(tls));
+	if (ns == 0 || id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+		return NULL;
+	}
+	__atomic_add_fetch(&region->lookups, 1, __ATOMIC_RELAXED);
+	hash = session_hash(ns, id, id_len);
+
+	set = set_lock(hash, &stripe);
+	entry = set_find(set, hash, ns, id, id_len);
+	if (entry != NULL && entry->expires <= time(NULL)) {
+		__atomic_store_n(&entry->hash, 0, __ATOMIC_RELAXED);
+		entry = NULL;
+	}
+	if (entry != NULL) {
+		entry->last_used = ++stripe->clock;
+		memcpy(&meta, entry, sizeof(meta));
+		der_len = entry->der_len;
+		memcpy(der, entry_der(entry), der_len);
+		if (entry->single_use) {
+			__atomic_store_n(&entry->hash, 0, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (der_len == 0) {
+		return NULL;
+	}
+	if (sealed && open_der(&meta, der, der) != 0) {
+		return NULL;
+	}
+	p = der;
+	session = d2i_SSL_SESSION(NULL, &p, der_len);
+	OPENSSL_cleanse(der, der_len);
+	if (session == NULL) {
+		return NULL;
+	}
+	__atomic_add_fetch(&region->hits, 1, __ATOMIC_RELAXED);
+	return session;
+}
+
+/* OpenSSL drops sessions that failed or timed out */
+void remove_session_cb(SSL_CTX* tls_ctx, SSL_SESSION* session) {
+	const unsigned char* id;
+	unsigned int id_len;
+	session_entry_t* set;
+	session_entry_t* entry;
+	stripe_t* stripe;
+	uint64_t hash;
+	uint32_t ns;
+
+	ns = ctx_namespace(tls_ctx);
+	id = SSL_SESSION_get_id(session, &id_len);
+	if (ns == 0 || id_len == 0) {
+		return;
+	}
+	hash = session_hash(ns, id, id_len);
+	set = set_lock(hash, &stripe);
+	entry = set_find(set, hash, ns, id, id_len);
+	if (entry != NULL) {
+		__atomic_store_n(&entry->hash, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return;
+}
+
+/* FNV-1a, never 0 since that marks a free entry */
+uint64_t session_hash(uint32_t ns, const unsigned char* id, unsigned int id_len) {
+	uint64_t hash = 14695981039346656037ull;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ns); i++) {
+		hash = (hash ^ ((ns >> (i * 8)) & 0xff)) * 1099511628211ull;
+	}
+	for (i = 0; i < id_len; i++) {
+		hash = (hash ^ id[i]) * 1099511628211ull;
+	}
+	return hash | 1;
+}
+
+uint32_t ctx_namespace(SSL_CTX* tls_ctx) {
+	if (region == NULL || tls_ctx == NULL) {
+		return 0;
+	}
+	return (uint32_t)(uintptr_t)SSL_CTX_get_ex_data(tls_ctx, ns_index);
+}
+
+/* Locks the stripe covering the hash's set. When the last holder died
+ * mid update, every set under the stripe is emptied rather than trusted */
+session_entry_t* set_lock(uint64_t hash, stripe_t** stripe) {
+	size_t set = (hash >> 1) % region->sets;
+	size_t i;
+
+	*stripe = &region->stripes[set % SESSION_CACHE_STRIPES];
+	if (pthread_mutex_lock(&(*stripe)->lock) == EOWNERDEAD) {
+		log_printf(LOG_WARNING, "Session cache lock owner died, dropping its sessions\n");
+		for (i = set % SESSION_CACHE_STRIPES; i < region->sets; i += SESSION_CACHE_STRIPES) {
+			memset(&region->entries[i * SESSION_CACHE_WAYS], 0,
+				sizeof(session_entry_t) * SESSION_CACHE_WAYS);
+		}
+		pthread_mutex_consistent(&(*stripe)->lock);
+	}
+	return &region->entries[set * SESSION_CACHE_WAYS];
+}
+
+session_entry_t* set_find(session_entry_t* set, uint64_t hash, uint32_t ns,
+		const unsigned char* id, unsigned int id_len) {
+	int i;
+
+	for (i = 0; i < SESSION_CACHE_WAYS; i++) {
+		if (set[i].hash == hash && set[i].ns == ns && set[i].id_len == id_len &&
+				memcmp(set[i].id, id, id_len) == 0) {
+			return &set[i];
+		}
+	}
+	return NULL;
+}
+
+unsigned char* entry_der(session_entry_t* entry) {
+	return der_slots + (size_t)(entry - region->entries) * SESSION_CACHE_DER_MAX;
+}
+
+/* Maps LOCATION/sessions, starting it over when it was written with a
+ * different layout or key */
+session_region_t* map_file(const char* location, size_t sets) {
+	session_region_t* map;
+	unsigned char key_id[32];
+	char path[PATH_MAX];
+	struct stat st;
+	size_t len;
+	int fd;
+
+	len = strlen(location);
+	if (snprintf(path, sizeof(path), "%s%s%s", location,
+			len > 0 && location[len - 1] == '/' ? "" : "/",
+			SESSION_STORE_FILE) >= (int)sizeof(path)) {
+		log_printf(LOG_ERROR, "SessionCacheLocation too long: %s\n", location);
+		return NULL;
+	}
+	EVP_Digest(store_key, sizeof(store_key), key_id, NULL, EVP_sha256(), NULL);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		log_printf(LOG_ERROR, "Failed to open session store %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || (st.st_size != 0 && (size_t)st.st_size != region_size)) {
+		/* a different SessionCacheSize, begin again */
+		if (ftruncate(fd, 0) == -1) {
+			log_printf(LOG_ERROR, "Failed to reset session store %s: %s\n", path, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+	}
+	if (ftruncate(fd, region_size) == -1) {
+		log_printf(LOG_ERROR, "Failed to size session store %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_printf(LOG_ERROR, "Failed to map session store %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (memcmp(map->magic, SESSION_STORE_MAGIC, sizeof(SESSION_STORE_MAGIC)) != 0 ||
+			map->version != SESSION_STORE_VERSION ||
+			map->ways != SESSION_CACHE_WAYS ||
+			map->der_max != SESSION_CACHE_DER_MAX ||
+			map->entry_size != sizeof(session_entry_t) ||
+			map->sets != sets ||
+			CRYPTO_memcmp(map->key_id, key_id, sizeof(key_id)) != 0) {
+		memset(map, 0, region_size);
+		memcpy(map->magic, SESSION_STORE_MAGIC, sizeof(SESSION_STORE_MAGIC));
+		map->version = SESSION_STORE_VERSION;
+		map->ways = SESSION_CACHE_WAYS;
+		map->der_max = SESSION_CACHE_DER_MAX;
+		map->entry_size = sizeof(session_entry_t);
+		map->sets = sets;
+		memcpy(map->key_id, key_id, sizeof(key_id));
+	}
+	return map;
+}
+
+/* Reads the sealing key into KEY, or makes one if the file doesn't
+ * exist. The ticket key store is sealed with the same key */
+int session_cache_load_key(const char* path, unsigned char* key) {
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT) {
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd == -1 || RAND_bytes(key, SESSION_KEY_LEN) != 1 ||
+				write(fd, key, SESSION_KEY_LEN) != SESSION_KEY_LEN) {
+			log_printf(LOG_ERROR, "Failed to create session key %s\n", path);
+			if (fd != -1) {
+				close(fd);
+				unlink(path);
+			}
+			return 1;
+		}
+		close(fd);
+		log_printf(LOG_INFO, "Created session key %s\n", path);
+		return 0;
+	}
+	if (fd == -1) {
+		log_printf(LOG_ERROR, "Failed to open session key %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	len = read(fd, key, SESSION_KEY_LEN);
+	close(fd);
+	if (len != SESSION_KEY_LEN) {
+		log_printf(LOG_ERROR, "Session key %s must hold %d bytes\n", path, SESSION_KEY_LEN);
+		return 1;
+	}
+	return 0;
+}
+
+/* AES-256-GCM over the DER, with the entry's key and expiry as
+ * associated data so a record can't be moved or extended. Fills in
+ * the nonce and tag. out may be the same buffer as der */
+int seal_der(session_entry_t* meta, const unsigned char* der, unsigned char* out) {
+	EVP_CIPHER_CTX* cipher_ctx;
+	int len;
+	int ret = 1;
+
+	if (RAND_bytes(meta->nonce, sizeof(meta->nonce)) != 1) {
+		return 1;
+	}
+	cipher_ctx = EVP_CIPHER_CTX_new();
+	if (cipher_ctx == NULL) {
+		return 1;
+	}
+	if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, store_key, meta->nonce) == 1 &&
+			EVP_EncryptUpdate(cipher_ctx, NULL, &len, (unsigned char*)&meta->expires,
+				offsetof(session_entry_t, nonce) - offsetof(session_entry_t, expires)) == 1 &&
+			EVP_EncryptUpdate(cipher_ctx, out, &len, der, meta->der_len) == 1 &&
+			EVP_EncryptFinal_ex(cipher_ctx, out + len, &len) == 1 &&
+			EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_GET_TAG, sizeof(meta->tag), meta->tag) == 1) {
+		ret = 0;
+	}
+	EVP_CIPHER_CTX_free(cipher_ctx);
+	return ret;
+}
+
+int open_der(session_entry_t* meta, const unsigned char* in, unsigned char* out) {
+	EVP_CIPHER_CTX* cipher_ctx;
+	int len;
+	int ret = 1;
+
+	cipher_ctx = EVP_CIPHER_CTX_new();
+	if (cipher_ctx == NULL) {
+		return 1;
+	}
+	if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, store_key, meta->nonce) == 1 &&
+			EVP_DecryptUpdate(cipher_ctx, NULL, &len, (unsigned char*)&meta->expires,
+				offsetof(session_entry_t, nonce) - offsetof(session_entry_t, expires)) == 1 &&
+			EVP_DecryptUpdate(cipher_ctx, out, &len, in, meta->der_len) == 1 &&
+			EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_TAG, sizeof(meta->tag), meta->tag) == 1 &&
+			EVP_DecryptFinal_ex(cipher_ctx, out + len, &len) == 1) {
+		ret = 0;
+	}
+	EVP_CIPHER_CTX_free(cipher_ctx);
+	return ret;
+}
+
+/* Frees entries that expired while the daemon was down or that don't
+ * open, as after a crash mid write. Returns how many are left */
+size_t sweep(void) {
+	unsigned char der[SESSION_CACHE_DER_MAX];
+	session_entry_t* entry;
+	time_t now = time(NULL);
+	size_t loaded = 0;
+	size_t i;
+
+	for (i = 0; i < region->sets * SESSION_CACHE_WAYS; i++) {
+		entry = &region->entries[i];
+		if (entry->hash == 0) {
+			continue;
+		}
+		if (entry->expires <= now || entry->der_len > SESSION_CACHE_DER_MAX ||
+				entry->id_len > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+				open_der(entry, entry_der(entry), der) != 0 ||
+				session_hash(entry->ns, entry->id, entry->id_len) != entry->hash) {
+			entry->hash = 0;
+			continue;
+		}
+		loaded++;
+	}
+	OPENSSL_cleanse(der, sizeof(der));
+	return loaded;
+}
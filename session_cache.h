@@ -0,0 +1,63 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+#include "config.h"
+
+#define SESSION_KEY_LEN		32
+
+typedef struct session_cache_stats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t stores;
+	uint64_t evictions; /* live sessions pushed out to make room */
+	uint64_t oversized; /* sessions too big to share */
+	size_t entries;
+} session_cache_stats_t;
+
+/* Server sessions live in one shared mapping made by the parent before
+ * it forks, so a client can resume on any worker. Entries sit in sets of
+ * SESSION_CACHE_WAYS, the least recently used is replaced when a set is
+ * full, and each set's process-shared lock is one of a fixed stripe.
+ * Sessions are keyed by ID within a namespace drawn from the profile
+ * and its SessionCacheLocation, and expire with SessionCacheTimeout.
+ * Given a location and key file the mapping is a file there, sealed
+ * with the key, and survives restarts. Without session_cache_init()
+ * contexts keep OpenSSL's own cache */
+int session_cache_init(size_t entries, const char* location, const char* key_file);
+void session_cache_attach(SSL_CTX* tls_ctx, ssa_config_t* ssa_config);
+long session_cache_mode(void);
+int session_cache_get_stats(session_cache_stats_t* stats);
+void session_cache_free(void);
+int session_cache_load_key(const char* path, unsigned char* key);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+/* Socket IDs from the kernel module are addresses of kernel socket
+ * structures, so their low bits are mostly constant and their high bits
+ * rarely change. The 64-bit finalizer from MurmurHash3 spreads them
+ * before the modulo so consecutive sockets land on different workers.
+ *
+ * Worker i listens and receives netlink messages on port base + i. All
+ * of a socket's state stays in the worker shard_for_id picks: a worker
+ * passes messages about other workers' sockets on to their port, so the
+ * kernel module saves a hop by sending to base + shard_for_id(id,
+ * worker_count) itself. Accepted sockets stay with their listener's
+ * worker instead, and the worker they shard to passes their messages
+ * on, see check_shard() in netlink.c. test_files/shard_test applies the same rule in
+ * userspace to load test the scheme without the module, and its
+ * routing_test checks the routing in netlink.c */
+static inline unsigned long long shard_mix(unsigned long long id) {
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	id *= 0xc4ceb9fe1a85ec53ULL;
+	id ^= id >> 33;
+	return id;
+}
+
+static inline int shard_for_id(unsigned long long id, int worker_count) {
+	if (worker_count <= 1) {
+		return 0;
+	}
+	return (int)(shard_mix(id) % (unsigned long long)worker_count);
+}
+
+/* Spreads a worker's sockets over its data plane threads. IDs reaching
+ * one worker already agree on shard_mix(id) % worker_count, so the
+ * thread is taken from the remaining high part of the hash */
+static inline int shard_for_thread(unsigned long long id, int worker_count, int thread_count) {
+	if (thread_count <= 1) {
+		return 0;
+	}
+	if (worker_count < 1) {
+		worker_count = 1;
+	}
+	return (int)((shard_mix(id) / (unsigned long long)worker_count) % (unsigned long long)thread_count);
+}
+
+#endif
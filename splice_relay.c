@@ -0,0 +1,252 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#include "splice_relay.h"
+#include "metrics.h"
+#include "log.h"
+
+typedef struct splice_dir {
+	splice_relay_t* relay;
+	evutil_socket_t src;
+	evutil_socket_t dst;
+	int pipe[2];
+	size_t pending; /* bytes sitting in the pipe */
+	size_t limit;
+	int reading;
+	int eof;
+	struct event* read_ev;
+	struct event* write_ev;
+} splice_dir_t;
+
+struct splice_relay {
+	splice_dir_t dirs[2];
+	splice_done_cb_t done_cb;
+	void* arg;
+	int done;
+};
+
+static int dir_init(splice_dir_t* dir, struct event_base* ev_base, size_t limit);
+static void dir_free(splice_dir_t* dir);
+static int dir_flush(splice_dir_t* dir);
+static void dir_read_cb(evutil_socket_t fd, short events, void* arg);
+static void dir_write_cb(evutil_socket_t fd, short events, void* arg);
+static void relay_finish(splice_relay_t* relay, int error);
+
+splice_relay_t* splice_relay_new(struct event_base* ev_base, evutil_socket_t plain_fd,
+	evutil_socket_t secure_fd, size_t limit, splice_done_cb_t done_cb, void* arg) {
+	splice_relay_t* relay;
+
+	relay = (splice_relay_t*)calloc(1, sizeof(splice_relay_t));
+	if (relay == NULL) {
+		return NULL;
+	}
+	relay->done_cb = done_cb;
+	relay->arg = arg;
+	relay->dirs[0].relay = relay;
+	relay->dirs[0].src = plain_fd;
+	relay->dirs[0].dst = secure_fd;
+	relay->dirs[1].relay = relay;
+	relay->dirs[1].src = secure_fd;
+	relay->dirs[1].dst = plain_fd;
+	relay->dirs[0].pipe[0] = relay->dirs[0].pipe[1] = -1;
+	relay->dirs[1].pipe[0] = relay->dirs[1].pipe[1] = -1;
+
+	if (dir_init(&relay->dirs[0], ev_base, limit) != 0 ||
+		dir_init(&relay->dirs[1], ev_base, limit) != 0) {
+		splice_relay_free(relay);
+		return NULL;
+	}
+	event_add(relay->dirs[0].read_ev, NULL);
+	event_add(relay->dirs[1].read_ev, NULL);
+	relay->dirs[0].reading = 1;
+	relay->dirs[1].reading = 1;
+	return relay;
+}
+
+void splice_relay_free(splice_relay_t* relay) {
+	if (relay == NULL) return;
+	dir_free(&relay->dirs[0]);
+	dir_free(&relay->dirs[1]);
+	free(relay);
+	return;
+}
+
+int dir_init(splice_dir_t* dir, struct event_base* ev_base, size_t limit) {
+	int size;
+
+	if (pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		log_printf(LOG_ERROR, "pipe2: %s\n", strerror(errno));
+		return 1;
+	}
+	/* Ask for room for the whole limit, the kernel may cap it at
+	 * pipe-max-size, in which case a full pipe is the limit */
+	size = fcntl(dir->pipe[1], F_SETPIPE_SZ, (int)limit);
+	if (size == -1) {
+		size = fcntl(dir->pipe[1], F_GETPIPE_SZ);
+	}
+	dir->limit = (size > 0 && (size_t)size < limit) ? (size_t)size : limit;
+
+	dir->read_ev = event_new(ev_base, dir->src, EV_READ | EV_PERSIST, dir_read_cb, dir);
+	dir->write_ev = event_new(ev_base, dir->dst, EV_WRITE | EV_PERSIST, dir_write_cb, dir);
+	if (dir->read_ev == NULL || dir->write_ev == NULL) {
+		return 1;
+	}
+	return 0;
+}
+
+void dir_free(splice_dir_t* dir) {
+	if (dir->read_ev != NULL) {
+		event_free(dir->read_ev);
+	}
+	if (dir->write_ev != NULL) {
+		event_free(dir->write_ev);
+	}
+	if (dir->pipe[0] != -1) {
+		close(dir->pipe[0]);
+		close(dir->pipe[1]);
+	}
+	return;
+}
+
+/* Pushes what is in the pipe to the destination and adjusts which
+ * events are wanted. Returns 0 or an errno */
+int dir_flush(splice_dir_t* dir) {
+	size_t before = dir->pending;
+	ssize_t n;
+
+	while (dir->pending > 0) {
+		n = splice(dir->pipe[0], NULL, dir->dst, NULL, dir->pending,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			dir->pending -= n;
+			metrics_relay_bytes(dir == &dir->relay->dirs[0] ?
+				METRICS_OUTBOUND : METRICS_INBOUND, n);
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			break;
+		}
+		return (n == -1) ? errno : EPIPE;
+	}
+
+	if (dir->pending > 0) {
+		event_add(dir->write_ev, NULL);
+	}
+	else {
+		event_del(dir->write_ev);
+	}
+	/* Only resume after progress, a pipe full of small segments can
+	 * refuse more while holding less than the limit */
+	if (!dir->reading && !dir->eof && dir->pending <= dir->limit / 2 &&
+		(dir->pending < before || dir->pending == 0)) {
+		event_add(dir->read_ev, NULL);
+		dir->reading = 1;
+	}
+	if (dir->eof && dir->pending == 0) {
+		shutdown(dir->dst, SHUT_WR);
+	}
+	return 0;
+}
+
+void dir_read_cb(evutil_socket_t fd, short events, void* arg) {
+	splice_dir_t* dir = arg;
+	ssize_t n;
+	int error;
+
+	n = splice(dir->src, NULL, dir->pipe[1], NULL, dir->limit - dir->pending,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		dir->pending += n;
+	}
+	else if (n == 0) {
+		dir->eof = 1;
+	}
+	else if (errno != EAGAIN) {
+		relay_finish(dir->relay, errno);
+		return;
+	}
+	else if (dir->pending == 0) {
+		/* Spurious wakeup, nothing to read */
+		return;
+	}
+
+	/* Stop reading while the pipe is at its limit, or full of small
+	 * segments, until the destination catches up */
+	if (dir->eof || n == -1 || dir->pending >= dir->limit) {
+		event_del(dir->read_ev);
+		dir->reading = 0;
+	}
+	error = dir_flush(dir);
+	if (error != 0) {
+		relay_finish(dir->relay, error);
+		return;
+	}
+	if (dir->relay->dirs[0].eof && dir->relay->dirs[0].pending == 0 &&
+		dir->relay->dirs[1].eof && dir->relay->dirs[1].pending == 0) {
+		relay_finish(dir->relay, 0);
+	}
+	return;
+}
+
+void dir_write_cb(evutil_socket_t fd, short events, void* arg) {
+	splice_dir_t* dir = arg;
+	int error;
+
+	error = dir_flush(dir);
+	if (error != 0) {
+		relay_finish(dir->relay, error);
+		return;
+	}
+	if (dir->relay->dirs[0].eof && dir->relay->dirs[0].pending == 0 &&
+		dir->relay->dirs[1].eof && dir->relay->dirs[1].pending == 0) {
+		relay_finish(dir->relay, 0);
+	}
+	return;
+}
+
+void relay_finish(splice_relay_t* relay, int error) {
+	int i;
+
+	if (relay->done) return;
+	relay->done = 1;
+	for (i = 0; i < 2; i++) {
+		event_del(relay->dirs[i].read_ev);
+		event_del(relay->dirs[i].write_ev);
+		relay->dirs[i].reading = 0;
+	}
+	relay->done_cb(relay->arg, error);
+	return;
+}
@@ -0,0 +1,48 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SPLICE_RELAY_H
+#define SPLICE_RELAY_H
+
+#include <event2/event.h>
+
+typedef struct splice_relay splice_relay_t;
+
+/* Called once when both directions have finished, with 0 after a clean
+ * EOF each way or the errno that stopped the relay */
+typedef void (*splice_done_cb_t)(void* arg, int error);
+
+/* Moves bytes between two sockets through a pipe per direction with
+ * splice(2), so the payload never enters userspace. Each direction stops
+ * reading once limit bytes are waiting in its pipe (or the pipe is full)
+ * and resumes when they drain to half of that, like the MAX_BUFFER
+ * watermarks on the bufferevent path. The caller keeps ownership of
+ * both sockets */
+splice_relay_t* splice_relay_new(struct event_base* ev_base, evutil_socket_t plain_fd,
+	evutil_socket_t secure_fd, size_t limit, splice_done_cb_t done_cb, void* arg);
+void splice_relay_free(splice_relay_t* relay);
+
+#endif
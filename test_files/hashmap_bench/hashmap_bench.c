@@ -0,0 +1,239 @@
+/* Microbenchmark for the socket ID table in hashmap.c.
+ *
+ * Fills the table with IDs shaped like kernel socket addresses, looks
+ * every one up, then deletes them, and does the same with the chained
+ * 100 bucket table the daemon used before (copied below as chain_*).
+ * Reports the mean cost of each operation and the slowest single add,
+ * which shows whether growing the table stalls a caller.
+ *
+ * usage: ./hashmap_bench [sockets] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../hashmap.h"
+
+#define ID_BASE		0xffff888012340000ULL
+#define ID_STRIDE	0x800 /* typical slab size for a TCP socket */
+#define OLD_BUCKETS	100
+
+typedef struct chain_node {
+	struct chain_node* next;
+	unsigned long key;
+	void* value;
+} chain_node_t;
+
+typedef struct chain_map {
+	chain_node_t** buckets;
+	int num_buckets;
+} chain_map_t;
+
+typedef struct timing {
+	double add_ns;
+	double get_ns;
+	double del_ns;
+	double worst_add_ns;
+} timing_t;
+
+static double now_ns(void);
+static void shuffle(unsigned long* keys, int count);
+static chain_map_t* chain_create(int num_buckets);
+static void chain_free(chain_map_t* map);
+static int chain_add(chain_map_t* map, unsigned long key, void* value);
+static void* chain_get(chain_map_t* map, unsigned long key);
+static int chain_del(chain_map_t* map, unsigned long key);
+static void run_new(unsigned long* keys, int count, timing_t* t);
+static void run_chain(unsigned long* keys, int count, timing_t* t);
+static void report(const char* name, timing_t* t, int rounds);
+
+int main(int argc, char* argv[]) {
+	int count = 100000;
+	int rounds = 3;
+	unsigned long* keys;
+	timing_t new_t = { 0 };
+	timing_t chain_t = { 0 };
+	int i;
+
+	if (argc > 1) count = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+
+	keys = malloc(sizeof(unsigned long) * count);
+	if (keys == NULL) {
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		keys[i] = ID_BASE + (unsigned long)i * ID_STRIDE;
+	}
+	srand(1);
+	shuffle(keys, count);
+
+	printf("%d sockets, %d rounds\n", count, rounds);
+	for (i = 0; i < rounds; i++) {
+		run_new(keys, count, &new_t);
+		run_chain(keys, count, &chain_t);
+	}
+	report("open addressing", &new_t, rounds);
+	report("chained, 100 buckets", &chain_t, rounds);
+	free(keys);
+	return 0;
+}
+
+double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void shuffle(unsigned long* keys, int count) {
+	int i;
+	for (i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		unsigned long tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+void run_new(unsigned long* keys, int count, timing_t* t) {
+	hmap_t* map = hashmap_create(OLD_BUCKETS);
+	double start;
+	double op;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		op = now_ns();
+		if (hashmap_add(map, keys[i], &keys[i]) != 0) {
+			fprintf(stderr, "add failed\n");
+			exit(1);
+		}
+		op = now_ns() - op;
+		if (op > t->worst_add_ns) t->worst_add_ns = op;
+	}
+	t->add_ns += (now_ns() - start) / count;
+
+	start = now_ns();
+	for (i = count - 1; i >= 0; i--) {
+		if (hashmap_get(map, keys[i]) != &keys[i]) {
+			fprintf(stderr, "get failed\n");
+			exit(1);
+		}
+	}
+	t->get_ns += (now_ns() - start) / count;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		if (hashmap_del(map, keys[i]) != 0) {
+			fprintf(stderr, "del failed\n");
+			exit(1);
+		}
+	}
+	t->del_ns += (now_ns() - start) / count;
+	hashmap_free(map);
+}
+
+void run_chain(unsigned long* keys, int count, timing_t* t) {
+	chain_map_t* map = chain_create(OLD_BUCKETS);
+	double start;
+	double op;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		op = now_ns();
+		chain_add(map, keys[i], &keys[i]);
+		op = now_ns() - op;
+		if (op > t->worst_add_ns) t->worst_add_ns = op;
+	}
+	t->add_ns += (now_ns() - start) / count;
+
+	start = now_ns();
+	for (i = count - 1; i >= 0; i--) {
+		if (chain_get(map, keys[i]) != &keys[i]) {
+			fprintf(stderr, "chain get failed\n");
+			exit(1);
+		}
+	}
+	t->get_ns += (now_ns() - start) / count;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		chain_del(map, keys[i]);
+	}
+	t->del_ns += (now_ns() - start) / count;
+	chain_free(map);
+}
+
+void report(const char* name, timing_t* t, int rounds) {
+	printf("%-22s add %8.1f ns  get %8.1f ns  del %8.1f ns  worst add %8.0f ns\n",
+		name, t->add_ns / rounds, t->get_ns / rounds, t->del_ns / rounds, t->worst_add_ns);
+}
+
+/* The previous hashmap.c, for comparison */
+chain_map_t* chain_create(int num_buckets) {
+	chain_map_t* map = malloc(sizeof(chain_map_t));
+	map->buckets = calloc(num_buckets, sizeof(chain_node_t*));
+	map->num_buckets = num_buckets;
+	return map;
+}
+
+void chain_free(chain_map_t* map) {
+	int i;
+	for (i = 0; i < map->num_buckets; i++) {
+		chain_node_t* cur = map->buckets[i];
+		while (cur != NULL) {
+			chain_node_t* next = cur->next;
+			free(cur);
+			cur = next;
+		}
+	}
+	free(map->buckets);
+	free(map);
+}
+
+int chain_add(chain_map_t* map, unsigned long key, void* value) {
+	int index = key % map->num_buckets;
+	chain_node_t* cur = map->buckets[index];
+	chain_node_t* node = malloc(sizeof(chain_node_t));
+	node->key = key;
+	node->value = value;
+	node->next = NULL;
+	if (cur == NULL) {
+		map->buckets[index] = node;
+		return 0;
+	}
+	for (;;) {
+		if (cur->key == key) {
+			free(node);
+			return 1;
+		}
+		if (cur->next == NULL) break;
+		cur = cur->next;
+	}
+	cur->next = node;
+	return 0;
+}
+
+void* chain_get(chain_map_t* map, unsigned long key) {
+	chain_node_t* cur = map->buckets[key % map->num_buckets];
+	while (cur != NULL) {
+		if (cur->key == key) return cur->value;
+		cur = cur->next;
+	}
+	return NULL;
+}
+
+int chain_del(chain_map_t* map, unsigned long key) {
+	chain_node_t** cur = &map->buckets[key % map->num_buckets];
+	while (*cur != NULL) {
+		if ((*cur)->key == key) {
+			chain_node_t* tmp = *cur;
+			*cur = tmp->next;
+			free(tmp);
+			return 0;
+		}
+		cur = &(*cur)->next;
+	}
+	return 1;
+}
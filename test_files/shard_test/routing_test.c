@@ -0,0 +1,346 @@
+/* Checks that netlink.c serves each socket in exactly one worker.
+ *
+ * Builds kernel-style netlink messages and feeds them to
+ * handle_netlink_msg() in every worker, with and without data plane
+ * threads. A message about a socket owned by another worker must be
+ * passed on to that worker's netlink port and not handled, so across
+ * all workers every message is handled once. An accepted socket is
+ * served by the worker holding its listener's plaintext leg, so its
+ * accept, getsockopt and close are followed from worker to worker until
+ * one handles them. Then data plane threads
+ * notify the kernel at once, as they do with Threads above 1, and each
+ * send must happen under the netlink lock. Sends are caught by
+ * replacing nl_send_auto() and the daemon callbacks are stubs.
+ *
+ * usage: ./routing_test
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netlink/genl/genl.h>
+
+#include "../../daemon.h"
+#include "../../dataplane.h"
+#include "../../shard.h"
+#include "../../hashmap.h"
+#include "../../loop_monitor.h"
+#include "../../netlink.h"
+#include "../../log.h"
+
+#define WORKERS		4
+#define THREADS		3
+#define BASE_PORT	8443
+#define SOCKETS		1000
+#define ID_BASE		0xffff888012340000ULL
+#define ID_STRIDE	0x800
+#define NOTIFIES	10000 /* per thread */
+
+/* Mirrors the command and attribute numbers in netlink.c */
+#define CMD_SOCKET_NOTIFY	1
+#define CMD_GETSOCKOPT_NOTIFY	3
+#define CMD_ACCEPT_NOTIFY	7
+#define CMD_CLOSE_NOTIFY	8
+#define CMD_RETURN		9
+#define ATTR_ID			1
+#define ATTR_COMM		3
+#define ATTR_SOCKADDR_INTERNAL	4
+#define ATTR_OPTLEVEL		7
+#define ATTR_OPTNAME		8
+
+int handle_netlink_msg(struct nl_msg* msg, void* arg);
+
+static int handled; /* callbacks run for the last message */
+static int handled_thread;
+static int sends;
+static int sent_port; /* 0 is the kernel */
+static int sent_cmd;
+static int fail_forward;
+static int failures;
+static char fake_dataplane; /* only compared with NULL */
+static pthread_mutex_t netlink_lock = PTHREAD_MUTEX_INITIALIZER;
+static int threaded; /* counters below are shared while set */
+static int unlocked_sends;
+static int leg_owner = -1; /* what port_owner_get() reports */
+
+static struct nl_msg* make_msg(int cmd, unsigned long id);
+static void deliver(tls_daemon_ctx_t* ctx, int cmd, unsigned long id);
+static int follow(tls_daemon_ctx_t* ctx, int w, int cmd, unsigned long id);
+static void check(int cond, const char* what, unsigned long id);
+static void init_ctx(tls_daemon_ctx_t* ctx, int worker_id, dataplane_t* dp);
+static void run(int threads);
+static void run_notify(int threads);
+static void* notify_thread(void* arg);
+
+int main(void) {
+	/* A send that never returns the netlink lock hangs the test */
+	alarm(30);
+	run(0);
+	run(THREADS);
+	run_notify(THREADS);
+	if (failures > 0) {
+		printf("FAIL: %d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("PASS\n");
+	return EXIT_SUCCESS;
+}
+
+void run(int threads) {
+	tls_daemon_ctx_t ctx[WORKERS];
+	dataplane_t* dp = threads > 0 ? (dataplane_t*)&fake_dataplane : NULL;
+	static const int cmds[] = { CMD_SOCKET_NOTIFY, CMD_CLOSE_NOTIFY };
+	unsigned long id;
+	int owner;
+	int listener;
+	int total;
+	int c;
+	int i;
+	int w;
+
+	for (w = 0; w < WORKERS; w++) {
+		init_ctx(&ctx[w], w, dp);
+		ctx[w].accepted = hashmap_create(64);
+	}
+	for (i = 0; i < SOCKETS; i++) {
+		id = ID_BASE + (unsigned long)i * ID_STRIDE;
+		owner = shard_for_id(id, WORKERS);
+		for (c = 0; c < 2; c++) {
+			/* As if multicast, every worker sees the message */
+			total = 0;
+			for (w = 0; w < WORKERS; w++) {
+				deliver(&ctx[w], cmds[c], id);
+				total += handled;
+				if (w == owner) {
+					check(handled == 1 && sends == 0, "owner handles its socket", id);
+					if (threads > 0) {
+						check(handled_thread == shard_for_thread(id, WORKERS, threads),
+							"owner's thread handles its socket", id);
+					}
+				}
+				else {
+					check(handled == 0, "other workers leave the socket alone", id);
+					check(sends == 1 && sent_port == BASE_PORT + owner,
+						"other workers pass the message to the owner", id);
+				}
+			}
+			check(total == 1, "handled exactly once", id);
+		}
+		/* Accepted sockets stay with the worker holding their leg,
+		 * whether the accept is multicast or sent to the shard */
+		listener = (owner + 1) % WORKERS;
+		leg_owner = listener;
+		check(follow(ctx, i % 2 == 0 ? 0 : owner, CMD_ACCEPT_NOTIFY, id) == listener,
+			"accept reaches the listener's worker", id);
+		check(follow(ctx, owner, CMD_GETSOCKOPT_NOTIFY, id) == listener,
+			"getsockopt follows the accepted socket", id);
+		check(follow(ctx, (owner + 2) % WORKERS, CMD_GETSOCKOPT_NOTIFY, id) == listener,
+			"getsockopt sent elsewhere follows the accepted socket", id);
+		check(follow(ctx, owner, CMD_CLOSE_NOTIFY, id) == listener,
+			"close follows the accepted socket", id);
+		check(follow(ctx, owner, CMD_GETSOCKOPT_NOTIFY, id) == owner,
+			"closed accepted socket is forgotten", id);
+		/* Without port owners the shard serves it, as before */
+		leg_owner = -1;
+		check(follow(ctx, listener, CMD_ACCEPT_NOTIFY, id) == owner,
+			"accept with an unknown leg stays with the shard", id);
+		check(follow(ctx, owner, CMD_CLOSE_NOTIFY, id) == owner,
+			"close with an unknown leg stays with the shard", id);
+
+		/* The kernel hears back if the owner can't be reached */
+		fail_forward = 1;
+		deliver(&ctx[(owner + 1) % WORKERS], CMD_SOCKET_NOTIFY, id);
+		check(handled == 0 && sends == 2 && sent_port == 0 && sent_cmd == CMD_RETURN,
+			"unreachable owner is reported to the kernel", id);
+		fail_forward = 0;
+	}
+	for (w = 0; w < WORKERS; w++) {
+		check(ctx[w].misrouted > 0, "misrouted messages are counted", (unsigned long)w);
+		hashmap_free(ctx[w].accepted);
+	}
+	printf("%d workers, %d threads: %d sockets routed\n", WORKERS, threads, SOCKETS);
+	return;
+}
+
+/* Every thread sends through the worker's one netlink socket */
+void run_notify(int threads) {
+	tls_daemon_ctx_t ctx;
+	pthread_t tids[THREADS];
+	int i;
+
+	init_ctx(&ctx, 0, (dataplane_t*)&fake_dataplane);
+	sends = 0;
+	threaded = 1;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, notify_thread, &ctx) != 0) {
+			fprintf(stderr, "Failed to start thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	threaded = 0;
+	check(sends == threads * NOTIFIES, "every notify is sent once", (unsigned long)sends);
+	check(unlocked_sends == 0, "sends hold the netlink lock", (unsigned long)unlocked_sends);
+	printf("%d threads: %d notifies sent\n", threads, sends);
+	return;
+}
+
+void* notify_thread(void* arg) {
+	tls_daemon_ctx_t* ctx = (tls_daemon_ctx_t*)arg;
+	int i;
+
+	for (i = 0; i < NOTIFIES; i++) {
+		netlink_notify_kernel(ctx, ID_BASE + (unsigned long)i * ID_STRIDE, 0);
+	}
+	return NULL;
+}
+
+void init_ctx(tls_daemon_ctx_t* ctx, int worker_id, dataplane_t* dp) {
+	memset(ctx, 0, sizeof(tls_daemon_ctx_t));
+	ctx->port = BASE_PORT + worker_id;
+	ctx->worker_id = worker_id;
+	ctx->worker_count = WORKERS;
+	ctx->netlink_family = 42;
+	ctx->dataplane = dp;
+	ctx->thread_id = DP_CONTROL_THREAD;
+	/* As in server_create, threads share the socket under a lock */
+	ctx->netlink_lock = dp != NULL ? &netlink_lock : NULL;
+	return;
+}
+
+void deliver(tls_daemon_ctx_t* ctx, int cmd, unsigned long id) {
+	struct nl_msg* msg = make_msg(cmd, id);
+
+	handled = 0;
+	handled_thread = DP_CONTROL_THREAD;
+	sends = 0;
+	sent_port = -1;
+	sent_cmd = -1;
+	handle_netlink_msg(msg, ctx);
+	nlmsg_free(msg);
+	return;
+}
+
+/* Delivers to worker w and follows each pass on, as the netlink ports
+ * would. Returns the worker that handled the message, or -1 */
+int follow(tls_daemon_ctx_t* ctx, int w, int cmd, unsigned long id) {
+	struct nl_msg* msg = make_msg(cmd, id);
+	int served_by = -1;
+	int hops;
+
+	for (hops = 0; hops <= WORKERS; hops++) {
+		handled = 0;
+		sends = 0;
+		sent_port = -1;
+		handle_netlink_msg(msg, &ctx[w]);
+		if (handled > 0) {
+			served_by = w;
+			break;
+		}
+		if (sends != 1 || sent_port <= 0) {
+			break;
+		}
+		w = sent_port - BASE_PORT;
+	}
+	nlmsg_free(msg);
+	return served_by;
+}
+
+struct nl_msg* make_msg(int cmd, unsigned long id) {
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	struct nl_msg* msg;
+
+	msg = nlmsg_alloc();
+	if (msg == NULL ||
+			genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 42, 0, 0, cmd, 1) == NULL ||
+			nla_put_u64(msg, ATTR_ID, id) != 0 ||
+			(cmd == CMD_SOCKET_NOTIFY && nla_put(msg, ATTR_COMM, 5, "test") != 0) ||
+			(cmd == CMD_ACCEPT_NOTIFY && nla_put(msg, ATTR_SOCKADDR_INTERNAL, sizeof(addr), &addr) != 0) ||
+			(cmd == CMD_GETSOCKOPT_NOTIFY && (nla_put_u32(msg, ATTR_OPTLEVEL, 0) != 0 ||
+				nla_put_u32(msg, ATTR_OPTNAME, 0) != 0))) {
+		fprintf(stderr, "Failed to build netlink message\n");
+		exit(EXIT_FAILURE);
+	}
+	return msg;
+}
+
+void check(int cond, const char* what, unsigned long id) {
+	if (cond) {
+		return;
+	}
+	if (failures++ < 10) {
+		printf("FAIL: %s (ID %#lx)\n", what, id);
+	}
+	return;
+}
+
+/* Stands in for libnl's send so replies and forwards can be inspected */
+int nl_send_auto(struct nl_sock* sock, struct nl_msg* msg) {
+	struct sockaddr_nl* dst = nlmsg_get_dst(msg);
+	struct genlmsghdr* gnlh = nlmsg_data(nlmsg_hdr(msg));
+
+	if (threaded) {
+		/* Only one thread gets here at a time if the caller holds it */
+		if (pthread_mutex_trylock(&netlink_lock) == 0) {
+			pthread_mutex_unlock(&netlink_lock);
+			unlocked_sends++;
+		}
+		sends++;
+		return 0;
+	}
+	sends++;
+	sent_port = dst->nl_family == AF_NETLINK ? (int)dst->nl_pid : 0;
+	sent_cmd = gnlh->cmd;
+	if (fail_forward && sent_port != 0) {
+		return -NLE_OBJ_NOTFOUND;
+	}
+	return 0;
+}
+
+int dataplane_thread_for_id(dataplane_t* dp, unsigned long id) {
+	return shard_for_thread(id, WORKERS, THREADS);
+}
+
+/* Runs the message at once on a context standing in for the thread's */
+int dataplane_dispatch(dataplane_t* dp, int thread_id, dp_func_t func, void* arg) {
+	tls_daemon_ctx_t thread_ctx;
+
+	init_ctx(&thread_ctx, 0, dp);
+	thread_ctx.thread_id = thread_id;
+	func(&thread_ctx, arg);
+	return 0;
+}
+
+static void served(tls_daemon_ctx_t* ctx) {
+	handled++;
+	handled_thread = ctx->thread_id;
+}
+
+void socket_cb(tls_daemon_ctx_t* ctx, unsigned long id, char* comm) { served(ctx); }
+void close_cb(tls_daemon_ctx_t* ctx, unsigned long id) { served(ctx); }
+void associate_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
+	int int_addrlen) { served(ctx); }
+void setsockopt_cb(tls_daemon_ctx_t* ctx, unsigned long id, int level,
+	int option, void* value, socklen_t len) { served(ctx); }
+void getsockopt_cb(tls_daemon_ctx_t* ctx, unsigned long id, int level, int option) { served(ctx); }
+void bind_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
+	int int_addrlen, struct sockaddr* ext_addr, int ext_addrlen) { served(ctx); }
+void connect_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
+	int int_addrlen, struct sockaddr* rem_addr, int rem_addrlen, int blocking) { served(ctx); }
+void listen_cb(tls_daemon_ctx_t* ctx, unsigned long id, struct sockaddr* int_addr,
+	int int_addrlen, struct sockaddr* ext_addr, int ext_addrlen) { served(ctx); }
+int sockaddr_port_key(struct sockaddr* addr) { return 0; }
+int sock_owner(tls_daemon_ctx_t* ctx, unsigned long id) { return -1; }
+int sock_owner_port(tls_daemon_ctx_t* ctx, int port) { return -1; }
+int port_owner_get(int key) { return leg_owner; }
+uint64_t metrics_now(void) { return 0; }
+void metrics_netlink(int cmd, uint64_t started) { }
+void loop_monitor_end(enum loop_cb type, unsigned long id, uint64_t started) { }
+#ifndef NO_LOG
+void log_printf(log_level_t level, const char* format, ...) { }
+#endif
@@ -0,0 +1,269 @@
+/* Load test for the worker sharding rule in shard.h.
+ *
+ * Stands in for the kernel module: the parent makes up socket IDs shaped
+ * like kernel socket addresses and steers each one with shard_for_id() to
+ * one of N forked workers, each pinned to its own CPU. Every worker does a
+ * full in-memory TLS handshake per socket, which is the dominant cost in
+ * the daemon for short connections. Run with 1..N workers to see how
+ * handshake throughput scales with cores.
+ *
+ * usage: ./shard_test [workers] [handshakes]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "../../shard.h"
+
+#define CERT_FILE	"../certificate_a.pem"
+#define KEY_FILE	"../key_a.pem"
+#define ID_BASE		0xffff888012340000ULL
+#define ID_STRIDE	0x800 /* typical slab size for a TCP socket */
+
+typedef struct result {
+	int worker_id;
+	unsigned long handshakes;
+	unsigned long misrouted;
+	unsigned long failures;
+	long usec;
+} result_t;
+
+static long elapsed_usec(struct timeval* start);
+static void pin(int worker_id);
+static int handshake(SSL_CTX* server_ctx, SSL_CTX* client_ctx);
+static void run_worker(int worker_id, int workers, int id_fd, int result_fd);
+
+int main(int argc, char* argv[]) {
+	int workers;
+	long handshakes;
+	int* id_fds;
+	int result_fds[2];
+	int fds[2];
+	pid_t* pids;
+	result_t result;
+	result_t* results;
+	struct timeval start;
+	unsigned long long id;
+	long usec;
+	long i;
+	int w;
+
+	workers = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	handshakes = argc > 2 ? atol(argv[2]) : 20000;
+	if (workers <= 0 || handshakes <= 0) {
+		fprintf(stderr, "usage: %s [workers] [handshakes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	id_fds = calloc(workers, sizeof(int));
+	pids = calloc(workers, sizeof(pid_t));
+	results = calloc(workers, sizeof(result_t));
+	if (id_fds == NULL || pids == NULL || results == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	if (pipe(result_fds) == -1) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+
+	for (w = 0; w < workers; w++) {
+		if (pipe(fds) == -1) {
+			perror("pipe");
+			return EXIT_FAILURE;
+		}
+		pids[w] = fork();
+		if (pids[w] == -1) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pids[w] == 0) {
+			close(fds[1]);
+			close(result_fds[0]);
+			/* Drop the write ends inherited for earlier workers */
+			for (i = 0; i < w; i++) {
+				close(id_fds[i]);
+			}
+			run_worker(w, workers, fds[0], result_fds[1]);
+			exit(EXIT_SUCCESS);
+		}
+		close(fds[0]);
+		id_fds[w] = fds[1];
+	}
+	close(result_fds[1]);
+
+	/* Steer sockets the way the kernel module would */
+	gettimeofday(&start, NULL);
+	for (i = 0; i < handshakes; i++) {
+		id = ID_BASE + (unsigned long long)i * ID_STRIDE;
+		w = shard_for_id(id, workers);
+		if (write(id_fds[w], &id, sizeof(id)) != sizeof(id)) {
+			perror("write");
+			return EXIT_FAILURE;
+		}
+	}
+	for (w = 0; w < workers; w++) {
+		close(id_fds[w]);
+	}
+
+	/* Results are smaller than PIPE_BUF so each arrives whole */
+	while (read(result_fds[0], &result, sizeof(result)) == sizeof(result)) {
+		if (result.worker_id >= 0 && result.worker_id < workers) {
+			results[result.worker_id] = result;
+		}
+	}
+	for (w = 0; w < workers; w++) {
+		waitpid(pids[w], NULL, 0);
+	}
+	usec = elapsed_usec(&start);
+
+	for (w = 0; w < workers; w++) {
+		printf("worker %3d: %8lu handshakes (%5.1f%%), %lu failed, %lu misrouted, %.0f/s\n", w,
+			results[w].handshakes,
+			100.0 * results[w].handshakes / handshakes,
+			results[w].failures,
+			results[w].misrouted,
+			results[w].usec > 0 ? results[w].handshakes * 1e6 / results[w].usec : 0.0);
+	}
+	printf("%d workers: %ld handshakes in %.3f s, %.0f handshakes/s\n", workers,
+		handshakes, usec / 1e6, handshakes * 1e6 / usec);
+
+	free(id_fds);
+	free(pids);
+	free(results);
+	return EXIT_SUCCESS;
+}
+
+long elapsed_usec(struct timeval* start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+}
+
+void pin(int worker_id) {
+	cpu_set_t allowed;
+	cpu_set_t target;
+	int n;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+		return;
+	}
+	n = worker_id % CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+			break;
+		}
+	}
+	CPU_ZERO(&target);
+	CPU_SET(cpu, &target);
+	if (sched_setaffinity(0, sizeof(target), &target) == -1) {
+		fprintf(stderr, "worker %d: sched_setaffinity: %s\n", worker_id, strerror(errno));
+	}
+}
+
+/* Drives both ends of a handshake over a BIO pair until each completes */
+int handshake(SSL_CTX* server_ctx, SSL_CTX* client_ctx) {
+	SSL* server;
+	SSL* client;
+	BIO* server_bio;
+	BIO* client_bio;
+	int server_done = 0;
+	int client_done = 0;
+	int rounds;
+	int ret;
+
+	server = SSL_new(server_ctx);
+	client = SSL_new(client_ctx);
+	if (server == NULL || client == NULL ||
+			BIO_new_bio_pair(&server_bio, 0, &client_bio, 0) != 1) {
+		SSL_free(server);
+		SSL_free(client);
+		return 0;
+	}
+	SSL_set_bio(server, server_bio, server_bio);
+	SSL_set_bio(client, client_bio, client_bio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+
+	for (rounds = 0; rounds < 32 && (server_done == 0 || client_done == 0); rounds++) {
+		if (client_done == 0) {
+			ret = SSL_do_handshake(client);
+			if (ret == 1) {
+				client_done = 1;
+			}
+			else if (SSL_get_error(client, ret) != SSL_ERROR_WANT_READ) {
+				break;
+			}
+		}
+		if (server_done == 0) {
+			ret = SSL_do_handshake(server);
+			if (ret == 1) {
+				server_done = 1;
+			}
+			else if (SSL_get_error(server, ret) != SSL_ERROR_WANT_READ) {
+				break;
+			}
+		}
+	}
+	SSL_free(server);
+	SSL_free(client);
+	return server_done == 1 && client_done == 1;
+}
+
+void run_worker(int worker_id, int workers, int id_fd, int result_fd) {
+	SSL_CTX* server_ctx;
+	SSL_CTX* client_ctx;
+	unsigned long long id;
+	result_t result;
+	struct timeval start;
+
+	pin(worker_id);
+
+	SSL_library_init();
+	SSL_load_error_strings();
+	server_ctx = SSL_CTX_new(SSLv23_method());
+	client_ctx = SSL_CTX_new(SSLv23_method());
+	if (server_ctx == NULL || client_ctx == NULL ||
+			SSL_CTX_use_certificate_chain_file(server_ctx, CERT_FILE) != 1 ||
+			SSL_CTX_use_PrivateKey_file(server_ctx, KEY_FILE, SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+	/* Each socket is a fresh connection, as in the daemon */
+	SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+	memset(&result, 0, sizeof(result));
+	result.worker_id = worker_id;
+	gettimeofday(&start, NULL);
+	while (read(id_fd, &id, sizeof(id)) == sizeof(id)) {
+		/* The daemon would pass these on to their owner */
+		if (shard_for_id(id, workers) != worker_id) {
+			result.misrouted++;
+		}
+		if (handshake(server_ctx, client_ctx) == 1) {
+			result.handshakes++;
+		}
+		else {
+			result.failures++;
+		}
+	}
+	result.usec = elapsed_usec(&start);
+
+	if (write(result_fd, &result, sizeof(result)) != sizeof(result)) {
+		perror("write");
+	}
+	SSL_CTX_free(server_ctx);
+	SSL_CTX_free(client_ctx);
+}
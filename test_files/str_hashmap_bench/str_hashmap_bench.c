@@ -0,0 +1,213 @@
+/* Microbenchmark for the application path lookups in hashmap_str.c.
+ *
+ * Builds a config table keyed by application paths like the ones in
+ * ssa.cfg, then times lookups the way get_app_config does them: mostly
+ * hits, plus misses that fall back to the default profile. The old
+ * byte-sum table (copied below as sum_*) runs the same workload with the
+ * bucket count config.c used, where paths sharing a prefix land in a
+ * handful of buckets and every probe rescans the key with strlen.
+ *
+ * usage: ./str_hashmap_bench [profiles] [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../hashmap_str.h"
+
+#define OLD_BUCKETS	20
+#define PATH_MAX_LEN	128
+
+typedef struct sum_node {
+	struct sum_node* next;
+	char* key;
+	void* value;
+} sum_node_t;
+
+typedef struct sum_map {
+	sum_node_t** buckets;
+	int num_buckets;
+} sum_map_t;
+
+static const char* prefixes[] = {
+	"/usr/bin/",
+	"/usr/local/bin/",
+	"/usr/sbin/",
+	"/opt/google/chrome/",
+	"/snap/bin/",
+	"/home/user/.local/bin/",
+};
+
+static const char* names[] = {
+	"firefox", "chrome", "curl", "wget", "ssh", "git", "python3", "node",
+	"java", "thunderbird", "evolution", "apt", "dnf", "pip3", "npm",
+	"openssl", "lynx", "links", "mutt", "postfix", "nginx", "httpd",
+	"lighttpd", "redis-server", "psql", "mysql", "rsync", "scp", "sftp",
+	"docker", "podman", "kubectl", "helm", "terraform", "code", "slack",
+};
+
+static double now_ns(void);
+static char** make_paths(int count, const char* tag);
+static sum_map_t* sum_create(int num_buckets);
+static void sum_free(sum_map_t* map);
+static void sum_add(sum_map_t* map, char* key, void* value);
+static void* sum_get(sum_map_t* map, char* key);
+static int sum_hash(sum_map_t* map, char* key);
+
+int main(int argc, char* argv[]) {
+	int count = 200;
+	int lookups = 2000000;
+	char** paths;
+	char** misses;
+	hsmap_t* map;
+	sum_map_t* old;
+	double start;
+	double new_ns;
+	double old_ns;
+	void* found;
+	int i;
+
+	if (argc > 1) count = atoi(argv[1]);
+	if (argc > 2) lookups = atoi(argv[2]);
+
+	paths = make_paths(count, "");
+	misses = make_paths(count, "-unconfigured");
+	if (paths == NULL || misses == NULL) {
+		return 1;
+	}
+
+	map = str_hashmap_create(OLD_BUCKETS);
+	old = sum_create(OLD_BUCKETS);
+	for (i = 0; i < count; i++) {
+		str_hashmap_add(map, paths[i], paths[i]);
+		sum_add(old, paths[i], paths[i]);
+	}
+
+	/* Every fourth lookup is an application without a profile */
+	start = now_ns();
+	for (i = 0; i < lookups; i++) {
+		if ((i & 3) == 3) {
+			found = str_hashmap_get(map, misses[i % count]);
+			if (found != NULL) goto fail;
+		}
+		else {
+			found = str_hashmap_get(map, paths[i % count]);
+			if (found != paths[i % count]) goto fail;
+		}
+	}
+	new_ns = (now_ns() - start) / lookups;
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++) {
+		if ((i & 3) == 3) {
+			found = sum_get(old, misses[i % count]);
+			if (found != NULL) goto fail;
+		}
+		else {
+			found = sum_get(old, paths[i % count]);
+			if (found != paths[i % count]) goto fail;
+		}
+	}
+	old_ns = (now_ns() - start) / lookups;
+
+	printf("%d profiles, %d lookups (25%% misses)\n", count, lookups);
+	printf("%-18s %8.1f ns per lookup, %d buckets\n", "fnv-1a", new_ns, map->num_buckets);
+	printf("%-18s %8.1f ns per lookup, %d buckets\n", "byte sum", old_ns, old->num_buckets);
+
+	str_hashmap_free(map);
+	sum_free(old);
+	for (i = 0; i < count; i++) {
+		free(paths[i]);
+		free(misses[i]);
+	}
+	free(paths);
+	free(misses);
+	return 0;
+fail:
+	fprintf(stderr, "lookup %d returned the wrong value\n", i);
+	return 1;
+}
+
+double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Paths are unique: names repeat under each prefix, then get a version suffix */
+char** make_paths(int count, const char* tag) {
+	int num_prefixes = sizeof(prefixes) / sizeof(prefixes[0]);
+	int num_names = sizeof(names) / sizeof(names[0]);
+	char** paths;
+	int i;
+
+	paths = malloc(sizeof(char*) * count);
+	if (paths == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		int round = i / (num_prefixes * num_names);
+		paths[i] = malloc(PATH_MAX_LEN);
+		if (round == 0) {
+			snprintf(paths[i], PATH_MAX_LEN, "%s%s%s", prefixes[i % num_prefixes],
+				names[(i / num_prefixes) % num_names], tag);
+		}
+		else {
+			snprintf(paths[i], PATH_MAX_LEN, "%s%s-%d%s", prefixes[i % num_prefixes],
+				names[(i / num_prefixes) % num_names], round, tag);
+		}
+	}
+	return paths;
+}
+
+/* The previous hashmap_str.c, for comparison */
+int sum_hash(sum_map_t* map, char* key) {
+	int i;
+	int hash_val = 0;
+	for (i = 0; i < strlen(key); ++i) {
+		hash_val += key[i];
+	}
+	return hash_val % map->num_buckets;
+}
+
+sum_map_t* sum_create(int num_buckets) {
+	sum_map_t* map = malloc(sizeof(sum_map_t));
+	map->buckets = calloc(num_buckets, sizeof(sum_node_t*));
+	map->num_buckets = num_buckets;
+	return map;
+}
+
+void sum_free(sum_map_t* map) {
+	int i;
+	for (i = 0; i < map->num_buckets; i++) {
+		sum_node_t* cur = map->buckets[i];
+		while (cur != NULL) {
+			sum_node_t* next = cur->next;
+			free(cur);
+			cur = next;
+		}
+	}
+	free(map->buckets);
+	free(map);
+}
+
+void sum_add(sum_map_t* map, char* key, void* value) {
+	int index = sum_hash(map, key);
+	sum_node_t* node = malloc(sizeof(sum_node_t));
+	node->key = key;
+	node->value = value;
+	node->next = map->buckets[index];
+	map->buckets[index] = node;
+}
+
+void* sum_get(sum_map_t* map, char* key) {
+	sum_node_t* cur = map->buckets[sum_hash(map, key)];
+	while (cur != NULL) {
+		if (strcmp(cur->key, key) == 0) {
+			return cur->value;
+		}
+		cur = cur->next;
+	}
+	return NULL;
+}
@@ -0,0 +1,447 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "ticket_keys.h"
+#include "session_cache.h"
+#include "log.h"
+
+#define TICKET_NAME_LEN		16
+#define TICKET_AES_LEN		32
+#define TICKET_HMAC_LEN		32
+#define TICKET_STORE_MAGIC	"SSATKTS"
+#define TICKET_STORE_VERSION	1
+#define TICKET_STORE_FILE	"tickets"
+#define TICKET_NONCE_LEN	12
+#define TICKET_TAG_LEN		16
+
+enum ticket_slot { KEY_PREVIOUS, KEY_CURRENT, KEY_NEXT, KEY_SLOTS };
+
+typedef struct ticket_key {
+	unsigned char name[TICKET_NAME_LEN];
+	unsigned char aes_key[TICKET_AES_LEN];
+	unsigned char hmac_key[TICKET_HMAC_LEN];
+} ticket_key_t;
+
+typedef struct ticket_region {
+	pthread_mutex_t lock; /* taken to rotate, readers go by seq */
+	unsigned long seq; /* odd while keys are being rotated */
+	time_t rotated_at;
+	long rotate_secs;
+	int has_previous;
+	ticket_key_t keys[KEY_SLOTS];
+} ticket_region_t;
+
+/* What the store file holds, sealed */
+typedef struct ticket_state {
+	int64_t rotated_at;
+	int32_t has_previous;
+	ticket_key_t keys[KEY_SLOTS];
+} ticket_state_t;
+
+typedef struct ticket_store {
+	char magic[sizeof(TICKET_STORE_MAGIC)];
+	uint32_t version;
+	unsigned char nonce[TICKET_NONCE_LEN];
+	unsigned char tag[TICKET_TAG_LEN];
+	unsigned char state[sizeof(ticket_state_t)];
+} ticket_store_t;
+
+static ticket_region_t* region;
+static char store_path[PATH_MAX]; /* empty when keys aren't kept */
+static unsigned char store_key[SESSION_KEY_LEN];
+
+static int new_key(ticket_key_t* key);
+static int set_store(const char* location, const char* key_file);
+static int load_keys(void);
+static void save_keys(void);
+static int seal_state(ticket_store_t* store, ticket_state_t* state, int enc);
+static void snapshot(ticket_key_t* keys, int* has_previous);
+static void rotate_if_due(void);
+static int find_key(ticket_key_t* keys, int has_previous, const unsigned char* name);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL* tls, unsigned char* name, unsigned char* iv,
+	EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc);
+#else
+static int ticket_key_cb(SSL* tls, unsigned char* name, unsigned char* iv,
+	EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* mac_ctx, int enc);
+#endif
+
+/* Called by the parent before it forks. With a location and a key
+ * file the keys are kept there, sealed, and read back here, so tickets
+ * issued before a restart still open after it */
+int ticket_keys_init(long rotate_secs, const char* location, const char* key_file) {
+	pthread_mutexattr_t attr;
+	time_t now = time(NULL);
+
+	region = mmap(NULL, sizeof(ticket_region_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		log_printf(LOG_ERROR, "Failed to map ticket keys: %s\n", strerror(errno));
+		region = NULL;
+		return 1;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&region->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	region->rotate_secs = rotate_secs;
+
+	if (location != NULL && key_file != NULL && set_store(location, key_file) != 0) {
+		log_printf(LOG_ERROR, "Keeping ticket keys in memory only\n");
+	}
+	if (store_path[0] != '\0' && load_keys() == 0) {
+		/* the clock went back, don't wait for it to catch up */
+		if (region->rotated_at > now) {
+			region->rotated_at = now;
+		}
+		log_printf(LOG_INFO, "Loaded session ticket keys from %s\n", store_path);
+		return 0;
+	}
+	if (new_key(&region->keys[KEY_CURRENT]) != 0 || new_key(&region->keys[KEY_NEXT]) != 0) {
+		log_printf(LOG_ERROR, "Failed to generate ticket keys\n");
+		ticket_keys_free();
+		return 1;
+	}
+	region->rotated_at = now;
+	save_keys();
+	return 0;
+}
+
+/* Without ticket_keys_init() the context keeps OpenSSL's own keys */
+void ticket_keys_attach(SSL_CTX* tls_ctx) {
+	if (region == NULL) {
+		return;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(tls_ctx, ticket_key_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(tls_ctx, ticket_key_cb);
+#endif
+	return;
+}
+
+void ticket_keys_free(void) {
+	if (region == NULL) {
+		return;
+	}
+	OPENSSL_cleanse(region->keys, sizeof(region->keys));
+	munmap(region, sizeof(ticket_region_t));
+	region = NULL;
+	store_path[0] = '\0';
+	OPENSSL_cleanse(store_key, sizeof(store_key));
+	return;
+}
+
+int new_key(ticket_key_t* key) {
+	if (RAND_bytes((unsigned char*)key, sizeof(ticket_key_t)) != 1) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Seqlock read, retried if a rotation overlapped the copy */
+void snapshot(ticket_key_t* keys, int* has_previous) {
+	unsigned long seq;
+
+	do {
+		seq = __atomic_load_n(&region->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(keys, region->keys, sizeof(region->keys));
+		*has_previous = region->has_previous;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&region->seq, __ATOMIC_RELAXED) != seq);
+	return;
+}
+
+void rotate_if_due(void) {
+	ticket_key_t next;
+	time_t now = time(NULL);
+
+	if (region->rotate_secs == 0 ||
+			now < __atomic_load_n(&region->rotated_at, __ATOMIC_RELAXED) + region->rotate_secs) {
+		return;
+	}
+	if (new_key(&next) != 0) {
+		log_printf(LOG_ERROR, "Failed to generate ticket key, keeping the current one\n");
+		return;
+	}
+	if (pthread_mutex_lock(&region->lock) == EOWNERDEAD) {
+		/* a worker died mid rotation, the keys may be torn either way */
+		pthread_mutex_consistent(&region->lock);
+		if (region->seq & 1) {
+			region->seq++;
+		}
+	}
+	/* another worker may have just done it */
+	if (now >= region->rotated_at + region->rotate_secs) {
+		__atomic_add_fetch(&region->seq, 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		region->keys[KEY_PREVIOUS] = region->keys[KEY_CURRENT];
+		region->keys[KEY_CURRENT] = region->keys[KEY_NEXT];
+		region->keys[KEY_NEXT] = next;
+		region->has_previous = 1;
+		__atomic_store_n(&region->rotated_at, now, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&region->seq, 1, __ATOMIC_RELEASE);
+		log_printf(LOG_INFO, "Rotated session ticket keys\n");
+		save_keys();
+	}
+	pthread_mutex_unlock(&region->lock);
+	OPENSSL_cleanse(&next, sizeof(next));
+	return;
+}
+
+int find_key(ticket_key_t* keys, int has_previous, const unsigned char* name) {
+	int i;
+
+	for (i = has_previous ? KEY_PREVIOUS : KEY_CURRENT; i < KEY_SLOTS; i++) {
+		if (CRYPTO_memcmp(keys[i].name, name, TICKET_NAME_LEN) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Returns 1 to use the ticket, 2 to use it and issue a fresh one, 0 to
+ * fall back to a full handshake and -1 on error */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int ticket_key_cb(SSL* tls, unsigned char* name, unsigned char* iv,
+		EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc) {
+	OSSL_PARAM params[3];
+#else
+int ticket_key_cb(SSL* tls, unsigned char* name, unsigned char* iv,
+		EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* mac_ctx, int enc) {
+#endif
+	ticket_key_t keys[KEY_SLOTS];
+	ticket_key_t* key;
+	int has_previous;
+	int slot;
+	int ret = -1;
+
+	rotate_if_due();
+	snapshot(keys, &has_previous);
+	if (enc) {
+		slot = KEY_CURRENT;
+		memcpy(name, keys[slot].name, TICKET_NAME_LEN);
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+			goto out;
+		}
+	}
+	else {
+		slot = find_key(keys, has_previous, name);
+		if (slot == -1) {
+			ret = 0;
+			goto out;
+		}
+	}
+	key = &keys[slot];
+	if (EVP_CipherInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv, enc) != 1) {
+		goto out;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+		key->hmac_key, TICKET_HMAC_LEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) {
+		goto out;
+	}
+#else
+	if (HMAC_Init_ex(mac_ctx, key->hmac_key, TICKET_HMAC_LEN, EVP_sha256(), NULL) != 1) {
+		goto out;
+	}
+#endif
+	ret = (!enc && slot == KEY_PREVIOUS) ? 2 : 1;
+out:
+	OPENSSL_cleanse(keys, sizeof(keys));
+	return ret;
+}
+
+/* Keeps the keys in LOCATION/tickets, sealed with the session key */
+int set_store(const char* location, const char* key_file) {
+	size_t len;
+
+	len = strlen(location);
+	if (snprintf(store_path, sizeof(store_path), "%s%s%s", location,
+			len > 0 && location[len - 1] == '/' ? "" : "/",
+			TICKET_STORE_FILE) >= (int)sizeof(store_path)) {
+		log_printf(LOG_ERROR, "SessionCacheLocation too long: %s\n", location);
+		store_path[0] = '\0';
+		return 1;
+	}
+	if (session_cache_load_key(key_file, store_key) != 0) {
+		store_path[0] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+/* Fills the region from the store. A missing, torn or foreign store
+ * fails and fresh keys are made instead */
+int load_keys(void) {
+	ticket_store_t store;
+	ticket_state_t state;
+	ssize_t len;
+	int fd;
+	int ret = 1;
+
+	fd = open(store_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			log_printf(LOG_ERROR, "Failed to open ticket key store %s: %s\n",
+				store_path, strerror(errno));
+		}
+		return 1;
+	}
+	len = read(fd, &store, sizeof(store));
+	close(fd);
+	if (len != sizeof(store) ||
+			memcmp(store.magic, TICKET_STORE_MAGIC, sizeof(TICKET_STORE_MAGIC)) != 0 ||
+			store.version != TICKET_STORE_VERSION ||
+			seal_state(&store, &state, 0) != 0) {
+		log_printf(LOG_ERROR, "Ticket key store %s doesn't open, starting it over\n", store_path);
+		goto out;
+	}
+	memcpy(region->keys, state.keys, sizeof(region->keys));
+	region->has_previous = state.has_previous != 0;
+	region->rotated_at = (time_t)state.rotated_at;
+	ret = 0;
+out:
+	OPENSSL_cleanse(&store, sizeof(store));
+	OPENSSL_cleanse(&state, sizeof(state));
+	return ret;
+}
+
+/* Writes the region out to the store. Called with the keys settled,
+ * before the fork or under the rotation lock, so writers never overlap.
+ * The new store goes in whole by rename, a crash leaves the old one */
+void save_keys(void) {
+	char tmp_path[PATH_MAX + 4];
+	ticket_store_t store;
+	ticket_state_t state;
+	int fd;
+
+	if (store_path[0] == '\0') {
+		return;
+	}
+	memset(&store, 0, sizeof(store));
+	memset(&state, 0, sizeof(state));
+	memcpy(store.magic, TICKET_STORE_MAGIC, sizeof(TICKET_STORE_MAGIC));
+	store.version = TICKET_STORE_VERSION;
+	memcpy(state.keys, region->keys, sizeof(state.keys));
+	state.has_previous = region->has_previous;
+	state.rotated_at = region->rotated_at;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store_path);
+
+	if (seal_state(&store, &state, 1) != 0) {
+		log_printf(LOG_ERROR, "Failed to seal session ticket keys\n");
+		goto out;
+	}
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		log_printf(LOG_ERROR, "Failed to open ticket key store %s: %s\n", tmp_path, strerror(errno));
+		goto out;
+	}
+	if (write(fd, &store, sizeof(store)) != sizeof(store) || fsync(fd) == -1) {
+		log_printf(LOG_ERROR, "Failed to write ticket key store %s\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp_path, store_path) == -1) {
+		log_printf(LOG_ERROR, "Failed to replace ticket key store %s: %s\n",
+			store_path, strerror(errno));
+		unlink(tmp_path);
+	}
+out:
+	OPENSSL_cleanse(&store, sizeof(store));
+	OPENSSL_cleanse(&state, sizeof(state));
+	return;
+}
+
+/* AES-256-GCM between STATE and the store, with the store's magic and
+ * version as associated data. Sealing fills in the nonce and tag */
+int seal_state(ticket_store_t* store, ticket_state_t* state, int enc) {
+	EVP_CIPHER_CTX* cipher_ctx;
+	unsigned char* out;
+	unsigned char* in;
+	int len;
+	int ret = 1;
+
+	if (enc && RAND_bytes(store->nonce, sizeof(store->nonce)) != 1) {
+		return 1;
+	}
+	in = enc ? (unsigned char*)state : store->state;
+	out = enc ? store->state : (unsigned char*)state;
+	cipher_ctx = EVP_CIPHER_CTX_new();
+	if (cipher_ctx == NULL) {
+		return 1;
+	}
+	if (EVP_CipherInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, store_key, store->nonce, enc) != 1 ||
+			EVP_CipherUpdate(cipher_ctx, NULL, &len, (unsigned char*)store,
+				offsetof(ticket_store_t, nonce)) != 1 ||
+			EVP_CipherUpdate(cipher_ctx, out, &len, in, sizeof(ticket_state_t)) != 1) {
+		goto out;
+	}
+	if (!enc && EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_TAG,
+			sizeof(store->tag), store->tag) != 1) {
+		goto out;
+	}
+	if (EVP_CipherFinal_ex(cipher_ctx, out + len, &len) != 1) {
+		goto out;
+	}
+	if (enc && EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_GET_TAG,
+			sizeof(store->tag), store->tag) != 1) {
+		goto out;
+	}
+	ret = 0;
+out:
+	EVP_CIPHER_CTX_free(cipher_ctx);
+	return ret;
+}
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 #include <event2/bufferevent_ssl.h>
@@ -48,28 +49,65 @@
 #include "log.h"
 #include "config.h"
 #include "netlink.h"
+#include "trust_store.h"
+#include "relay_budget.h"
+#include "pool.h"
+#include "metrics.h"
+#include "loop_monitor.h"
+#include "session_cache.h"
+#include "ticket_keys.h"
+#include "client_sessions.h"
+#include "verify_cache.h"
 
-#define MAX_BUFFER	1024*1024*10
 #define IPPROTO_TLS 	(715 % 255)
 
 
-static SSL* tls_server_setup(SSL_CTX* tls_ctx);
+static SSL* tls_server_setup(SSL_CTX* tls_ctx, tls_opts_t* tls_opts);
 static SSL* tls_client_setup(SSL_CTX* tls_ctx, char* hostname);
 static void tls_bev_write_cb(struct bufferevent *bev, void *arg);
 static void tls_bev_read_cb(struct bufferevent *bev, void *arg);
 static void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg);
+static void tls_bev_write(struct bufferevent *bev, void *arg);
+static void tls_bev_read(struct bufferevent *bev, void *arg);
+static void tls_bev_event(struct bufferevent *bev, short events, void *arg);
+static unsigned long tls_store_conn_id(X509_STORE_CTX* store);
 static int server_name_cb(SSL* tls, int* ad, void* arg);
 static int server_alpn_cb(SSL *s, const unsigned char **out, unsigned char *outlen,
 	       	const unsigned char *in, unsigned int inlen, void *arg);
 static SSL_CTX* get_tls_ctx_from_name(tls_opts_t* tls_opts, const char* hostname);
 
+static void tls_ctx_server_setup(SSL_CTX* tls_ctx);
+static void tls_ctx_client_setup(SSL_CTX* tls_ctx);
+static int tls_opts_make_private(tls_opts_t* opts);
+
 static tls_conn_ctx_t* new_tls_conn_ctx();
+static void tls_pools_init(void);
+
+static pool_t* conn_pool;
+static pool_t* opts_pool;
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+static void tls_ring_cb(void* arg, int event, int error);
+static void tls_conn_relay_init(tls_conn_ctx_t* ctx, tls_opts_t* tls_opts);
+static void tls_relay_adapt(tls_conn_ctx_t* ctx, channel_t* channel, size_t remaining);
+static void tls_relay_buffer_cb(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg);
 static void shutdown_tls_conn_ctx(tls_conn_ctx_t* ctx); 
-static int read_rand_seed(char **buf, char* seed_path, int size);
+static void tls_conn_handshake_started(tls_conn_ctx_t* ctx, int is_server);
+static void tls_conn_handshake_done(tls_conn_ctx_t* ctx);
+static void tls_trace_msg_cb(int write_p, int version, int content_type, const void* buf,
+	size_t len, SSL* tls, void* arg);
+#ifdef HAVE_KTLS
+static int tls_conn_ktls_switch(tls_conn_ctx_t* ctx);
+static void tls_conn_ktls_fallback(tls_conn_ctx_t* ctx);
+static void tls_conn_move_bev(tls_conn_ctx_t* ctx, struct bufferevent* to);
+static void tls_conn_try_splice(tls_conn_ctx_t* ctx);
+static void tls_splice_done_cb(void* arg, int error);
+#endif
 int trustbase_verify(X509_STORE_CTX* store, void* arg);
 int client_verify(X509_STORE_CTX* store, void* arg);
 int verify_dummy(int preverify, X509_STORE_CTX* store);
 
+extern int tls_opts_index;
+
 #ifdef CLIENT_AUTH
 typedef struct auth_info {
 	int fd;
@@ -112,6 +150,21 @@ tls_conn_ctx_t* tls_client_wrapper_setup(evutil_socket_t efd, tls_daemon_ctx_t*
 		free_tls_conn_ctx(ctx);
 		return NULL;
 	}
+	SSL_set_app_data(ctx->tls, ctx);
+
+	if (daemon_config.relay_engine == RELAY_ENGINE_RING) {
+		ctx->ring = ring_relay_new(daemon_ctx->ev_base, ctx->tls, efd, -1,
+			is_accepting, tls_ring_cb, ctx);
+		if (ctx->ring == NULL) {
+			log_printf(LOG_ERROR, "Failed to set up ring relay [direct mode]\n");
+			SSL_free(ctx->tls);
+			free_tls_conn_ctx(ctx);
+			return NULL;
+		}
+		tls_conn_handshake_started(ctx, is_accepting);
+		return ctx;
+	}
+
 	/* socket set to -1 because we set it later */
 	ctx->plain.bev = bufferevent_socket_new(daemon_ctx->ev_base, -1,
 			BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
@@ -149,6 +202,7 @@ tls_conn_ctx_t* tls_client_wrapper_setup(evutil_socket_t efd, tls_daemon_ctx_t*
 	bufferevent_setcb(ctx->secure.bev, tls_bev_read_cb, tls_bev_write_cb, tls_bev_event_cb, ctx);
 	bufferevent_enable(ctx->secure.bev, EV_READ | EV_WRITE);
 	bufferevent_setcb(ctx->plain.bev, tls_bev_read_cb, tls_bev_write_cb, tls_bev_event_cb, ctx);
+	tls_conn_relay_init(ctx, tls_opts);
 	//log_printf(LOG_INFO, "secure bev enabled\n");
 	//bufferevent_enable(ctx->plain.bev, EV_READ | EV_WRITE);
 
@@ -159,17 +213,50 @@ tls_conn_ctx_t* tls_client_wrapper_setup(evutil_socket_t efd, tls_daemon_ctx_t*
 		return;
 	}*/
 	//SSL_connect(ctx->tls);
+	tls_conn_handshake_started(ctx, is_accepting);
 	return ctx;
 }
 
 void associate_fd(tls_conn_ctx_t* conn, evutil_socket_t ifd) {
+	if (conn->ring != NULL) {
+		if (ring_relay_set_plain(conn->ring, ifd) != 0) {
+			log_printf(LOG_ERROR, "Failed to attach plaintext socket to ring relay\n");
+		}
+		conn->plain.connected = 1;
+		return;
+	}
 	bufferevent_setfd(conn->plain.bev, ifd);
 	bufferevent_enable(conn->plain.bev, EV_READ | EV_WRITE);
+	conn->plain.connected = 1;
+#ifdef HAVE_KTLS
+	tls_conn_try_splice(conn);
+#endif
 
 	//log_printf(LOG_INFO, "plain bev enabled\n");
 	return;
 }
 
+/* Offers a session from an earlier connection to the same destination,
+ * and files any the server sends under it */
+void tls_conn_resume(tls_conn_ctx_t* conn, tls_opts_t* tls_opts, struct sockaddr* addr, int addrlen) {
+	ssa_config_t* ssa_config;
+
+	if (conn == NULL || conn->tls == NULL) {
+		return;
+	}
+	ssa_config = get_app_config(tls_opts->app_path);
+	client_sessions_resume(conn->tls, ssa_config != NULL ? ssa_config->profile : NULL, addr, addrlen);
+	return;
+}
+
+/* Connects the secure side of a connection set up in the client role */
+int tls_conn_connect(tls_conn_ctx_t* conn, struct sockaddr* addr, int addrlen) {
+	if (conn->ring != NULL) {
+		return ring_relay_connect(conn->ring, addr, addrlen);
+	}
+	return bufferevent_socket_connect(conn->secure.bev, addr, addrlen);
+}
+
 
 tls_conn_ctx_t* tls_server_wrapper_setup(evutil_socket_t efd, evutil_socket_t ifd, tls_daemon_ctx_t* daemon_ctx,
 	tls_opts_t* tls_opts, struct sockaddr* internal_addr, int internal_addrlen) {
@@ -181,8 +268,29 @@ tls_conn_ctx_t* tls_server_wrapper_setup(evutil_socket_t efd, evutil_socket_t if
 	}
 	
 	/* We're sending just the first tls_ctx here because our SNI callbacks will fix it if needed */
-	SSL_CTX_set_cert_verify_callback(tls_opts->tls_ctx, client_verify, ctx);
-	ctx->tls = tls_server_setup(tls_opts->tls_ctx);
+	ctx->tls = tls_server_setup(tls_opts->tls_ctx, tls_opts);
+	if (ctx->tls != NULL) {
+		SSL_set_app_data(ctx->tls, ctx);
+	}
+
+	if (daemon_config.relay_engine == RELAY_ENGINE_RING) {
+		ctx->addr = internal_addr;
+		ctx->addrlen = internal_addrlen;
+		ctx->secure.connected = 1;
+		ctx->ring = ring_relay_new(daemon_ctx->ev_base, ctx->tls, efd, ifd,
+			1, tls_ring_cb, ctx);
+		if (ctx->ring == NULL) {
+			log_printf(LOG_ERROR, "Failed to set up ring relay [listener mode]\n");
+			EVUTIL_CLOSESOCKET(efd);
+			EVUTIL_CLOSESOCKET(ifd);
+			SSL_free(ctx->tls);
+			free_tls_conn_ctx(ctx);
+			return NULL;
+		}
+		tls_conn_handshake_started(ctx, 1);
+		return ctx;
+	}
+
 	ctx->secure.bev = bufferevent_openssl_socket_new(daemon_ctx->ev_base, efd, ctx->tls,
 			BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
 	ctx->secure.connected = 1;
@@ -215,6 +323,7 @@ tls_conn_ctx_t* tls_server_wrapper_setup(evutil_socket_t efd, evutil_socket_t if
 	//bufferevent_enable(ctx->plain.bev, EV_READ | EV_WRITE);
 	bufferevent_setcb(ctx->secure.bev, tls_bev_read_cb, tls_bev_write_cb, tls_bev_event_cb, ctx);
 	bufferevent_enable(ctx->secure.bev, EV_READ | EV_WRITE);
+	tls_conn_relay_init(ctx, tls_opts);
 	
 	/* Connect to local application server */
 	/*if (bufferevent_socket_connect(ctx->plain.bev, internal_addr, internal_addrlen) < 0) {
@@ -222,106 +331,115 @@ tls_conn_ctx_t* tls_server_wrapper_setup(evutil_socket_t efd, evutil_socket_t if
 		free_tls_conn_ctx(ctx);
 		return;
 	}*/
+	tls_conn_handshake_started(ctx, 1);
 	return ctx;
 }
 
-static int read_rand_seed(char **buf, char* seed_path, int size) {
-	int fd;
-	int data_len = 0;
-	int ret;
+/* Builds a context from the administrator's settings for a profile. The
+ * result may be shared by many sockets through the context cache */
+SSL_CTX* tls_ctx_create(ssa_config_t* ssa_config, ctx_role_t role) {
+	SSL_CTX* tls_ctx;
+	X509_STORE* store;
+	const unsigned char unverified_context_id = 1;
 
-	if ((seed_path == NULL) || ( size < 0)) {
-		return 0;
+	tls_ctx = SSL_CTX_new(SSLv23_method());
+	if (tls_ctx == NULL) {
+		return NULL;
 	}
+	SSL_CTX_set_session_id_context(tls_ctx, &unverified_context_id, sizeof(unverified_context_id));
 
-	fd = open(seed_path,O_RDONLY);
-	if (fd == -1) {
-		return 0;
+	/*if (SSL_CTX_set_min_proto_version(tls_ctx, ssa_config->min_version) == 0) {
+		log_printf(LOG_ERROR, "Unable to set min protocol version for %s\n",path);
+	}
+	if (SSL_CTX_set_max_proto_version(tls_ctx, ssa_config->max_version) == 0) {
+		log_printf(LOG_ERROR, "Unable to set max protocol version for %s\n",path);
+	}*/
+	if (SSL_CTX_set_cipher_list(tls_ctx, ssa_config->cipher_list) == 0) {
+		log_printf(LOG_ERROR, "Unable to set cipher list for %s\n", ssa_config->profile);
 	}
 
-	*buf = malloc(size);
-	if (*buf == NULL) {
-		return 0;
+	/* Stores are parsed once per worker and shared by reference */
+	store = trust_store_get(ssa_config->trust_store);
+	if (store == NULL) {
+		log_printf(LOG_ERROR, "Unable set truststore %s\n",ssa_config->trust_store);
+	}
+	else {
+		SSL_CTX_set_cert_store(tls_ctx, store);
 	}
 
-	while (data_len < size) {
-	    	ret = read(fd, *buf + data_len, size-data_len);
-	        if (ret < 0) {
-			free(*buf);
-			close(fd);
-			*buf = NULL;
-			return 0;
+	SSL_CTX_set_timeout(tls_ctx, ssa_config->cache_timeout);
+	session_cache_attach(tls_ctx, ssa_config);
+	if (role != CTX_ROLE_CLIENT) {
+		/* Resumption goes through the session cache unless the
+		 * profile asks for tickets, sealed with the shared keys */
+		if (ssa_config->extensions & SSA_EXT_TICKET) {
+			ticket_keys_attach(tls_ctx);
+		}
+		else {
+			SSL_CTX_set_options(tls_ctx, SSL_OP_NO_TICKET);
 		}
-		data_len += ret;
 	}
 
-	close(fd);
-	return 1;
+	if (ssa_config->ktls) {
+#ifdef HAVE_KTLS
+		/* OpenSSL installs the keys with TCP_ULP "tls" itself when the
+		 * cipher allows. Renegotiation would need records we no longer see */
+		SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+#else
+		log_printf(LOG_ERROR, "KernelTLS requested for %s but OpenSSL lacks support\n",
+			ssa_config->profile);
+#endif
+	}
+
+	switch (role) {
+	case CTX_ROLE_CLIENT:
+		tls_ctx_client_setup(tls_ctx);
+		break;
+	case CTX_ROLE_SERVER:
+		tls_ctx_server_setup(tls_ctx);
+		break;
+	default:
+		break;
+	}
+	return tls_ctx;
 }
 
 tls_opts_t* tls_opts_create(char* path) {
 	tls_opts_t* opts;
-	SSL_CTX* tls_ctx;
 	ssa_config_t* ssa_config;
-	struct stat stat_store;
-	/*char* store_dir = NULL;*/
-	char* store_file = NULL;
-	char* rand_buf;
-	const unsigned char unverified_context_id = 1;
 
-	opts = (tls_opts_t*)calloc(1, sizeof(tls_opts_t));
+	pthread_once(&pools_once, tls_pools_init);
+	opts = (tls_opts_t*)pool_alloc(opts_pool);
 	if (opts == NULL) {
 		return NULL;
 	}
 
 	/* Configure default settings for connections based on
 	 * admin preferences */
-	tls_ctx = SSL_CTX_new(SSLv23_method());
-	SSL_CTX_set_session_id_context(tls_ctx, &unverified_context_id, sizeof(unverified_context_id));
 	ssa_config = get_app_config(path);
-
+	opts->relay_min = RELAY_BUFFER_MIN;
+	opts->relay_max = MAX_BUFFER;
 	if (ssa_config) {
-		/*if (SSL_CTX_set_min_proto_version(tls_ctx, ssa_config->min_version) == 0) {
-			log_printf(LOG_ERROR, "Unable to set min protocol version for %s\n",path);
-		}
-		if (SSL_CTX_set_max_proto_version(tls_ctx, ssa_config->max_version) == 0) {
-			log_printf(LOG_ERROR, "Unable to set max protocol version for %s\n",path);
-		}*/
-		if (SSL_CTX_set_cipher_list(tls_ctx, ssa_config->cipher_list) == 0) {
-			log_printf(LOG_ERROR, "Unable to set cipher list for %s\n",path);
-		}
-
-		stat(ssa_config->trust_store, &stat_store);
-		if (S_ISDIR(stat_store.st_mode)) {
-			/*store_dir = ssa_config->trust_store;
-			 * XXX We don't support dirs yet */
-		}
-		else {
-			store_file = ssa_config->trust_store;
+		opts->custom_validation = ssa_config->custom_validation;
+		if (ssa_config->relay_buffer_min > 0) {
+			opts->relay_min = ssa_config->relay_buffer_min;
 		}
-		log_printf(LOG_INFO, "Setting cert root store to %s\n", store_file);
-		if (SSL_CTX_load_verify_locations(tls_ctx, store_file, store_file) == 0) {
-			log_printf(LOG_ERROR, "Unable set truststore %s\n",ssa_config->trust_store);
+		if (ssa_config->relay_buffer_max > 0) {
+			opts->relay_max = ssa_config->relay_buffer_max;
 		}
-
-		if (read_rand_seed(&rand_buf,ssa_config->randseed_path,ssa_config->randseed_size) == 1) {
-			RAND_seed(rand_buf,ssa_config->randseed_size);
-			free(rand_buf);
+		if (opts->relay_min > opts->relay_max) {
+			opts->relay_min = opts->relay_max;
 		}
-		else {
-			log_printf(LOG_ERROR, "Unable to read set random seed from %s\n",ssa_config->randseed_path);
-		}
-
-		//SessionCacheLocation
-		SSL_CTX_set_timeout(tls_ctx, ssa_config->cache_timeout);
-		opts->custom_validation = ssa_config->custom_validation;
-		
-	}
-	else {
-		log_printf(LOG_ERROR, "Unable to find ssa configuration\n");
 	}
 
-	opts->tls_ctx = tls_ctx;
+	opts->tls_ctx = ctx_cache_get(path, CTX_ROLE_UNSPEC);
+	if (opts->tls_ctx == NULL) {
+		log_printf(LOG_ERROR, "Unable to get SSL_CTX for %s\n", path);
+		pool_free(opts_pool, opts);
+		return NULL;
+	}
+	opts->is_shared = 1;
+	opts->role = CTX_ROLE_UNSPEC;
 	opts->app_path = NULL;
 	if (path) {
 		opts->app_path = strdup(path);
@@ -329,6 +447,35 @@ tls_opts_t* tls_opts_create(char* path) {
 	return opts;
 }
 
+/* Replaces a shared context with a private copy before the first
+ * per-socket setting diverges from the profile */
+static int tls_opts_make_private(tls_opts_t* opts) {
+	SSL_CTX* tls_ctx;
+	ssa_config_t* ssa_config;
+
+	if (opts->is_shared == 0) {
+		return 1;
+	}
+	ssa_config = get_app_config(opts->app_path);
+	if (ssa_config == NULL) {
+		log_printf(LOG_ERROR, "Unable to find ssa configuration\n");
+		return 0;
+	}
+	tls_ctx = tls_ctx_create(ssa_config, opts->role);
+	if (tls_ctx == NULL) {
+		log_printf(LOG_ERROR, "Unable to create private SSL_CTX\n");
+		return 0;
+	}
+	if (opts->cipher_list != NULL &&
+	    SSL_CTX_set_cipher_list(tls_ctx, opts->cipher_list) == 0) {
+		log_printf(LOG_ERROR, "Unable to set cipher list %s\n", opts->cipher_list);
+	}
+	SSL_CTX_free(opts->tls_ctx);
+	opts->tls_ctx = tls_ctx;
+	opts->is_shared = 0;
+	return 1;
+}
+
 void tls_opts_free(tls_opts_t* opts) {
 	tls_opts_t* cur_opts;
 	tls_opts_t* tmp_opts;
@@ -342,53 +489,82 @@ void tls_opts_free(tls_opts_t* opts) {
 		if (cur_opts->app_path) {
 			free(cur_opts->app_path);
 		}
-		free(cur_opts);
+		if (cur_opts->cipher_list) {
+			free(cur_opts->cipher_list);
+		}
+		pool_free(opts_pool, cur_opts);
 		cur_opts = tmp_opts;
 	}
 	return;
 }
 
+/* Swaps the role-neutral shared context for the shared context of the
+ * given role. Private contexts are configured in place */
+static int tls_opts_set_role(tls_opts_t* tls_opts, ctx_role_t role) {
+	SSL_CTX* tls_ctx;
+
+	tls_opts->role = role;
+	tls_opts->is_server = role == CTX_ROLE_SERVER;
+	if (tls_opts->is_shared == 0) {
+		if (role == CTX_ROLE_SERVER) {
+			tls_ctx_server_setup(tls_opts->tls_ctx);
+		}
+		else {
+			tls_ctx_client_setup(tls_opts->tls_ctx);
+		}
+		return 1;
+	}
+
+	tls_ctx = ctx_cache_get(tls_opts->app_path, role);
+	if (tls_ctx == NULL) {
+		return 0;
+	}
+	SSL_CTX_free(tls_opts->tls_ctx);
+	tls_opts->tls_ctx = tls_ctx;
+	return 1;
+}
+
 int tls_opts_server_setup(tls_opts_t* tls_opts) {
-	SSL_CTX* tls_ctx = tls_opts->tls_ctx;
-	
-	tls_opts->is_server = 1;
-	
+	return tls_opts_set_role(tls_opts, CTX_ROLE_SERVER);
+}
+
+int tls_opts_client_setup(tls_opts_t* tls_opts) {
+	return tls_opts_set_role(tls_opts, CTX_ROLE_CLIENT);
+}
+
+static void tls_ctx_server_setup(SSL_CTX* tls_ctx) {
 	SSL_CTX_set_options(tls_ctx, SSL_OP_ALL);
 	/* There's a billion options we can/should set here by admin config XXX
  	 * See SSL_CTX_set_options and SSL_CTX_set_cipher_list for details */
 
-	/* XXX We can do all sorts of caching modes and define our own callbacks
-	 * if desired */
-	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+	/* Sessions go to the cache shared between workers when there is one */
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER | session_cache_mode());
 
-	/* SNI configuration */
+	/* SNI configuration. The socket's options are found through
+	 * the SSL object since the context may be shared */
 	SSL_CTX_set_tlsext_servername_callback(tls_ctx, server_name_cb);
-	SSL_CTX_set_tlsext_servername_arg(tls_ctx, (void*)tls_opts);
 
-	SSL_CTX_use_certificate_chain_file(tls_ctx, "test_files/localhost_cert.pem");
-	SSL_CTX_use_PrivateKey_file(tls_ctx, "test_files/localhost_key.pem", SSL_FILETYPE_PEM);
+	SSL_CTX_set_cert_verify_callback(tls_ctx, client_verify, NULL);
 
-	return 1;
+	SSL_CTX_use_certificate_chain_file(tls_ctx, SERVER_DEFAULT_CERT);
+	SSL_CTX_use_PrivateKey_file(tls_ctx, SERVER_DEFAULT_KEY, SSL_FILETYPE_PEM);
+	return;
 }
 
-int tls_opts_client_setup(tls_opts_t* tls_opts) {
-	SSL_CTX* tls_ctx = tls_opts->tls_ctx;
-
-	tls_opts->is_server = 0;
-
+static void tls_ctx_client_setup(SSL_CTX* tls_ctx) {
 	SSL_CTX_set_options(tls_ctx, SSL_OP_ALL);
 
 	/* Temporarily disable validation */
 	//SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, verify_dummy);
 	SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, verify_dummy);
+	client_sessions_attach(tls_ctx);
 
 	/* There's a billion options we can/should set here by admin config XXX
  	 * See SSL_CTX_set_options and SSL_CTX_set_cipher_list for details */
 
 	/* For client auth portion of the SSA utilize 
 	 * SSL_CTX_set_default_passwd_cb */
-
-	return 1;
+	return;
 }
 
 int verify_dummy(int preverify, X509_STORE_CTX* store) {
@@ -398,25 +574,31 @@ int verify_dummy(int preverify, X509_STORE_CTX* store) {
 int client_verify(X509_STORE_CTX* store, void* arg) {
 	/*tls_conn_ctx_t* ctx = arg;*/
 	X509* cert;
-	STACK_OF(X509)* chain;
 #ifndef NO_LOG
 	X509_NAME* subject_name;
 	char* identity;
 #endif
-
-	if (X509_verify_cert(store) != 1) {
+	char key[VERIFY_CACHE_KEY_LEN];
+	uint64_t started = loop_monitor_begin();
+	int verified;
+
+	/* A client that reconnects with the same chain was checked already */
+	verified = verify_cache_lookup(store, NULL, VERIFY_MODE_CLIENT_CERT, key);
+	if (verified != 1) {
+		verified = X509_verify_cert(store);
+		if (verified == 1) {
+			verify_cache_add(store, key);
+		}
+	}
+	loop_monitor_end(LOOP_CB_VERIFY, tls_store_conn_id(store), started);
+	if (verified != 1) {
 		/*netlink_notify_kernel(ctx->daemon, ctx->id, -EINVAL);*/
 		return 0;
 	}
 
 	log_printf(LOG_INFO, "Client cert verify invoked\n");
-	chain = X509_STORE_CTX_get1_chain(store);
-	if (chain == NULL) {
-		log_printf(LOG_ERROR, "Certificate chain unavailable\n");
-		/*netlink_notify_kernel(ctx->daemon, ctx->id, 0);*/
-		return 0;
-	}
-	cert = sk_X509_value(chain, 0);
+	/* The chain isn't built when the verdict came from the cache */
+	cert = X509_STORE_CTX_get0_cert(store);
 	if (cert == NULL) {
 		log_printf(LOG_ERROR, "First cert not there\n");
 		/*netlink_notify_kernel(ctx->daemon, ctx->id, -EINVAL);*/
@@ -427,7 +609,6 @@ int client_verify(X509_STORE_CTX* store, void* arg) {
 	identity = X509_NAME_oneline(subject_name, NULL, 0);
 	log_printf(LOG_INFO, "User \"%s\" is authenticated\n", identity);
 #endif
-	sk_X509_pop_free(chain, X509_free);
 
 	/*netlink_notify_kernel(ctx->daemon, ctx->id, 0);*/
 	return 1;
@@ -438,7 +619,14 @@ int trustbase_verify(X509_STORE_CTX* store, void* arg) {
 	STACK_OF(X509)* chain;
 	int response;
 	char* hostname = arg;
+	char key[VERIFY_CACHE_KEY_LEN];
+	uint64_t started = loop_monitor_begin();
 
+	if (verify_cache_lookup(store, hostname, VERIFY_MODE_TRUSTBASE, key) == 1) {
+		loop_monitor_end(LOOP_CB_VERIFY, tls_store_conn_id(store), started);
+		log_printf(LOG_INFO, "Chain from %s was accepted by TrustBase recently\n", hostname);
+		return 1;
+	}
 	X509_verify_cert(store);
 
 	query_id = 1;
@@ -451,12 +639,15 @@ int trustbase_verify(X509_STORE_CTX* store, void* arg) {
 	if (trustbase_connect()) {
 		log_printf(LOG_ERROR, "unable to connect to trustbase\n");
 		sk_X509_pop_free(chain, X509_free);
+		loop_monitor_end(LOOP_CB_VERIFY, tls_store_conn_id(store), started);
 		return 0;
 	}
 	log_printf(LOG_INFO, "Querying TrustBase with chain supposedly from %s\n", hostname);
 	send_query_openssl(query_id, hostname, 443, chain);
 	response = recv_response();
 	trustbase_disconnect();
+	/* Blocks on the TrustBase round trip */
+	loop_monitor_end(LOOP_CB_VERIFY, tls_store_conn_id(store), started);
 
 	sk_X509_pop_free(chain, X509_free);
 	// Response checking
@@ -471,12 +662,23 @@ int trustbase_verify(X509_STORE_CTX* store, void* arg) {
 	}
 	
 	log_printf(LOG_INFO, "TrustBase indicates Certificate was valid!\n");
+	verify_cache_add(store, key);
 	return 1;
 }
 
+/* Verification callbacks only get the store, the SSL leads back to us */
+unsigned long tls_store_conn_id(X509_STORE_CTX* store) {
+	SSL* tls = X509_STORE_CTX_get_ex_data(store, SSL_get_ex_data_X509_STORE_CTX_idx());
+	tls_conn_ctx_t* conn = (tls != NULL) ? SSL_get_app_data(tls) : NULL;
+
+	return (conn != NULL) ? conn->id : 0;
+}
+
 int set_trusted_peer_certificates(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* value, int len) {
 	const unsigned char verified_context_id = 2;
 	SSL_CTX* tls_ctx;
+	X509_STORE* store;
+	ssa_config_t* ssa_config;
 	/* XXX update this to take in-memory PEM chains as well as file names */
 	STACK_OF(X509_NAME)* cert_names;
 
@@ -494,7 +696,19 @@ int set_trusted_peer_certificates(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx
 		return 1;
 	}
 	while (tls_opts != NULL) {
-       		tls_ctx = tls_opts->tls_ctx;
+		if (tls_opts_make_private(tls_opts) == 0) {
+			return 0;
+		}
+		tls_ctx = tls_opts->tls_ctx;
+		/* The context still points at the shared store, which other
+		 * contexts use too, so add the app's certificates to a copy */
+		ssa_config = get_app_config(tls_opts->app_path);
+		store = trust_store_copy(SSL_CTX_get_cert_store(tls_ctx),
+			ssa_config != NULL ? ssa_config->trust_store : NULL);
+		if (store == NULL) {
+			return 0;
+		}
+		SSL_CTX_set_cert_store(tls_ctx, store);
 		if (SSL_CTX_load_verify_locations(tls_ctx, value, NULL) == 0) {
 			return 0;
 		}
@@ -532,6 +746,12 @@ int set_alpn_protos(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* protos
 		/* Already connected */
 		return 0;
 	}
+	/* The ALPN callback is applied to every SSL_CTX below */
+	for (cur_opts = tls_opts; cur_opts != NULL; cur_opts = cur_opts->next) {
+		if (tls_opts_make_private(cur_opts) == 0) {
+			return 0;
+		}
+	}
 	alpn_string = tls_opts->alpn_string;
 	proto = protos;
 	alpn_str_ptr = alpn_string;
@@ -571,14 +791,22 @@ int set_alpn_protos(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* protos
 }
 
 int set_disbled_cipher(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* cipher) {
-	SSL_CTX* tls_ctx = tls_opts->tls_ctx;
 	ssa_config_t* ssa_config;
+	char* base_list;
 	char* cipher_list;
 	int length;
 
-	ssa_config = get_app_config(tls_opts->app_path);
+	/* Earlier calls may already have disabled ciphers for this socket */
+	base_list = tls_opts->cipher_list;
+	if (base_list == NULL) {
+		ssa_config = get_app_config(tls_opts->app_path);
+		if (ssa_config == NULL) {
+			return 0;
+		}
+		base_list = ssa_config->cipher_list;
+	}
 
-	length = snprintf(NULL, 0, "%s:!%s", ssa_config->cipher_list, cipher);
+	length = snprintf(NULL, 0, "%s:!%s", base_list, cipher);
 	if (length == -1) {
 		log_printf(LOG_ERROR, "Unable to parse cipher: %s\n", cipher);
 		return 0;
@@ -588,19 +816,23 @@ int set_disbled_cipher(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* cip
 		log_printf(LOG_ERROR, "Unable to allocate new cipher list\n");
 		return 0;
 	}
-	if (snprintf(cipher_list, length + 1, "%s:!%s", ssa_config->cipher_list, cipher) == -1) {
+	if (snprintf(cipher_list, length + 1, "%s:!%s", base_list, cipher) == -1) {
 		log_printf(LOG_ERROR, "Unable to add cipher: %s\n",cipher);
+		free(cipher_list);
 		return 0;
 	}
 
-	if (SSL_CTX_set_cipher_list(tls_ctx, ssa_config->cipher_list) == 0) {
+	if (tls_opts_make_private(tls_opts) == 0 ||
+	    SSL_CTX_set_cipher_list(tls_opts->tls_ctx, cipher_list) == 0) {
 		free(cipher_list);
 		log_printf(LOG_ERROR, "Unable to disable cipher %s\n",cipher);
 		return 0;
 	}
 
-	free(ssa_config->cipher_list);
-	ssa_config->cipher_list = cipher_list;
+	if (tls_opts->cipher_list != NULL) {
+		free(tls_opts->cipher_list);
+	}
+	tls_opts->cipher_list = cipher_list;
 
 	return 1;
 }
@@ -614,6 +846,9 @@ int set_session_ttl(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* ttl) {
 	}
 
 	if (tls_opts != NULL) {
+		if (tls_opts_make_private(tls_opts) == 0) {
+			return 0;
+		}
 		tls_ctx = tls_opts->tls_ctx;
 		SSL_CTX_set_timeout(tls_ctx, timeout);
 	}
@@ -686,8 +921,13 @@ int set_certificate_chain(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char*
 		return 0;
 	}
 	cur_opts = tls_opts;
-	/* There is no cert set yet on the first SSL_CTX so we'll use that */
-	if (SSL_CTX_get0_certificate(cur_opts->tls_ctx) == NULL) {
+	/* There is no cert set yet on the first SSL_CTX so we'll use that.
+	 * Shared server contexts carry the default certificate, which an
+	 * application supplied chain replaces */
+	if (cur_opts->is_shared == 1 || SSL_CTX_get0_certificate(cur_opts->tls_ctx) == NULL) {
+		if (tls_opts_make_private(cur_opts) == 0) {
+			return 0;
+		}
 		if (SSL_CTX_use_certificate_chain_file(cur_opts->tls_ctx, filepath) != 1) {
 			log_printf(LOG_ERROR, "Unable to assign certificate chain\n");
 			return 0;
@@ -705,9 +945,16 @@ int set_certificate_chain(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char*
 	if (new_opts == NULL) {
 		return 0;
 	}
+	new_opts->role = cur_opts->role;
+	new_opts->is_server = cur_opts->is_server;
+	if (tls_opts_make_private(new_opts) == 0) {
+		tls_opts_free(new_opts);
+		return 0;
+	}
 	
 	if (SSL_CTX_use_certificate_chain_file(new_opts->tls_ctx, filepath) != 1) {
 		log_printf(LOG_ERROR, "Unable to assign certificate chain\n");
+		tls_opts_free(new_opts);
 		return 0;
 	}
 	log_printf(LOG_INFO, "Using cert located at %s\n", filepath);
@@ -733,7 +980,10 @@ int set_private_key(tls_opts_t* tls_opts, tls_conn_ctx_t* conn_ctx, char* filepa
 	/* Otherwise set the key to the first SSL_CTX that doesn't currently have one */
 	cur_opts = tls_opts;
 	while (cur_opts != NULL) {
-		if (SSL_CTX_get0_privatekey(cur_opts->tls_ctx) == NULL) {
+		if (cur_opts->is_shared == 1 || SSL_CTX_get0_privatekey(cur_opts->tls_ctx) == NULL) {
+			if (tls_opts_make_private(cur_opts) == 0) {
+				return 0;
+			}
 			if (SSL_CTX_use_PrivateKey_file(cur_opts->tls_ctx, filepath, SSL_FILETYPE_PEM) != 1) {
 				return 0;
 			}
@@ -900,7 +1150,7 @@ int server_name_cb(SSL* tls, int* ad, void* arg) {
 		return SSL_TLSEXT_ERR_NOACK;
 	}
 	log_printf(LOG_INFO, "SNI from client is %s\n", hostname);
-	tls_ctx = get_tls_ctx_from_name((tls_opts_t*)arg, hostname);
+	tls_ctx = get_tls_ctx_from_name((tls_opts_t*)SSL_get_ex_data(tls, tls_opts_index), hostname);
 	if (tls_ctx != NULL) {
 		log_printf(LOG_INFO, "Server SSL_CTX matching SNI was found\n");
 		SSL_set_SSL_CTX(tls, tls_ctx);
@@ -954,11 +1204,13 @@ SSL* tls_client_setup(SSL_CTX* tls_ctx, char* hostname) {
 	return tls;
 }
 
-SSL* tls_server_setup(SSL_CTX* tls_ctx) {
+SSL* tls_server_setup(SSL_CTX* tls_ctx, tls_opts_t* tls_opts) {
 	SSL* tls = SSL_new(tls_ctx);
 	if (tls == NULL) {
 		return NULL;
 	}
+	/* SNI and ALPN callbacks look up the listener's options here */
+	SSL_set_ex_data(tls, tls_opts_index, (void*)tls_opts);
 	return tls;
 }
 
@@ -968,13 +1220,43 @@ int set_netlink_cb_params(tls_conn_ctx_t* conn, tls_daemon_ctx_t* daemon_ctx, un
 	}*/
 	conn->daemon = daemon_ctx;
 	conn->id = id;
+	if (conn->ring != NULL) {
+		ring_relay_set_id(conn->ring, id);
+	}
 	return 1;
 }
 
+/* The bufferevent callbacks are timed for the loop monitor. The id is
+ * read first, nothing frees the connection from inside them */
 void tls_bev_write_cb(struct bufferevent *bev, void *arg) {
+	unsigned long id = ((tls_conn_ctx_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	tls_bev_write(bev, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void tls_bev_read_cb(struct bufferevent *bev, void *arg) {
+	unsigned long id = ((tls_conn_ctx_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	tls_bev_read(bev, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg) {
+	unsigned long id = ((tls_conn_ctx_t*)arg)->id;
+	uint64_t started = loop_monitor_begin();
+	tls_bev_event(bev, events, arg);
+	loop_monitor_end(LOOP_CB_RELAY, id, started);
+	return;
+}
+
+void tls_bev_write(struct bufferevent *bev, void *arg) {
 	//log_printf(LOG_DEBUG, "write event on bev %p\n", bev);
 	tls_conn_ctx_t* ctx = arg;
 	channel_t* endpoint = (bev == ctx->secure.bev) ? &ctx->plain : &ctx->secure;
+	channel_t* startpoint = (bev == ctx->secure.bev) ? &ctx->secure : &ctx->plain;
 	struct evbuffer* out_buf;
 
 	if (endpoint->closed == 1) {
@@ -987,19 +1269,24 @@ void tls_bev_write_cb(struct bufferevent *bev, void *arg) {
 	}
 
 	if (endpoint->bev && !(bufferevent_get_enabled(endpoint->bev) & EV_READ)) {
+		tls_relay_adapt(ctx, startpoint, evbuffer_get_length(bufferevent_get_output(bev)));
 		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
 		bufferevent_enable(endpoint->bev, EV_READ);
 	}
+#ifdef HAVE_KTLS
+	tls_conn_try_splice(ctx);
+#endif
 	return;
 }
 
-void tls_bev_read_cb(struct bufferevent *bev, void *arg) {
+void tls_bev_read(struct bufferevent *bev, void *arg) {
 	//log_printf(LOG_DEBUG, "read event on bev %p\n", bev);
 	tls_conn_ctx_t* ctx = arg;
 	channel_t* endpoint = (bev == ctx->secure.bev) ? &ctx->plain : &ctx->secure;
 	struct evbuffer* in_buf;
 	struct evbuffer* out_buf;
 	size_t in_len;
+	size_t limit;
 
 	in_buf = bufferevent_get_input(bev);
 	in_len = evbuffer_get_length(in_buf);
@@ -1015,16 +1302,168 @@ void tls_bev_read_cb(struct bufferevent *bev, void *arg) {
 
 	out_buf = bufferevent_get_output(endpoint->bev);
 	evbuffer_add_buffer(out_buf, in_buf);
+	metrics_relay_bytes(bev == ctx->secure.bev ? METRICS_INBOUND : METRICS_OUTBOUND, in_len);
+	if (ctx->trace != NULL) {
+		trace_mark(ctx->trace, TRACE_FIRST_BYTE);
+	}
 
-	if (evbuffer_get_length(out_buf) >= MAX_BUFFER) {
+	limit = relay_budget_limit(endpoint->limit, endpoint->limit_min);
+	if (evbuffer_get_length(out_buf) >= limit) {
 		log_printf(LOG_DEBUG, "Overflowing buffer, slowing down\n");
-		bufferevent_setwatermark(endpoint->bev, EV_WRITE, MAX_BUFFER / 2, MAX_BUFFER);
+		endpoint->paused_len = evbuffer_get_length(out_buf);
+		event_base_gettimeofday_cached(ctx->daemon->ev_base, &endpoint->paused_at);
+		bufferevent_setwatermark(endpoint->bev, EV_WRITE, limit / 2, limit);
 		bufferevent_disable(bev, EV_READ);
 	}
+#ifdef HAVE_KTLS
+	/* OpenSSL has read what kept it from kernel TLS */
+	if (ctx->ktls_resume && bev == ctx->secure.bev) {
+		tls_conn_ktls_switch(ctx);
+	}
+#endif
 	return;
 }
 
-void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg) {
+#ifdef HAVE_KTLS
+/* With both directions in kernel TLS the socket reads and writes plaintext
+ * for us, so the OpenSSL filter only adds copies. Swap it for a socket
+ * bufferevent on a duplicate of the fd and park it, still holding the SSL,
+ * for tls_conn_ktls_fallback(). Records OpenSSL has already pulled in are
+ * read through it first, ktls_resume tries again on the next read.
+ * Returns 1 if the swap happened */
+int tls_conn_ktls_switch(tls_conn_ctx_t* ctx) {
+	struct bufferevent* new_bev;
+	evutil_socket_t fd;
+
+	if (!(SSL_get_options(ctx->tls) & SSL_OP_ENABLE_KTLS)) {
+		return 0;
+	}
+	if (!BIO_get_ktls_send(SSL_get_wbio(ctx->tls)) ||
+		!BIO_get_ktls_recv(SSL_get_rbio(ctx->tls))) {
+		log_printf(LOG_DEBUG, "Kernel TLS unavailable for %s\n", SSL_get_cipher_name(ctx->tls));
+		ctx->ktls_resume = 0;
+		return 0;
+	}
+	if (SSL_pending(ctx->tls) > 0 || !SSL_want_nothing(ctx->tls)) {
+		ctx->ktls_resume = 1;
+		return 0;
+	}
+
+	/* Each bev closes its own fd when freed */
+	fd = dup(bufferevent_getfd(ctx->secure.bev));
+	if (fd == -1) {
+		log_printf(LOG_ERROR, "dup: %s\n", strerror(errno));
+		return 0;
+	}
+	new_bev = bufferevent_socket_new(ctx->daemon->ev_base, fd,
+			BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+	if (new_bev == NULL) {
+		close(fd);
+		return 0;
+	}
+	evbuffer_add_cb(bufferevent_get_output(new_bev), tls_relay_buffer_cb, NULL);
+	ctx->tls_bev = ctx->secure.bev;
+	tls_conn_move_bev(ctx, new_bev);
+	ctx->ktls = 1;
+	if (ctx->ktls_resume) {
+		log_printf(LOG_DEBUG, "Back on kernel TLS\n");
+	}
+	else {
+		log_printf(LOG_INFO, "Kernel TLS enabled with %s %s\n",
+			SSL_get_version(ctx->tls), SSL_get_cipher_name(ctx->tls));
+	}
+	ctx->ktls_resume = 0;
+	if (evbuffer_get_length(bufferevent_get_input(new_bev)) > 0) {
+		tls_bev_read_cb(new_bev, ctx);
+	}
+	return 1;
+}
+
+/* A TLS 1.3 peer sends NewSessionTicket, KeyUpdate and alerts as records
+ * that a plain read on kernel TLS refuses with EIO, leaving them queued.
+ * The parked OpenSSL bev takes the socket back to read them, switching
+ * again after, or staying if OpenSSL could not rekey the kernel */
+void tls_conn_ktls_fallback(tls_conn_ctx_t* ctx) {
+	struct bufferevent* ktls_bev = ctx->secure.bev;
+
+	log_printf(LOG_DEBUG, "Control record on kernel TLS, reading it with OpenSSL\n");
+	tls_conn_move_bev(ctx, ctx->tls_bev);
+	/* the failed read disabled it */
+	bufferevent_enable(ctx->secure.bev, EV_READ);
+	bufferevent_free(ktls_bev);
+	ctx->tls_bev = NULL;
+	ctx->ktls = 0;
+	ctx->ktls_resume = 1;
+	return;
+}
+
+/* Gives the secure channel, with its queues, callbacks, write watermarks
+ * and paused reads, to TO and leaves the old bev disabled */
+void tls_conn_move_bev(tls_conn_ctx_t* ctx, struct bufferevent* to) {
+	struct bufferevent* from = ctx->secure.bev;
+	short enabled = bufferevent_get_enabled(from);
+	size_t low;
+	size_t high;
+
+	evbuffer_add_buffer(bufferevent_get_input(to), bufferevent_get_input(from));
+	evbuffer_add_buffer(bufferevent_get_output(to), bufferevent_get_output(from));
+	bufferevent_getwatermark(from, EV_WRITE, &low, &high);
+	bufferevent_setwatermark(to, EV_WRITE, low, high);
+	bufferevent_setcb(to, tls_bev_read_cb, tls_bev_write_cb, tls_bev_event_cb, ctx);
+	bufferevent_disable(from, EV_READ | EV_WRITE);
+	bufferevent_disable(to, ~enabled & (EV_READ | EV_WRITE));
+	bufferevent_enable(to, enabled);
+	ctx->secure.bev = to;
+	return;
+}
+
+void tls_splice_done_cb(void* arg, int error) {
+	tls_conn_ctx_t* ctx = arg;
+
+	if (error != 0) {
+		log_printf(LOG_INFO, "Spliced connection closed: %s\n", strerror(error));
+	}
+	ctx->plain.closed = 1;
+	ctx->secure.closed = 1;
+	shutdown_tls_conn_ctx(ctx);
+	return;
+}
+
+/* With kernel TLS both sockets carry plaintext, so once neither bev has
+ * anything buffered the bytes can move with splice and skip userspace.
+ * The bevs are parked, still owning their fds */
+void tls_conn_try_splice(tls_conn_ctx_t* ctx) {
+	if (!ctx->ktls || ctx->splice != NULL || !ctx->plain.connected) {
+		return;
+	}
+	/* Bytes already in the pipes can't go back to OpenSSL when a TLS 1.3
+	 * control record turns up, so those stay on the bevs */
+	if (SSL_version(ctx->tls) != TLS1_2_VERSION) {
+		return;
+	}
+	if (ctx->plain.closed || ctx->secure.closed) {
+		return;
+	}
+	if (evbuffer_get_length(bufferevent_get_input(ctx->plain.bev)) > 0 ||
+		evbuffer_get_length(bufferevent_get_output(ctx->plain.bev)) > 0 ||
+		evbuffer_get_length(bufferevent_get_input(ctx->secure.bev)) > 0 ||
+		evbuffer_get_length(bufferevent_get_output(ctx->secure.bev)) > 0) {
+		return;
+	}
+	ctx->splice = splice_relay_new(ctx->daemon->ev_base, bufferevent_getfd(ctx->plain.bev),
+		bufferevent_getfd(ctx->secure.bev), ctx->secure.limit_max, tls_splice_done_cb, ctx);
+	if (ctx->splice == NULL) {
+		log_printf(LOG_ERROR, "Unable to splice connection, staying on bufferevents\n");
+		return;
+	}
+	bufferevent_disable(ctx->plain.bev, EV_READ | EV_WRITE);
+	bufferevent_disable(ctx->secure.bev, EV_READ | EV_WRITE);
+	log_printf(LOG_DEBUG, "Relaying connection with splice\n");
+	return;
+}
+#endif
+
+void tls_bev_event(struct bufferevent *bev, short events, void *arg) {
 	tls_conn_ctx_t* ctx = arg;
 	unsigned long ssl_err;
 	channel_t* endpoint = (bev == ctx->secure.bev) ? &ctx->plain : &ctx->secure;
@@ -1032,9 +1471,21 @@ void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg) {
 	if (events & BEV_EVENT_CONNECTED) {
 		log_printf(LOG_DEBUG, "%s endpoint connected\n", bev == ctx->secure.bev ? "encrypted" : "plaintext");
 		//startpoint->connected = 1;
+		if (bev == ctx->plain.bev) {
+			ctx->plain.connected = 1;
+#ifdef HAVE_KTLS
+			tls_conn_try_splice(ctx);
+#endif
+		}
 		if (bev == ctx->secure.bev) {
 			//log_printf(LOG_INFO, "Is handshake finished?: %d\n", SSL_is_init_finished(ctx->tls));
 			log_printf(LOG_INFO, "Negotiated connection with %s\n", SSL_get_version(ctx->tls));
+			tls_conn_handshake_done(ctx);
+#ifdef HAVE_KTLS
+			if (tls_conn_ktls_switch(ctx)) {
+				bev = ctx->secure.bev;
+			}
+#endif
 			if (bufferevent_getfd(ctx->plain.bev) == -1) {
 				netlink_handshake_notify_kernel(ctx->daemon, ctx->id, 0);
 			}
@@ -1044,6 +1495,13 @@ void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg) {
 			}
 		}
 	}
+#ifdef HAVE_KTLS
+	if ((events & BEV_EVENT_ERROR) && (events & BEV_EVENT_READING) &&
+			bev == ctx->secure.bev && ctx->ktls && errno == EIO) {
+		tls_conn_ktls_fallback(ctx);
+		return;
+	}
+#endif
 	if (events & BEV_EVENT_ERROR) {
 		//log_printf(LOG_DEBUG, "%s endpoint encountered an error\n", bev == ctx->secure.bev ? "encrypted" : "plaintext");
 		if (errno) {
@@ -1097,9 +1555,110 @@ void tls_bev_event_cb(struct bufferevent *bev, short events, void *arg) {
 	return;
 }
 
+/* Both channels start at the profile's minimum and count what they queue
+ * against the worker's relay budget */
+void tls_conn_relay_init(tls_conn_ctx_t* ctx, tls_opts_t* tls_opts) {
+	channel_t* channels[2] = { &ctx->plain, &ctx->secure };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		channels[i]->limit = tls_opts->relay_min;
+		channels[i]->limit_min = tls_opts->relay_min;
+		channels[i]->limit_max = tls_opts->relay_max;
+		evbuffer_add_cb(bufferevent_get_output(channels[i]->bev), tls_relay_buffer_cb, NULL);
+	}
+	return;
+}
+
+/* Sizes a channel's limit to what it drains in RELAY_DRAIN_TARGET_MS, so
+ * bulk transfers grow toward limit_max and slow readers shrink toward
+ * limit_min. Moves at most a factor of two per pause */
+void tls_relay_adapt(tls_conn_ctx_t* ctx, channel_t* channel, size_t remaining) {
+	struct timeval now;
+	struct timeval elapsed;
+	double seconds;
+	size_t target;
+
+	if (channel->paused_len <= remaining) {
+		return;
+	}
+	event_base_gettimeofday_cached(ctx->daemon->ev_base, &now);
+	timeval_subtract(&elapsed, &now, &channel->paused_at);
+	seconds = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+	if (seconds < 0.001) {
+		seconds = 0.001;
+	}
+	target = (channel->paused_len - remaining) / seconds * RELAY_DRAIN_TARGET_MS / 1000;
+	if (target > channel->limit * 2) {
+		target = channel->limit * 2;
+	}
+	if (target < channel->limit / 2) {
+		target = channel->limit / 2;
+	}
+	if (target > channel->limit_max) {
+		target = channel->limit_max;
+	}
+	if (target < channel->limit_min) {
+		target = channel->limit_min;
+	}
+	channel->limit = target;
+	channel->paused_len = 0;
+	return;
+}
+
+void tls_relay_buffer_cb(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg) {
+	relay_budget_account((long)info->n_added - (long)info->n_deleted);
+	return;
+}
+
+/* The ring relay's counterpart to the CONNECTED and closing branches of
+ * tls_bev_event_cb */
+void tls_ring_cb(void* arg, int event, int error) {
+	tls_conn_ctx_t* ctx = arg;
+
+	if (event == RING_RELAY_CONNECTED) {
+		log_printf(LOG_INFO, "Negotiated connection with %s\n", SSL_get_version(ctx->tls));
+		tls_conn_handshake_done(ctx);
+		if (ring_relay_plain_fd(ctx->ring) == -1) {
+			netlink_handshake_notify_kernel(ctx->daemon, ctx->id, 0);
+		}
+		else {
+			ring_relay_connect_plain(ctx->ring, ctx->addr, ctx->addrlen);
+		}
+		return;
+	}
+	if (event == RING_RELAY_DATA) {
+		trace_mark(ctx->trace, TRACE_FIRST_BYTE);
+		return;
+	}
+
+	if (error != 0 && error != ECONNRESET && error != EPIPE) {
+		log_printf(LOG_INFO, "Ring relay closed: %s\n", strerror(error));
+	}
+	else {
+		log_printf(LOG_INFO, "Connection closed\n");
+	}
+	ctx->plain.closed = 1;
+	ctx->secure.closed = 1;
+	/* A finished handshake was reported already, the kernel learns of
+	 * the close from the socket itself */
+	if (ring_relay_plain_fd(ctx->ring) == -1 && ctx->hs_done == 0) {
+		netlink_handshake_notify_kernel(ctx->daemon, ctx->id, -EHOSTUNREACH);
+	}
+	shutdown_tls_conn_ctx(ctx);
+	return;
+}
+
+/* Connections and options come and go with every socket */
+void tls_pools_init(void) {
+	conn_pool = pool_create("tls_conn_ctx", sizeof(tls_conn_ctx_t));
+	opts_pool = pool_create("tls_opts", sizeof(tls_opts_t));
+	return;
+}
+
 tls_conn_ctx_t* new_tls_conn_ctx() {
-	tls_conn_ctx_t* ctx = (tls_conn_ctx_t*)calloc(1, sizeof(tls_conn_ctx_t));
-	return ctx;
+	pthread_once(&pools_once, tls_pools_init);
+	return (tls_conn_ctx_t*)pool_alloc(conn_pool);
 }
 
 void shutdown_tls_conn_ctx(tls_conn_ctx_t* ctx) {
@@ -1107,13 +1666,83 @@ void shutdown_tls_conn_ctx(tls_conn_ctx_t* ctx) {
 
 	if (ctx->tls != NULL && ctx->secure.closed == 1) {
 		//SSL_shutdown(ctx->tls);
+		/* Without a close_notify sent, SSL_free would drop the session
+		 * from the cache. Fatal alerts still drop it */
+		if (ctx->hs_done) {
+			SSL_set_shutdown(ctx->tls, SSL_get_shutdown(ctx->tls) | SSL_SENT_SHUTDOWN);
+		}
+	}
+	return;
+}
+
+void tls_conn_handshake_started(tls_conn_ctx_t* ctx, int is_server) {
+	ctx->hs_start = metrics_now();
+	metrics_handshake_started(is_server ? METRICS_SERVER : METRICS_CLIENT);
+	return;
+}
+
+void tls_conn_handshake_done(tls_conn_ctx_t* ctx) {
+	if (ctx->hs_done) return;
+	ctx->hs_done = 1;
+	metrics_handshake_completed(SSL_version(ctx->tls), SSL_get_cipher_name(ctx->tls), ctx->hs_start);
+	if (SSL_session_reused(ctx->tls)) {
+		metrics_handshake_resumed(SSL_is_server(ctx->tls) ? METRICS_SERVER : METRICS_CLIENT);
 	}
+	trace_mark(ctx->trace, TRACE_HANDSHAKE);
+	return;
+}
+
+/* The first handshake message goes out or arrives once TCP is up */
+void tls_conn_set_trace(tls_conn_ctx_t* conn, conn_trace_t* trace) {
+	conn->trace = trace;
+	if (conn->tls != NULL) {
+		SSL_set_msg_callback(conn->tls, trace != NULL ? tls_trace_msg_cb : NULL);
+		SSL_set_msg_callback_arg(conn->tls, trace);
+	}
+	return;
+}
+
+void tls_trace_msg_cb(int write_p, int version, int content_type, const void* buf,
+		size_t len, SSL* tls, void* arg) {
+	trace_mark((conn_trace_t*)arg, TRACE_ESTABLISHED);
+	SSL_set_msg_callback(tls, NULL);
 	return;
 }
 
 void free_tls_conn_ctx(tls_conn_ctx_t* ctx) {
+	const SSL_CIPHER* cipher;
+
+	/* The version and cipher are whatever was offered or agreed before
+	 * it failed, no cipher if it failed before one was chosen */
+	if (ctx->hs_start != 0 && !ctx->hs_done && ctx->tls != NULL) {
+		cipher = SSL_get_current_cipher(ctx->tls);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		if (cipher == NULL) {
+			cipher = SSL_get_pending_cipher(ctx->tls);
+		}
+#endif
+		metrics_handshake_failed(SSL_version(ctx->tls),
+			cipher != NULL ? SSL_CIPHER_get_name(cipher) : NULL);
+	}
 	shutdown_tls_conn_ctx(ctx);
+	splice_relay_free(ctx->splice);
+	ctx->splice = NULL;
+	/* The ring relay owns the SSL and both sockets */
+	ring_relay_free(ctx->ring);
+	ctx->ring = NULL;
+	/* A bev parked for kernel TLS owns the SSL and the first fd */
+	if (ctx->tls_bev != NULL) {
+		bufferevent_free(ctx->tls_bev);
+		ctx->tls_bev = NULL;
+	}
 	ctx->tls = NULL;
+	/* Freeing a bev drops its queue without telling the buffer callbacks */
+	if (ctx->secure.bev != NULL) {
+		relay_budget_account(-(long)evbuffer_get_length(bufferevent_get_output(ctx->secure.bev)));
+	}
+	if (ctx->plain.bev != NULL) {
+		relay_budget_account(-(long)evbuffer_get_length(bufferevent_get_output(ctx->plain.bev)));
+	}
 	if (ctx->secure.bev != NULL) {
 		// && ctx->secure.closed == 0) {
 		 bufferevent_free(ctx->secure.bev);
@@ -1124,7 +1753,7 @@ void free_tls_conn_ctx(tls_conn_ctx_t* ctx) {
 		 bufferevent_free(ctx->plain.bev);
 	}
 	ctx->plain.bev = NULL;
-	free(ctx);
+	pool_free(conn_pool, ctx);
 	return;
 }
 
@@ -1214,6 +1843,9 @@ int client_cert_callback(SSL *tls, X509** cert, EVP_PKEY** key) {
 	STACK_OF(X509_NAME)* names;
 	auth_info_t* ai;
 	int fd;
+	uint64_t started = loop_monitor_begin();
+	tls_conn_ctx_t* conn = SSL_get_app_data(tls);
+	unsigned long id = (conn != NULL) ? conn->id : 0;
 	//*cert = get_cert_from_file(CLIENT_AUTH_CERT);
 	ai = SSL_get_ex_data(tls, auth_info_index);
 	/* XXX improve this later to not block. This
@@ -1224,6 +1856,7 @@ int client_cert_callback(SSL *tls, X509** cert, EVP_PKEY** key) {
 	log_printf(LOG_INFO, "fd to auth daemon is %d\n", fd);
 	if (fd == -1) {
 		log_printf(LOG_ERROR, "Failed to connect to auth daemon\n");
+		loop_monitor_end(LOOP_CB_CLIENT_AUTH, id, started);
 		return 0;
 	}
 	ai->fd = fd;
@@ -1250,11 +1883,13 @@ int client_cert_callback(SSL *tls, X509** cert, EVP_PKEY** key) {
 		*key  = NULL;
 		close(ai->fd);
 		//free(ai);
+		loop_monitor_end(LOOP_CB_CLIENT_AUTH, id, started);
 		return 0;
 	}
 	*key = NULL;
 	//*key = get_private_key_from_file(CLIENT_KEY);
 	SSL_set_client_auth_cb(tls, client_auth_callback);
+	loop_monitor_end(LOOP_CB_CLIENT_AUTH, id, started);
 	return 1;
 }
 
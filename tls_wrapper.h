@@ -35,18 +35,37 @@
 #include <openssl/x509.h>
 
 #include "daemon.h"
+#include "config.h"
+#include "ctx_cache.h"
+#include "splice_relay.h"
+#include "ring_relay.h"
+#include "trace.h"
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 int SSL_use_certificate_chain_file(SSL *ssl, const char *file);
 #endif
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
+
 #define ALPN_STRING_MAXLEN	256
+#define MAX_BUFFER	1024*1024*10
+#define RELAY_BUFFER_MIN	64*1024
+#define RELAY_DRAIN_TARGET_MS	100
+#define SERVER_DEFAULT_CERT	"test_files/localhost_cert.pem"
+#define SERVER_DEFAULT_KEY	"test_files/localhost_key.pem"
 
 typedef struct tls_opts {
 	SSL_CTX* tls_ctx;
 	char* app_path;
 	int custom_validation;
 	int is_server;
+	ctx_role_t role;
+	int is_shared; /* tls_ctx belongs to the context cache, copy before changing */
+	char* cipher_list; /* set once a cipher is disabled for this socket only */
+	size_t relay_min; /* bounds on each connection's adaptive buffer limit */
+	size_t relay_max;
 	char alpn_string[ALPN_STRING_MAXLEN];
 	struct tls_opts* next;
 } tls_opts_t;
@@ -55,13 +74,26 @@ typedef struct channel {
 	struct bufferevent* bev;
 	int closed;
 	int connected;
+	size_t limit; /* bytes queued toward this channel before the other side pauses */
+	size_t limit_min;
+	size_t limit_max;
+	size_t paused_len; /* queued bytes when the other side paused, 0 if it didn't */
+	struct timeval paused_at;
 } channel_t;
 
 typedef struct tls_conn_ctx {
 	channel_t plain;
 	channel_t secure;
 	SSL* tls;
+	int ktls; /* secure.bev is a plain socket on kernel TLS */
+	struct bufferevent* tls_bev; /* the OpenSSL bev, parked while ktls is set */
+	int ktls_resume; /* switch to kernel TLS once OpenSSL has read what it holds */
+	splice_relay_t* splice; /* moves the bytes once both bevs are idle on kernel TLS */
+	ring_relay_t* ring; /* replaces both bevs with RelayEngine "ring" */
 	unsigned long id;
+	uint64_t hs_start; /* metrics_now() when the handshake was set up, 0 before */
+	int hs_done;
+	conn_trace_t* trace; /* owned by the socket, NULL unless sampled */
 	tls_daemon_ctx_t* daemon;
 	struct sockaddr* addr;
 	int addrlen;
@@ -70,15 +102,19 @@ typedef struct tls_conn_ctx {
 tls_conn_ctx_t* tls_client_wrapper_setup(evutil_socket_t efd, tls_daemon_ctx_t* daemon_ctx,
 	char* hostname, int is_accepting, tls_opts_t* tls_opts);
 void associate_fd(tls_conn_ctx_t* conn, evutil_socket_t ifd);
+void tls_conn_resume(tls_conn_ctx_t* conn, tls_opts_t* tls_opts, struct sockaddr* addr, int addrlen);
+int tls_conn_connect(tls_conn_ctx_t* conn, struct sockaddr* addr, int addrlen);
 tls_conn_ctx_t* tls_server_wrapper_setup(evutil_socket_t efd, evutil_socket_t ifd, tls_daemon_ctx_t* daemon_ctx,
 	tls_opts_t* tls_opts, struct sockaddr* internal_addr, int internal_addrlen);
 void free_tls_conn_ctx(tls_conn_ctx_t* ctx);
+void tls_conn_set_trace(tls_conn_ctx_t* conn, conn_trace_t* trace);
 
 int set_netlink_cb_params(tls_conn_ctx_t* conn, tls_daemon_ctx_t* daemon_ctx, unsigned long id);
 tls_opts_t* tls_opts_create(char* path);
 void tls_opts_free(tls_opts_t*);
 int tls_opts_server_setup(tls_opts_t* ops);
 int tls_opts_client_setup(tls_opts_t* ops);
+SSL_CTX* tls_ctx_create(ssa_config_t* ssa_config, ctx_role_t role);
 
 
 /* Helper functions to separate daemon from security library */
@@ -0,0 +1,249 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "log.h"
+
+#define TRACE_DEFAULT_PREFIX	"ssa-trace"
+#define TRACE_MAX_RECORDS	32
+#define TRACE_NAME_LEN		64
+
+typedef struct trace_record {
+	uint64_t ts;
+	int event;
+	int option;
+} trace_record_t;
+
+struct conn_trace {
+	unsigned long id;
+	unsigned long track; /* tid in the trace file */
+	char name[TRACE_NAME_LEN];
+	unsigned int seen; /* bit per event kept once */
+	int count;
+	trace_record_t records[TRACE_MAX_RECORDS];
+};
+
+static const char* event_names[TRACE_EVENTS] = {
+	"socket", "bind", "listen", "connect", "established", "handshake",
+	"associate", "first_byte", "close", "setsockopt", "getsockopt"
+};
+
+/* Sockets are sampled by every data plane thread of the worker */
+static FILE* trace_file;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sample_every;
+static unsigned long sockets_seen;
+static unsigned long tracks;
+static int trace_pid;
+static int events_written;
+
+static void add_record(conn_trace_t* trace, enum trace_event event, int option);
+static void write_event(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static void json_escape(char* out, size_t size, const char* in);
+
+int trace_init(const char* prefix, int sample, int worker_id) {
+	char path[PATH_MAX];
+
+	if (sample <= 0) {
+		return 0;
+	}
+	if (prefix == NULL) {
+		prefix = TRACE_DEFAULT_PREFIX;
+	}
+	snprintf(path, sizeof(path), "%s.%d.json", prefix, worker_id);
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		log_printf(LOG_ERROR, "Failed to open trace file %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	sample_every = sample;
+	trace_pid = worker_id + 1;
+	events_written = 0;
+	fputs("[", trace_file);
+	write_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+		"\"args\":{\"name\":\"worker %d\"}}", trace_pid, worker_id);
+	log_printf(LOG_INFO, "Tracing one in %d sockets to %s\n", sample, path);
+	return 0;
+}
+
+void trace_free(void) {
+	if (trace_file == NULL) {
+		return;
+	}
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+	sample_every = 0;
+	return;
+}
+
+/* Returns NULL for sockets that aren't sampled, which every other
+ * function accepts */
+conn_trace_t* trace_begin(unsigned long id, const char* name) {
+	conn_trace_t* trace;
+
+	if (sample_every == 0 ||
+			__atomic_fetch_add(&sockets_seen, 1, __ATOMIC_RELAXED) % sample_every != 0) {
+		return NULL;
+	}
+	trace = calloc(1, sizeof(conn_trace_t));
+	if (trace == NULL) {
+		return NULL;
+	}
+	trace->id = id;
+	trace->track = __atomic_add_fetch(&tracks, 1, __ATOMIC_RELAXED);
+	if (name != NULL) {
+		strncpy(trace->name, name, TRACE_NAME_LEN - 1);
+	}
+	add_record(trace, TRACE_SOCKET, 0);
+	return trace;
+}
+
+void trace_set_id(conn_trace_t* trace, unsigned long id) {
+	if (trace == NULL) return;
+	trace->id = id;
+	return;
+}
+
+void trace_mark(conn_trace_t* trace, enum trace_event event) {
+	if (trace == NULL || trace->seen & (1u << event)) return;
+	add_record(trace, event, 0);
+	return;
+}
+
+void trace_option(conn_trace_t* trace, enum trace_event event, int option) {
+	if (trace == NULL) return;
+	add_record(trace, event, option);
+	return;
+}
+
+/* Writes the connection as one span, a span between each pair of
+ * lifecycle steps it reached and an instant per record, then frees it */
+void trace_end(conn_trace_t* trace) {
+	trace_record_t* prev = NULL;
+	trace_record_t* rec;
+	char name[TRACE_NAME_LEN * 2];
+	uint64_t start;
+	uint64_t end;
+	int i;
+
+	if (trace == NULL) return;
+	trace_mark(trace, TRACE_CLOSE);
+	json_escape(name, sizeof(name), trace->name);
+	start = trace->records[0].ts;
+	end = trace->records[trace->count - 1].ts;
+
+	pthread_mutex_lock(&file_lock);
+	if (trace_file == NULL) {
+		pthread_mutex_unlock(&file_lock);
+		free(trace);
+		return;
+	}
+	write_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,"
+		"\"args\":{\"name\":\"%s %lu\"}}", trace_pid, trace->track, name, trace->id);
+	write_event("{\"name\":\"connection\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+		"\"ts\":%lu,\"dur\":%lu,\"args\":{\"id\":\"%lu\",\"app\":\"%s\"}}",
+		trace_pid, trace->track, start, end - start, trace->id, name);
+	for (i = 0; i < trace->count; i++) {
+		rec = &trace->records[i];
+		if (rec->event == TRACE_SETSOCKOPT || rec->event == TRACE_GETSOCKOPT) {
+			write_event("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%lu,"
+				"\"ts\":%lu,\"args\":{\"option\":%d}}", event_names[rec->event],
+				trace_pid, trace->track, rec->ts, rec->option);
+			continue;
+		}
+		write_event("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%lu,\"ts\":%lu}",
+			event_names[rec->event], trace_pid, trace->track, rec->ts);
+		if (prev != NULL) {
+			write_event("{\"name\":\"%s to %s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+				"\"ts\":%lu,\"dur\":%lu}", event_names[prev->event], event_names[rec->event],
+				trace_pid, trace->track, prev->ts, rec->ts - prev->ts);
+		}
+		prev = rec;
+	}
+	fflush(trace_file);
+	pthread_mutex_unlock(&file_lock);
+	free(trace);
+	return;
+}
+
+/* The close record is always kept so the spans have an end */
+void add_record(conn_trace_t* trace, enum trace_event event, int option) {
+	trace_record_t* rec;
+
+	if (trace->count == TRACE_MAX_RECORDS ||
+			(trace->count == TRACE_MAX_RECORDS - 1 && event != TRACE_CLOSE)) {
+		return;
+	}
+	if (event < TRACE_SETSOCKOPT) {
+		trace->seen |= 1u << event;
+	}
+	rec = &trace->records[trace->count++];
+	rec->ts = metrics_now();
+	rec->event = event;
+	rec->option = option;
+	return;
+}
+
+/* Called with file_lock held, or before any socket exists */
+void write_event(const char* fmt, ...) {
+	va_list args;
+
+	fputs(events_written++ == 0 ? "\n" : ",\n", trace_file);
+	va_start(args, fmt);
+	vfprintf(trace_file, fmt, args);
+	va_end(args);
+	return;
+}
+
+void json_escape(char* out, size_t size, const char* in) {
+	size_t len = 0;
+
+	for (; *in != '\0' && len + 7 < size; in++) {
+		if (*in == '"' || *in == '\\') {
+			out[len++] = '\\';
+			out[len++] = *in;
+		}
+		else if ((unsigned char)*in < 0x20) {
+			len += snprintf(out + len, size - len, "\\u%04x", (unsigned char)*in);
+		}
+		else {
+			out[len++] = *in;
+		}
+	}
+	out[len] = '\0';
+	return;
+}
@@ -0,0 +1,60 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+enum trace_event {
+	TRACE_SOCKET, /* socket notification, or accept for a listener's connection */
+	TRACE_BIND,
+	TRACE_LISTEN,
+	TRACE_CONNECT,
+	TRACE_ESTABLISHED, /* first TLS record after the TCP connect */
+	TRACE_HANDSHAKE, /* handshake done, kernel notified */
+	TRACE_ASSOCIATE, /* plaintext leg paired with the connection */
+	TRACE_FIRST_BYTE, /* first plaintext relayed either way */
+	TRACE_CLOSE,
+	TRACE_SETSOCKOPT, /* these two may repeat, the rest are kept once */
+	TRACE_GETSOCKOPT,
+	TRACE_EVENTS
+};
+
+typedef struct conn_trace conn_trace_t;
+
+/* Records when a sampled socket reaches each step of its life. Traces
+ * are written when the socket closes, as Chrome trace events in
+ * <prefix>.<worker>.json, one track per connection. The file can be
+ * opened in Perfetto or chrome://tracing even if the worker died
+ * before closing the JSON array */
+int trace_init(const char* prefix, int sample, int worker_id);
+void trace_free(void);
+conn_trace_t* trace_begin(unsigned long id, const char* name);
+void trace_set_id(conn_trace_t* trace, unsigned long id);
+void trace_mark(conn_trace_t* trace, enum trace_event event);
+void trace_option(conn_trace_t* trace, enum trace_event event, int option);
+void trace_end(conn_trace_t* trace);
+
+#endif
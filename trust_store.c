@@ -0,0 +1,331 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+
+#include "trust_store.h"
+#include "config.h"
+#include "hashmap_str.h"
+#include "openssl_compat.h"
+#include "log.h"
+
+#define TRUST_STORE_BUCKETS	10
+
+typedef struct store_entry {
+	char* path;
+	X509_STORE* store;
+} store_entry_t;
+
+static hsmap_t* store_map = NULL;
+static __thread hsmap_t* staged_map; /* only the thread that staged it sees it */
+static unsigned long store_generation;
+static unsigned long next_serial;
+static int serial_index = -1;
+static pthread_mutex_t store_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static X509_STORE* load_store(const char* path);
+static int add_locations(X509_STORE* store, const char* path, int dir_only);
+static store_entry_t* add_store(hsmap_t* map, const char* path);
+static void preload_store(char* name, void* config, void* arg);
+static void free_store_entry(void* entry);
+
+int trust_store_init(void) {
+	if (store_map != NULL) {
+		return 0;
+	}
+	store_map = str_hashmap_create(TRUST_STORE_BUCKETS);
+	if (store_map == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate trust store map\n");
+		return 1;
+	}
+	store_generation++;
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (serial_index == -1) {
+		serial_index = X509_STORE_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	}
+	#endif
+	/* Parse every store named by a profile now rather than on
+	 * the first socket that needs it */
+	str_hashmap_foreach(global_config, preload_store, store_map);
+	return 0;
+}
+
+/* Parses every store the profiles name into a map of its own. Nothing
+ * running sees it until trust_store_install, so this may run on a
+ * thread while sockets are still being set up */
+hsmap_t* trust_store_load(hsmap_t* profiles) {
+	hsmap_t* map;
+
+	map = str_hashmap_create(TRUST_STORE_BUCKETS);
+	if (map == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate trust store map\n");
+		return NULL;
+	}
+	str_hashmap_foreach(profiles, preload_store, map);
+	return map;
+}
+
+/* trust_store_get on the calling thread takes stores from map, or from
+ * the running stores again once map is NULL. Contexts for a reload are
+ * built this way so they match the stores installed with them */
+void trust_store_stage(hsmap_t* map) {
+	staged_map = map;
+	return;
+}
+
+/* Contexts created before a reload keep the stores they hold references
+ * to, new contexts pick up the stores in map */
+void trust_store_install(hsmap_t* map) {
+	hsmap_t* old_map;
+
+	pthread_mutex_lock(&store_map_lock);
+	old_map = store_map;
+	store_map = map;
+	store_generation++;
+	pthread_mutex_unlock(&store_map_lock);
+
+	str_hashmap_deep_free(old_map, free_store_entry);
+	return;
+}
+
+void trust_store_discard(hsmap_t* map) {
+	str_hashmap_deep_free(map, free_store_entry);
+	return;
+}
+
+void trust_store_free(void) {
+	str_hashmap_deep_free(store_map, free_store_entry);
+	store_map = NULL;
+	return;
+}
+
+unsigned long trust_store_generation(void) {
+	return store_generation;
+}
+
+/* Serials are never reused, so a store parsed again on reload never
+ * passes for the one it replaced. Private copies have none */
+unsigned long trust_store_serial(X509_STORE* store) {
+	if (store == NULL || serial_index == -1) {
+		return 0;
+	}
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return (unsigned long)(uintptr_t)X509_STORE_get_ex_data(store, serial_index);
+	#else
+	return 0;
+	#endif
+}
+
+X509_STORE* trust_store_get(const char* path) {
+	store_entry_t* entry;
+
+	if (path == NULL) {
+		return NULL;
+	}
+	if (staged_map != NULL) {
+		entry = (store_entry_t*)str_hashmap_get(staged_map, (char*)path);
+		if (entry == NULL) {
+			entry = add_store(staged_map, path);
+		}
+		if (entry == NULL) {
+			return NULL;
+		}
+		#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		X509_STORE_up_ref(entry->store);
+		#else
+		compat_X509_STORE_up_ref(entry->store);
+		#endif
+		return entry->store;
+	}
+	if (store_map == NULL && trust_store_init() != 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&store_map_lock);
+	entry = (store_entry_t*)str_hashmap_get(store_map, (char*)path);
+	if (entry == NULL) {
+		entry = add_store(store_map, path);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&store_map_lock);
+			return NULL;
+		}
+	}
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_up_ref(entry->store);
+	#else
+	compat_X509_STORE_up_ref(entry->store);
+	#endif
+	pthread_mutex_unlock(&store_map_lock);
+	return entry->store;
+}
+
+/* Returns a private store holding the same certificates, CRLs and
+ * verify parameters as store, for sockets that add their own trusted
+ * certificates. Only what store has looked up so far is in its object
+ * cache, so a hashed directory at path is searched by the copy too */
+X509_STORE* trust_store_copy(X509_STORE* store, const char* path) {
+	X509_STORE* copy;
+	X509_OBJECT* obj;
+	STACK_OF(X509_OBJECT)* objs;
+	int i;
+
+	copy = X509_STORE_new();
+	if (copy == NULL) {
+		return NULL;
+	}
+	if (store == NULL) {
+		return copy;
+	}
+	/* A directory lookup adds to the cache while other threads verify */
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_lock(store);
+	objs = X509_STORE_get0_objects(store);
+	#else
+	CRYPTO_w_lock(CRYPTO_LOCK_X509_STORE);
+	objs = store->objs;
+	#endif
+	for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+		obj = sk_X509_OBJECT_value(objs, i);
+		switch (X509_OBJECT_get_type(obj)) {
+		case X509_LU_X509:
+			X509_STORE_add_cert(copy, X509_OBJECT_get0_X509(obj));
+			break;
+		case X509_LU_CRL:
+			X509_STORE_add_crl(copy, X509_OBJECT_get0_X509_CRL(obj));
+			break;
+		default:
+			break;
+		}
+	}
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_unlock(store);
+	#else
+	CRYPTO_w_unlock(CRYPTO_LOCK_X509_STORE);
+	#endif
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_set1_param(copy, X509_STORE_get0_param(store));
+	#else
+	X509_STORE_set1_param(copy, store->param);
+	#endif
+	if (path != NULL && add_locations(copy, path, 1) != 0) {
+		X509_STORE_free(copy);
+		return NULL;
+	}
+	return copy;
+}
+
+X509_STORE* load_store(const char* path) {
+	X509_STORE* store;
+
+	store = X509_STORE_new();
+	if (store == NULL) {
+		return NULL;
+	}
+	if (add_locations(store, path, 0) != 0) {
+		X509_STORE_free(store);
+		return NULL;
+	}
+	return store;
+}
+
+/* With dir_only set a file is skipped, its certificates having been
+ * copied already */
+int add_locations(X509_STORE* store, const char* path, int dir_only) {
+	struct stat stat_store;
+	int ret = 1;
+
+	if (stat(path, &stat_store) == -1) {
+		log_printf(LOG_ERROR, "Unable to find truststore %s\n", path);
+		return 1;
+	}
+	if (S_ISDIR(stat_store.st_mode)) {
+		/* Hashed directories are searched lazily by OpenSSL */
+		ret = X509_STORE_load_locations(store, NULL, path);
+	}
+	else if (dir_only == 0) {
+		ret = X509_STORE_load_locations(store, path, NULL);
+	}
+	if (ret == 0) {
+		log_printf(LOG_ERROR, "Unable set truststore %s\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+store_entry_t* add_store(hsmap_t* map, const char* path) {
+	store_entry_t* entry;
+
+	entry = (store_entry_t*)calloc(1, sizeof(store_entry_t));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->path = strdup(path);
+	if (entry->path == NULL) {
+		free(entry);
+		return NULL;
+	}
+	log_printf(LOG_INFO, "Loading cert root store %s\n", path);
+	entry->store = load_store(path);
+	if (entry->store == NULL) {
+		free_store_entry(entry);
+		return NULL;
+	}
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_set_ex_data(entry->store, serial_index,
+		(void*)(uintptr_t)__atomic_add_fetch(&next_serial, 1, __ATOMIC_RELAXED));
+	#endif
+	str_hashmap_add(map, entry->path, entry);
+	return entry;
+}
+
+void preload_store(char* name, void* config, void* arg) {
+	ssa_config_t* ssa_config = (ssa_config_t*)config;
+	hsmap_t* map = (hsmap_t*)arg;
+	if (ssa_config->trust_store == NULL) {
+		return;
+	}
+	if (str_hashmap_get(map, ssa_config->trust_store) != NULL) {
+		return;
+	}
+	add_store(map, ssa_config->trust_store);
+	return;
+}
+
+void free_store_entry(void* arg) {
+	store_entry_t* entry = (store_entry_t*)arg;
+	if (entry->store != NULL) {
+		X509_STORE_free(entry->store);
+	}
+	free(entry->path);
+	free(entry);
+	return;
+}
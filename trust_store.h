@@ -0,0 +1,48 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TRUST_STORE_H
+#define TRUST_STORE_H
+
+#include <openssl/x509.h>
+#include "hashmap_str.h"
+
+/* Trust stores are parsed once per worker and shared by every SSL_CTX
+ * whose profile names the same TrustStoreLocation. Stores returned by
+ * trust_store_get carry a reference owned by the caller. Each store
+ * parsed here gets a serial, 0 means the store isn't one of ours */
+int trust_store_init(void);
+hsmap_t* trust_store_load(hsmap_t* profiles);
+void trust_store_stage(hsmap_t* map);
+void trust_store_install(hsmap_t* map);
+void trust_store_discard(hsmap_t* map);
+void trust_store_free(void);
+X509_STORE* trust_store_get(const char* path);
+X509_STORE* trust_store_copy(X509_STORE* store, const char* path);
+unsigned long trust_store_generation(void);
+unsigned long trust_store_serial(X509_STORE* store);
+
+#endif
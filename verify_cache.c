@@ -0,0 +1,309 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+#include <openssl/evp.h>
+
+#include "verify_cache.h"
+#include "trust_store.h"
+#include "hashmap_str.h"
+#include "log.h"
+
+#define VERIFY_CACHE_BUCKETS	64
+
+typedef struct verdict {
+	char key[VERIFY_CACHE_KEY_LEN];
+	time_t expires;
+	struct verdict* prev; /* most recently used toward head */
+	struct verdict* next;
+} verdict_t;
+
+static hsmap_t* verdicts;
+static verdict_t* head;
+static verdict_t* tail;
+static int max_count;
+static long ttl;
+static unsigned long hits;
+static unsigned long misses;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int make_key(X509_STORE_CTX* store, const char* hostname, verify_mode_t mode, char* key);
+static int digest_cert(EVP_MD_CTX* md_ctx, X509* cert);
+static time_t chain_expiry(X509_STORE_CTX* store, time_t now);
+static int cert_expiry(X509* cert, time_t now, time_t* expires);
+static void drop(verdict_t* verdict);
+static void lru_unlink(verdict_t* verdict);
+static void lru_push(verdict_t* verdict);
+
+int verify_cache_init(int max_entries, long timeout) {
+	if (max_entries <= 0 || timeout <= 0) {
+		return 0;
+	}
+	verdicts = str_hashmap_create(VERIFY_CACHE_BUCKETS);
+	if (verdicts == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate verification cache\n");
+		return 1;
+	}
+	max_count = max_entries;
+	ttl = timeout;
+	return 0;
+}
+
+void verify_cache_free(void) {
+	if (verdicts == NULL) {
+		return;
+	}
+	log_printf(LOG_INFO, "Verification cache: %lu hits, %lu misses\n", hits, misses);
+	verify_cache_flush();
+	str_hashmap_free(verdicts);
+	verdicts = NULL;
+	return;
+}
+
+void verify_cache_flush(void) {
+	if (verdicts == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	while (head != NULL) {
+		drop(head);
+	}
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+/* Returns 1 if the chain verified recently. Otherwise key is filled in
+ * for verify_cache_add, or left empty when the verdict can't be cached */
+int verify_cache_lookup(X509_STORE_CTX* store, const char* hostname, verify_mode_t mode, char* key) {
+	verdict_t* verdict;
+	int found = 0;
+
+	key[0] = '\0';
+	if (verdicts == NULL || make_key(store, hostname, mode, key) != 0) {
+		key[0] = '\0';
+		return 0;
+	}
+	pthread_mutex_lock(&lock);
+	verdict = str_hashmap_get(verdicts, key);
+	if (verdict != NULL && verdict->expires <= time(NULL)) {
+		drop(verdict);
+		verdict = NULL;
+	}
+	if (verdict != NULL) {
+		lru_unlink(verdict);
+		lru_push(verdict);
+		hits++;
+		found = 1;
+	}
+	else {
+		misses++;
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/* Called once store has verified, so its chain is the one built */
+void verify_cache_add(X509_STORE_CTX* store, const char* key) {
+	verdict_t* verdict;
+	time_t now = time(NULL);
+	time_t expires;
+
+	if (verdicts == NULL || key[0] == '\0') {
+		return;
+	}
+	expires = chain_expiry(store, now);
+	if (expires <= now) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	verdict = str_hashmap_get(verdicts, (char*)key);
+	if (verdict != NULL) {
+		verdict->expires = expires;
+		lru_unlink(verdict);
+		lru_push(verdict);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (verdicts->item_count >= max_count) {
+		drop(tail);
+	}
+	verdict = calloc(1, sizeof(verdict_t));
+	if (verdict == NULL) {
+		pthread_mutex_unlock(&lock);
+		log_printf(LOG_ERROR, "Failed to cache verification result\n");
+		return;
+	}
+	memcpy(verdict->key, key, VERIFY_CACHE_KEY_LEN);
+	verdict->expires = expires;
+	if (str_hashmap_add(verdicts, verdict->key, verdict) != 0) {
+		pthread_mutex_unlock(&lock);
+		free(verdict);
+		return;
+	}
+	lru_push(verdict);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+void verify_cache_get_stats(verify_cache_stats_t* stats) {
+	memset(stats, 0, sizeof(verify_cache_stats_t));
+	if (verdicts == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	stats->hits = hits;
+	stats->misses = misses;
+	stats->entries = verdicts->item_count;
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+/* A digest of the mode, the trust store, the hostname and every
+ * certificate the peer sent, the leaf first */
+int make_key(X509_STORE_CTX* store, const char* hostname, verify_mode_t mode, char* key) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	unsigned long serial;
+	STACK_OF(X509)* untrusted;
+	EVP_MD_CTX* md_ctx;
+	int ret = 1;
+	int i;
+
+	serial = trust_store_serial(X509_STORE_CTX_get0_store(store));
+	if (serial == 0 || X509_STORE_CTX_get0_cert(store) == NULL) {
+		return 1;
+	}
+	if (hostname == NULL) {
+		hostname = "";
+	}
+	md_ctx = EVP_MD_CTX_new();
+	if (md_ctx == NULL) {
+		return 1;
+	}
+	if (EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL) != 1 ||
+			EVP_DigestUpdate(md_ctx, &mode, sizeof(mode)) != 1 ||
+			EVP_DigestUpdate(md_ctx, &serial, sizeof(serial)) != 1 ||
+			EVP_DigestUpdate(md_ctx, hostname, strlen(hostname) + 1) != 1 ||
+			digest_cert(md_ctx, X509_STORE_CTX_get0_cert(store)) != 0) {
+		goto out;
+	}
+	untrusted = X509_STORE_CTX_get0_untrusted(store);
+	for (i = 0; i < sk_X509_num(untrusted); i++) {
+		if (digest_cert(md_ctx, sk_X509_value(untrusted, i)) != 0) {
+			goto out;
+		}
+	}
+	if (EVP_DigestFinal_ex(md_ctx, digest, &digest_len) != 1 ||
+			digest_len * 2 >= VERIFY_CACHE_KEY_LEN) {
+		goto out;
+	}
+	for (i = 0; i < (int)digest_len; i++) {
+		sprintf(&key[i * 2], "%02x", digest[i]);
+	}
+	ret = 0;
+out:
+	EVP_MD_CTX_free(md_ctx);
+	return ret;
+}
+
+int digest_cert(EVP_MD_CTX* md_ctx, X509* cert) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	if (X509_digest(cert, EVP_sha256(), digest, &digest_len) != 1) {
+		return 1;
+	}
+	return EVP_DigestUpdate(md_ctx, digest, digest_len) != 1;
+}
+
+/* The verdict lasts until the timeout or until the first certificate in
+ * the chain expires, whichever is sooner */
+time_t chain_expiry(X509_STORE_CTX* store, time_t now) {
+	STACK_OF(X509)* chain;
+	time_t expires = now + ttl;
+	int i;
+
+	if (cert_expiry(X509_STORE_CTX_get0_cert(store), now, &expires) != 0) {
+		return now;
+	}
+	chain = X509_STORE_CTX_get0_chain(store);
+	for (i = 0; chain != NULL && i < sk_X509_num(chain); i++) {
+		if (cert_expiry(sk_X509_value(chain, i), now, &expires) != 0) {
+			return now;
+		}
+	}
+	return expires;
+}
+
+/* Brings expires forward to the certificate's notAfter */
+int cert_expiry(X509* cert, time_t now, time_t* expires) {
+	time_t not_after;
+	int days;
+	int secs;
+
+	if (ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(cert)) != 1) {
+		return 1;
+	}
+	not_after = now + (time_t)days * 86400 + secs;
+	if (not_after < *expires) {
+		*expires = not_after;
+	}
+	return 0;
+}
+
+/* Lock held */
+void drop(verdict_t* verdict) {
+	lru_unlink(verdict);
+	str_hashmap_del(verdicts, verdict->key);
+	free(verdict);
+	return;
+}
+
+void lru_unlink(verdict_t* verdict) {
+	if (verdict->prev != NULL) verdict->prev->next = verdict->next;
+	else head = verdict->next;
+	if (verdict->next != NULL) verdict->next->prev = verdict->prev;
+	else tail = verdict->prev;
+	verdict->prev = NULL;
+	verdict->next = NULL;
+	return;
+}
+
+void lru_push(verdict_t* verdict) {
+	verdict->next = head;
+	if (head != NULL) head->prev = verdict;
+	head = verdict;
+	if (tail == NULL) tail = verdict;
+	return;
+}
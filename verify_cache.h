@@ -0,0 +1,59 @@
+/*
+ * TLS Wrapping Daemon - transparent TLS wrapping of plaintext connections
+ * Copyright (C) 2017, Mark O'Neill <mark@markoneill.name>
+ * All rights reserved.
+ * https://owntrust.org
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef VERIFY_CACHE_H
+#define VERIFY_CACHE_H
+
+#include <stddef.h>
+#include <openssl/x509.h>
+
+#define VERIFY_CACHE_KEY_LEN	65
+
+typedef enum verify_mode {
+	VERIFY_MODE_CLIENT_CERT, /* X509_verify_cert on a client's chain */
+	VERIFY_MODE_TRUSTBASE, /* TrustBase's answer for a server's chain */
+} verify_mode_t;
+
+typedef struct verify_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	size_t entries;
+} verify_cache_stats_t;
+
+/* Chains that verified, kept per worker so a peer that reconnects
+ * skips chain building and TrustBase. A verdict is keyed by the peer's
+ * chain, the hostname, the trust store it was checked against and the
+ * mode, and lasts timeout seconds or until a certificate in the chain
+ * expires. Only shared trust stores are cached, and the whole cache is
+ * dropped when the configuration or trust stores reload */
+int verify_cache_init(int max_entries, long timeout);
+void verify_cache_free(void);
+void verify_cache_flush(void);
+int verify_cache_lookup(X509_STORE_CTX* store, const char* hostname, verify_mode_t mode, char* key);
+void verify_cache_add(X509_STORE_CTX* store, const char* key);
+void verify_cache_get_stats(verify_cache_stats_t* stats);
+
+#endif